@@ -19,51 +19,93 @@
 [org 0x7C00]    ; Standard BIOS boot sector load address
 [bits 16]       ; Start in 16-bit real mode
 
+; Sectors before the FAT12 filesystem: this boot sector and the kernel
+; (the Makefile passes its FLOPPY_RESERVED_SECTORS)
+%ifndef RESERVED_SECTORS
+%define RESERVED_SECTORS 512
+%endif
+
+; Sectors of the boot archive (see mkinitramfs.sh), stored at the end of the
+; reserved sectors; 0 when the image has none
+%ifndef INITRAMFS_SECTORS
+%define INITRAMFS_SECTORS 0
+%endif
+
+; =============================================================================
+; BIOS Parameter Block
+; =============================================================================
+
+; Describes the FAT12 filesystem laid out after the reserved sectors of a
+; 1.44MB floppy. The jump must be the first three bytes of the sector.
+; Source: Microsoft "FAT: General Overview of On-Disk Format" (FAT32 File
+;         System Specification), Section 3
+    jmp near _start
+    db "MAXOS2.0"                   ; OEM name
+    dw 512                          ; Bytes per sector
+    db 1                            ; Sectors per cluster
+    dw RESERVED_SECTORS             ; Reserved sectors (boot sector and kernel)
+    db 2                            ; FAT copies
+    dw 224                          ; Root directory entries
+    dw 2880                         ; Total sectors
+    db 0xF0                         ; Media descriptor (1.44MB floppy)
+    dw 9                            ; Sectors per FAT
+    dw 18                           ; Sectors per track
+    dw 2                            ; Heads
+    dd 0                            ; Hidden sectors
+    dd 0                            ; Total sectors (32-bit field, unused)
+    db 0                            ; BIOS drive number
+    db 0                            ; Reserved
+    db 0x29                         ; Extended boot signature
+    dd 0x4D41584F                   ; Volume serial number
+    db "MAXOS      "                ; Volume label (11 bytes)
+    db "FAT12   "                   ; Filesystem type (8 bytes)
+
 ; =============================================================================
 ; Constants and Equates
 ; =============================================================================
 
 ; Memory layout constants
 ; Source: IBM PC/AT BIOS specification and Intel x86 documentation
-KERNEL_SEGMENT        equ 0x1000        ; Kernel load address (segment 0x1000)
-KERNEL_SECTOR_COUNT   equ 0x02          ; Number of sectors to load (2 sectors = 1KB)
+KERNEL_SEGMENT        equ 0x1000        ; Kernel staging address (segment 0x1000 = 0x10000)
+KERNEL_SECTOR_COUNT   equ RESERVED_SECTORS - 1 - INITRAMFS_SECTORS  ; Every reserved sector before the archive
+KERNEL_ADDRESS        equ 0x100000      ; Address kernel/link.ld links the kernel at (1MB)
 BOOT_SECTOR          equ 0x01           ; Boot sector number (sector 1)
 STACK_SEGMENT        equ 0x9000         ; Stack segment address (64KB from top)
 STACK_OFFSET         equ 0x0000         ; Stack offset within segment
 
+; Boot archive and the information block the kernel reads it from
+; (struct boot_information in kernel/kernel.c)
+INITRAMFS_SECTOR     equ RESERVED_SECTORS - INITRAMFS_SECTORS
+INITRAMFS_SEGMENT    equ 0x5000         ; Loaded at 0x50000, page-aligned
+BOOT_INFO_ADDRESS    equ 0x0500         ; First free byte after the BIOS data area
+BOOT_INFO_MAGIC      equ 0x4F464E49     ; "INFO"
+
+; 1.44MB floppy geometry, for LBA to CHS conversion
+SECTORS_PER_TRACK    equ 18
+HEAD_COUNT           equ 2
+
 ; =============================================================================
 ; Includes
 ; =============================================================================
 
-; Assembly includes for protected mode functionality
+; Global Descriptor Table, skipped over by the jump at the start of the BPB
 ; Source: Intel x86 architecture manual, Volume 3: System Programming Guide
 %include "bootloader/gdt.asm"           ; Global Descriptor Table setup
-%include "bootloader/switchpm.asm"      ; Protected mode transition
-%include "bootloader/ppstring.asm"      ; Protected mode string printing
-%include "bootloader/pstring.asm"       ; Real mode string printing
 
 ; =============================================================================
 ; Data Section
 ; =============================================================================
 
-section .data
-    ; Boot sequence messages
-    ; Standard bootloader user feedback patterns
-    msg_booting:        db "MaxOS Bootloader v2.0", 0x0D, 0x0A, 0
-    msg_initializing:   db "Initializing system components...", 0x0D, 0x0A, 0
-    msg_loading:        db "Loading MaxOS kernel from disk...", 0x0D, 0x0A, 0
-    msg_success:        db "Kernel loaded successfully", 0x0D, 0x0A, 0
-    msg_switching:      db "Switching to 32-bit protected mode...", 0x0D, 0x0A, 0
-    msg_error:          db "ERROR: Disk read operation failed", 0x0D, 0x0A, 0
-    msg_complete:       db "Boot process completed successfully", 0x0D, 0x0A, 0
+; Boot sequence messages, kept short: everything here must fit in the one
+; sector the BIOS loads
+msg_booting:        db "MaxOS Bootloader v2.0", 0x0D, 0x0A, 0
+msg_loading:        db "Loading kernel...", 0x0D, 0x0A, 0
+msg_error:          db "Disk read error", 0x0D, 0x0A, 0
 
 ; =============================================================================
 ; Bootloader Entry Point
 ; =============================================================================
 
-section .text
-global _start
-
 _start:
     ; =====================================================================
     ; Phase 1: System Initialization
@@ -90,9 +132,6 @@ _start:
     mov si, msg_booting
     call print_string
     
-    mov si, msg_initializing
-    call print_string
-    
     ; =====================================================================
     ; Phase 2: Kernel Loading
     ; =====================================================================
@@ -109,27 +148,25 @@ _start:
     ; Error handling pattern from robust bootloader design
     jc disk_read_error
     
-    ; Display success message
-    mov si, msg_success
-    call print_string
+    ; Load the boot archive, if the image has one
+    call load_initramfs_from_disk
+    jc disk_read_error
     
     ; =====================================================================
     ; Phase 3: Protected Mode Transition
     ; =====================================================================
     
-    mov si, msg_switching
-    call print_string
+    ; Enable the A20 line so addresses at and above 1MB do not wrap
+    ; (the "fast A20" bit of System Control Port A)
+    ; Source: IBM PS/2 Hardware Interface Technical Reference, port 92h
+    in al, 0x92
+    or al, 0x02
+    out 0x92, al
     
-    ; Disable interrupts before mode switch
-    ; Required for protected mode transition
-    cli
-    
-    ; Switch to 32-bit protected mode
+    ; Switch to 32-bit protected mode; BEGIN_PM moves the kernel to 1MB
+    ; and enters it
     ; Source: Intel x86 architecture manual, Volume 3
-    call switch_to_protected_mode
-    
-    ; This point should never be reached in real mode
-    jmp $
+    jmp switch_to_pm
 
 ; =============================================================================
 ; Disk Operations
@@ -137,42 +174,74 @@ _start:
 
 load_kernel_from_disk:
     ; =====================================================================
-    ; Load kernel from disk sectors 2-3 to memory address 0x1000
+    ; Load every reserved sector before the boot archive to 0x10000
     ; 
-    ; BIOS interrupt 13h function 02h: Read sectors
-    ; Source: IBM PC/AT BIOS specification and "The Unabridged Pentium 4"
+    ; The kernel is linked at 1MB, out of reach in real mode, so it is
+    ; staged here and copied up after the switch to protected mode. Up to
+    ; 255.5KB fits below the boot archive at 0x50000.
+    ; =====================================================================
+    mov ax, KERNEL_SEGMENT
+    mov es, ax
+    mov si, BOOT_SECTOR            ; Kernel starts in the sector after this one (LBA 1)
+    mov di, KERNEL_SECTOR_COUNT
+    jmp read_sectors
+
+load_initramfs_from_disk:
+    ; =====================================================================
+    ; Load the boot archive to 0x50000 and record it at BOOT_INFO_ADDRESS
     ; =====================================================================
     
-    ; Set up disk read parameters
-    ; Standard BIOS disk I/O parameter setup
-    mov bx, KERNEL_SEGMENT         ; Load address for kernel (ES:BX)
-    
-    mov ah, 0x02                   ; BIOS function: Read sectors
-    mov al, KERNEL_SECTOR_COUNT    ; Number of sectors to read
-    mov ch, 0x00                   ; Cylinder 0
-    mov dh, 0x00                   ; Head 0
-    mov cl, BOOT_SECTOR + 1        ; Starting sector (sector 2)
-    
-    ; Perform disk read operation
-    ; BIOS interrupt 13h handles all disk I/O details
-    int 0x13                       ; Call BIOS disk service
-    
-    ; Check for errors (CF set on error)
-    ; Standard BIOS error handling pattern
-    jc .error
-    
-    ; Verify number of sectors read
-    ; Ensure complete kernel loading
-    cmp al, KERNEL_SECTOR_COUNT
-    jne .error
+    ; The size stays 0 (no archive) unless every sector arrives
+    mov dword [BOOT_INFO_ADDRESS], BOOT_INFO_MAGIC
+    mov dword [BOOT_INFO_ADDRESS + 4], INITRAMFS_SEGMENT * 16
+    mov dword [BOOT_INFO_ADDRESS + 8], 0
     
-    ; Success - clear carry flag
+%if INITRAMFS_SECTORS > 0
+    mov ax, INITRAMFS_SEGMENT
+    mov es, ax
+    mov si, INITRAMFS_SECTOR
+    mov di, INITRAMFS_SECTORS
+    call read_sectors
+    jc .done
+    mov dword [BOOT_INFO_ADDRESS + 8], INITRAMFS_SECTORS * 512
+%endif
     clc
+.done:
     ret
+
+read_sectors:
+    ; =====================================================================
+    ; Read DI sectors from LBA SI to ES:0000, advancing ES; CF set on error
+    ; 
+    ; One sector per call, since BIOS reads may not cross a track. LBA to
+    ; CHS: sector = LBA % 18 + 1, head = (LBA / 18) % 2, cylinder = LBA / 36
+    ; Source: IBM PC/AT BIOS specification, INT 13h function 02h
+    ; =====================================================================
+    mov ax, si
+    xor dx, dx
+    mov bx, SECTORS_PER_TRACK
+    div bx                         ; AX = track, DX = sector within it
+    mov cl, dl
+    inc cl                         ; Sector numbers start at 1
+    mov dh, al
+    and dh, HEAD_COUNT - 1         ; Head
+    shr ax, 1
+    mov ch, al                     ; Cylinder
+    mov dl, 0x00                   ; Drive A:
+    xor bx, bx                     ; Read to ES:0000
+    mov ax, 0x0201                 ; BIOS function: Read one sector
+    int 0x13
+    jc .done
     
-.error:
-    ; Set carry flag to indicate error
-    stc
+    ; Advance ES by one sector (512 bytes = 32 paragraphs)
+    mov ax, es
+    add ax, 512 / 16
+    mov es, ax
+    inc si
+    dec di
+    jnz read_sectors
+    clc
+.done:
     ret
 
 ; =============================================================================
@@ -221,6 +290,25 @@ print_string:
     popa                            ; Restore all registers
     ret
 
+; =============================================================================
+; Protected Mode
+; =============================================================================
+
+; Switches to protected mode and calls BEGIN_PM; assembles as 32-bit from
+; here on
+%include "bootloader/switchpm.asm"
+
+BEGIN_PM:
+    ; Copy the staged kernel to the address it is linked at and enter it
+    ; (kernel/link.ld puts _start at its first byte)
+    mov esi, KERNEL_SEGMENT * 16
+    mov edi, KERNEL_ADDRESS
+    mov ecx, KERNEL_SECTOR_COUNT * 512 / 4
+    cld
+    rep movsd
+    mov eax, KERNEL_ADDRESS
+    jmp eax
+
 ; =============================================================================
 ; Boot Sector Padding
 ; =============================================================================
@@ -231,4 +319,4 @@ times 510 - ($ - $$) db 0x00
 
 ; Boot signature (required by BIOS)
 ; Magic number 0xAA55 identifies valid boot sector
-dw 0xAA55
\ No newline at end of file
+dw 0xAA55
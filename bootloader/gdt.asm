@@ -9,6 +9,9 @@ gdt_descriptor:
 
 CODE_SEG equ gdt_code - gdt_start
 DATA_SEG equ gdt_data - gdt_start
+USER_CODE_SEG equ gdt_user_code - gdt_start
+USER_DATA_SEG equ gdt_user_data - gdt_start
+TSS_SEG equ gdt_tss - gdt_start
 
 gdt_start: 
     dq 0x0
@@ -30,4 +33,33 @@ gdt_code:
     db 11001111b ; second flags
     db 0x0 ; base (bits 24-31)
 
-gdt_end:
\ No newline at end of file
+gdt_user_code:
+    ; Ring 3 code segment (same flat layout, DPL = 3)
+    dw 0xFFFF ; limit (bits 0-15)
+    dw 0x0 ; base (bits 0-15)
+    db 0x0 ; base (bits 16-23)
+    db 11111010b ; first flags (present, DPL 3, code, readable)
+    db 11001111b ; second flags
+    db 0x0 ; base (bits 24-31)
+
+gdt_user_data:
+    ; Ring 3 data segment (same flat layout, DPL = 3)
+    dw 0xFFFF ; limit (bits 0-15)
+    dw 0x0 ; base (bits 0-15)
+    db 0x0 ; base (bits 16-23)
+    db 11110010b ; first flags (present, DPL 3, data, writable)
+    db 11001111b ; second flags
+    db 0x0 ; base (bits 24-31)
+
+gdt_tss:
+    ; Task State Segment descriptor
+    ; Base is left zero here; the kernel patches in the address of its own
+    ; TSS and loads the task register during tss_initialize()
+    dw 0x0067 ; limit (bits 0-15) - 104 byte TSS
+    dw 0x0 ; base (bits 0-15)
+    db 0x0 ; base (bits 16-23)
+    db 10001001b ; first flags (present, DPL 0, 32-bit available TSS)
+    db 00000000b ; second flags (byte granularity)
+    db 0x0 ; base (bits 24-31)
+
+gdt_end:
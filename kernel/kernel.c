@@ -60,6 +60,20 @@
 #define SYSTEM_STATUS_ERROR    0x02
 #define SYSTEM_STATUS_WARNING  0x04
 
+// Kernel error codes, returned as negative values by kernel functions
+// and system calls
+#define ERROR_NO_MEMORY        (-1)
+#define ERROR_INVALID_ARGUMENT (-2)
+#define ERROR_BAD_ADDRESS      (-3)
+#define ERROR_BAD_EXECUTABLE   (-4)
+#define ERROR_BUSY             (-5)
+#define ERROR_NO_CHILD         (-6)
+#define ERROR_NOT_FOUND        (-7)
+#define ERROR_WOULD_BLOCK      (-8)
+#define ERROR_BROKEN_PIPE      (-9)
+#define ERROR_TIMED_OUT        (-10)
+#define ERROR_IO               (-11)
+
 // =============================================================================
 // Global Variables
 // =============================================================================
@@ -91,6 +105,92 @@ void print_status_message(void);
 void scroll_screen(void);
 void delay_milliseconds(uint32_t ms);
 uint32_t get_system_uptime(void);
+struct timer;
+void timer_cancel(struct timer* timer);
+void* memset(void* destination, int value, size_t count);
+void* memcpy(void* destination, const void* source, size_t count);
+void* memmove(void* destination, const void* source, size_t count);
+int memcmp(const void* first, const void* second, size_t count);
+size_t string_length(const char* str);
+void print_unsigned(uint32_t value);
+void print_hex(uint32_t value);
+void kernel_panic(const char* message);
+
+// Memory management
+void memory_initialize(void);
+uint32_t page_frame_allocate(void);
+uint32_t page_frame_allocate_contiguous(uint32_t count, uint32_t alignment, uint32_t limit);
+void page_frame_free(uint32_t address);
+void page_frame_reference(uint32_t address);
+uint32_t page_frame_reference_count(uint32_t address);
+void paging_initialize(void);
+void* heap_allocate(size_t size);
+void heap_free(void* pointer);
+
+// Interrupts, processes and system calls
+struct trap_frame;
+struct process;
+struct wait_queue;
+struct vm_area;
+struct file;
+void interrupts_initialize(void);
+void interrupt_dispatch(struct trap_frame* frame);
+void tss_initialize(void);
+void scheduler_initialize(void);
+void scheduler_yield(void);
+void wait_queue_wake_all(struct wait_queue* queue);
+void process_reap_orphans(void);
+int32_t process_create_from_elf(const uint8_t* image, uint32_t size);
+int32_t program_register(const char* name, const uint8_t* image, uint32_t size);
+void timer_initialize(void);
+void vdso_initialize(void);
+void floppy_initialize(void);
+void pci_initialize(void);
+void ata_initialize(void);
+void ahci_initialize(void);
+void virtio_blk_initialize(void);
+void nvme_initialize(void);
+void page_cache_initialize(void);
+void block_initialize(void);
+void fat_initialize(void);
+void ext2_initialize(void);
+void vfs_initialize(void);
+int32_t initramfs_unpack(void);
+void message_passing_initialize(void);
+void pipes_initialize(void);
+void console_log_append(char c);
+void console_log_tick(void);
+void process_files_close(struct process* process, uint32_t flags);
+void file_get(struct file* file);
+void file_put(struct file* file);
+int32_t file_map_fault(struct process* process, struct vm_area* area, uint32_t page, uint32_t error_code);
+void file_map_collect_dirty(struct process* process, struct vm_area* area, uint32_t start, uint32_t end);
+void process_files_inherit(struct process* child, struct process* parent);
+int32_t vdso_map(struct process* process);
+uint32_t divide_u64(uint64_t dividend, uint32_t divisor);
+uint32_t timestamp_to_microseconds(uint64_t cycles);
+
+// Benchmarks
+#ifdef KERNEL_BENCHMARKS
+void run_benchmarks(void);
+void benchmark_report(const char* label, uint32_t operations, uint64_t cycles);
+void benchmark_process_creation(void);
+void benchmark_shared_ring(void);
+void benchmark_message_passing(void);
+void benchmark_io_ring(void);
+void benchmark_event_poll(void);
+void benchmark_futex(void);
+void benchmark_vdso(void);
+void benchmark_multi_call(void);
+void benchmark_ata(void);
+void benchmark_ahci(void);
+void benchmark_nvme(void);
+void benchmark_readahead(void);
+void benchmark_path_walk(void);
+void benchmark_writeback(void);
+void benchmark_file_map(void);
+void benchmark_journal(void);
+#endif
 
 // =============================================================================
 // Kernel Entry Point
@@ -104,14 +204,23 @@ uint32_t get_system_uptime(void);
  * 
  * Design pattern from "Operating System Concepts" by Silberschatz et al.
  */
+__attribute__((section(".text.entry")))
 void _start(void) {
+    // The flat binary does not carry .bss, so clear it before any C code
+    // relies on zero-initialized globals (see kernel/link.ld)
+    extern uint8_t kernel_bss_start[];
+    extern uint8_t kernel_end[];
+    memset(kernel_bss_start, 0, (size_t)(kernel_end - kernel_bss_start));
+    
     kernel_main();
     
     // Infinite loop to prevent system hang
     // Standard OS kernel pattern for idle state
     while (1) {
-        // System idle - could be extended with task scheduling
-        __asm__ volatile("hlt");  // Halt CPU until next interrupt
+        // System idle - run any ready process, then wait for interrupts
+        scheduler_yield();
+        process_reap_orphans();
+        __asm__ volatile("sti; hlt; cli");  // Halt CPU until next interrupt
     }
 }
 
@@ -140,6 +249,10 @@ void kernel_main(void) {
     // Display status and prompt
     print_status_message();
     
+#ifdef KERNEL_BENCHMARKS
+    run_benchmarks();
+#endif
+    
     // System is now ready for operation
     system_status = SYSTEM_STATUS_READY;
 }
@@ -162,6 +275,28 @@ void system_initialize(void) {
     
     // Set initial cursor position
     set_cursor_position(0, 0);
+    
+    // Memory, interrupts and the process subsystem
+    memory_initialize();
+    paging_initialize();
+    interrupts_initialize();
+    tss_initialize();
+    scheduler_initialize();
+    timer_initialize();
+    vdso_initialize();
+    floppy_initialize();
+    pci_initialize();
+    ata_initialize();
+    ahci_initialize();
+    virtio_blk_initialize();
+    nvme_initialize();
+    page_cache_initialize();
+    block_initialize();
+    fat_initialize();
+    ext2_initialize();
+    vfs_initialize();
+    message_passing_initialize();
+    pipes_initialize();
 }
 
 /**
@@ -227,6 +362,8 @@ void set_cursor_position(uint8_t x, uint8_t y) {
 void print_character(char c) {
     volatile uint16_t* video_memory = (volatile uint16_t*)VIDEO_MEMORY_ADDRESS;
     
+    console_log_append(c);
+    
     if (c == '\n') {
         // Newline: move to beginning of next line
         cursor_position.x = 0;
@@ -454,17 +591,17012 @@ void delay_milliseconds(uint32_t ms) {
     }
 }
 
+// =============================================================================
+// Benchmarks
+// =============================================================================
+
+// The suite and every benchmark below are only compiled in when
+// KERNEL_BENCHMARKS is defined (see `make bench`)
+#ifdef KERNEL_BENCHMARKS
+
 /**
- * @brief Get system uptime
+ * @brief Run the in-kernel benchmark suite
+ * 
+ * Each benchmark drives the same kernel paths that system calls use and
+ * prints its results to the console.
+ */
+void run_benchmarks(void) {
+    set_cursor_position(0, 24);
+    print_colored_string("\nBenchmarks:\n", COLOR_LIGHT_GREEN);
+    
+    benchmark_process_creation();
+    benchmark_shared_ring();
+    benchmark_message_passing();
+    benchmark_io_ring();
+    benchmark_event_poll();
+    benchmark_futex();
+    benchmark_vdso();
+    benchmark_multi_call();
+    benchmark_ata();
+    benchmark_ahci();
+    benchmark_nvme();
+    benchmark_readahead();
+    benchmark_path_walk();
+    benchmark_writeback();
+    benchmark_journal();
+    benchmark_file_map();
+}
+
+/**
+ * @brief Print an operation rate measured with the time stamp counter
+ * 
+ * @param label Description of the operation
+ * @param operations Number of operations performed
+ * @param cycles Total elapsed cycles
+ */
+void benchmark_report(const char* label, uint32_t operations, uint64_t cycles) {
+    uint32_t microseconds = timestamp_to_microseconds(cycles);
+    
+    if (microseconds == 0) microseconds = 1;
+    if (operations == 0) operations = 1;
+    
+    print_string("  ");
+    print_string(label);
+    print_string(": ");
+    print_unsigned(divide_u64((uint64_t)operations * 1000000, microseconds));
+    print_string("/s, ");
+    print_unsigned(divide_u64(cycles, operations));
+    print_string(" cycles each\n");
+}
+
+#endif // KERNEL_BENCHMARKS
+
+// =============================================================================
+// Freestanding Runtime Support
+// =============================================================================
+
+/**
+ * @brief Fill a block of memory with a byte value
  * 
- * @return Approximate uptime in milliseconds
+ * @param destination Start of the block
+ * @param value Byte value to store
+ * @param count Number of bytes
+ * @return destination
  * 
- * Placeholder for future implementation
- * Could use PIT timer or RTC for accurate timing
+ * GCC may emit calls to memset, memcpy, memmove and memcmp even in a
+ * freestanding build (C99 section 4, GCC manual "-ffreestanding"), so the
+ * kernel provides its own definitions. String instructions are used for the
+ * bulk of the work since page-sized clears and copies are common.
  */
-uint32_t get_system_uptime(void) {
-    // Placeholder for future implementation
-    // Could use PIT timer or RTC for accurate timing
-    // Implementation would require hardware timer setup
+void* memset(void* destination, int value, size_t count) {
+    uint32_t pattern = (uint8_t)value * 0x01010101u;
+    uint8_t* bytes = (uint8_t*)destination;
+    size_t words = count / 4;
+    
+    __asm__ volatile("rep stosl"
+                     : "+D"(bytes), "+c"(words)
+                     : "a"(pattern)
+                     : "memory");
+    for (size_t i = 0; i < (count & 3); ++i) {
+        bytes[i] = (uint8_t)value;
+    }
+    return destination;
+}
+
+/**
+ * @brief Copy a block of memory (regions must not overlap)
+ * 
+ * @param destination Destination block
+ * @param source Source block
+ * @param count Number of bytes
+ * @return destination
+ */
+void* memcpy(void* destination, const void* source, size_t count) {
+    uint8_t* to = (uint8_t*)destination;
+    const uint8_t* from = (const uint8_t*)source;
+    size_t words = count / 4;
+    
+    __asm__ volatile("rep movsl"
+                     : "+D"(to), "+S"(from), "+c"(words)
+                     :
+                     : "memory");
+    for (size_t i = 0; i < (count & 3); ++i) {
+        to[i] = from[i];
+    }
+    return destination;
+}
+
+/**
+ * @brief Copy a block of memory that may overlap the destination
+ * 
+ * @param destination Destination block
+ * @param source Source block
+ * @param count Number of bytes
+ * @return destination
+ */
+void* memmove(void* destination, const void* source, size_t count) {
+    uint8_t* to = (uint8_t*)destination;
+    const uint8_t* from = (const uint8_t*)source;
+    
+    if (to <= from || to >= from + count) {
+        return memcpy(destination, source, count);
+    }
+    
+    // Overlapping with destination above source: copy backwards
+    while (count--) {
+        to[count] = from[count];
+    }
+    return destination;
+}
+
+/**
+ * @brief Compare two blocks of memory
+ * 
+ * @param first First block
+ * @param second Second block
+ * @param count Number of bytes
+ * @return Zero if equal, otherwise the difference of the first mismatch
+ */
+int memcmp(const void* first, const void* second, size_t count) {
+    const uint8_t* a = (const uint8_t*)first;
+    const uint8_t* b = (const uint8_t*)second;
+    
+    for (size_t i = 0; i < count; ++i) {
+        if (a[i] != b[i]) {
+            return a[i] - b[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Length of a null-terminated string
+ * 
+ * @param str String to measure
+ * @return Number of characters before the terminator
+ */
+size_t string_length(const char* str) {
+    size_t length = 0;
+    
+    while (str[length] != '\0') {
+        length++;
+    }
+    return length;
+}
+
+// =============================================================================
+// CPU and Port I/O Helpers
+// =============================================================================
+
+// x86 I/O port access and control register helpers
+// Source: Intel 64 and IA-32 Architectures Software Developer's Manual, Vol. 2
+
+static inline void outb(uint16_t port, uint8_t value) {
+    __asm__ volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t value;
+    __asm__ volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void outw(uint16_t port, uint16_t value) {
+    __asm__ volatile("outw %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t value;
+    __asm__ volatile("inw %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    __asm__ volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+// Repeated word transfers for programmed I/O data ports
+static inline void insw(uint16_t port, void* buffer, uint32_t count) {
+    __asm__ volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+static inline void outsw(uint16_t port, const void* buffer, uint32_t count) {
+    __asm__ volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+
+// Memory-mapped device register access (see paging_map_device())
+static inline uint32_t mmio_read32(const volatile void* address) {
+    return *(const volatile uint32_t*)address;
+}
+
+static inline void mmio_write32(volatile void* address, uint32_t value) {
+    *(volatile uint32_t*)address = value;
+}
+
+static inline uint16_t mmio_read16(const volatile void* address) {
+    return *(const volatile uint16_t*)address;
+}
+
+static inline void mmio_write16(volatile void* address, uint16_t value) {
+    *(volatile uint16_t*)address = value;
+}
+
+static inline uint8_t mmio_read8(const volatile void* address) {
+    return *(const volatile uint8_t*)address;
+}
+
+static inline void mmio_write8(volatile void* address, uint8_t value) {
+    *(volatile uint8_t*)address = value;
+}
+
+// Index of the CPU running this code. Only the boot CPU is brought up, so
+// per-CPU structures always use slot 0.
+#define CPU_COUNT              1
+
+static inline uint32_t cpu_current(void) {
+    return 0;
+}
+
+// Write to an unused port to give slow ISA devices time to settle
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+static inline uint32_t read_cr0(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(uint32_t value) {
+    __asm__ volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr2(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline uint32_t read_cr3(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(uint32_t value) {
+    __asm__ volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline uint32_t read_cr4(void) {
+    uint32_t value;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(uint32_t value) {
+    __asm__ volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void invalidate_page(uint32_t address) {
+    __asm__ volatile("invlpg (%0)" : : "r"(address) : "memory");
+}
+
+// =============================================================================
+// Console Number Output and Panic
+// =============================================================================
+
+/**
+ * @brief Print an unsigned integer in decimal
+ * 
+ * @param value Value to print
+ */
+void print_unsigned(uint32_t value) {
+    char digits[11];
+    int count = 0;
+    
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    
+    while (count > 0) {
+        print_character(digits[--count]);
+    }
+}
+
+/**
+ * @brief Print an unsigned integer as 0x-prefixed hexadecimal
+ * 
+ * @param value Value to print
+ */
+void print_hex(uint32_t value) {
+    static const char hex_digits[] = "0123456789ABCDEF";
+    
+    print_string("0x");
+    for (int shift = 28; shift >= 0; shift -= 4) {
+        print_character(hex_digits[(value >> shift) & 0xF]);
+    }
+}
+
+/**
+ * @brief Report an unrecoverable kernel error and halt
+ * 
+ * @param message Description of the failure
+ */
+void kernel_panic(const char* message) {
+    __asm__ volatile("cli");
+    print_colored_string("\nKERNEL PANIC: ", COLOR_LIGHT_RED);
+    print_string(message);
+    
+    while (1) {
+        __asm__ volatile("hlt");
+    }
+}
+
+// =============================================================================
+// Physical Memory Management
+// =============================================================================
+
+// Page and address space layout
+// Source: Intel SDM Vol. 3, Chapter 4 "Paging"
+#define PAGE_SIZE              4096
+#define PAGE_SHIFT             12
+#define PAGE_ALIGN_DOWN(addr)  ((addr) & ~(uint32_t)(PAGE_SIZE - 1))
+#define PAGE_ALIGN_UP(addr)    (((addr) + PAGE_SIZE - 1) & ~(uint32_t)(PAGE_SIZE - 1))
+
+// All physical memory below 1GB is identity-mapped for the kernel, so a
+// physical frame address can be used directly as a kernel pointer
+#define KERNEL_SPACE_END       0x40000000
+#define MAX_PAGE_FRAMES        (KERNEL_SPACE_END / PAGE_SIZE)
+
+// CMOS registers holding the BIOS memory size
+// Source: IBM PC/AT Technical Reference, CMOS RAM map
+#define CMOS_ADDRESS_PORT      0x70
+#define CMOS_DATA_PORT         0x71
+#define CMOS_EXTENDED_LOW      0x30    // KB above 1MB (low byte)
+#define CMOS_EXTENDED_HIGH     0x31    // KB above 1MB (high byte)
+#define CMOS_HIGH_BLOCKS_LOW   0x34    // 64KB blocks above 16MB (low byte)
+#define CMOS_HIGH_BLOCKS_HIGH  0x35    // 64KB blocks above 16MB (high byte)
+
+extern uint8_t kernel_end[];    // Provided by kernel/link.ld
+
+// Left in low memory by the bootloader (bootloader/boot.asm)
+#define BOOT_INFORMATION_ADDRESS  0x500
+#define BOOT_INFORMATION_MAGIC    0x4F464E49    // "INFO"
+#define BOOT_ARCHIVE_LIMIT        0xA0000       // End of conventional memory
+
+struct boot_information {
+    uint32_t magic;
+    uint32_t initramfs_address;     // Boot archive, page-aligned; 0 if none
+    uint32_t initramfs_size;        // Bytes
+};
+
+static struct boot_information boot_information;
+
+// One bit per page frame, set when the frame is in use
+static uint32_t page_frame_bitmap[MAX_PAGE_FRAMES / 32];
+static uint32_t page_frame_total;
+static uint32_t page_frames_free;
+static uint32_t page_frame_search_start;
+
+// Per-frame reference counts, placed directly after the kernel image and
+// sized to installed memory. Shared frames (copy-on-write after fork) are
+// only returned to the bitmap when the last reference is dropped.
+static uint16_t* page_frame_references;
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(CMOS_ADDRESS_PORT, reg);
+    return inb(CMOS_DATA_PORT);
+}
+
+static void page_frame_mark_used(uint32_t frame) {
+    page_frame_bitmap[frame / 32] |= 1u << (frame % 32);
+}
+
+static void page_frame_mark_free(uint32_t frame) {
+    page_frame_bitmap[frame / 32] &= ~(1u << (frame % 32));
+}
+
+static int page_frame_is_used(uint32_t frame) {
+    return (page_frame_bitmap[frame / 32] >> (frame % 32)) & 1;
+}
+
+/**
+ * @brief Detect installed memory and initialize the page frame allocator
+ * 
+ * Everything below the end of the kernel image (BIOS data, video memory,
+ * bootloader, boot stack and the kernel itself) is permanently reserved,
+ * except the boot archive: its frames are given one reference each, held
+ * until initramfs_unpack() is done with them.
+ * 
+ * CMOS memory size registers from the IBM PC/AT Technical Reference
+ */
+void memory_initialize(void) {
+    uint32_t extended_kb = cmos_read(CMOS_EXTENDED_LOW) |
+                           ((uint32_t)cmos_read(CMOS_EXTENDED_HIGH) << 8);
+    uint32_t high_blocks = cmos_read(CMOS_HIGH_BLOCKS_LOW) |
+                           ((uint32_t)cmos_read(CMOS_HIGH_BLOCKS_HIGH) << 8);
+    uint32_t memory_bytes;
+    
+    if (high_blocks != 0) {
+        uint32_t max_blocks = (KERNEL_SPACE_END - 0x1000000) / 0x10000;
+        if (high_blocks > max_blocks) high_blocks = max_blocks;
+        memory_bytes = 0x1000000 + high_blocks * 0x10000;
+    } else {
+        memory_bytes = 0x100000 + extended_kb * 1024;
+    }
+    
+    page_frame_total = memory_bytes / PAGE_SIZE;
+    
+    // Frames beyond installed memory are never handed out
+    for (uint32_t i = 0; i < MAX_PAGE_FRAMES / 32; ++i) {
+        page_frame_bitmap[i] = 0xFFFFFFFF;
+    }
+    
+    page_frame_references = (uint16_t*)PAGE_ALIGN_UP((uint32_t)kernel_end);
+    memset(page_frame_references, 0, page_frame_total * sizeof(uint16_t));
+    
+    uint32_t first_free = PAGE_ALIGN_UP((uint32_t)page_frame_references +
+                                        page_frame_total * sizeof(uint16_t)) / PAGE_SIZE;
+    page_frames_free = 0;
+    for (uint32_t frame = first_free; frame < page_frame_total; ++frame) {
+        page_frame_mark_free(frame);
+        page_frames_free++;
+    }
+    page_frame_search_start = first_free / 32;
+    
+    memcpy(&boot_information, (const void*)BOOT_INFORMATION_ADDRESS, sizeof(boot_information));
+    if (boot_information.magic != BOOT_INFORMATION_MAGIC || (boot_information.initramfs_address & (PAGE_SIZE - 1)) ||
+        boot_information.initramfs_address < PAGE_SIZE || boot_information.initramfs_address >= BOOT_ARCHIVE_LIMIT ||
+        boot_information.initramfs_size > BOOT_ARCHIVE_LIMIT - boot_information.initramfs_address) {
+        boot_information.initramfs_size = 0;
+    } else {
+        for (uint32_t frame = boot_information.initramfs_address / PAGE_SIZE;
+             frame < PAGE_ALIGN_UP(boot_information.initramfs_address + boot_information.initramfs_size) / PAGE_SIZE;
+             ++frame) {
+            page_frame_references[frame] = 1;
+        }
+    }
+}
+
+/**
+ * @brief Allocate one physical page frame
+ * 
+ * @return Physical (and identity-mapped kernel) address, or 0 if exhausted
+ * 
+ * The search resumes at the last word that had a free frame, so the common
+ * case inspects a single bitmap word.
+ */
+uint32_t page_frame_allocate(void) {
+    uint32_t words = (page_frame_total + 31) / 32;
+    
+    for (uint32_t n = 0; n < words; ++n) {
+        uint32_t index = (page_frame_search_start + n) % words;
+        uint32_t word = page_frame_bitmap[index];
+        
+        if (word != 0xFFFFFFFF) {
+            uint32_t frame = index * 32 + (uint32_t)__builtin_ctz(~word);
+            page_frame_mark_used(frame);
+            page_frame_references[frame] = 1;
+            page_frames_free--;
+            page_frame_search_start = index;
+            return frame * PAGE_SIZE;
+        }
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Allocate physically contiguous page frames
+ * 
+ * @param count Number of frames
+ * @param alignment Required physical alignment in bytes (power of two)
+ * @param limit Highest physical address the run may end at (0 = no limit)
+ * @return Physical address of the first frame, or 0 if no run is available
+ * 
+ * Used for multi-page kernel allocations and DMA buffers.
+ */
+uint32_t page_frame_allocate_contiguous(uint32_t count, uint32_t alignment, uint32_t limit) {
+    uint32_t step = alignment > PAGE_SIZE ? alignment / PAGE_SIZE : 1;
+    uint32_t end_frame = page_frame_total;
+    
+    if (limit != 0 && limit / PAGE_SIZE < end_frame) {
+        end_frame = limit / PAGE_SIZE;
+    }
+    
+    for (uint32_t start = 0; start + count <= end_frame; start += step) {
+        uint32_t run = 0;
+        while (run < count && !page_frame_is_used(start + run)) {
+            run++;
+        }
+        if (run == count) {
+            for (uint32_t i = 0; i < count; ++i) {
+                page_frame_mark_used(start + i);
+                page_frame_references[start + i] = 1;
+            }
+            page_frames_free -= count;
+            return start * PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Drop a reference to a page frame
+ * 
+ * @param address Physical address of the frame
+ * 
+ * The frame returns to the allocator when its last reference is dropped.
+ */
+void page_frame_free(uint32_t address) {
+    uint32_t frame = address / PAGE_SIZE;
+    
+    if (frame >= page_frame_total || !page_frame_is_used(frame) ||
+        page_frame_references[frame] == 0) {
+        kernel_panic("page_frame_free: frame not allocated");
+    }
+    if (--page_frame_references[frame] != 0) {
+        return;
+    }
+    page_frame_mark_free(frame);
+    page_frames_free++;
+}
+
+/**
+ * @brief Take an additional reference to an allocated page frame
+ * 
+ * @param address Physical address of the frame
+ */
+void page_frame_reference(uint32_t address) {
+    uint32_t frame = address / PAGE_SIZE;
+    
+    if (page_frame_references[frame] == 0xFFFF) {
+        kernel_panic("page_frame_reference: reference count overflow");
+    }
+    page_frame_references[frame]++;
+}
+
+/**
+ * @brief Number of references held on a page frame
+ * 
+ * @param address Physical address of the frame
+ * @return Reference count (0 for free frames)
+ */
+uint32_t page_frame_reference_count(uint32_t address) {
+    return page_frame_references[address / PAGE_SIZE];
+}
+
+// =============================================================================
+// Paging
+// =============================================================================
+
+// Page table entry flags
+// Source: Intel SDM Vol. 3, Section 4.3 "32-bit Paging"
+#define PAGE_PRESENT           0x001
+#define PAGE_WRITABLE          0x002
+#define PAGE_USER              0x004
+#define PAGE_WRITE_THROUGH     0x008
+#define PAGE_CACHE_DISABLE     0x010
+#define PAGE_ACCESSED          0x020
+#define PAGE_DIRTY             0x040
+#define PAGE_LARGE             0x080   // 4MB page (page directory entries only)
+#define PAGE_COPY_ON_WRITE     0x200   // Software bit: shared until written
+#define PAGE_SHARED            0x400   // Software bit: stays shared across fork
+#define PAGE_FLAGS_MASK        0xFFF
+#define PAGE_FAULT_PRESENT     0x1     // Error code: protection violation
+#define PAGE_FAULT_WRITE       0x2     // Error code: write access
+#define PAGE_FAULT_USER        0x4     // Error code: fault in ring 3
+#define LARGE_PAGE_SIZE        0x400000
+
+#define CR0_WRITE_PROTECT      0x00010000
+#define CR0_PAGING             0x80000000
+#define CR4_PAGE_SIZE_EXT      0x00000010
+
+#define PAGE_DIRECTORY_INDEX(addr)  ((addr) >> 22)
+#define PAGE_TABLE_INDEX(addr)      (((addr) >> PAGE_SHIFT) & 0x3FF)
+
+// Virtual address space layout:
+//   0x00000000 - 0x3FFFFFFF  kernel, identity-mapped RAM (4MB pages)
+//   0x40000000 - 0xBFFFFFFF  user space, private to each process
+//   0xC0000000 - 0xFFFFFFFF  kernel, reserved for device MMIO
+#define USER_SPACE_START       KERNEL_SPACE_END
+#define USER_SPACE_END         0xC0000000
+#define USER_STACK_TOP         USER_SPACE_END
+#define USER_STACK_SIZE        (1024 * 1024)
+#define USER_MAPPING_BASE      0x80000000  // Shared memory and other mappings
+#define VDSO_ADDRESS           0xBFEFF000  // Page just below the user stack
+#define KERNEL_PDE_LOW_END     PAGE_DIRECTORY_INDEX(USER_SPACE_START)
+#define KERNEL_PDE_HIGH_START  PAGE_DIRECTORY_INDEX(USER_SPACE_END)
+
+static uint32_t kernel_page_directory[1024] __attribute__((aligned(PAGE_SIZE)));
+
+/**
+ * @brief Build the kernel page directory and enable paging
+ * 
+ * Installed RAM is identity-mapped with supervisor-only 4MB pages, which
+ * needs no page tables and is shared by every address space. CR0.WP is set
+ * so that kernel writes honour read-only user mappings (needed for
+ * copy-on-write).
+ * 
+ * Paging enable sequence from Intel SDM Vol. 3, Section 4.1
+ */
+void paging_initialize(void) {
+    uint32_t large_pages = (page_frame_total * PAGE_SIZE + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
+    
+    for (uint32_t i = 0; i < large_pages && i < KERNEL_PDE_LOW_END; ++i) {
+        kernel_page_directory[i] = (i * LARGE_PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE;
+    }
+    
+    write_cr4(read_cr4() | CR4_PAGE_SIZE_EXT);
+    write_cr3((uint32_t)kernel_page_directory);
+    write_cr0(read_cr0() | CR0_PAGING | CR0_WRITE_PROTECT);
+}
+
+/**
+ * @brief Create an empty user address space
+ * 
+ * @return Page directory sharing the kernel mappings, or NULL if out of memory
+ */
+uint32_t* address_space_create(void) {
+    uint32_t* directory = (uint32_t*)page_frame_allocate();
+    
+    if (!directory) return NULL;
+    
+    memset(directory, 0, PAGE_SIZE);
+    for (uint32_t i = 0; i < KERNEL_PDE_LOW_END; ++i) {
+        directory[i] = kernel_page_directory[i];
+    }
+    for (uint32_t i = KERNEL_PDE_HIGH_START; i < 1024; ++i) {
+        directory[i] = kernel_page_directory[i];
+    }
+    return directory;
+}
+
+/**
+ * @brief Find the page table entry for a user virtual address
+ * 
+ * @param directory Page directory to walk
+ * @param address Virtual address
+ * @param create Allocate a missing page table when non-zero
+ * @return Pointer to the entry, or NULL if absent (or out of memory)
+ */
+uint32_t* paging_get_entry(uint32_t* directory, uint32_t address, int create) {
+    uint32_t* pde = &directory[PAGE_DIRECTORY_INDEX(address)];
+    
+    if (!(*pde & PAGE_PRESENT)) {
+        if (!create) return NULL;
+        
+        uint32_t table = page_frame_allocate();
+        if (!table) return NULL;
+        memset((void*)table, 0, PAGE_SIZE);
+        
+        // Permissions are enforced at the page table entry level
+        *pde = table | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+    }
+    
+    uint32_t* table = (uint32_t*)(*pde & ~(uint32_t)PAGE_FLAGS_MASK);
+    return &table[PAGE_TABLE_INDEX(address)];
+}
+
+/**
+ * @brief Map one page in an address space
+ * 
+ * @param directory Page directory
+ * @param address Page-aligned virtual address
+ * @param physical Page-aligned physical address
+ * @param flags PAGE_* flags (PAGE_PRESENT is implied)
+ * @return 0 on success, ERROR_NO_MEMORY if a page table could not be allocated
+ */
+int32_t paging_map_page(uint32_t* directory, uint32_t address, uint32_t physical, uint32_t flags) {
+    uint32_t* entry = paging_get_entry(directory, address, 1);
+    
+    if (!entry) return ERROR_NO_MEMORY;
+    
+    *entry = physical | flags | PAGE_PRESENT;
+    if (directory == (uint32_t*)read_cr3()) {
+        invalidate_page(address);
+    }
+    return 0;
+}
+
+/**
+ * @brief Map device registers into the kernel's MMIO window
+ * 
+ * @param physical Physical address of the registers
+ * @param size Length in bytes
+ * @return Kernel pointer to the registers, or NULL if they lie below the
+ *         MMIO window
+ * 
+ * The window is identity-mapped with uncached 4MB pages in the kernel page
+ * directory. Address spaces copy the kernel's high entries when they are
+ * created, so devices must be mapped during initialization.
+ */
+void* paging_map_device(uint32_t physical, uint32_t size) {
+    if (size == 0 || physical < USER_SPACE_END || physical + (size - 1) < physical) return NULL;
+    
+    uint32_t last = PAGE_DIRECTORY_INDEX(physical + (size - 1));
+    for (uint32_t i = PAGE_DIRECTORY_INDEX(physical); i <= last; ++i) {
+        kernel_page_directory[i] = (i * LARGE_PAGE_SIZE) | PAGE_PRESENT | PAGE_WRITABLE | PAGE_LARGE |
+                                   PAGE_WRITE_THROUGH | PAGE_CACHE_DISABLE;
+        invalidate_page(i * LARGE_PAGE_SIZE);
+    }
+    return (void*)physical;
+}
+
+/**
+ * @brief Release every user page and page table, then the directory itself
+ * 
+ * @param directory Page directory (must not be the active one)
+ */
+void address_space_destroy(uint32_t* directory) {
+    for (uint32_t i = KERNEL_PDE_LOW_END; i < KERNEL_PDE_HIGH_START; ++i) {
+        if (!(directory[i] & PAGE_PRESENT)) continue;
+        
+        uint32_t* table = (uint32_t*)(directory[i] & ~(uint32_t)PAGE_FLAGS_MASK);
+        for (uint32_t j = 0; j < 1024; ++j) {
+            if (table[j] & PAGE_PRESENT) {
+                page_frame_free(table[j] & ~(uint32_t)PAGE_FLAGS_MASK);
+            }
+        }
+        page_frame_free((uint32_t)table);
+    }
+    page_frame_free((uint32_t)directory);
+}
+
+/**
+ * @brief Share every user page of one address space with another,
+ *        copy-on-write
+ * 
+ * @param source Page directory to clone (may be the active one)
+ * @param destination Freshly created, empty page directory
+ * @return 0 on success, ERROR_NO_MEMORY if a page table could not be allocated
+ * 
+ * Only page tables are allocated; data pages gain a reference and writable
+ * entries are downgraded to read-only + PAGE_COPY_ON_WRITE in both spaces.
+ * The source TLB is flushed once at the end instead of per page.
+ */
+int32_t address_space_clone(uint32_t* source, uint32_t* destination) {
+    int downgraded = 0;
+    
+    for (uint32_t i = KERNEL_PDE_LOW_END; i < KERNEL_PDE_HIGH_START; ++i) {
+        if (!(source[i] & PAGE_PRESENT)) continue;
+        
+        uint32_t* source_table = (uint32_t*)(source[i] & ~(uint32_t)PAGE_FLAGS_MASK);
+        uint32_t* table = (uint32_t*)page_frame_allocate();
+        if (!table) return ERROR_NO_MEMORY;
+        
+        for (uint32_t j = 0; j < 1024; ++j) {
+            uint32_t entry = source_table[j];
+            
+            if (entry & PAGE_PRESENT) {
+                if ((entry & PAGE_WRITABLE) && !(entry & PAGE_SHARED)) {
+                    entry = (entry & ~(uint32_t)PAGE_WRITABLE) | PAGE_COPY_ON_WRITE;
+                    source_table[j] = entry;
+                    downgraded = 1;
+                }
+                page_frame_reference(entry & ~(uint32_t)PAGE_FLAGS_MASK);
+            }
+            table[j] = entry;
+        }
+        destination[i] = (uint32_t)table | (source[i] & PAGE_FLAGS_MASK);
+    }
+    
+    if (downgraded && source == (uint32_t*)read_cr3()) {
+        write_cr3((uint32_t)source);
+    }
+    return 0;
+}
+
+// =============================================================================
+// Kernel Heap
+// =============================================================================
+
+// Small allocations come from power-of-two size classes carved out of whole
+// pages; anything larger gets its own run of contiguous page frames.
+// Every block starts with a header recording its size so heap_free() needs
+// no size argument.
+#define HEAP_MIN_CLASS_SHIFT   5       // 32 byte blocks
+#define HEAP_MAX_CLASS_SHIFT   11      // 2048 byte blocks
+#define HEAP_SIZE_CLASSES      (HEAP_MAX_CLASS_SHIFT - HEAP_MIN_CLASS_SHIFT + 1)
+#define HEAP_BLOCK_MAGIC       0x4D41584F    // "MAXO"
+
+struct heap_block_header {
+    uint32_t size;      // Block size in bytes including this header
+    uint32_t magic;
+};
+
+struct heap_free_block {
+    struct heap_free_block* next;
+};
+
+static struct heap_free_block* heap_free_lists[HEAP_SIZE_CLASSES];
+
+/**
+ * @brief Allocate zero-filled kernel memory
+ * 
+ * @param size Number of bytes
+ * @return Pointer to the memory, or NULL if out of memory
+ */
+void* heap_allocate(size_t size) {
+    uint32_t total = (uint32_t)size + sizeof(struct heap_block_header);
+    struct heap_block_header* header;
+    
+    if (total > (1u << HEAP_MAX_CLASS_SHIFT)) {
+        uint32_t pages = PAGE_ALIGN_UP(total) / PAGE_SIZE;
+        uint32_t address = page_frame_allocate_contiguous(pages, PAGE_SIZE, 0);
+        if (!address) return NULL;
+        
+        header = (struct heap_block_header*)address;
+        header->size = pages * PAGE_SIZE;
+    } else {
+        uint32_t shift = HEAP_MIN_CLASS_SHIFT;
+        while ((1u << shift) < total) shift++;
+        
+        uint32_t class_index = shift - HEAP_MIN_CLASS_SHIFT;
+        if (!heap_free_lists[class_index]) {
+            // Refill the class by splitting a fresh page into blocks
+            uint8_t* page = (uint8_t*)page_frame_allocate();
+            if (!page) return NULL;
+            
+            for (uint32_t offset = 0; offset < PAGE_SIZE; offset += 1u << shift) {
+                struct heap_free_block* block = (struct heap_free_block*)(page + offset);
+                block->next = heap_free_lists[class_index];
+                heap_free_lists[class_index] = block;
+            }
+        }
+        
+        header = (struct heap_block_header*)heap_free_lists[class_index];
+        heap_free_lists[class_index] = heap_free_lists[class_index]->next;
+        header->size = 1u << shift;
+    }
+    
+    header->magic = HEAP_BLOCK_MAGIC;
+    memset(header + 1, 0, header->size - sizeof(struct heap_block_header));
+    return header + 1;
+}
+
+/**
+ * @brief Release memory obtained from heap_allocate
+ * 
+ * @param pointer Allocation to free (NULL is ignored)
+ */
+void heap_free(void* pointer) {
+    if (!pointer) return;
+    
+    struct heap_block_header* header = (struct heap_block_header*)pointer - 1;
+    if (header->magic != HEAP_BLOCK_MAGIC) {
+        kernel_panic("heap_free: corrupted or foreign block");
+    }
+    header->magic = 0;
+    
+    if (header->size > (1u << HEAP_MAX_CLASS_SHIFT)) {
+        for (uint32_t offset = 0; offset < header->size; offset += PAGE_SIZE) {
+            page_frame_free((uint32_t)header + offset);
+        }
+        return;
+    }
+    
+    uint32_t shift = HEAP_MIN_CLASS_SHIFT;
+    while ((1u << shift) < header->size) shift++;
+    
+    struct heap_free_block* block = (struct heap_free_block*)header;
+    block->next = heap_free_lists[shift - HEAP_MIN_CLASS_SHIFT];
+    heap_free_lists[shift - HEAP_MIN_CLASS_SHIFT] = block;
+}
+
+// =============================================================================
+// Interrupt Handling
+// =============================================================================
+
+// Descriptor table layout and gate types
+// Source: Intel SDM Vol. 3, Chapter 6 "Interrupt and Exception Handling"
+#define IDT_ENTRIES            256
+#define IDT_INTERRUPT_GATE     0x8E    // Present, DPL 0, 32-bit interrupt gate
+#define IDT_USER_GATE          0xEE    // Present, DPL 3 (reachable via int n)
+#define EXCEPTION_COUNT        32
+#define EXCEPTION_PAGE_FAULT   14
+#define IRQ_BASE_VECTOR        32
+#define IRQ_COUNT              16
+#define IRQ_MAX_HANDLERS       4       // PCI interrupt lines may be shared
+#define SYSCALL_VECTOR         0x80
+#define EFLAGS_INTERRUPT       0x200
+
+// Segment selectors defined by bootloader/gdt.asm
+#define KERNEL_DATA_SELECTOR   0x08
+#define KERNEL_CODE_SELECTOR   0x10
+#define USER_CODE_SELECTOR     (0x18 | 3)
+#define USER_DATA_SELECTOR     (0x20 | 3)
+#define TSS_SELECTOR           0x28
+#define TSS_GDT_INDEX          5
+
+// 8259A programmable interrupt controller
+// Source: Intel 8259A datasheet and OSDev Wiki "8259 PIC"
+#define PIC_MASTER_COMMAND     0x20
+#define PIC_MASTER_DATA        0x21
+#define PIC_SLAVE_COMMAND      0xA0
+#define PIC_SLAVE_DATA         0xA1
+#define PIC_END_OF_INTERRUPT   0x20
+#define PIC_CASCADE_IRQ        2
+
+// Register state saved by the interrupt entry stubs, lowest address first
+struct trap_frame {
+    uint32_t gs, fs, es, ds;
+    uint32_t edi, esi, ebp, kernel_esp, ebx, edx, ecx, eax;   // pusha
+    uint32_t interrupt_number, error_code;
+    uint32_t eip, cs, eflags;
+    uint32_t user_esp, user_ss;     // Only pushed on a ring 3 -> ring 0 entry
+};
+
+struct idt_entry {
+    uint16_t offset_low;
+    uint16_t selector;
+    uint8_t zero;
+    uint8_t type_attributes;
+    uint16_t offset_high;
+} __attribute__((packed));
+
+struct descriptor_pointer {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+typedef void (*irq_handler_t)(struct trap_frame* frame, void* context);
+
+// Bottom half: work an interrupt handler defers until every handler of the
+// interrupt has returned. Runs with interrupts disabled and must not sleep.
+struct deferred_work {
+    void (*function)(struct deferred_work* work);
+    void* context;
+    int pending;
+    struct deferred_work* next;
+};
+
+static struct deferred_work* deferred_work_list;
+static struct deferred_work** deferred_work_tail = &deferred_work_list;
+
+static struct idt_entry interrupt_descriptor_table[IDT_ENTRIES];
+static struct {
+    irq_handler_t handler;
+    void* context;
+} irq_handlers[IRQ_COUNT][IRQ_MAX_HANDLERS];
+
+static const char* const exception_names[EXCEPTION_COUNT] = {
+    "Divide error", "Debug", "NMI", "Breakpoint", "Overflow",
+    "Bound range exceeded", "Invalid opcode", "Device not available",
+    "Double fault", "Coprocessor segment overrun", "Invalid TSS",
+    "Segment not present", "Stack fault", "General protection fault",
+    "Page fault", "Reserved", "x87 floating point error", "Alignment check",
+    "Machine check", "SIMD floating point error", "Virtualization",
+    "Control protection", "Reserved", "Reserved", "Reserved", "Reserved",
+    "Reserved", "Reserved", "Hypervisor injection", "VMM communication",
+    "Security exception", "Reserved"
+};
+
+// Interrupt entry stubs. Each stub normalises the stack to a trap_frame
+// (pushing a dummy error code where the CPU does not) and jumps to a common
+// path that saves registers, loads kernel segments, clears the direction
+// flag and calls interrupt_dispatch(). interrupt_return is also the first
+// "return address" of a newly created process, see
+// process_prepare_user_entry().
+__asm__(
+    ".section .text\n"
+    ".macro INTERRUPT_STUB num, has_error_code\n"
+    "interrupt_stub_\\num:\n"
+    "    .if \\has_error_code == 0\n"
+    "    push $0\n"
+    "    .endif\n"
+    "    push $\\num\n"
+    "    jmp interrupt_common\n"
+    ".endm\n"
+    ".irp num, 0,1,2,3,4,5,6,7,9,15,16,18,19,20,22,23,24,25,26,27,28,31\n"
+    "    INTERRUPT_STUB \\num, 0\n"
+    ".endr\n"
+    ".irp num, 8,10,11,12,13,14,17,21,29,30\n"
+    "    INTERRUPT_STUB \\num, 1\n"
+    ".endr\n"
+    ".irp num, 32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,128\n"
+    "    INTERRUPT_STUB \\num, 0\n"
+    ".endr\n"
+    "interrupt_common:\n"
+    "    pusha\n"
+    "    push %ds\n"
+    "    push %es\n"
+    "    push %fs\n"
+    "    push %gs\n"
+    "    mov $0x08, %ax\n"
+    "    mov %ax, %ds\n"
+    "    mov %ax, %es\n"
+    "    mov %ax, %fs\n"
+    "    mov %ax, %gs\n"
+    // User code may leave the direction flag set, and memcpy()/memset()
+    // rely on rep movs/stos counting upwards
+    "    cld\n"
+    "    push %esp\n"
+    "    call interrupt_dispatch\n"
+    "    add $4, %esp\n"
+    ".globl interrupt_return\n"
+    "interrupt_return:\n"
+    "    pop %gs\n"
+    "    pop %fs\n"
+    "    pop %es\n"
+    "    pop %ds\n"
+    "    popa\n"
+    "    add $8, %esp\n"
+    "    iret\n"
+    ".section .rodata\n"
+    ".align 4\n"
+    "interrupt_stub_table:\n"
+    ".irp num, 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,"
+    "24,25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47\n"
+    "    .long interrupt_stub_\\num\n"
+    ".endr\n"
+    "    .long interrupt_stub_128\n"
+    ".section .text\n"
+);
+
+extern const uint32_t interrupt_stub_table[IRQ_BASE_VECTOR + IRQ_COUNT + 1];
+extern void interrupt_return(void);
+
+void page_fault_handler(struct trap_frame* frame);
+void syscall_dispatch(struct trap_frame* frame);
+void process_exit(int32_t exit_code);
+
+static void idt_set_gate(uint8_t vector, uint32_t handler, uint8_t type_attributes) {
+    interrupt_descriptor_table[vector].offset_low = (uint16_t)(handler & 0xFFFF);
+    interrupt_descriptor_table[vector].selector = KERNEL_CODE_SELECTOR;
+    interrupt_descriptor_table[vector].zero = 0;
+    interrupt_descriptor_table[vector].type_attributes = type_attributes;
+    interrupt_descriptor_table[vector].offset_high = (uint16_t)(handler >> 16);
+}
+
+/**
+ * @brief Remap the 8259 PICs so IRQs 0-15 use vectors 32-47
+ * 
+ * The BIOS default (vectors 8-15) collides with CPU exceptions. All lines
+ * except the cascade start masked; irq_register_handler() unmasks them.
+ * 
+ * ICW sequence from the Intel 8259A datasheet
+ */
+static void pic_remap(void) {
+    outb(PIC_MASTER_COMMAND, 0x11);    // ICW1: edge triggered, cascade, ICW4
+    io_wait();
+    outb(PIC_SLAVE_COMMAND, 0x11);
+    io_wait();
+    outb(PIC_MASTER_DATA, IRQ_BASE_VECTOR);        // ICW2: vector offsets
+    io_wait();
+    outb(PIC_SLAVE_DATA, IRQ_BASE_VECTOR + 8);
+    io_wait();
+    outb(PIC_MASTER_DATA, 1 << PIC_CASCADE_IRQ);   // ICW3: slave on IRQ2
+    io_wait();
+    outb(PIC_SLAVE_DATA, PIC_CASCADE_IRQ);
+    io_wait();
+    outb(PIC_MASTER_DATA, 0x01);                   // ICW4: 8086 mode
+    io_wait();
+    outb(PIC_SLAVE_DATA, 0x01);
+    io_wait();
+    
+    outb(PIC_MASTER_DATA, (uint8_t)~(1 << PIC_CASCADE_IRQ));
+    outb(PIC_SLAVE_DATA, 0xFF);
+}
+
+static void pic_unmask(uint8_t irq) {
+    uint16_t port = irq < 8 ? PIC_MASTER_DATA : PIC_SLAVE_DATA;
+    outb(port, inb(port) & (uint8_t)~(1 << (irq % 8)));
+}
+
+/**
+ * @brief Install the IDT, remap the PICs and route exceptions and IRQs
+ * 
+ * Interrupts stay disabled; the idle loop enables them while halted and
+ * user processes run with IF set.
+ */
+void interrupts_initialize(void) {
+    struct descriptor_pointer idt_pointer;
+    
+    for (uint32_t vector = 0; vector < IRQ_BASE_VECTOR + IRQ_COUNT; ++vector) {
+        idt_set_gate((uint8_t)vector, interrupt_stub_table[vector], IDT_INTERRUPT_GATE);
+    }
+    idt_set_gate(SYSCALL_VECTOR, interrupt_stub_table[IRQ_BASE_VECTOR + IRQ_COUNT], IDT_USER_GATE);
+    
+    idt_pointer.limit = sizeof(interrupt_descriptor_table) - 1;
+    idt_pointer.base = (uint32_t)interrupt_descriptor_table;
+    __asm__ volatile("lidt %0" : : "m"(idt_pointer));
+    
+    pic_remap();
+}
+
+/**
+ * @brief Attach a handler to a hardware interrupt line and unmask it
+ * 
+ * @param irq Interrupt line (0-15)
+ * @param handler Function called with the trap frame and context
+ * @param context Driver-private pointer passed back to the handler
+ * @return 0 on success, ERROR_BUSY if the line has no free handler slot
+ */
+int32_t irq_register_handler(uint8_t irq, irq_handler_t handler, void* context) {
+    for (uint32_t i = 0; i < IRQ_MAX_HANDLERS; ++i) {
+        if (!irq_handlers[irq][i].handler) {
+            irq_handlers[irq][i].handler = handler;
+            irq_handlers[irq][i].context = context;
+            pic_unmask(irq);
+            return 0;
+        }
+    }
+    return ERROR_BUSY;
+}
+
+/**
+ * @brief Queue a bottom half to run once the current interrupt's handlers
+ *        have finished
+ * 
+ * @param work Caller-owned work item with function and context set
+ * 
+ * Scheduling an item that is already pending does nothing, so a burst of
+ * interrupts is handled by a single run.
+ */
+void deferred_work_schedule(struct deferred_work* work) {
+    if (work->pending) return;
+    
+    work->pending = 1;
+    work->next = NULL;
+    *deferred_work_tail = work;
+    deferred_work_tail = &work->next;
+}
+
+static void deferred_work_run(void) {
+    while (deferred_work_list) {
+        struct deferred_work* work = deferred_work_list;
+        
+        deferred_work_list = work->next;
+        if (!deferred_work_list) deferred_work_tail = &deferred_work_list;
+        work->pending = 0;              // It may reschedule itself
+        work->function(work);
+    }
+}
+
+static void irq_dispatch(struct trap_frame* frame) {
+    uint32_t irq = frame->interrupt_number - IRQ_BASE_VECTOR;
+    
+    // Acknowledge first: handlers may switch to another process
+    if (irq >= 8) {
+        outb(PIC_SLAVE_COMMAND, PIC_END_OF_INTERRUPT);
+    }
+    outb(PIC_MASTER_COMMAND, PIC_END_OF_INTERRUPT);
+    
+    // Bottom halves left over from a handler that switched away run first
+    deferred_work_run();
+    for (uint32_t i = 0; i < IRQ_MAX_HANDLERS && irq_handlers[irq][i].handler; ++i) {
+        irq_handlers[irq][i].handler(frame, irq_handlers[irq][i].context);
+    }
+    deferred_work_run();
+}
+
+static void exception_handler(struct trap_frame* frame) {
+    const char* name = exception_names[frame->interrupt_number];
+    
+    if ((frame->cs & 3) == 3) {
+        // Faults in user mode only take down the offending process
+        print_colored_string("\nProcess fault: ", COLOR_LIGHT_RED);
+        print_string(name);
+        print_string(" at ");
+        print_hex(frame->eip);
+        process_exit(-(int32_t)frame->interrupt_number - 1);
+    }
+    
+    print_colored_string("\nException: ", COLOR_LIGHT_RED);
+    print_string(name);
+    print_string(" at ");
+    print_hex(frame->eip);
+    print_string(" error ");
+    print_hex(frame->error_code);
+    kernel_panic("unhandled exception in kernel mode");
+}
+
+/**
+ * @brief Common C entry point for all interrupt stubs
+ * 
+ * @param frame Saved register state of the interrupted context
+ */
+void interrupt_dispatch(struct trap_frame* frame) {
+    uint32_t vector = frame->interrupt_number;
+    
+    if (vector == SYSCALL_VECTOR) {
+        syscall_dispatch(frame);
+    } else if (vector == EXCEPTION_PAGE_FAULT) {
+        page_fault_handler(frame);
+    } else if (vector < EXCEPTION_COUNT) {
+        exception_handler(frame);
+    } else if (vector < IRQ_BASE_VECTOR + IRQ_COUNT) {
+        irq_dispatch(frame);
+    }
+}
+
+// =============================================================================
+// Task State Segment
+// =============================================================================
+
+// Hardware TSS; only SS0:ESP0 is used, to find the kernel stack on a
+// ring 3 -> ring 0 transition.
+// Source: Intel SDM Vol. 3, Section 7.2.1 "Task-State Segment"
+struct task_state_segment {
+    uint32_t previous_task;
+    uint32_t esp0, ss0;
+    uint32_t esp1, ss1;
+    uint32_t esp2, ss2;
+    uint32_t cr3, eip, eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t io_map_base;
+} __attribute__((packed));
+
+static struct task_state_segment kernel_tss;
+
+/**
+ * @brief Point the GDT's TSS descriptor at kernel_tss and load TR
+ * 
+ * bootloader/gdt.asm reserves the descriptor with a zero base since the
+ * TSS lives in the kernel image, whose address the bootloader does not know.
+ */
+void tss_initialize(void) {
+    struct descriptor_pointer gdt_pointer;
+    uint32_t base = (uint32_t)&kernel_tss;
+    
+    memset(&kernel_tss, 0, sizeof(kernel_tss));
+    kernel_tss.ss0 = KERNEL_DATA_SELECTOR;
+    kernel_tss.io_map_base = sizeof(kernel_tss);    // No I/O permission bitmap
+    
+    __asm__ volatile("sgdt %0" : "=m"(gdt_pointer));
+    uint8_t* descriptor = (uint8_t*)gdt_pointer.base + TSS_GDT_INDEX * 8;
+    descriptor[2] = (uint8_t)(base & 0xFF);
+    descriptor[3] = (uint8_t)((base >> 8) & 0xFF);
+    descriptor[4] = (uint8_t)((base >> 16) & 0xFF);
+    descriptor[5] = 0x89;    // Present, available 32-bit TSS
+    descriptor[7] = (uint8_t)(base >> 24);
+    
+    __asm__ volatile("ltr %w0" : : "r"(TSS_SELECTOR));
+}
+
+// =============================================================================
+// Timer and Time Stamp Counter
+// =============================================================================
+
+// 8253/8254 programmable interval timer, channel 0 on IRQ0
+// Source: Intel 8254 datasheet and OSDev Wiki "Programmable Interval Timer"
+#define PIT_CHANNEL0_PORT      0x40
+#define PIT_COMMAND_PORT       0x43
+#define PIT_BASE_FREQUENCY     1193182
+#define PIT_MODE_RATE          0x34    // Channel 0, lobyte/hibyte, mode 2
+#define TIMER_FREQUENCY        1000    // One tick per millisecond
+#define TIMER_IRQ              0
+#define TSC_CALIBRATION_TICKS  50
+#define SCHEDULER_TIME_SLICE   10      // Ticks a user process runs before preemption
+
+static volatile uint32_t timer_ticks;
+static uint32_t scheduler_slice_ticks;
+static uint32_t tsc_cycles_per_millisecond;
+
+// One-shot wakeup at a given tick, kept on a list sorted by deadline
+struct timer {
+    uint32_t deadline;              // timer_ticks value to fire at
+    struct wait_queue* queue;       // Woken when the timer fires
+    int armed;
+    struct timer* next;
+};
+
+static struct timer* timer_list;
+
+/**
+ * @brief Read the CPU time stamp counter
+ * 
+ * @return Cycles since reset
+ */
+static inline uint64_t timestamp_read(void) {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+/**
+ * @brief Divide a 64-bit value by a 32-bit one without libgcc
+ * 
+ * @param dividend Value to divide
+ * @param divisor Non-zero divisor
+ * @return Quotient, saturated to 0xFFFFFFFF if it does not fit
+ * 
+ * The kernel is not linked against libgcc, so 64-bit '/' is unavailable.
+ */
+uint32_t divide_u64(uint64_t dividend, uint32_t divisor) {
+    uint32_t high = (uint32_t)(dividend >> 32);
+    uint32_t low = (uint32_t)dividend;
+    uint32_t quotient, remainder;
+    
+    if (high >= divisor) return 0xFFFFFFFF;
+    __asm__("divl %4" : "=a"(quotient), "=d"(remainder) : "a"(low), "d"(high), "r"(divisor));
+    (void)remainder;
+    return quotient;
+}
+
+/**
+ * @brief Convert a time stamp counter delta to microseconds
+ * 
+ * @param cycles Elapsed cycles
+ * @return Elapsed microseconds
+ */
+uint32_t timestamp_to_microseconds(uint64_t cycles) {
+    if (tsc_cycles_per_millisecond < 1000) return 0;
+    return divide_u64(cycles, tsc_cycles_per_millisecond / 1000);
+}
+
+/**
+ * @brief Get system uptime
+ * 
+ * @return Uptime in milliseconds since timer_initialize()
+ * 
+ * Counted by the PIT interrupt at TIMER_FREQUENCY
+ */
+uint32_t get_system_uptime(void) {
+    return timer_ticks * (1000 / TIMER_FREQUENCY);
+}
+
+/**
+ * @brief Wake a wait queue once timer_ticks reaches a deadline
+ * 
+ * @param timer Caller-owned timer (re-armed if already pending)
+ * @param deadline Tick to fire at
+ * @param queue Queue to wake
+ */
+void timer_arm(struct timer* timer, uint32_t deadline, struct wait_queue* queue) {
+    struct timer** link = &timer_list;
+    
+    timer_cancel(timer);
+    while (*link && (int32_t)((*link)->deadline - deadline) <= 0) {
+        link = &(*link)->next;
+    }
+    timer->deadline = deadline;
+    timer->queue = queue;
+    timer->armed = 1;
+    timer->next = *link;
+    *link = timer;
+}
+
+/**
+ * @brief Disarm a timer if it has not fired yet
+ * 
+ * @param timer Timer to cancel
+ */
+void timer_cancel(struct timer* timer) {
+    if (!timer->armed) return;
+    
+    for (struct timer** link = &timer_list; *link; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+    timer->armed = 0;
+}
+
+// Clock parameters published in the vDSO page. Field offsets are used by
+// the vDSO stub, so keep the order.
+#define VDSO_MULTIPLIER_SHIFT  24
+
+struct vdso_data {
+    volatile uint32_t sequence;     // Odd while the fields are being updated
+    volatile uint32_t milliseconds; // Uptime at the last tick
+    volatile uint32_t tsc_low;      // Time stamp counter at the last tick
+    volatile uint32_t tsc_high;
+    uint32_t multiplier;            // Nanoseconds per cycle << VDSO_MULTIPLIER_SHIFT
+    uint32_t cpu;                   // Current CPU number
+    uint32_t clock_entry;           // User addresses of the stub functions
+    uint32_t uptime_entry;
+    uint32_t cpu_entry;
+};
+
+static struct vdso_data* vdso_data;
+
+/**
+ * @brief Publish the current tick in the vDSO page (seqlock writer)
+ * 
+ * @param data Page to update
+ */
+static void vdso_update(struct vdso_data* data) {
+    uint64_t now = timestamp_read();
+    
+    data->sequence++;
+    __asm__ volatile("" : : : "memory");
+    data->milliseconds = get_system_uptime();
+    data->tsc_low = (uint32_t)now;
+    data->tsc_high = (uint32_t)(now >> 32);
+    __asm__ volatile("" : : : "memory");
+    data->sequence++;
+}
+
+static void timer_interrupt(struct trap_frame* frame, void* context) {
+    (void)context;
+    timer_ticks++;
+    console_log_tick();
+    
+    while (timer_list && (int32_t)(timer_list->deadline - timer_ticks) <= 0) {
+        struct timer* timer = timer_list;
+        timer_list = timer->next;
+        timer->armed = 0;
+        wait_queue_wake_all(timer->queue);
+    }
+    if (vdso_data) {
+        vdso_update(vdso_data);
+    }
+    
+    // Only user mode is preemptible; kernel code runs to completion
+    if ((frame->cs & 3) == 3 && ++scheduler_slice_ticks >= SCHEDULER_TIME_SLICE) {
+        scheduler_slice_ticks = 0;
+        scheduler_yield();
+    }
+}
+
+/**
+ * @brief Program the PIT for 1ms ticks and calibrate the TSC against it
+ * 
+ * Interrupts are briefly enabled while counting ticks for calibration.
+ */
+void timer_initialize(void) {
+    uint16_t divisor = PIT_BASE_FREQUENCY / TIMER_FREQUENCY;
+    
+    outb(PIT_COMMAND_PORT, PIT_MODE_RATE);
+    outb(PIT_CHANNEL0_PORT, (uint8_t)(divisor & 0xFF));
+    outb(PIT_CHANNEL0_PORT, (uint8_t)(divisor >> 8));
+    irq_register_handler(TIMER_IRQ, timer_interrupt, NULL);
+    
+    // Align to a tick edge, then count cycles across a fixed number of ticks
+    uint32_t start = timer_ticks;
+    while (timer_ticks == start) {
+        __asm__ volatile("sti; hlt; cli");
+    }
+    uint64_t cycles_start = timestamp_read();
+    start = timer_ticks;
+    while (timer_ticks - start < TSC_CALIBRATION_TICKS) {
+        __asm__ volatile("sti; hlt; cli");
+    }
+    uint64_t cycles = timestamp_read() - cycles_start;
+    tsc_cycles_per_millisecond = divide_u64(cycles, TSC_CALIBRATION_TICKS);
+}
+
+// =============================================================================
+// Processes and Scheduling
+// =============================================================================
+
+#define MAX_PROCESSES          64
+#define KERNEL_STACK_SIZE      8192
+#define MAX_PROCESS_FILES      16
+
+// Open file flags (struct file)
+#define FILE_READABLE          0x01
+#define FILE_WRITABLE          0x02
+#define FILE_NONBLOCK          0x04    // Fail with ERROR_WOULD_BLOCK instead of waiting
+#define FILE_PRIVATE           0x08    // Not inherited, closed on exec
+
+// Process states
+#define PROCESS_UNUSED         0
+#define PROCESS_READY          1
+#define PROCESS_RUNNING        2
+#define PROCESS_BLOCKED        3
+#define PROCESS_ZOMBIE         4
+
+// Virtual memory area flags
+#define VM_READ                0x01
+#define VM_WRITE               0x02
+#define VM_EXEC                0x04
+#define VM_SHARED              0x08    // Writes are shared: a shared_memory object, or a file
+#define VM_MESSAGE             0x10    // Pages received through message passing
+#define VM_FILE                0x20    // Maps a file's cached pages (see file_map_fault())
+
+/**
+ * Physically contiguous pages that several address spaces map at once.
+ * The object owns one reference to each frame; every mapped page holds
+ * another, so frames outlive the object while still mapped.
+ */
+struct shared_memory {
+    uint32_t base;                  // Physical (and kernel) address
+    uint32_t page_count;
+    uint32_t references;            // Areas mapping the object, plus owners
+    void (*release)(struct shared_memory* memory);  // Called before freeing
+    void* owner;                    // Private to whoever set release
+};
+
+/**
+ * A contiguous range of user virtual memory with uniform permissions.
+ * Pages are populated on first touch by vm_area_fault(): shared areas map
+ * the corresponding page of their shared_memory object, and VM_FILE areas
+ * the cached page of their file; otherwise the part between file_start
+ * and file_end is copied from file_image and everything else in the area
+ * is zero-filled.
+ */
+struct vm_area {
+    uint32_t start;                 // Page-aligned, inclusive
+    uint32_t end;                   // Page-aligned, exclusive
+    uint32_t flags;                 // VM_* permissions
+    const uint8_t* file_image;      // Bytes backing file_start (or NULL)
+    uint32_t file_start;            // Virtual range backed by file_image
+    uint32_t file_end;
+    struct shared_memory* shared;   // Backing object for VM_SHARED areas
+    struct file* file;              // Mapped file of VM_FILE areas, referenced
+    struct address_space* mapping;  // Its cached pages
+    struct readahead_state* readahead;  // The open file's, shared with read()
+    uint32_t offset;                // File offset of start, page-aligned
+    struct vm_area* next;
+};
+
+// FIFO of processes blocked until some event; see wait_queue_sleep()
+struct wait_queue {
+    struct process* head;
+    struct process* tail;
+    struct wait_callback* callbacks;    // Run on every wakeup
+};
+
+// Lets an object such as an event poll set react to wakeups of a queue
+// without a process sleeping on it. Called in the waker's context, which
+// may be an interrupt handler, so it must not sleep.
+struct wait_callback {
+    void (*function)(struct wait_callback* callback);
+    void* context;
+    struct wait_queue* queue;       // Queue it is attached to, or NULL
+    struct wait_callback* next;
+};
+
+struct file;
+
+struct process {
+    uint32_t pid;
+    uint32_t state;
+    uint32_t* page_directory;
+    uint8_t* kernel_stack;          // Base of the KERNEL_STACK_SIZE stack
+    uint32_t kernel_esp;            // Saved stack pointer while switched out
+    struct trap_frame* trap_frame;  // User state at the last kernel entry
+    struct vm_area* vm_areas;
+    uint32_t resident_pages;        // Pages populated by demand faults
+    int32_t exit_code;
+    struct process* parent;
+    struct process* vfork_parent;   // Set while borrowing the parent's address space
+    struct wait_queue child_wait;   // Sleeps here for child exit or exec
+    struct process* wait_next;      // Link while on a wait queue
+    struct file* files[MAX_PROCESS_FILES];  // Indexed by file descriptor
+    struct process* memory_owner;   // Kernel threads: whose user memory they work on
+};
+
+static struct process process_table[MAX_PROCESSES];
+static struct process* current_process;
+static uint32_t next_process_id = 1;
+static uint32_t scheduler_next_index = 1;
+
+// Save callee-saved registers on the current kernel stack, store the stack
+// pointer to *save_esp, then resume the context saved on next_esp.
+void context_switch(uint32_t* save_esp, uint32_t next_esp);
+__asm__(
+    ".section .text\n"
+    ".globl context_switch\n"
+    "context_switch:\n"
+    "    push %ebp\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    mov 20(%esp), %eax\n"
+    "    mov %esp, (%eax)\n"
+    "    mov 24(%esp), %esp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    pop %ebp\n"
+    "    ret\n"
+);
+
+/**
+ * @brief Turn the boot context into process 0, the idle process
+ * 
+ * Process 0 runs on the bootloader's stack in the kernel address space and
+ * is only scheduled when nothing else is ready.
+ */
+void scheduler_initialize(void) {
+    struct process* idle = &process_table[0];
+    
+    memset(process_table, 0, sizeof(process_table));
+    idle->pid = 0;
+    idle->state = PROCESS_RUNNING;
+    idle->page_directory = kernel_page_directory;
+    current_process = idle;
+}
+
+/**
+ * @brief Switch the CPU to another process
+ * 
+ * @param next Process to run
+ */
+static void process_switch(struct process* next) {
+    struct process* previous = current_process;
+    
+    if (next == previous) return;
+    
+    if (previous->state == PROCESS_RUNNING) {
+        previous->state = PROCESS_READY;
+    }
+    next->state = PROCESS_RUNNING;
+    
+    if (next->kernel_stack) {
+        kernel_tss.esp0 = (uint32_t)next->kernel_stack + KERNEL_STACK_SIZE;
+    }
+    if (next->page_directory != previous->page_directory) {
+        write_cr3((uint32_t)next->page_directory);
+    }
+    
+    current_process = next;
+    context_switch(&previous->kernel_esp, next->kernel_esp);
+}
+
+/**
+ * @brief Give up the CPU to the next ready process (round robin)
+ * 
+ * Returns immediately if the caller is still runnable and nothing else is
+ * ready. A process that has blocked or exited falls back to the idle
+ * process when no other process is ready.
+ */
+void scheduler_yield(void) {
+    for (uint32_t n = 0; n < MAX_PROCESSES - 1; ++n) {
+        uint32_t index = 1 + (scheduler_next_index - 1 + n) % (MAX_PROCESSES - 1);
+        struct process* candidate = &process_table[index];
+        
+        if (candidate->state == PROCESS_READY) {
+            scheduler_next_index = index + 1;
+            process_switch(candidate);
+            return;
+        }
+    }
+    
+    if (current_process->state != PROCESS_RUNNING) {
+        process_switch(&process_table[0]);
+    }
+}
+
+/**
+ * @brief Allocate a process table slot with a fresh kernel stack
+ * 
+ * @return New process in the BLOCKED state, or NULL if none is available
+ */
+static struct process* process_allocate(void) {
+    for (uint32_t i = 1; i < MAX_PROCESSES; ++i) {
+        struct process* process = &process_table[i];
+        
+        if (process->state != PROCESS_UNUSED) continue;
+        
+        memset(process, 0, sizeof(*process));
+        process->kernel_stack = (uint8_t*)heap_allocate(KERNEL_STACK_SIZE);
+        if (!process->kernel_stack) return NULL;
+        
+        process->pid = next_process_id++;
+        process->state = PROCESS_BLOCKED;
+        return process;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fill in a trap frame that starts user code at a given address
+ * 
+ * @param frame Frame to initialize
+ * @param entry User instruction pointer
+ * @param user_stack User stack pointer
+ */
+static void trap_frame_initialize_user(struct trap_frame* frame, uint32_t entry, uint32_t user_stack) {
+    memset(frame, 0, sizeof(*frame));
+    frame->gs = frame->fs = frame->es = frame->ds = USER_DATA_SELECTOR;
+    frame->cs = USER_CODE_SELECTOR;
+    frame->eip = entry;
+    frame->eflags = EFLAGS_INTERRUPT;
+    frame->user_esp = user_stack;
+    frame->user_ss = USER_DATA_SELECTOR;
+}
+
+/**
+ * @brief Lay out a new process's kernel stack so that its first switch-in
+ *        "returns" through interrupt_return into user mode
+ * 
+ * @param process Process to prepare
+ * @param user_state Register state to resume with (copied)
+ */
+static void process_prepare_return(struct process* process, const struct trap_frame* user_state) {
+    uint32_t stack_top = (uint32_t)process->kernel_stack + KERNEL_STACK_SIZE;
+    struct trap_frame* frame = (struct trap_frame*)(stack_top - sizeof(struct trap_frame));
+    
+    *frame = *user_state;
+    process->trap_frame = frame;
+    
+    // Initial context_switch frame: edi, esi, ebx, ebp, return address
+    uint32_t* stack = (uint32_t*)frame;
+    *--stack = (uint32_t)interrupt_return;
+    *--stack = 0;
+    *--stack = 0;
+    *--stack = 0;
+    *--stack = 0;
+    process->kernel_esp = (uint32_t)stack;
+}
+
+/**
+ * @brief Free a zombie's remaining resources and its table slot
+ * 
+ * @param process Zombie process (must not be the current process)
+ */
+static void process_reap(struct process* process) {
+    heap_free(process->kernel_stack);
+    process->kernel_stack = NULL;
+    process->state = PROCESS_UNUSED;
+}
+
+/**
+ * @brief Block the current process until the queue is woken
+ * 
+ * @param queue Queue to sleep on
+ * 
+ * Callers re-check their condition in a loop. The idle process cannot
+ * block, so for it this runs whatever is ready, which may be a kernel
+ * thread it is waiting for, then waits for the next interrupt.
+ */
+void wait_queue_sleep(struct wait_queue* queue) {
+    struct process* process = current_process;
+    
+    if (process->pid == 0) {
+        scheduler_yield();
+        __asm__ volatile("sti; hlt; cli");
+        return;
+    }
+    
+    process->wait_next = NULL;
+    if (queue->tail) {
+        queue->tail->wait_next = process;
+    } else {
+        queue->head = process;
+    }
+    queue->tail = process;
+    process->state = PROCESS_BLOCKED;
+    scheduler_yield();
+}
+
+static void wait_queue_run_callbacks(struct wait_queue* queue) {
+    struct wait_callback* callback = queue->callbacks;
+    
+    while (callback) {
+        struct wait_callback* next = callback->next;    // It may detach itself
+        callback->function(callback);
+        callback = next;
+    }
+}
+
+static int wait_queue_dequeue(struct wait_queue* queue) {
+    struct process* process = queue->head;
+    
+    if (!process) return 0;
+    
+    queue->head = process->wait_next;
+    if (!queue->head) queue->tail = NULL;
+    process->wait_next = NULL;
+    process->state = PROCESS_READY;
+    return 1;
+}
+
+/**
+ * @brief Run a queue's callbacks and make its longest-waiting process
+ *        runnable
+ * 
+ * @param queue Queue to wake from
+ * @return 1 if a process was woken, 0 if the queue was empty
+ */
+int wait_queue_wake_one(struct wait_queue* queue) {
+    wait_queue_run_callbacks(queue);
+    return wait_queue_dequeue(queue);
+}
+
+/**
+ * @brief Make every process on a queue runnable
+ * 
+ * @param queue Queue to wake
+ */
+void wait_queue_wake_all(struct wait_queue* queue) {
+    wait_queue_run_callbacks(queue);
+    while (wait_queue_dequeue(queue)) {
+    }
+}
+
+/**
+ * @brief Attach a callback to a queue
+ * 
+ * @param queue Queue to watch
+ * @param callback Caller-owned callback with function and context set
+ */
+void wait_queue_add_callback(struct wait_queue* queue, struct wait_callback* callback) {
+    callback->queue = queue;
+    callback->next = queue->callbacks;
+    queue->callbacks = callback;
+}
+
+/**
+ * @brief Detach a callback from the queue it is attached to
+ * 
+ * @param callback Callback to detach (no-op if not attached)
+ */
+void wait_queue_remove_callback(struct wait_callback* callback) {
+    if (!callback->queue) return;
+    
+    for (struct wait_callback** link = &callback->queue->callbacks; *link; link = &(*link)->next) {
+        if (*link == callback) {
+            *link = callback->next;
+            break;
+        }
+    }
+    callback->queue = NULL;
+}
+
+/**
+ * @brief Block the current process for at least a number of milliseconds
+ * 
+ * @param milliseconds Time to sleep
+ * 
+ * For device drivers that have to let hardware settle (motor spin-up,
+ * resets). The idle process halts until the deadline instead.
+ */
+void timer_sleep(uint32_t milliseconds) {
+    struct wait_queue queue = {NULL, NULL, NULL};
+    struct timer timer;
+    uint32_t deadline = timer_ticks + milliseconds * (TIMER_FREQUENCY / 1000);
+    
+    memset(&timer, 0, sizeof(timer));
+    timer_arm(&timer, deadline, &queue);
+    while ((int32_t)(deadline - timer_ticks) > 0) {
+        wait_queue_sleep(&queue);
+    }
+    timer_cancel(&timer);
+}
+
+/**
+ * @brief Reap exited processes that have no parent to collect them
+ * 
+ * Called from the idle loop, which never runs on a zombie's kernel stack.
+ */
+void process_reap_orphans(void) {
+    for (uint32_t i = 1; i < MAX_PROCESSES; ++i) {
+        struct process* process = &process_table[i];
+        
+        if (process->state == PROCESS_ZOMBIE && !process->parent && process != current_process) {
+            process_reap(process);
+        }
+    }
+}
+
+/**
+ * @brief Terminate the current kernel thread
+ * 
+ * Reached by returning from the thread's entry function. The zombie has
+ * no parent and is reaped by the idle loop.
+ */
+static void kernel_thread_exit(void) {
+    struct process* thread = current_process;
+    
+    thread->page_directory = kernel_page_directory;
+    thread->memory_owner = NULL;
+    thread->state = PROCESS_ZOMBIE;
+    scheduler_yield();
+    
+    kernel_panic("kernel_thread_exit: zombie was scheduled");
+}
+
+/**
+ * @brief Start a thread that runs a kernel function
+ * 
+ * @param entry Function to run; the thread exits when it returns
+ * @param argument Passed to entry
+ * @return The thread (already runnable), or NULL if out of memory
+ * 
+ * Kernel threads run in the kernel address space with no descriptors.
+ * Like all kernel code they are not preempted and must yield or sleep.
+ */
+struct process* kernel_thread_create(void (*entry)(void* argument), void* argument) {
+    struct process* thread = process_allocate();
+    
+    if (!thread) return NULL;
+    
+    // Initial context_switch frame: edi, esi, ebx, ebp, return address,
+    // followed by entry's own return address and argument
+    uint32_t* stack = (uint32_t*)(thread->kernel_stack + KERNEL_STACK_SIZE);
+    *--stack = (uint32_t)argument;
+    *--stack = (uint32_t)kernel_thread_exit;
+    *--stack = (uint32_t)entry;
+    *--stack = 0;
+    *--stack = 0;
+    *--stack = 0;
+    *--stack = 0;
+    thread->kernel_esp = (uint32_t)stack;
+    thread->page_directory = kernel_page_directory;
+    thread->state = PROCESS_READY;
+    return thread;
+}
+
+// =============================================================================
+// Shared Memory Objects
+// =============================================================================
+
+/**
+ * @brief Allocate a zero-filled shared memory object
+ * 
+ * @param page_count Number of pages
+ * @return The object with one reference held by the caller, or NULL
+ * 
+ * Pages are physically contiguous so the kernel can also access the
+ * object through a single pointer.
+ */
+struct shared_memory* shared_memory_create(uint32_t page_count) {
+    struct shared_memory* memory = (struct shared_memory*)heap_allocate(sizeof(struct shared_memory));
+    
+    if (!memory) return NULL;
+    
+    memory->base = page_frame_allocate_contiguous(page_count, PAGE_SIZE, 0);
+    if (!memory->base) {
+        heap_free(memory);
+        return NULL;
+    }
+    memset((void*)memory->base, 0, page_count * PAGE_SIZE);
+    memory->page_count = page_count;
+    memory->references = 1;
+    return memory;
+}
+
+/**
+ * @brief Drop a reference to a shared memory object
+ * 
+ * @param memory Object to release
+ * 
+ * The object's own frame references go with the last reference; pages
+ * still mapped somewhere stay alive through their page table references.
+ */
+void shared_memory_put(struct shared_memory* memory) {
+    if (--memory->references != 0) return;
+    
+    if (memory->release) {
+        memory->release(memory);
+    }
+    for (uint32_t i = 0; i < memory->page_count; ++i) {
+        page_frame_free(memory->base + i * PAGE_SIZE);
+    }
+    heap_free(memory);
+}
+
+// =============================================================================
+// Virtual Memory Areas and Demand Paging
+// =============================================================================
+
+/**
+ * @brief Find the area containing a user address
+ * 
+ * @param process Process to search
+ * @param address User virtual address
+ * @return The area, or NULL if the address is unmapped
+ */
+struct vm_area* vm_area_find(struct process* process, uint32_t address) {
+    for (struct vm_area* area = process->vm_areas; area; area = area->next) {
+        if (address >= area->start && address < area->end) {
+            return area;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Add a demand-paged area to a process
+ * 
+ * @param process Owning process
+ * @param start Page-aligned start address
+ * @param end Page-aligned end address
+ * @param flags VM_* permissions
+ * @return The new area, or NULL on overlap, bad range or out of memory
+ */
+struct vm_area* vm_area_create(struct process* process, uint32_t start, uint32_t end, uint32_t flags) {
+    if (start >= end || start < USER_SPACE_START || end > USER_SPACE_END) {
+        return NULL;
+    }
+    for (struct vm_area* area = process->vm_areas; area; area = area->next) {
+        if (start < area->end && end > area->start) {
+            return NULL;
+        }
+    }
+    
+    struct vm_area* area = (struct vm_area*)heap_allocate(sizeof(struct vm_area));
+    if (!area) return NULL;
+    
+    area->start = start;
+    area->end = end;
+    area->flags = flags;
+    area->next = process->vm_areas;
+    process->vm_areas = area;
+    return area;
+}
+
+/**
+ * @brief Unmap an area and release its pages
+ * 
+ * @param process Owning process
+ * @param area Area to remove (freed on return)
+ */
+void vm_area_remove(struct process* process, struct vm_area* area) {
+    struct vm_area** link = &process->vm_areas;
+    int active = process->page_directory == (uint32_t*)read_cr3();
+    
+    while (*link && *link != area) {
+        link = &(*link)->next;
+    }
+    if (!*link) return;
+    *link = area->next;
+    
+    if (area->file) file_map_collect_dirty(process, area, area->start, area->end);
+    for (uint32_t page = area->start; page < area->end; page += PAGE_SIZE) {
+        uint32_t* entry = paging_get_entry(process->page_directory, page, 0);
+        
+        if (entry && (*entry & PAGE_PRESENT)) {
+            page_frame_free(*entry & ~(uint32_t)PAGE_FLAGS_MASK);
+            *entry = 0;
+            if (active) invalidate_page(page);
+            process->resident_pages--;
+        }
+    }
+    
+    if (area->shared) {
+        shared_memory_put(area->shared);
+    }
+    if (area->file) {
+        file_put(area->file);
+    }
+    heap_free(area);
+}
+
+// Drop every area; the pages are freed with the page tables, which must
+// still be in place so that file mappings can hand on their dirty bits
+static void vm_areas_free(struct process* process) {
+    struct vm_area* area = process->vm_areas;
+    
+    while (area) {
+        struct vm_area* next = area->next;
+        if (area->shared) {
+            shared_memory_put(area->shared);
+        }
+        if (area->file) {
+            file_map_collect_dirty(process, area, area->start, area->end);
+            file_put(area->file);
+        }
+        heap_free(area);
+        area = next;
+    }
+    process->vm_areas = NULL;
+}
+
+/**
+ * @brief Find an unused, page-aligned range of user address space
+ * 
+ * @param process Process to search
+ * @param size Size of the range in bytes
+ * @return Start of the range, or 0 if the mapping region is full
+ * 
+ * Mappings are placed first-fit upwards from USER_MAPPING_BASE, leaving
+ * the area below it to the program image and the top to the stack.
+ */
+uint32_t vm_area_find_free(struct process* process, uint32_t size) {
+    uint32_t start = USER_MAPPING_BASE;
+    
+    size = PAGE_ALIGN_UP(size);
+    while (start + size <= USER_STACK_TOP - USER_STACK_SIZE && start + size > start) {
+        struct vm_area* overlap = NULL;
+        
+        for (struct vm_area* area = process->vm_areas; area; area = area->next) {
+            if (start < area->end && start + size > area->start) {
+                overlap = area;
+                break;
+            }
+        }
+        if (!overlap) return start;
+        start = overlap->end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Map a shared memory object into a process
+ * 
+ * @param process Process to map into
+ * @param memory Object to map (gains a reference)
+ * @param flags VM_* permissions (VM_SHARED is implied)
+ * @return User address of the mapping, or 0 on failure
+ * 
+ * Pages are mapped lazily on first touch like any other area.
+ */
+uint32_t shared_memory_map(struct process* process, struct shared_memory* memory, uint32_t flags) {
+    uint32_t size = memory->page_count * PAGE_SIZE;
+    uint32_t start = vm_area_find_free(process, size);
+    
+    if (!start) return 0;
+    
+    struct vm_area* area = vm_area_create(process, start, start + size, flags | VM_SHARED);
+    if (!area) return 0;
+    
+    area->shared = memory;
+    memory->references++;
+    return start;
+}
+
+/**
+ * @brief Resolve a write to a shared copy-on-write page
+ * 
+ * @param process Faulting process
+ * @param page Page-aligned faulting address
+ * @return 0 if resolved, otherwise a negative error
+ * 
+ * The last sharer simply regains write access; everyone else gets a
+ * private copy and drops its reference to the shared frame.
+ */
+static int32_t vm_area_copy_on_write(struct process* process, uint32_t page) {
+    uint32_t* entry = paging_get_entry(process->page_directory, page, 0);
+    
+    if (!entry || !(*entry & PAGE_COPY_ON_WRITE)) {
+        return ERROR_BAD_ADDRESS;
+    }
+    
+    uint32_t shared = *entry & ~(uint32_t)PAGE_FLAGS_MASK;
+    uint32_t flags = (*entry & PAGE_FLAGS_MASK & ~(uint32_t)PAGE_COPY_ON_WRITE) | PAGE_WRITABLE;
+    
+    if (page_frame_reference_count(shared) == 1) {
+        *entry = shared | flags;
+        invalidate_page(page);
+        return 0;
+    }
+    
+    uint32_t copy = page_frame_allocate();
+    if (!copy) return ERROR_NO_MEMORY;
+    
+    memcpy((void*)copy, (const void*)shared, PAGE_SIZE);
+    *entry = copy | flags;
+    invalidate_page(page);
+    page_frame_free(shared);
+    return 0;
+}
+
+/**
+ * @brief Populate the page containing a faulting user address
+ * 
+ * @param process Faulting process
+ * @param address Faulting virtual address
+ * @param error_code Page fault error code pushed by the CPU
+ * @return 0 if the fault was resolved, otherwise a negative error
+ * 
+ * Only the touched page is allocated, so program start-up costs scale with
+ * the pages actually used rather than with the size of the executable.
+ */
+int32_t vm_area_fault(struct process* process, uint32_t address, uint32_t error_code) {
+    struct vm_area* area = vm_area_find(process, address);
+    uint32_t page = PAGE_ALIGN_DOWN(address);
+    
+    if (!area) return ERROR_BAD_ADDRESS;
+    if ((error_code & PAGE_FAULT_WRITE) && !(area->flags & VM_WRITE)) {
+        return ERROR_BAD_ADDRESS;
+    }
+    if ((area->flags & VM_FILE) && ((area->flags & VM_SHARED) || !(error_code & PAGE_FAULT_PRESENT))) {
+        return file_map_fault(process, area, page, error_code);
+    }
+    if (error_code & PAGE_FAULT_PRESENT) {
+        return vm_area_copy_on_write(process, page);
+    }
+    
+    if (area->shared) {
+        uint32_t shared_frame = area->shared->base + (page - area->start);
+        uint32_t shared_flags = PAGE_USER | PAGE_SHARED | ((area->flags & VM_WRITE) ? PAGE_WRITABLE : 0);
+        
+        if (paging_map_page(process->page_directory, page, shared_frame, shared_flags) != 0) {
+            return ERROR_NO_MEMORY;
+        }
+        page_frame_reference(shared_frame);
+        process->resident_pages++;
+        return 0;
+    }
+    
+    uint32_t frame = page_frame_allocate();
+    if (!frame) return ERROR_NO_MEMORY;
+    
+    uint8_t* destination = (uint8_t*)frame;
+    memset(destination, 0, PAGE_SIZE);
+    
+    if (area->file_image) {
+        uint32_t copy_start = page > area->file_start ? page : area->file_start;
+        uint32_t copy_end = page + PAGE_SIZE < area->file_end ? page + PAGE_SIZE : area->file_end;
+        
+        if (copy_start < copy_end) {
+            memcpy(destination + (copy_start - page),
+                   area->file_image + (copy_start - area->file_start),
+                   copy_end - copy_start);
+        }
+    }
+    
+    uint32_t flags = PAGE_USER | ((area->flags & VM_WRITE) ? PAGE_WRITABLE : 0);
+    if (paging_map_page(process->page_directory, page, frame, flags) != 0) {
+        page_frame_free(frame);
+        return ERROR_NO_MEMORY;
+    }
+    process->resident_pages++;
+    return 0;
+}
+
+/**
+ * @brief Page fault (#PF) handler
+ * 
+ * @param frame Trap frame of the faulting context
+ * 
+ * Faults on user addresses - including kernel accesses to user buffers
+ * during system calls - are resolved through the process's areas. One
+ * that fails for want of memory, or because a mapped file could not be
+ * read, kills the process even in a system call. Anything else is fatal
+ * to the process (user mode) or the kernel.
+ */
+void page_fault_handler(struct trap_frame* frame) {
+    uint32_t address = read_cr2();
+    int from_user = (frame->cs & 3) == 3;
+    
+    struct process* owner = current_process->memory_owner ? current_process->memory_owner : current_process;
+    
+    if (current_process->pid != 0 && address >= USER_SPACE_START && address < USER_SPACE_END) {
+        int32_t result = vm_area_fault(owner, address, frame->error_code);
+        if (result == 0) return;
+        
+        if (from_user || result != ERROR_BAD_ADDRESS) {
+            print_colored_string("\nSegmentation fault: pid ", COLOR_LIGHT_RED);
+            print_unsigned(current_process->pid);
+            print_string(" address ");
+            print_hex(address);
+            process_exit(ERROR_BAD_ADDRESS);
+        }
+    } else if (from_user) {
+        print_colored_string("\nSegmentation fault: pid ", COLOR_LIGHT_RED);
+        print_unsigned(current_process->pid);
+        print_string(" address ");
+        print_hex(address);
+        process_exit(ERROR_BAD_ADDRESS);
+    }
+    
+    print_colored_string("\nPage fault at ", COLOR_LIGHT_RED);
+    print_hex(address);
+    print_string(" eip ");
+    print_hex(frame->eip);
+    kernel_panic("unhandled page fault in kernel mode");
+}
+
+/**
+ * @brief Check that a user buffer lies entirely inside accessible areas
+ * 
+ * @param address Start of the buffer
+ * @param length Length in bytes
+ * @param write Non-zero if the kernel will write to the buffer
+ * @return Non-zero if every page of the buffer may be touched
+ * 
+ * System calls validate buffers up front so that the demand-paging faults
+ * they trigger while copying can always be resolved.
+ */
+int user_buffer_valid(uint32_t address, uint32_t length, int write) {
+    struct process* owner = current_process->memory_owner ? current_process->memory_owner : current_process;
+    uint32_t end = address + length;
+    
+    if (end < address || address < USER_SPACE_START || end > USER_SPACE_END) {
+        return 0;
+    }
+    while (address < end) {
+        struct vm_area* area = vm_area_find(owner, address);
+        if (!area || (write && !(area->flags & VM_WRITE))) {
+            return 0;
+        }
+        address = area->end;
+    }
+    return 1;
+}
+
+// =============================================================================
+// ELF Program Loader
+// =============================================================================
+
+// ELF32 file format constants
+// Source: "Tool Interface Standard (TIS) Executable and Linking Format
+//          (ELF) Specification", Version 1.2
+#define ELF_MAGIC              0x464C457F   // "\x7F" "ELF" read little-endian
+#define ELF_CLASS_32           1
+#define ELF_DATA_LSB           1
+#define ELF_TYPE_EXECUTABLE    2
+#define ELF_MACHINE_386        3
+#define ELF_SEGMENT_LOAD       1
+#define ELF_FLAG_EXECUTE       0x1
+#define ELF_FLAG_WRITE         0x2
+#define ELF_FLAG_READ          0x4
+
+struct elf32_header {
+    uint32_t magic;
+    uint8_t file_class;
+    uint8_t data_encoding;
+    uint8_t version_ident;
+    uint8_t padding[9];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t program_header_offset;
+    uint32_t section_header_offset;
+    uint32_t flags;
+    uint16_t header_size;
+    uint16_t program_header_size;
+    uint16_t program_header_count;
+    uint16_t section_header_size;
+    uint16_t section_header_count;
+    uint16_t section_name_index;
+};
+
+struct elf32_program_header {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t virtual_address;
+    uint32_t physical_address;
+    uint32_t file_size;
+    uint32_t memory_size;
+    uint32_t flags;
+    uint32_t alignment;
+};
+
+/**
+ * @brief Register the PT_LOAD segments of an ELF32 executable as areas
+ * 
+ * @param process Process whose address space receives the segments
+ * @param image Complete executable image in kernel memory (must outlive
+ *              the process, since pages are filled from it on demand)
+ * @param size Size of the image in bytes
+ * @param entry Receives the program entry point
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Nothing is copied here: each segment becomes a vm_area whose pages are
+ * read from the image by the page fault handler when first touched.
+ */
+int32_t elf_load(struct process* process, const uint8_t* image, uint32_t size, uint32_t* entry) {
+    const struct elf32_header* header = (const struct elf32_header*)image;
+    
+    if (size < sizeof(*header) ||
+        header->magic != ELF_MAGIC ||
+        header->file_class != ELF_CLASS_32 ||
+        header->data_encoding != ELF_DATA_LSB ||
+        header->type != ELF_TYPE_EXECUTABLE ||
+        header->machine != ELF_MACHINE_386 ||
+        header->program_header_size != sizeof(struct elf32_program_header)) {
+        return ERROR_BAD_EXECUTABLE;
+    }
+    
+    uint32_t table_end = header->program_header_offset +
+                         (uint32_t)header->program_header_count * sizeof(struct elf32_program_header);
+    if (table_end > size || table_end < header->program_header_offset) {
+        return ERROR_BAD_EXECUTABLE;
+    }
+    
+    const struct elf32_program_header* segments =
+        (const struct elf32_program_header*)(image + header->program_header_offset);
+    
+    for (uint32_t i = 0; i < header->program_header_count; ++i) {
+        const struct elf32_program_header* segment = &segments[i];
+        
+        if (segment->type != ELF_SEGMENT_LOAD || segment->memory_size == 0) continue;
+        
+        uint32_t start = segment->virtual_address;
+        uint32_t end = start + segment->memory_size;
+        if (segment->file_size > segment->memory_size ||
+            segment->offset + segment->file_size > size ||
+            segment->offset + segment->file_size < segment->offset ||
+            end < start) {
+            return ERROR_BAD_EXECUTABLE;
+        }
+        
+        uint32_t flags = VM_READ;
+        if (segment->flags & ELF_FLAG_WRITE) flags |= VM_WRITE;
+        if (segment->flags & ELF_FLAG_EXECUTE) flags |= VM_EXEC;
+        
+        struct vm_area* area = vm_area_create(process, PAGE_ALIGN_DOWN(start), PAGE_ALIGN_UP(end), flags);
+        if (!area) return ERROR_BAD_EXECUTABLE;
+        
+        area->file_image = image + segment->offset;
+        area->file_start = start;
+        area->file_end = start + segment->file_size;
+    }
+    
+    if (!vm_area_find(process, header->entry)) {
+        return ERROR_BAD_EXECUTABLE;
+    }
+    *entry = header->entry;
+    return 0;
+}
+
+/**
+ * @brief Give a process a fresh address space holding an ELF program
+ * 
+ * @param process Process to load into (its current address space, if
+ *                any, is left untouched and must be released by the caller)
+ * @param image Executable image in kernel memory
+ * @param size Size of the image in bytes
+ * @param entry Receives the program entry point
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t process_load_image(struct process* process, const uint8_t* image, uint32_t size, uint32_t* entry) {
+    int32_t result;
+    
+    process->vm_areas = NULL;
+    process->resident_pages = 0;
+    process->page_directory = address_space_create();
+    if (!process->page_directory) return ERROR_NO_MEMORY;
+    
+    result = elf_load(process, image, size, entry);
+    if (result == 0 &&
+        !vm_area_create(process, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP, VM_READ | VM_WRITE)) {
+        result = ERROR_NO_MEMORY;
+    }
+    if (result == 0) {
+        result = vdso_map(process);
+    }
+    if (result != 0) {
+        vm_areas_free(process);
+        address_space_destroy(process->page_directory);
+        process->page_directory = NULL;
+    }
+    return result;
+}
+
+/**
+ * @brief Create a process running an ELF32 executable image
+ * 
+ * @param image Executable image in kernel memory
+ * @param size Size of the image in bytes
+ * @param parent Parent process, or NULL for an orphan reaped by the kernel
+ * @return The new process (not yet runnable), or NULL on failure
+ * 
+ * This is the spawn fast path: nothing of the parent is duplicated. The
+ * process gets an empty address space, one area per PT_LOAD segment and a
+ * lazily populated stack.
+ */
+struct process* process_spawn(const uint8_t* image, uint32_t size, struct process* parent) {
+    struct process* process = process_allocate();
+    struct trap_frame user_state;
+    uint32_t entry;
+    
+    if (!process) return NULL;
+    
+    if (process_load_image(process, image, size, &entry) != 0) {
+        process_reap(process);
+        return NULL;
+    }
+    
+    trap_frame_initialize_user(&user_state, entry, USER_STACK_TOP);
+    process_prepare_return(process, &user_state);
+    process_files_inherit(process, parent);
+    process->parent = parent;
+    return process;
+}
+
+/**
+ * @brief Start a user program from an ELF32 executable image
+ * 
+ * @param image Executable image in kernel memory
+ * @param size Size of the image in bytes
+ * @return Process ID of the new process, or a negative error
+ * 
+ * The process has no parent and becomes ready to run immediately.
+ */
+int32_t process_create_from_elf(const uint8_t* image, uint32_t size) {
+    struct process* process = process_spawn(image, size, NULL);
+    
+    if (!process) return ERROR_BAD_EXECUTABLE;
+    
+    process->state = PROCESS_READY;
+    return (int32_t)process->pid;
+}
+
+/**
+ * @brief Duplicate a process, sharing its pages copy-on-write
+ * 
+ * @param parent Process to duplicate (its trap_frame is the resume state)
+ * @return The child (not yet runnable), or NULL on failure
+ * 
+ * Cost is one page table per populated 4MB of the parent plus a reference
+ * count bump per resident page; data is only copied when either side
+ * writes to it. The child sees a return value of 0.
+ */
+struct process* process_fork(struct process* parent) {
+    struct process* child = process_allocate();
+    
+    if (!child) return NULL;
+    
+    child->page_directory = address_space_create();
+    if (!child->page_directory) {
+        process_reap(child);
+        return NULL;
+    }
+    
+    int32_t result = address_space_clone(parent->page_directory, child->page_directory);
+    for (struct vm_area* area = parent->vm_areas; area && result == 0; area = area->next) {
+        struct vm_area* copy = (struct vm_area*)heap_allocate(sizeof(struct vm_area));
+        if (!copy) {
+            result = ERROR_NO_MEMORY;
+            break;
+        }
+        *copy = *area;
+        copy->next = child->vm_areas;
+        child->vm_areas = copy;
+        if (copy->shared) {
+            copy->shared->references++;
+        }
+        if (copy->file) {
+            file_get(copy->file);
+        }
+    }
+    
+    if (result != 0) {
+        vm_areas_free(child);
+        address_space_destroy(child->page_directory);
+        process_reap(child);
+        return NULL;
+    }
+    
+    child->resident_pages = parent->resident_pages;
+    process_files_inherit(child, parent);
+    child->parent = parent;
+    process_prepare_return(child, parent->trap_frame);
+    child->trap_frame->eax = 0;
+    return child;
+}
+
+/**
+ * @brief Create a child that borrows the parent's address space (vfork)
+ * 
+ * @param parent Process to borrow from
+ * @return The child (not yet runnable), or NULL on failure
+ * 
+ * No page tables are touched at all. The child may only exec or exit;
+ * either one hands the address space back, together with any areas the
+ * child mapped or unmapped meanwhile, and wakes the parent, which stays
+ * blocked in sys_vfork() until then.
+ */
+struct process* process_vfork(struct process* parent) {
+    struct process* child = process_allocate();
+    
+    if (!child) return NULL;
+    
+    child->page_directory = parent->page_directory;
+    child->vm_areas = parent->vm_areas;
+    child->resident_pages = parent->resident_pages;
+    child->vfork_parent = parent;
+    process_files_inherit(child, parent);
+    child->parent = parent;
+    process_prepare_return(child, parent->trap_frame);
+    child->trap_frame->eax = 0;
+    return child;
+}
+
+/**
+ * @brief Drop the address space of a process that is not running
+ * 
+ * @param process Process whose memory should be released
+ * 
+ * A vfork child only returns the borrowed space to its parent. The area
+ * list goes back too: the child may have added areas to its head or
+ * freed the one the parent's head still points at.
+ */
+static void process_release_address_space(struct process* process) {
+    if (process->vfork_parent) {
+        struct process* parent = process->vfork_parent;
+        parent->vm_areas = process->vm_areas;
+        parent->resident_pages = process->resident_pages;
+        process->vfork_parent = NULL;
+        wait_queue_wake_all(&parent->child_wait);
+    } else if (process->page_directory && process->page_directory != kernel_page_directory) {
+        vm_areas_free(process);
+        address_space_destroy(process->page_directory);
+    }
+    process->vm_areas = NULL;
+    process->page_directory = kernel_page_directory;
+}
+
+/**
+ * @brief Free a process that was created but never made runnable
+ * 
+ * @param process Process to destroy
+ */
+void process_discard(struct process* process) {
+    process_release_address_space(process);
+    process_files_close(process, 0);
+    process_reap(process);
+}
+
+/**
+ * @brief Replace the current process's program
+ * 
+ * @param image Executable image in kernel memory
+ * @param size Size of the image in bytes
+ * @return 0 on success (the caller's trap frame now enters the new
+ *         program), otherwise a negative error and nothing has changed
+ */
+int32_t process_exec(const uint8_t* image, uint32_t size) {
+    struct process* process = current_process;
+    uint32_t* old_directory = process->page_directory;
+    struct vm_area* old_areas = process->vm_areas;
+    uint32_t old_resident = process->resident_pages;
+    uint32_t entry;
+    
+    int32_t result = process_load_image(process, image, size, &entry);
+    if (result != 0) {
+        process->page_directory = old_directory;
+        process->vm_areas = old_areas;
+        process->resident_pages = old_resident;
+        return result;
+    }
+    
+    uint32_t* new_directory = process->page_directory;
+    struct vm_area* new_areas = process->vm_areas;
+    uint32_t new_resident = process->resident_pages;
+    write_cr3((uint32_t)new_directory);
+    
+    process->page_directory = old_directory;
+    process->vm_areas = old_areas;
+    process->resident_pages = old_resident;
+    process_release_address_space(process);
+    process->page_directory = new_directory;
+    process->vm_areas = new_areas;
+    process->resident_pages = new_resident;
+    process_files_close(process, FILE_PRIVATE);
+    
+    trap_frame_initialize_user(process->trap_frame, entry, USER_STACK_TOP);
+    return 0;
+}
+
+/**
+ * @brief Terminate the current process
+ * 
+ * @param exit_code Status reported to the parent
+ * 
+ * The address space is torn down immediately; the kernel stack we are
+ * running on is released later by whoever reaps the zombie.
+ */
+void process_exit(int32_t exit_code) {
+    struct process* process = current_process;
+    
+    if (process->pid == 0) {
+        kernel_panic("process_exit: idle process cannot exit");
+    }
+    
+    write_cr3((uint32_t)kernel_page_directory);
+    process_release_address_space(process);
+    process_files_close(process, 0);
+    
+    // Children outlive us as orphans, reaped by the idle loop
+    for (uint32_t i = 1; i < MAX_PROCESSES; ++i) {
+        if (process_table[i].parent == process) {
+            process_table[i].parent = NULL;
+        }
+    }
+    
+    process->exit_code = exit_code;
+    process->state = PROCESS_ZOMBIE;
+    if (process->parent) {
+        wait_queue_wake_all(&process->parent->child_wait);
+    }
+    scheduler_yield();
+    
+    kernel_panic("process_exit: zombie was scheduled");
+}
+
+// =============================================================================
+// Shared-Memory Ring Buffers
+// =============================================================================
+
+// Single-producer/single-consumer message rings living in memory mapped by
+// both processes. The kernel only creates and maps the ring and provides a
+// futex-style sleep for the two sides; messages themselves move without
+// any system call.
+//
+// Protocol (spsc_ring_push/spsc_ring_pop are the reference
+// implementation):
+//   - head and tail are free-running counters on separate cache lines,
+//     written only by the producer and the consumer respectively; a slot
+//     index is counter & (slot_count - 1)
+//   - the producer fills slot[head], then publishes with a release store
+//     of head + 1; the consumer reads head with an acquire load
+//   - a consumer finding the ring empty sets consumer_waiting, re-checks
+//     head, and only then calls SYSCALL_RING_WAIT(id, RING_CONSUMER, head).
+//     A producer that sees consumer_waiting after publishing calls
+//     SYSCALL_RING_WAKE(id, RING_CONSUMER). Full rings work the same way
+//     with producer_waiting and tail.
+#define MAX_SHARED_RINGS       32
+#define RING_CACHE_LINE_SIZE   64
+#define RING_MAX_BYTES         (256 * 1024)
+#define RING_SLOT_HEADER_SIZE  4       // Message length precedes each message
+#define RING_PRODUCER          0
+#define RING_CONSUMER          1
+
+struct spsc_ring_header {
+    // Producer cache line
+    volatile uint32_t head;
+    volatile uint32_t producer_waiting;
+    uint8_t producer_padding[RING_CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];
+    
+    // Consumer cache line
+    volatile uint32_t tail;
+    volatile uint32_t consumer_waiting;
+    uint8_t consumer_padding[RING_CACHE_LINE_SIZE - 2 * sizeof(uint32_t)];
+    
+    // Read-only after creation
+    uint32_t ring_id;
+    uint32_t slot_count;            // Power of two
+    uint32_t slot_size;             // Bytes per slot including the length
+    uint32_t slots_offset;          // From the start of this header
+};
+
+struct shared_ring {
+    uint32_t id;
+    struct shared_memory* memory;   // NULL while the table entry is free
+    struct wait_queue consumers;    // Waiting for a message
+    struct wait_queue producers;    // Waiting for a free slot
+};
+
+static struct shared_ring shared_rings[MAX_SHARED_RINGS];
+static uint32_t next_ring_id = 1;
+
+static void shared_ring_release(struct shared_memory* memory) {
+    struct shared_ring* ring = (struct shared_ring*)memory->owner;
+    ring->memory = NULL;
+}
+
+/**
+ * @brief Create a ring with a power-of-two number of fixed-size slots
+ * 
+ * @param slot_count Number of slots (power of two)
+ * @param slot_size Bytes per slot, including the 4-byte length field
+ * @return The ring (its memory has one reference held by the caller), or NULL
+ */
+struct shared_ring* shared_ring_create(uint32_t slot_count, uint32_t slot_size) {
+    if (slot_count < 2 || (slot_count & (slot_count - 1)) != 0 ||
+        slot_size <= RING_SLOT_HEADER_SIZE || (slot_size & 3) != 0 ||
+        slot_count > RING_MAX_BYTES / slot_size) {
+        return NULL;
+    }
+    
+    for (uint32_t i = 0; i < MAX_SHARED_RINGS; ++i) {
+        struct shared_ring* ring = &shared_rings[i];
+        if (ring->memory) continue;
+        
+        uint32_t data_pages = PAGE_ALIGN_UP(slot_count * slot_size) / PAGE_SIZE;
+        ring->memory = shared_memory_create(1 + data_pages);
+        if (!ring->memory) return NULL;
+        
+        ring->memory->release = shared_ring_release;
+        ring->memory->owner = ring;
+        ring->id = next_ring_id++;
+        
+        struct spsc_ring_header* header = (struct spsc_ring_header*)ring->memory->base;
+        header->ring_id = ring->id;
+        header->slot_count = slot_count;
+        header->slot_size = slot_size;
+        header->slots_offset = PAGE_SIZE;
+        return ring;
+    }
+    return NULL;
+}
+
+static struct shared_ring* shared_ring_find(uint32_t id) {
+    for (uint32_t i = 0; i < MAX_SHARED_RINGS; ++i) {
+        if (shared_rings[i].memory && shared_rings[i].id == id) {
+            return &shared_rings[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Sleep while one side's counter still holds an expected value
+ * 
+ * @param ring Ring to wait on
+ * @param side RING_CONSUMER waits on head, RING_PRODUCER waits on tail
+ * @param expected Counter value observed by the caller
+ * 
+ * Like a futex, the check happens in the kernel with no wakeup able to
+ * slip in between, so a wake issued after the caller's last check is
+ * never lost.
+ */
+void shared_ring_wait(struct shared_ring* ring, uint32_t side, uint32_t expected) {
+    struct spsc_ring_header* header = (struct spsc_ring_header*)ring->memory->base;
+    
+    if (side == RING_CONSUMER) {
+        if (header->head == expected) wait_queue_sleep(&ring->consumers);
+    } else {
+        if (header->tail == expected) wait_queue_sleep(&ring->producers);
+    }
+}
+
+/**
+ * @brief Wake the sleepers on one side of a ring
+ * 
+ * @param ring Ring to wake
+ * @param side RING_CONSUMER or RING_PRODUCER
+ */
+void shared_ring_wake(struct shared_ring* ring, uint32_t side) {
+    wait_queue_wake_all(side == RING_CONSUMER ? &ring->consumers : &ring->producers);
+}
+
+/**
+ * @brief Append a message (reference producer implementation)
+ * 
+ * @param ring Mapped ring header
+ * @param message Message bytes
+ * @param length Message length (at most slot_size - 4)
+ * @return 1 if queued, 0 if the ring is full
+ */
+int spsc_ring_push(struct spsc_ring_header* ring, const void* message, uint32_t length) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    
+    if (head - tail == ring->slot_count) return 0;
+    
+    uint8_t* slot = (uint8_t*)ring + ring->slots_offset + (head & (ring->slot_count - 1)) * ring->slot_size;
+    *(uint32_t*)slot = length;
+    memcpy(slot + RING_SLOT_HEADER_SIZE, message, length);
+    
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * @brief Remove the oldest message (reference consumer implementation)
+ * 
+ * @param ring Mapped ring header
+ * @param buffer Destination for the message
+ * @param capacity Size of the destination
+ * @return Message length, or ERROR_WOULD_BLOCK if the ring is empty
+ */
+int32_t spsc_ring_pop(struct spsc_ring_header* ring, void* buffer, uint32_t capacity) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    
+    if (head == tail) return ERROR_WOULD_BLOCK;
+    
+    const uint8_t* slot = (const uint8_t*)ring + ring->slots_offset +
+                          (tail & (ring->slot_count - 1)) * ring->slot_size;
+    uint32_t length = *(const uint32_t*)slot;
+    if (length > capacity) length = capacity;
+    memcpy(buffer, slot + RING_SLOT_HEADER_SIZE, length);
+    
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return (int32_t)length;
+}
+
+// =============================================================================
+// Message Passing
+// =============================================================================
+
+// Message ports carry variable-length messages between processes. Small
+// messages are copied through a kernel buffer. Page-aligned messages of at
+// least ipc_remap_min_pages pages are moved instead: the sender's page
+// table entries are taken out of its address space and installed in the
+// receiver's, so the data itself is never touched. The threshold is
+// measured at boot by message_passing_initialize().
+#define MAX_MESSAGE_PORTS          32
+#define MESSAGE_QUEUE_LIMIT        64
+#define MESSAGE_MAX_LENGTH         (4 * 1024 * 1024)
+#define MESSAGE_FLAG_REMAPPED      0x1     // message_info: pages were moved
+#define IPC_INVLPG_BATCH_LIMIT     32      // Beyond this, reload CR3 instead
+#define IPC_CALIBRATION_MAX_PAGES  16
+#define IPC_CALIBRATION_ROUNDS     4       // Best of, after one warm-up round
+#define IPC_CALIBRATION_ADDRESS    USER_MAPPING_BASE
+
+struct ipc_message {
+    uint32_t length;
+    uint32_t page_count;            // Non-zero when pages were moved
+    uint32_t* page_entries;         // Sender's page table entries
+    uint8_t* data;                  // Copied payload otherwise
+    struct ipc_message* next;
+};
+
+// Written to the receiver's info buffer by SYSCALL_MESSAGE_RECEIVE
+struct message_info {
+    uint32_t address;               // Where the payload now is
+    uint32_t length;
+    uint32_t flags;                 // MESSAGE_FLAG_*
+};
+
+struct message_port {
+    uint32_t id;                    // 0 while the table entry is free
+    struct ipc_message* head;
+    struct ipc_message* tail;
+    uint32_t queued;
+    struct wait_queue receivers;
+    struct wait_queue senders;
+};
+
+static struct message_port message_ports[MAX_MESSAGE_PORTS];
+static uint32_t next_message_port_id = 1;
+static uint32_t ipc_remap_min_pages = IPC_CALIBRATION_MAX_PAGES;
+
+static struct message_port* message_port_find(uint32_t id) {
+    for (uint32_t i = 0; i < MAX_MESSAGE_PORTS; ++i) {
+        if (message_ports[i].id != 0 && message_ports[i].id == id) {
+            return &message_ports[i];
+        }
+    }
+    return NULL;
+}
+
+static void ipc_message_free(struct ipc_message* message) {
+    for (uint32_t i = 0; i < message->page_count; ++i) {
+        page_frame_free(message->page_entries[i] & ~(uint32_t)PAGE_FLAGS_MASK);
+    }
+    heap_free(message->page_entries);
+    heap_free(message->data);
+    heap_free(message);
+}
+
+/**
+ * @brief Create a message port
+ * 
+ * @return Port ID, or a negative error
+ */
+int32_t message_port_create(void) {
+    for (uint32_t i = 0; i < MAX_MESSAGE_PORTS; ++i) {
+        if (message_ports[i].id == 0) {
+            memset(&message_ports[i], 0, sizeof(message_ports[i]));
+            message_ports[i].id = next_message_port_id++;
+            return (int32_t)message_ports[i].id;
+        }
+    }
+    return ERROR_NO_MEMORY;
+}
+
+/**
+ * @brief Destroy a port, discarding queued messages and waking waiters
+ * 
+ * @param port Port to destroy
+ */
+void message_port_destroy(struct message_port* port) {
+    while (port->head) {
+        struct ipc_message* message = port->head;
+        port->head = message->next;
+        ipc_message_free(message);
+    }
+    port->id = 0;
+    wait_queue_wake_all(&port->receivers);
+    wait_queue_wake_all(&port->senders);
+}
+
+/**
+ * @brief Take a page-aligned range out of a process's address space
+ * 
+ * @param process Sending process
+ * @param address Page-aligned start of the range
+ * @param page_count Number of pages
+ * @param entries Receives the removed page table entries
+ * @return 0 on success, otherwise a negative error (nothing is removed)
+ * 
+ * Missing pages are faulted in first. The TLB is flushed once for the
+ * whole message rather than after every entry. The range reverts to its
+ * initial demand-paged contents; a received-message area that is sent on
+ * in full is removed altogether.
+ */
+static int32_t ipc_detach_pages(struct process* process, uint32_t address, uint32_t page_count, uint32_t* entries) {
+    for (uint32_t i = 0; i < page_count; ++i) {
+        uint32_t page = address + i * PAGE_SIZE;
+        struct vm_area* area = vm_area_find(process, page);
+        
+        if (!area || (area->flags & (VM_SHARED | VM_FILE))) return ERROR_BAD_ADDRESS;
+        
+        uint32_t* entry = paging_get_entry(process->page_directory, page, 0);
+        if (!entry || !(*entry & PAGE_PRESENT)) {
+            int32_t result = vm_area_fault(process, page, 0);
+            if (result != 0) return result;
+        }
+    }
+    
+    for (uint32_t i = 0; i < page_count; ++i) {
+        uint32_t* entry = paging_get_entry(process->page_directory, address + i * PAGE_SIZE, 0);
+        entries[i] = *entry;
+        *entry = 0;
+    }
+    process->resident_pages -= page_count;
+    
+    if (process->page_directory == (uint32_t*)read_cr3()) {
+        if (page_count > IPC_INVLPG_BATCH_LIMIT) {
+            write_cr3(read_cr3());
+        } else {
+            for (uint32_t i = 0; i < page_count; ++i) {
+                invalidate_page(address + i * PAGE_SIZE);
+            }
+        }
+    }
+    
+    struct vm_area* area = vm_area_find(process, address);
+    if ((area->flags & VM_MESSAGE) && area->start == address &&
+        area->end == address + page_count * PAGE_SIZE) {
+        vm_area_remove(process, area);
+    }
+    return 0;
+}
+
+/**
+ * @brief Install moved page table entries in a fresh area of a process
+ * 
+ * @param process Receiving process
+ * @param entries Page table entries taken from the sender
+ * @param page_count Number of entries
+ * @return User address of the new area, or 0 if it could not be mapped
+ * 
+ * Writable pages stay writable; read-only or copy-on-write pages are
+ * mapped copy-on-write so the receiver can still write to its copy.
+ */
+static uint32_t ipc_attach_pages(struct process* process, const uint32_t* entries, uint32_t page_count) {
+    uint32_t start = vm_area_find_free(process, page_count * PAGE_SIZE);
+    
+    if (!start) return 0;
+    
+    struct vm_area* area = vm_area_create(process, start, start + page_count * PAGE_SIZE,
+                                          VM_READ | VM_WRITE | VM_MESSAGE);
+    if (!area) return 0;
+    
+    // Allocate any page tables up front so installation cannot fail halfway
+    for (uint32_t i = 0; i < page_count; ++i) {
+        if (!paging_get_entry(process->page_directory, start + i * PAGE_SIZE, 1)) {
+            vm_area_remove(process, area);
+            return 0;
+        }
+    }
+    
+    for (uint32_t i = 0; i < page_count; ++i) {
+        uint32_t frame = entries[i] & ~(uint32_t)PAGE_FLAGS_MASK;
+        uint32_t flags = PAGE_PRESENT | PAGE_USER;
+        
+        flags |= (entries[i] & PAGE_WRITABLE) ? PAGE_WRITABLE : PAGE_COPY_ON_WRITE;
+        *paging_get_entry(process->page_directory, start + i * PAGE_SIZE, 0) = frame | flags;
+    }
+    process->resident_pages += page_count;
+    return start;
+}
+
+/**
+ * @brief Queue a message on a port
+ * 
+ * @param process Sending process (its address space must be active)
+ * @param port Destination port
+ * @param address User address of the payload
+ * @param length Payload length in bytes
+ * @param remap Move whole pages instead of copying (address must be
+ *              page-aligned)
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t message_send(struct process* process, struct message_port* port, uint32_t address,
+                     uint32_t length, int remap) {
+    struct ipc_message* message;
+    int32_t result = 0;
+    
+    if (length > MESSAGE_MAX_LENGTH || (remap && (address & (PAGE_SIZE - 1)))) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    while (port->id != 0 && port->queued >= MESSAGE_QUEUE_LIMIT) {
+        wait_queue_sleep(&port->senders);
+    }
+    if (port->id == 0) return ERROR_NOT_FOUND;
+    
+    message = (struct ipc_message*)heap_allocate(sizeof(struct ipc_message));
+    if (!message) return ERROR_NO_MEMORY;
+    message->length = length;
+    
+    if (remap) {
+        uint32_t page_count = PAGE_ALIGN_UP(length) / PAGE_SIZE;
+        
+        message->page_entries = (uint32_t*)heap_allocate(page_count * sizeof(uint32_t));
+        if (!message->page_entries) {
+            result = ERROR_NO_MEMORY;
+        } else {
+            result = ipc_detach_pages(process, address, page_count, message->page_entries);
+            if (result == 0) message->page_count = page_count;
+        }
+    } else if (length != 0) {
+        message->data = (uint8_t*)heap_allocate(length);
+        if (!message->data) {
+            result = ERROR_NO_MEMORY;
+        } else {
+            memcpy(message->data, (const void*)address, length);
+        }
+    }
+    
+    if (result != 0) {
+        ipc_message_free(message);
+        return result;
+    }
+    
+    if (port->tail) {
+        port->tail->next = message;
+    } else {
+        port->head = message;
+    }
+    port->tail = message;
+    port->queued++;
+    wait_queue_wake_one(&port->receivers);
+    return 0;
+}
+
+/**
+ * @brief Take the oldest message from a port, blocking while it is empty
+ * 
+ * @param process Receiving process (its address space must be active)
+ * @param port Port to receive from
+ * @param buffer User buffer for copied payloads
+ * @param capacity Size of the buffer
+ * @param info Receives where the payload is and how it arrived
+ * @return Message length, or a negative error
+ * 
+ * Moved pages appear at a new address in the receiver; copied payloads
+ * are written to the buffer.
+ */
+int32_t message_receive(struct process* process, struct message_port* port, uint32_t buffer,
+                        uint32_t capacity, struct message_info* info) {
+    struct ipc_message* message;
+    
+    while (port->id != 0 && !port->head) {
+        wait_queue_sleep(&port->receivers);
+    }
+    if (port->id == 0) return ERROR_NOT_FOUND;
+    
+    message = port->head;
+    if (message->page_count) {
+        info->address = ipc_attach_pages(process, message->page_entries, message->page_count);
+        if (!info->address) return ERROR_NO_MEMORY;
+        info->flags = MESSAGE_FLAG_REMAPPED;
+        message->page_count = 0;        // Pages now belong to the receiver
+    } else {
+        if (message->length > capacity) return ERROR_INVALID_ARGUMENT;
+        memcpy((void*)buffer, message->data, message->length);
+        info->address = buffer;
+        info->flags = 0;
+    }
+    info->length = message->length;
+    
+    port->head = message->next;
+    if (!port->head) port->tail = NULL;
+    port->queued--;
+    wait_queue_wake_one(&port->senders);
+    
+    uint32_t length = message->length;
+    ipc_message_free(message);
+    return (int32_t)length;
+}
+
+/**
+ * @brief Measure where moving pages becomes cheaper than copying them
+ * 
+ * For n = 1, 2, 4 ... pages, times both ways a message is delivered, on a
+ * scratch process: copying into a kernel buffer and out to the receiver's
+ * buffer, against ipc_detach_pages() and ipc_attach_pages() followed by
+ * the receiver's first touch of each page. Each is run once to warm the
+ * caches, heap and page tables, then the fastest of IPC_CALIBRATION_ROUNDS
+ * counts. The smallest n where remapping wins becomes the zero-copy
+ * threshold.
+ */
+void message_passing_initialize(void) {
+    uint32_t frames[IPC_CALIBRATION_MAX_PAGES];
+    uint32_t entries[IPC_CALIBRATION_MAX_PAGES / 2];
+    uint32_t* previous = (uint32_t*)read_cr3();
+    uint32_t allocated = 0;
+    int failed = 0;
+    
+    struct process* process = (struct process*)heap_allocate(sizeof(struct process));
+    if (!process) return;
+    process->page_directory = address_space_create();
+    if (!process->page_directory) {
+        heap_free(process);
+        return;
+    }
+    
+    while (allocated < IPC_CALIBRATION_MAX_PAGES && (frames[allocated] = page_frame_allocate()) != 0) {
+        allocated++;
+    }
+    
+    uint32_t source = IPC_CALIBRATION_ADDRESS;
+    uint32_t destination = IPC_CALIBRATION_ADDRESS + LARGE_PAGE_SIZE;
+    uint32_t half = allocated / 2;
+    if (!vm_area_create(process, source, source + half * PAGE_SIZE, VM_READ | VM_WRITE) ||
+        !vm_area_create(process, destination, destination + half * PAGE_SIZE, VM_READ | VM_WRITE)) {
+        half = 0;
+    }
+    for (uint32_t i = 0; i < half; ++i) {
+        paging_map_page(process->page_directory, source + i * PAGE_SIZE, frames[i], PAGE_WRITABLE | PAGE_USER);
+        paging_map_page(process->page_directory, destination + i * PAGE_SIZE, frames[half + i],
+                        PAGE_WRITABLE | PAGE_USER);
+    }
+    process->resident_pages = 2 * half;
+    
+    write_cr3((uint32_t)process->page_directory);
+    for (uint32_t pages = 1; pages <= half && !failed; pages *= 2) {
+        uint64_t copy_cycles = UINT64_MAX;
+        uint64_t remap_cycles = UINT64_MAX;
+        
+        for (uint32_t round = 0; round <= IPC_CALIBRATION_ROUNDS && !failed; ++round) {
+            // What message_send() and message_receive() do for a copy
+            uint64_t start = timestamp_read();
+            uint8_t* data = (uint8_t*)heap_allocate(pages * PAGE_SIZE);
+            if (!data) {
+                failed = 1;
+                break;
+            }
+            memcpy(data, (const void*)source, pages * PAGE_SIZE);
+            memcpy((void*)destination, data, pages * PAGE_SIZE);
+            heap_free(data);
+            uint64_t cycles = timestamp_read() - start;
+            if (round && cycles < copy_cycles) copy_cycles = cycles;
+            
+            // ... and for a move, including the receiver's TLB misses
+            start = timestamp_read();
+            if (ipc_detach_pages(process, source, pages, entries) != 0) {
+                failed = 1;
+                break;
+            }
+            uint32_t received = ipc_attach_pages(process, entries, pages);
+            for (uint32_t i = 0; received && i < pages; ++i) {
+                (void)*(volatile uint8_t*)(received + i * PAGE_SIZE);
+            }
+            cycles = timestamp_read() - start;
+            if (round && cycles < remap_cycles) remap_cycles = cycles;
+            
+            // Move the pages back for the next round
+            if (!received || ipc_detach_pages(process, received, pages, entries) != 0) {
+                failed = 1;             // The frames are freed below
+                break;
+            }
+            for (uint32_t i = 0; i < pages; ++i) {
+                *paging_get_entry(process->page_directory, source + i * PAGE_SIZE, 0) = entries[i];
+                invalidate_page(source + i * PAGE_SIZE);
+            }
+            process->resident_pages += pages;
+        }
+        
+        if (!failed && remap_cycles < copy_cycles) {
+            ipc_remap_min_pages = pages;
+            break;
+        }
+    }
+    write_cr3((uint32_t)previous);
+    
+    // Mapped frames are released along with the scratch address space
+    vm_areas_free(process);
+    address_space_destroy(process->page_directory);
+    heap_free(process);
+    for (uint32_t i = 0; i < allocated; ++i) {
+        if (page_frame_reference_count(frames[i]) != 0) {
+            page_frame_free(frames[i]);
+        }
+    }
+}
+
+// =============================================================================
+// Files and Pipes
+// =============================================================================
+
+// A file is an open object reached through a process's descriptor table.
+// Pipes keep their contents in a ring of page buffers, each naming a
+// reference-counted page frame and the byte range of it in use. splice
+// hands those pages from one file to another and tee shares them, so data
+// moves between pipes, the console and (through splice_read/splice_write)
+// any other file without being copied through user memory.
+#define PIPE_BUFFER_COUNT      16      // Pages a pipe can hold
+
+#define SPLICE_KEEP            0x01    // Leave the data in the source (tee)
+#define SPLICE_NONBLOCK        0x02    // Return 0 instead of waiting for data
+
+// Readiness bits returned by the poll operation (Linux values)
+#define POLL_IN                0x001
+#define POLL_OUT               0x004
+#define POLL_ERROR             0x008
+#define POLL_HANG_UP           0x010
+
+struct pipe_buffer {
+    uint32_t page;                  // Frame holding the data (one reference)
+    uint16_t offset;                // First byte in use
+    uint16_t length;                // Bytes in use
+};
+
+struct pipe {
+    struct pipe_buffer buffers[PIPE_BUFFER_COUNT];
+    uint32_t head;                  // Oldest buffer
+    uint32_t count;                 // Buffers in use
+    uint32_t readers;               // Open read ends
+    uint32_t writers;               // Open write ends
+    struct wait_queue read_wait;
+    struct wait_queue write_wait;
+};
+
+// Passed to a file's poll operation by callers that want to be told about
+// readiness changes; the file hands each wait queue it wakes to poll_wait()
+struct poll_table {
+    void (*add)(struct poll_table* table, struct wait_queue* queue);
+};
+
+static void poll_wait(struct poll_table* table, struct wait_queue* queue) {
+    if (table) table->add(table, queue);
+}
+
+// read and write take FILE_* flags for the call, normally file->flags
+struct file_operations {
+    int32_t (*read)(struct file* file, uint8_t* buffer, uint32_t length, uint32_t flags);
+    int32_t (*write)(struct file* file, const uint8_t* buffer, uint32_t length, uint32_t flags);
+    // Produce up to length bytes as a page reference, starting skip bytes
+    // in (SPLICE_* flags). Returns bytes, 0 at end or when nothing is ready.
+    int32_t (*splice_read)(struct file* file, struct pipe_buffer* piece, uint32_t skip,
+                           uint32_t length, uint32_t flags);
+    // Consume a page reference; the reference is always taken
+    int32_t (*splice_write)(struct file* file, struct pipe_buffer* piece);
+    // Report POLL_* readiness, registering with table if it is non-NULL
+    uint32_t (*poll)(struct file* file, struct poll_table* table);
+    // Write the file's cached data to its device; NULL when there is none
+    int32_t (*sync)(struct file* file);
+    // Back a new VM_FILE area with the file's pages; NULL if it cannot be
+    // mapped
+    int32_t (*mmap)(struct file* file, struct vm_area* area);
+    void (*close)(struct file* file);
+};
+
+struct file {
+    const struct file_operations* operations;
+    uint32_t flags;                 // FILE_* access and behaviour
+    uint32_t references;            // Descriptors and mappings referring to the file
+    void* private_data;
+};
+
+// Console log: the most recent console output in a fixed ring of pages.
+// Every reader has its own position in it, so readers do not take data
+// from each other, and one that falls behind skips to the oldest byte kept.
+#define CONSOLE_LOG_PAGES      16
+#define CONSOLE_LOG_BYTES      (CONSOLE_LOG_PAGES * PAGE_SIZE)
+
+struct console_log_reader {
+    uint32_t position;              // Total bytes written when it reads next
+};
+
+static uint32_t console_log_pages[CONSOLE_LOG_PAGES];
+static uint32_t console_log_written;    // Bytes ever written, wrapping
+static uint32_t console_log_announced;  // console_log_written when readers were last woken
+static struct wait_queue console_log_wait;
+static struct file console_file;
+
+static struct pipe_buffer* pipe_buffer_at(struct pipe* pipe, uint32_t index) {
+    return &pipe->buffers[(pipe->head + index) % PIPE_BUFFER_COUNT];
+}
+
+static void pipe_drop_oldest(struct pipe* pipe) {
+    page_frame_free(pipe->buffers[pipe->head].page);
+    pipe->head = (pipe->head + 1) % PIPE_BUFFER_COUNT;
+    pipe->count--;
+}
+
+/**
+ * @brief Copy bytes into a pipe without blocking
+ * 
+ * @param pipe Destination pipe
+ * @param data Bytes to append
+ * @param length Number of bytes
+ * @return Bytes appended (less than length once the pipe is full)
+ * 
+ * The newest page is filled up before another is allocated, unless tee has
+ * shared it with another pipe.
+ */
+static uint32_t pipe_append(struct pipe* pipe, const uint8_t* data, uint32_t length) {
+    uint32_t appended = 0;
+    
+    while (appended < length) {
+        struct pipe_buffer* last = pipe->count ? pipe_buffer_at(pipe, pipe->count - 1) : NULL;
+        
+        if (!last || last->offset + last->length == PAGE_SIZE ||
+            page_frame_reference_count(last->page) != 1) {
+            if (pipe->count == PIPE_BUFFER_COUNT) break;
+            uint32_t page = page_frame_allocate();
+            if (!page) break;
+            
+            last = pipe_buffer_at(pipe, pipe->count++);
+            last->page = page;
+            last->offset = 0;
+            last->length = 0;
+        }
+        
+        uint32_t space = PAGE_SIZE - last->offset - last->length;
+        uint32_t chunk = length - appended < space ? length - appended : space;
+        memcpy((uint8_t*)last->page + last->offset + last->length, data + appended, chunk);
+        last->length += chunk;
+        appended += chunk;
+    }
+    return appended;
+}
+
+static int32_t pipe_write(struct file* file, const uint8_t* buffer, uint32_t length, uint32_t flags) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    uint32_t written = 0;
+    
+    while (written < length) {
+        if (pipe->readers == 0) {
+            return written ? (int32_t)written : ERROR_BROKEN_PIPE;
+        }
+        
+        uint32_t appended = pipe_append(pipe, buffer + written, length - written);
+        if (appended) {
+            written += appended;
+            wait_queue_wake_all(&pipe->read_wait);
+        } else if (flags & FILE_NONBLOCK) {
+            return written ? (int32_t)written : ERROR_WOULD_BLOCK;
+        } else {
+            wait_queue_sleep(&pipe->write_wait);
+        }
+    }
+    return (int32_t)written;
+}
+
+/**
+ * @brief Wait until a pipe has data or no writer is left
+ * 
+ * @param pipe Pipe to wait on
+ * @return Non-zero if data is available, 0 at end of file
+ */
+static int pipe_wait_readable(struct pipe* pipe) {
+    while (pipe->count == 0 && pipe->writers > 0) {
+        wait_queue_sleep(&pipe->read_wait);
+    }
+    return pipe->count != 0;
+}
+
+static int32_t pipe_read(struct file* file, uint8_t* buffer, uint32_t length, uint32_t flags) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    uint32_t copied = 0;
+    
+    if ((flags & FILE_NONBLOCK) && pipe->count == 0 && pipe->writers > 0) {
+        return ERROR_WOULD_BLOCK;
+    }
+    if (!pipe_wait_readable(pipe)) return 0;
+    
+    while (copied < length && pipe->count) {
+        struct pipe_buffer* first = pipe_buffer_at(pipe, 0);
+        uint32_t chunk = length - copied < first->length ? length - copied : first->length;
+        
+        memcpy(buffer + copied, (const uint8_t*)first->page + first->offset, chunk);
+        first->offset += chunk;
+        first->length -= chunk;
+        copied += chunk;
+        if (first->length == 0) {
+            pipe_drop_oldest(pipe);
+        }
+    }
+    wait_queue_wake_all(&pipe->write_wait);
+    return (int32_t)copied;
+}
+
+static int32_t pipe_splice_read(struct file* file, struct pipe_buffer* piece, uint32_t skip,
+                                uint32_t length, uint32_t flags) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    int keep = (flags & SPLICE_KEEP) != 0;
+    uint32_t index = 0;
+    
+    if (!(flags & SPLICE_NONBLOCK)) {
+        pipe_wait_readable(pipe);
+    }
+    
+    while (index < pipe->count && skip >= pipe_buffer_at(pipe, index)->length) {
+        skip -= pipe_buffer_at(pipe, index)->length;
+        index++;
+    }
+    if (index == pipe->count) return 0;
+    
+    struct pipe_buffer* source = pipe_buffer_at(pipe, index);
+    *piece = *source;
+    piece->offset += skip;
+    piece->length -= skip;
+    if (piece->length > length) piece->length = (uint16_t)length;
+    
+    if (keep || piece->length != source->length) {
+        page_frame_reference(piece->page);
+    }
+    if (!keep) {
+        if (piece->length == source->length) {
+            // The whole buffer moves: the pipe's reference becomes the piece's
+            pipe->head = (pipe->head + 1) % PIPE_BUFFER_COUNT;
+            pipe->count--;
+        } else {
+            source->offset += piece->length;
+            source->length -= piece->length;
+        }
+        wait_queue_wake_all(&pipe->write_wait);
+    }
+    return piece->length;
+}
+
+static int32_t pipe_splice_write(struct file* file, struct pipe_buffer* piece) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    
+    while (pipe->count == PIPE_BUFFER_COUNT && pipe->readers > 0) {
+        wait_queue_sleep(&pipe->write_wait);
+    }
+    if (pipe->readers == 0) {
+        page_frame_free(piece->page);
+        return ERROR_BROKEN_PIPE;
+    }
+    
+    *pipe_buffer_at(pipe, pipe->count++) = *piece;
+    wait_queue_wake_all(&pipe->read_wait);
+    return piece->length;
+}
+
+static uint32_t pipe_poll_reader(struct file* file, struct poll_table* table) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    uint32_t mask = pipe->count ? POLL_IN : 0;
+    
+    poll_wait(table, &pipe->read_wait);
+    if (pipe->writers == 0) mask |= POLL_HANG_UP;
+    return mask;
+}
+
+static uint32_t pipe_poll_writer(struct file* file, struct poll_table* table) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    uint32_t mask = pipe->count < PIPE_BUFFER_COUNT ? POLL_OUT : 0;
+    
+    poll_wait(table, &pipe->write_wait);
+    if (pipe->readers == 0) mask |= POLL_ERROR;
+    return mask;
+}
+
+static void pipe_release(struct pipe* pipe) {
+    if (pipe->readers != 0 || pipe->writers != 0) return;
+    
+    while (pipe->count) {
+        pipe_drop_oldest(pipe);
+    }
+    heap_free(pipe);
+}
+
+static void pipe_close_reader(struct file* file) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    
+    pipe->readers--;
+    wait_queue_wake_all(&pipe->write_wait);
+    pipe_release(pipe);
+}
+
+static void pipe_close_writer(struct file* file) {
+    struct pipe* pipe = (struct pipe*)file->private_data;
+    
+    pipe->writers--;
+    wait_queue_wake_all(&pipe->read_wait);
+    pipe_release(pipe);
+}
+
+static const struct file_operations pipe_read_operations = {
+    .read = pipe_read,
+    .splice_read = pipe_splice_read,
+    .poll = pipe_poll_reader,
+    .close = pipe_close_reader,
+};
+
+static const struct file_operations pipe_write_operations = {
+    .write = pipe_write,
+    .splice_write = pipe_splice_write,
+    .poll = pipe_poll_writer,
+    .close = pipe_close_writer,
+};
+
+static int32_t console_write(struct file* file, const uint8_t* buffer, uint32_t length, uint32_t flags) {
+    (void)file; (void)flags;
+    
+    for (uint32_t i = 0; i < length; ++i) {
+        print_character((char)buffer[i]);
+    }
+    return (int32_t)length;
+}
+
+static int32_t console_splice_write(struct file* file, struct pipe_buffer* piece) {
+    console_write(file, (const uint8_t*)piece->page + piece->offset, piece->length, 0);
+    page_frame_free(piece->page);
+    return piece->length;
+}
+
+static const struct file_operations console_operations = {
+    .write = console_write,
+    .splice_write = console_splice_write,
+};
+
+/**
+ * @brief Allocate a file with one reference
+ * 
+ * @param operations Operations implementing the file
+ * @param flags FILE_READABLE and/or FILE_WRITABLE
+ * @param private_data Object behind the file
+ * @return The file, or NULL if out of memory
+ */
+struct file* file_create(const struct file_operations* operations, uint32_t flags, void* private_data) {
+    struct file* file = (struct file*)heap_allocate(sizeof(struct file));
+    
+    if (!file) return NULL;
+    
+    file->operations = operations;
+    file->flags = flags;
+    file->references = 1;
+    file->private_data = private_data;
+    return file;
+}
+
+/**
+ * @brief Take another reference to a file
+ */
+void file_get(struct file* file) {
+    file->references++;
+}
+
+/**
+ * @brief Drop a reference to a file, closing it with the last one
+ * 
+ * @param file File to release
+ */
+void file_put(struct file* file) {
+    if (--file->references != 0) return;
+    
+    if (file->operations->close) {
+        file->operations->close(file);
+    }
+    heap_free(file);
+}
+
+/**
+ * @brief Create a pipe
+ * 
+ * @param reader Receives the read end
+ * @param writer Receives the write end
+ * @return 0 on success, ERROR_NO_MEMORY otherwise
+ */
+int32_t pipe_create(struct file** reader, struct file** writer) {
+    struct pipe* pipe = (struct pipe*)heap_allocate(sizeof(struct pipe));
+    
+    if (!pipe) return ERROR_NO_MEMORY;
+    
+    *reader = file_create(&pipe_read_operations, FILE_READABLE, pipe);
+    *writer = file_create(&pipe_write_operations, FILE_WRITABLE, pipe);
+    if (!*reader || !*writer) {
+        if (*reader) heap_free(*reader);
+        if (*writer) heap_free(*writer);
+        heap_free(pipe);
+        return ERROR_NO_MEMORY;
+    }
+    pipe->readers = 1;
+    pipe->writers = 1;
+    return 0;
+}
+
+/**
+ * @brief Move (splice) or share (tee) data from one file to another
+ * 
+ * @param input Source; must support splice_read (pipes do)
+ * @param output Destination; must support splice_write (pipes and the
+ *               console do)
+ * @param length Maximum number of bytes
+ * @param keep Leave the data in the source (tee)
+ * @return Bytes transferred, or a negative error
+ * 
+ * Only page references change hands: splice moves whole buffers and
+ * splits a partially transferred one, tee takes an extra reference.
+ */
+int32_t file_splice(struct file* input, struct file* output, uint32_t length, int keep) {
+    uint32_t transferred = 0;
+    
+    if (!input->operations->splice_read || !output->operations->splice_write ||
+        input->private_data == output->private_data) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    // Only the first piece may wait; after that we stop at what is queued
+    while (transferred < length) {
+        struct pipe_buffer piece;
+        uint32_t flags = (keep ? SPLICE_KEEP : 0) | (transferred ? SPLICE_NONBLOCK : 0);
+        int32_t result = input->operations->splice_read(input, &piece, keep ? transferred : 0,
+                                                        length - transferred, flags);
+        if (result <= 0) break;
+        
+        result = output->operations->splice_write(output, &piece);
+        if (result < 0) {
+            return transferred ? (int32_t)transferred : result;
+        }
+        transferred += (uint32_t)result;
+    }
+    return (int32_t)transferred;
+}
+
+/**
+ * @brief Install a file in the lowest free descriptor of a process
+ * 
+ * @param process Owning process
+ * @param file File (the descriptor takes over the caller's reference)
+ * @return Descriptor, or ERROR_BUSY if the table is full
+ */
+int32_t file_descriptor_install(struct process* process, struct file* file) {
+    for (uint32_t fd = 0; fd < MAX_PROCESS_FILES; ++fd) {
+        if (!process->files[fd]) {
+            process->files[fd] = file;
+            return (int32_t)fd;
+        }
+    }
+    return ERROR_BUSY;
+}
+
+/**
+ * @brief Look up an open descriptor of a process
+ * 
+ * @param process Process owning the descriptor table
+ * @param fd Descriptor
+ * @param flags Access the file must allow
+ * @return The file, or NULL
+ */
+struct file* file_descriptor_lookup(struct process* process, uint32_t fd, uint32_t flags) {
+    if (fd >= MAX_PROCESS_FILES || !process->files[fd]) return NULL;
+    if ((process->files[fd]->flags & flags) != flags) return NULL;
+    return process->files[fd];
+}
+
+static struct file* file_descriptor_get(uint32_t fd, uint32_t flags) {
+    return file_descriptor_lookup(current_process, fd, flags);
+}
+
+/**
+ * @brief Give a new process its parent's descriptors, or the console on
+ *        descriptors 1 and 2 if it has no parent
+ * 
+ * @param child New process with an empty table
+ * @param parent Parent process, or NULL
+ */
+void process_files_inherit(struct process* child, struct process* parent) {
+    if (!parent) {
+        child->files[1] = &console_file;
+        child->files[2] = &console_file;
+        console_file.references += 2;
+        return;
+    }
+    
+    for (uint32_t fd = 0; fd < MAX_PROCESS_FILES; ++fd) {
+        struct file* file = parent->files[fd];
+        
+        if (file && !(file->flags & FILE_PRIVATE)) {
+            child->files[fd] = file;
+            file->references++;
+        }
+    }
+}
+
+/**
+ * @brief Close descriptors of a process
+ * 
+ * @param process Process owning the descriptors
+ * @param flags Only close files with all of these FILE_* flags (0 for all)
+ */
+void process_files_close(struct process* process, uint32_t flags) {
+    for (uint32_t fd = 0; fd < MAX_PROCESS_FILES; ++fd) {
+        if (process->files[fd] && (process->files[fd]->flags & flags) == flags) {
+            file_put(process->files[fd]);
+            process->files[fd] = NULL;
+        }
+    }
+}
+
+/**
+ * @brief Record a console character in the console log
+ * 
+ * @param c Character written to the screen
+ * 
+ * Called for every character printed, including from kernel_panic() and
+ * interrupt handlers, so it only stores the byte and leaves waking the
+ * readers to the next timer tick (console_log_tick()).
+ */
+void console_log_append(char c) {
+    if (!console_log_pages[0]) return;
+    
+    uint32_t offset = console_log_written % CONSOLE_LOG_BYTES;
+    ((char*)console_log_pages[offset / PAGE_SIZE])[offset % PAGE_SIZE] = c;
+    console_log_written++;
+}
+
+/**
+ * @brief Wake the log's readers if output arrived since the last tick
+ * 
+ * Called from the timer interrupt.
+ */
+void console_log_tick(void) {
+    if (console_log_announced != console_log_written) {
+        console_log_announced = console_log_written;
+        wait_queue_wake_all(&console_log_wait);
+    }
+}
+
+// Bytes the reader has not seen yet, after skipping any already overwritten
+static uint32_t console_log_pending(struct console_log_reader* reader) {
+    if (console_log_written - reader->position > CONSOLE_LOG_BYTES) {
+        reader->position = console_log_written - CONSOLE_LOG_BYTES;
+    }
+    return console_log_written - reader->position;
+}
+
+// Copy up to length unread bytes, stopping at the end of a ring page
+static uint32_t console_log_copy(struct console_log_reader* reader, uint8_t* buffer, uint32_t length) {
+    uint32_t offset = reader->position % CONSOLE_LOG_BYTES;
+    uint32_t chunk = PAGE_SIZE - offset % PAGE_SIZE;
+    uint32_t pending = console_log_pending(reader);
+    
+    if (chunk > pending) chunk = pending;
+    if (chunk > length) chunk = length;
+    memcpy(buffer, (const uint8_t*)console_log_pages[offset / PAGE_SIZE] + offset % PAGE_SIZE, chunk);
+    reader->position += chunk;
+    return chunk;
+}
+
+static int32_t console_log_read(struct file* file, uint8_t* buffer, uint32_t length, uint32_t flags) {
+    struct console_log_reader* reader = (struct console_log_reader*)file->private_data;
+    uint32_t copied = 0;
+    
+    while (console_log_pending(reader) == 0) {
+        if (flags & FILE_NONBLOCK) return ERROR_WOULD_BLOCK;
+        wait_queue_sleep(&console_log_wait);
+    }
+    while (copied < length && console_log_pending(reader)) {
+        copied += console_log_copy(reader, buffer + copied, length - copied);
+    }
+    return (int32_t)copied;
+}
+
+/**
+ * @brief Splice the next unread piece of the log
+ * 
+ * The ring pages are overwritten as the console prints, so the piece is
+ * copied into a page of its own rather than sharing one.
+ */
+static int32_t console_log_splice_read(struct file* file, struct pipe_buffer* piece, uint32_t skip,
+                                       uint32_t length, uint32_t flags) {
+    struct console_log_reader* reader = (struct console_log_reader*)file->private_data;
+    struct console_log_reader peek;
+    
+    if (!(flags & SPLICE_NONBLOCK)) {
+        while (console_log_pending(reader) == 0) {
+            wait_queue_sleep(&console_log_wait);
+        }
+    }
+    if (console_log_pending(reader) <= skip) return 0;
+    
+    uint32_t page = page_frame_allocate();
+    if (!page) return ERROR_NO_MEMORY;
+    
+    peek.position = reader->position + skip;
+    piece->page = page;
+    piece->offset = 0;
+    piece->length = (uint16_t)console_log_copy(&peek, (uint8_t*)page, length < PAGE_SIZE ? length : PAGE_SIZE);
+    if (!(flags & SPLICE_KEEP)) reader->position = peek.position;
+    return piece->length;
+}
+
+static uint32_t console_log_poll(struct file* file, struct poll_table* table) {
+    struct console_log_reader* reader = (struct console_log_reader*)file->private_data;
+    
+    poll_wait(table, &console_log_wait);
+    return console_log_pending(reader) ? POLL_IN : 0;
+}
+
+static void console_log_close(struct file* file) {
+    heap_free(file->private_data);
+}
+
+static const struct file_operations console_log_operations = {
+    .read = console_log_read,
+    .splice_read = console_log_splice_read,
+    .poll = console_log_poll,
+    .close = console_log_close,
+};
+
+/**
+ * @brief Open a new reader on the console log
+ * 
+ * @return Reader starting at the oldest byte kept, or NULL if out of memory
+ */
+struct file* console_log_open(void) {
+    if (!console_log_pages[0]) return NULL;
+    
+    struct console_log_reader* reader = (struct console_log_reader*)heap_allocate(sizeof(*reader));
+    if (!reader) return NULL;
+    
+    reader->position = console_log_written > CONSOLE_LOG_BYTES ? console_log_written - CONSOLE_LOG_BYTES : 0;
+    struct file* file = file_create(&console_log_operations, FILE_READABLE, reader);
+    if (!file) heap_free(reader);
+    return file;
+}
+
+/**
+ * @brief Set up the console file and start logging console output
+ */
+void pipes_initialize(void) {
+    console_file.operations = &console_operations;
+    console_file.flags = FILE_WRITABLE;
+    console_file.references = 1;        // Held by the kernel, never closed
+    
+    for (uint32_t i = CONSOLE_LOG_PAGES; i-- > 0;) {
+        console_log_pages[i] = page_frame_allocate();
+        if (!console_log_pages[i]) {
+            // Page 0 stays clear, which leaves logging off
+            while (++i < CONSOLE_LOG_PAGES) {
+                page_frame_free(console_log_pages[i]);
+            }
+            return;
+        }
+    }
+}
+
+// =============================================================================
+// Submission and Completion Rings
+// =============================================================================
+
+// Batched asynchronous system calls in the style of Linux io_uring. A ring
+// is a shared memory object holding a header, a submission queue (SQ)
+// filled by user space and a completion queue (CQ) filled by the kernel.
+// One SYSCALL_IO_RING_ENTER consumes every queued submission and can wait
+// for completions in the same call. With IO_RING_SETUP_SQ_POLL a kernel
+// thread consumes the SQ instead, so a busy program needs no system calls
+// at all; after sq_thread_idle ms without work the thread sets
+// IO_RING_SQ_NEED_WAKEUP and sleeps until IO_RING_ENTER_SQ_WAKEUP.
+//
+// Operations never block the ring. One that would block is parked, as
+// are timeouts. Parked operations are retried by the poll thread, or else
+// on every SYSCALL_IO_RING_ENTER and on each tick while one waits for
+// completions (timeouts fire at their deadline). Nothing retries them
+// while the owner waits elsewhere, e.g. in an event poll set watching the
+// ring, so such a wait should be bounded or followed by an enter.
+#define IO_RING_MAX_ENTRIES        256
+#define IO_RING_MAX_PENDING        32
+#define IO_RING_DEFAULT_IDLE       10      // Milliseconds before the poll thread sleeps
+
+// Setup flags (io_ring_params.flags)
+#define IO_RING_SETUP_SQ_POLL      0x01
+
+// Header sq_flags
+#define IO_RING_SQ_NEED_WAKEUP     0x01
+
+// SYSCALL_IO_RING_ENTER flags
+#define IO_RING_ENTER_GETEVENTS    0x01
+#define IO_RING_ENTER_SQ_WAKEUP    0x02
+
+// Submission opcodes
+#define IO_OP_NOP                  0
+#define IO_OP_READ                 1       // fd, address, length
+#define IO_OP_WRITE                2       // fd, address, length
+#define IO_OP_TIMEOUT              3       // length milliseconds
+
+struct io_submission {
+    uint8_t opcode;                 // IO_OP_*
+    uint8_t flags;
+    uint16_t reserved;
+    int32_t fd;
+    uint32_t address;               // User buffer
+    uint32_t length;
+    uint32_t offset;                // Position for seekable files
+    uint32_t user_data;             // Copied to the completion
+    uint32_t reserved2[2];
+};
+
+struct io_completion {
+    uint32_t user_data;
+    int32_t result;                 // Operation result or negative error
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct io_ring_header {
+    // Submission queue: tail advanced by user space, head by the kernel
+    volatile uint32_t sq_head;
+    volatile uint32_t sq_tail;
+    volatile uint32_t sq_flags;     // IO_RING_SQ_*
+    uint8_t sq_padding[RING_CACHE_LINE_SIZE - 3 * sizeof(uint32_t)];
+    
+    // Completion queue: tail advanced by the kernel, head by user space
+    volatile uint32_t cq_head;
+    volatile uint32_t cq_tail;
+    volatile uint32_t cq_overflow;  // Completions dropped because the CQ was full
+    uint8_t cq_padding[RING_CACHE_LINE_SIZE - 3 * sizeof(uint32_t)];
+    
+    // Read-only after setup
+    uint32_t sq_entries;            // Power of two
+    uint32_t cq_entries;            // Twice sq_entries
+    uint32_t sq_offset;             // From the start of this header
+    uint32_t cq_offset;
+};
+
+// SYSCALL_IO_RING_SETUP argument, updated with the actual ring layout
+struct io_ring_params {
+    uint32_t sq_entries;            // In: requested, out: rounded to a power of two
+    uint32_t flags;                 // IO_RING_SETUP_*
+    uint32_t sq_thread_idle;        // Milliseconds, 0 for the default
+    uint32_t ring_address;          // Out: user address of the header
+    uint32_t ring_size;             // Out: bytes mapped
+};
+
+struct io_pending {
+    struct io_submission submission;
+    uint32_t deadline;              // IO_OP_TIMEOUT: tick to complete at
+};
+
+struct io_ring {
+    struct shared_memory* memory;
+    struct io_ring_header* header;  // Kernel view of the shared memory
+    struct io_submission* sq;
+    struct io_completion* cq;
+    struct process* owner;          // Descriptors and buffers belong to it
+    struct process* poll_thread;    // IO_RING_SETUP_SQ_POLL only
+    uint32_t idle_ticks;
+    int stopping;                   // Poll thread must free the ring and exit
+    struct io_pending pending[IO_RING_MAX_PENDING];
+    uint32_t pending_count;
+    struct wait_queue completion_wait;
+    struct wait_queue poll_wait;
+    struct timer completion_timer;
+    struct timer poll_timer;
+};
+
+/**
+ * @brief Post a completion
+ * 
+ * @param ring Ring to complete on
+ * @param user_data Value from the submission
+ * @param result Result of the operation
+ */
+static void io_ring_complete(struct io_ring* ring, uint32_t user_data, int32_t result) {
+    struct io_ring_header* header = ring->header;
+    uint32_t tail = header->cq_tail;
+    
+    if (tail - __atomic_load_n(&header->cq_head, __ATOMIC_ACQUIRE) == header->cq_entries) {
+        header->cq_overflow++;
+        return;
+    }
+    
+    struct io_completion* completion = &ring->cq[tail & (header->cq_entries - 1)];
+    completion->user_data = user_data;
+    completion->result = result;
+    completion->flags = 0;
+    __atomic_store_n(&header->cq_tail, tail + 1, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&ring->completion_wait);
+}
+
+/**
+ * @brief Try to carry out one submission
+ * 
+ * @param ring Ring the submission came from
+ * @param submission Submission (a private copy)
+ * @return 1 if it completed, 0 if it must wait and be retried
+ * 
+ * Must run in the owner's address space. File operations are issued with
+ * FILE_NONBLOCK; a blocking descriptor that would block is retried later
+ * instead of failing.
+ */
+static int io_ring_execute(struct io_ring* ring, const struct io_submission* submission) {
+    int32_t result;
+    
+    switch (submission->opcode) {
+    case IO_OP_NOP:
+        result = 0;
+        break;
+        
+    case IO_OP_READ:
+    case IO_OP_WRITE: {
+        int write = submission->opcode == IO_OP_WRITE;
+        struct file* file = file_descriptor_lookup(ring->owner, (uint32_t)submission->fd,
+                                                   write ? FILE_WRITABLE : FILE_READABLE);
+        
+        if (!file || (write && !file->operations->write) || (!write && !file->operations->read)) {
+            result = ERROR_INVALID_ARGUMENT;
+        } else if (!user_buffer_valid(submission->address, submission->length, !write)) {
+            result = ERROR_BAD_ADDRESS;
+        } else if (write) {
+            result = file->operations->write(file, (const uint8_t*)submission->address,
+                                             submission->length, file->flags | FILE_NONBLOCK);
+        } else {
+            result = file->operations->read(file, (uint8_t*)submission->address,
+                                            submission->length, file->flags | FILE_NONBLOCK);
+        }
+        if (result == ERROR_WOULD_BLOCK && !(file->flags & FILE_NONBLOCK)) return 0;
+        break;
+    }
+        
+    case IO_OP_TIMEOUT:
+        return 0;                       // Completed by io_ring_retry()
+        
+    default:
+        result = ERROR_INVALID_ARGUMENT;
+        break;
+    }
+    
+    io_ring_complete(ring, submission->user_data, result);
+    return 1;
+}
+
+static void io_ring_park(struct io_ring* ring, const struct io_submission* submission) {
+    if (ring->pending_count == IO_RING_MAX_PENDING) {
+        io_ring_complete(ring, submission->user_data, ERROR_BUSY);
+        return;
+    }
+    
+    struct io_pending* pending = &ring->pending[ring->pending_count++];
+    pending->submission = *submission;
+    pending->deadline = timer_ticks + submission->length * (TIMER_FREQUENCY / 1000);
+}
+
+/**
+ * @brief Consume queued submissions
+ * 
+ * @param ring Ring to consume from
+ * @param limit Maximum number of submissions
+ * @return Number consumed
+ */
+static uint32_t io_ring_submit(struct io_ring* ring, uint32_t limit) {
+    struct io_ring_header* header = ring->header;
+    uint32_t head = header->sq_head;
+    uint32_t tail = __atomic_load_n(&header->sq_tail, __ATOMIC_ACQUIRE);
+    uint32_t submitted = 0;
+    
+    while (head != tail && submitted < limit) {
+        // Copy first: user space may reuse the slot once head moves past it
+        struct io_submission submission = ring->sq[head & (header->sq_entries - 1)];
+        
+        head++;
+        submitted++;
+        if (!io_ring_execute(ring, &submission)) {
+            io_ring_park(ring, &submission);
+        }
+    }
+    __atomic_store_n(&header->sq_head, head, __ATOMIC_RELEASE);
+    return submitted;
+}
+
+/**
+ * @brief Retry parked operations and fire due timeouts
+ * 
+ * @param ring Ring to service
+ * @return Number of operations completed
+ */
+static uint32_t io_ring_retry(struct io_ring* ring) {
+    uint32_t completed = 0;
+    
+    for (uint32_t i = 0; i < ring->pending_count; ) {
+        struct io_pending* pending = &ring->pending[i];
+        int done;
+        
+        if (pending->submission.opcode == IO_OP_TIMEOUT) {
+            done = (int32_t)(pending->deadline - timer_ticks) <= 0;
+            if (done) io_ring_complete(ring, pending->submission.user_data, 0);
+        } else {
+            done = io_ring_execute(ring, &pending->submission);
+        }
+        
+        if (done) {
+            *pending = ring->pending[--ring->pending_count];
+            completed++;
+        } else {
+            i++;
+        }
+    }
+    return completed;
+}
+
+/**
+ * @brief Arm a timer for the next retry of parked operations
+ * 
+ * @param ring Ring with pending operations
+ * @param timer Timer to arm
+ * @param queue Queue the timer should wake
+ */
+static void io_ring_arm_retry(struct io_ring* ring, struct timer* timer, struct wait_queue* queue) {
+    uint32_t deadline = 0;
+    
+    for (uint32_t i = 0; i < ring->pending_count; ++i) {
+        // Timeouts are due at their deadline, anything else on the next tick
+        uint32_t due = ring->pending[i].submission.opcode == IO_OP_TIMEOUT ?
+                       ring->pending[i].deadline : timer_ticks + 1;
+        
+        if (i == 0 || (int32_t)(due - deadline) < 0) {
+            deadline = due;
+        }
+    }
+    timer_arm(timer, deadline, queue);
+}
+
+static void io_ring_free(struct io_ring* ring) {
+    timer_cancel(&ring->completion_timer);
+    timer_cancel(&ring->poll_timer);
+    shared_memory_put(ring->memory);
+    heap_free(ring);
+}
+
+/**
+ * @brief Body of the submission polling thread
+ * 
+ * @param argument The ring
+ * 
+ * Runs in the owner's address space and follows it across exec.
+ */
+static void io_ring_poll_thread(void* argument) {
+    struct io_ring* ring = (struct io_ring*)argument;
+    struct process* thread = current_process;
+    uint32_t last_work = timer_ticks;
+    
+    while (!ring->stopping) {
+        if (thread->page_directory != ring->owner->page_directory) {
+            thread->page_directory = ring->owner->page_directory;
+            write_cr3((uint32_t)thread->page_directory);
+        }
+        
+        if (io_ring_submit(ring, 0xFFFFFFFF) + io_ring_retry(ring) != 0) {
+            last_work = timer_ticks;
+        } else if (timer_ticks - last_work >= ring->idle_ticks) {
+            __atomic_or_fetch(&ring->header->sq_flags, IO_RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+            // Re-check after publishing the flag so a racing submission is not missed
+            if (ring->header->sq_tail == ring->header->sq_head && !ring->stopping) {
+                if (ring->pending_count) {
+                    io_ring_arm_retry(ring, &ring->poll_timer, &ring->poll_wait);
+                }
+                wait_queue_sleep(&ring->poll_wait);
+                timer_cancel(&ring->poll_timer);
+            }
+            __atomic_and_fetch(&ring->header->sq_flags, ~(uint32_t)IO_RING_SQ_NEED_WAKEUP, __ATOMIC_SEQ_CST);
+            last_work = timer_ticks;
+            continue;
+        }
+        scheduler_yield();
+    }
+    io_ring_free(ring);
+}
+
+/**
+ * @brief Create a submission/completion ring
+ * 
+ * @param owner Process whose descriptors and memory operations refer to
+ * @param entries Requested submission queue size (rounded up to a power
+ *                of two, at most IO_RING_MAX_ENTRIES)
+ * @param flags IO_RING_SETUP_*
+ * @param idle_milliseconds Poll thread idle time, 0 for the default
+ * @return The ring, or NULL on failure
+ */
+struct io_ring* io_ring_create(struct process* owner, uint32_t entries, uint32_t flags,
+                               uint32_t idle_milliseconds) {
+    uint32_t sq_entries = 1;
+    
+    if (entries == 0 || entries > IO_RING_MAX_ENTRIES) return NULL;
+    while (sq_entries < entries) sq_entries <<= 1;
+    
+    struct io_ring* ring = (struct io_ring*)heap_allocate(sizeof(struct io_ring));
+    if (!ring) return NULL;
+    
+    uint32_t sq_offset = (sizeof(struct io_ring_header) + RING_CACHE_LINE_SIZE - 1) &
+                         ~(uint32_t)(RING_CACHE_LINE_SIZE - 1);
+    uint32_t cq_offset = sq_offset + sq_entries * sizeof(struct io_submission);
+    uint32_t size = cq_offset + 2 * sq_entries * sizeof(struct io_completion);
+    
+    ring->memory = shared_memory_create(PAGE_ALIGN_UP(size) / PAGE_SIZE);
+    if (!ring->memory) {
+        heap_free(ring);
+        return NULL;
+    }
+    
+    ring->header = (struct io_ring_header*)ring->memory->base;
+    ring->header->sq_entries = sq_entries;
+    ring->header->cq_entries = 2 * sq_entries;
+    ring->header->sq_offset = sq_offset;
+    ring->header->cq_offset = cq_offset;
+    ring->sq = (struct io_submission*)(ring->memory->base + sq_offset);
+    ring->cq = (struct io_completion*)(ring->memory->base + cq_offset);
+    ring->owner = owner;
+    ring->idle_ticks = (idle_milliseconds ? idle_milliseconds : IO_RING_DEFAULT_IDLE) *
+                       (TIMER_FREQUENCY / 1000);
+    
+    if (flags & IO_RING_SETUP_SQ_POLL) {
+        ring->poll_thread = kernel_thread_create(io_ring_poll_thread, ring);
+        if (!ring->poll_thread) {
+            io_ring_free(ring);
+            return NULL;
+        }
+        ring->poll_thread->memory_owner = owner;
+        ring->poll_thread->page_directory = owner->page_directory;
+    }
+    return ring;
+}
+
+/**
+ * @brief Submit queued operations and optionally wait for completions
+ * 
+ * @param ring Ring to enter
+ * @param to_submit Maximum number of submissions to consume
+ * @param min_complete With IO_RING_ENTER_GETEVENTS, completions that must
+ *                     be available in the CQ before returning
+ * @param flags IO_RING_ENTER_*
+ * @return Number of submissions consumed
+ * 
+ * Without a poll thread, parked operations are retried first. With one
+ * nothing is consumed here; IO_RING_ENTER_SQ_WAKEUP restarts the thread
+ * after it went idle.
+ */
+int32_t io_ring_enter(struct io_ring* ring, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    struct io_ring_header* header = ring->header;
+    uint32_t submitted = 0;
+    
+    if (ring->poll_thread) {
+        if (flags & IO_RING_ENTER_SQ_WAKEUP) {
+            wait_queue_wake_all(&ring->poll_wait);
+        }
+    } else {
+        io_ring_retry(ring);
+        submitted = io_ring_submit(ring, to_submit);
+    }
+    
+    if (!(flags & IO_RING_ENTER_GETEVENTS)) return (int32_t)submitted;
+    if (min_complete > header->cq_entries) min_complete = header->cq_entries;
+    
+    while (header->cq_tail - header->cq_head < min_complete) {
+        if (!ring->poll_thread) {
+            if (io_ring_retry(ring)) continue;
+            // Nothing in flight could ever complete
+            if (ring->pending_count == 0) break;
+            io_ring_arm_retry(ring, &ring->completion_timer, &ring->completion_wait);
+        }
+        wait_queue_sleep(&ring->completion_wait);
+    }
+    timer_cancel(&ring->completion_timer);
+    return (int32_t)submitted;
+}
+
+/**
+ * @brief Tear down a ring, stopping its poll thread
+ * 
+ * @param ring Ring to destroy
+ */
+void io_ring_destroy(struct io_ring* ring) {
+    if (ring->poll_thread) {
+        // The owner's address space may be going away; the thread frees
+        // the ring the next time it runs
+        ring->stopping = 1;
+        ring->poll_thread->page_directory = kernel_page_directory;
+        ring->poll_thread->memory_owner = NULL;
+        wait_queue_wake_all(&ring->poll_wait);
+    } else {
+        io_ring_free(ring);
+    }
+}
+
+static uint32_t io_ring_poll(struct file* file, struct poll_table* table) {
+    struct io_ring* ring = (struct io_ring*)file->private_data;
+    
+    poll_wait(table, &ring->completion_wait);
+    return ring->header->cq_tail != ring->header->cq_head ? POLL_IN : 0;
+}
+
+static void io_ring_close(struct file* file) {
+    io_ring_destroy((struct io_ring*)file->private_data);
+}
+
+static const struct file_operations io_ring_operations = {
+    .poll = io_ring_poll,
+    .close = io_ring_close,
+};
+
+// =============================================================================
+// Event Polling
+// =============================================================================
+
+// Readiness notification modelled on Linux epoll. An event poll set keeps
+// an interest set of descriptors, hashed by descriptor number, and a ready
+// list. Registering a file attaches a wait callback to each queue its poll
+// operation names; a wakeup on any of them appends the item to the ready
+// list in O(1). Waiting only looks at the ready list, so its cost grows
+// with the number of ready descriptors, not the number watched.
+//
+// Level-triggered items go back on the ready list after being reported
+// and are dropped on the next wait once no longer ready. Edge-triggered
+// items are reported once per wakeup; one-shot items are disabled after
+// one report until re-armed with EVENT_CONTROL_MODIFY.
+//
+// Sets may watch other sets. A wakeup is passed up to the sets watching
+// only when an item newly becomes ready, and adds that would close a loop
+// or nest sets more than EVENT_POLL_MAX_NESTS deep are refused, so a
+// wakeup's recursion through the chain is bounded.
+// Source: Linux fs/eventpoll.c (ep_loop_check, EP_MAX_NESTS)
+#define EVENT_POLL_HASH_SIZE       64
+#define EVENT_POLL_MAX_NESTS       4       // Longest chain of sets watching sets
+#define EVENT_ITEM_MAX_QUEUES      2       // Wait queues a file may name
+#define EVENT_WAIT_MAX             256     // Most events returned per wait
+#define EVENT_WAIT_FOREVER         0xFFFFFFFF
+
+// Interest flags beyond the POLL_* bits (Linux values)
+#define EVENT_ONE_SHOT             0x40000000
+#define EVENT_EDGE_TRIGGERED       0x80000000
+
+// SYSCALL_EVENT_CONTROL operations
+#define EVENT_CONTROL_ADD          1
+#define EVENT_CONTROL_DELETE       2
+#define EVENT_CONTROL_MODIFY       3
+
+// Exchanged with user space by EVENT_CONTROL and EVENT_WAIT
+struct event_record {
+    uint32_t events;                // Interest (control) or POLL_* bits (wait)
+    uint32_t data;                  // Returned unchanged with each event
+};
+
+struct event_item {
+    struct event_poll* poll;
+    struct file* file;              // Holds a reference while registered
+    uint32_t fd;
+    uint32_t events;                // POLL_* interest and EVENT_* flags
+    uint32_t data;
+    int ready;                      // On the ready list
+    struct event_item* ready_next;
+    struct event_item* hash_next;
+    struct poll_table table;        // Registers callbacks during ADD
+    struct wait_callback callbacks[EVENT_ITEM_MAX_QUEUES];
+    uint32_t callback_count;
+    int table_full;                 // The file named more queues than fit
+};
+
+struct event_poll {
+    struct event_item* interest[EVENT_POLL_HASH_SIZE];
+    struct event_item* ready_head;
+    struct event_item* ready_tail;
+    uint32_t item_count;
+    struct wait_queue waiters;      // Processes in event_poll_wait()
+    struct timer timer;
+};
+
+// Returns 1 if the item was not already listed
+static int event_poll_queue_ready(struct event_poll* poll, struct event_item* item) {
+    if (item->ready) return 0;
+    
+    item->ready = 1;
+    item->ready_next = NULL;
+    if (poll->ready_tail) {
+        poll->ready_tail->ready_next = item;
+    } else {
+        poll->ready_head = item;
+    }
+    poll->ready_tail = item;
+    return 1;
+}
+
+// Wakeup on a watched queue: only queues the item, readiness is checked
+// by the waiter. An item already listed has woken the waiters (and any
+// sets watching this one) since it was last taken off the list.
+static void event_item_wakeup(struct wait_callback* callback) {
+    struct event_item* item = (struct event_item*)callback->context;
+    
+    if (!(item->events & ~(uint32_t)(EVENT_ONE_SHOT | EVENT_EDGE_TRIGGERED))) return;
+    
+    if (event_poll_queue_ready(item->poll, item)) wait_queue_wake_all(&item->poll->waiters);
+}
+
+// A file naming more queues than an item has callbacks fails its ADD
+static void event_item_add_queue(struct poll_table* table, struct wait_queue* queue) {
+    struct event_item* item = (struct event_item*)((uint8_t*)table - offsetof(struct event_item, table));
+    
+    if (item->callback_count == EVENT_ITEM_MAX_QUEUES) {
+        item->table_full = 1;
+        return;
+    }
+    
+    struct wait_callback* callback = &item->callbacks[item->callback_count++];
+    callback->function = event_item_wakeup;
+    callback->context = item;
+    wait_queue_add_callback(queue, callback);
+}
+
+static struct event_item** event_poll_link(struct event_poll* poll, uint32_t fd) {
+    struct event_item** link = &poll->interest[fd % EVENT_POLL_HASH_SIZE];
+    
+    while (*link && (*link)->fd != fd) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+static void event_poll_remove_ready(struct event_poll* poll, struct event_item* item) {
+    struct event_item* previous = NULL;
+    
+    if (!item->ready) return;
+    
+    for (struct event_item* entry = poll->ready_head; entry; entry = entry->ready_next) {
+        if (entry == item) {
+            if (previous) {
+                previous->ready_next = item->ready_next;
+            } else {
+                poll->ready_head = item->ready_next;
+            }
+            if (poll->ready_tail == item) poll->ready_tail = previous;
+            break;
+        }
+        previous = entry;
+    }
+    item->ready = 0;
+}
+
+static void event_poll_remove_item(struct event_poll* poll, struct event_item** link) {
+    struct event_item* item = *link;
+    
+    for (uint32_t i = 0; i < item->callback_count; ++i) {
+        wait_queue_remove_callback(&item->callbacks[i]);
+    }
+    event_poll_remove_ready(poll, item);
+    *link = item->hash_next;
+    poll->item_count--;
+    file_put(item->file);
+    heap_free(item);
+}
+
+static uint32_t event_poll_file_poll(struct file* file, struct poll_table* table);
+
+// Longest chain of sets below poll, or more than EVENT_POLL_MAX_NESTS if
+// target is among them (the add would close a loop) or they nest too deep
+static uint32_t event_poll_depth_below(struct event_poll* poll, const struct event_poll* target, uint32_t depth) {
+    uint32_t longest = 0;
+    
+    if (poll == target || depth > EVENT_POLL_MAX_NESTS) return EVENT_POLL_MAX_NESTS + 1;
+    
+    for (uint32_t i = 0; i < EVENT_POLL_HASH_SIZE; ++i) {
+        for (struct event_item* item = poll->interest[i]; item; item = item->hash_next) {
+            if (item->file->operations->poll != event_poll_file_poll) continue;
+            
+            uint32_t below = 1 + event_poll_depth_below(item->file->private_data, target, depth + 1);
+            if (below > EVENT_POLL_MAX_NESTS) return EVENT_POLL_MAX_NESTS + 1;
+            if (below > longest) longest = below;
+        }
+    }
+    return longest;
+}
+
+// Longest chain of sets above poll, found through the callbacks their
+// items attached to its waiters
+static uint32_t event_poll_depth_above(const struct event_poll* poll, uint32_t depth) {
+    uint32_t longest = 0;
+    
+    if (depth > EVENT_POLL_MAX_NESTS) return EVENT_POLL_MAX_NESTS + 1;
+    
+    for (struct wait_callback* callback = poll->waiters.callbacks; callback; callback = callback->next) {
+        if (callback->function != event_item_wakeup) continue;
+        
+        uint32_t above = 1 + event_poll_depth_above(((struct event_item*)callback->context)->poll, depth + 1);
+        if (above > longest) longest = above;
+    }
+    return longest;
+}
+
+/**
+ * @brief Create an empty event poll set
+ * 
+ * @return The set, or NULL if out of memory
+ */
+struct event_poll* event_poll_create(void) {
+    return (struct event_poll*)heap_allocate(sizeof(struct event_poll));
+}
+
+/**
+ * @brief Add, change or remove a watched file
+ * 
+ * @param poll Event poll set
+ * @param operation EVENT_CONTROL_*
+ * @param fd Descriptor number identifying the item
+ * @param file File behind fd (ADD only; gains a reference)
+ * @param record Interest and user data (ADD and MODIFY)
+ * @return 0 on success, ERROR_BUSY if adding a set would make a loop or
+ *         nest sets too deep, otherwise a negative error
+ */
+int32_t event_poll_control(struct event_poll* poll, uint32_t operation, uint32_t fd,
+                           struct file* file, const struct event_record* record) {
+    struct event_item** link = event_poll_link(poll, fd);
+    struct event_item* item = *link;
+    
+    switch (operation) {
+    case EVENT_CONTROL_ADD:
+        if (item) return ERROR_BUSY;
+        if (!file->operations->poll) return ERROR_INVALID_ARGUMENT;
+        if (file->operations->poll == event_poll_file_poll &&
+            event_poll_depth_above(poll, 0) + 1 + event_poll_depth_below(file->private_data, poll, 0) >
+            EVENT_POLL_MAX_NESTS) {
+            return ERROR_BUSY;
+        }
+        
+        item = (struct event_item*)heap_allocate(sizeof(struct event_item));
+        if (!item) return ERROR_NO_MEMORY;
+        
+        item->poll = poll;
+        item->file = file;
+        item->fd = fd;
+        item->events = record->events;
+        item->data = record->data;
+        item->table.add = event_item_add_queue;
+        file->references++;
+        *link = item;
+        poll->item_count++;
+        
+        uint32_t mask = file->operations->poll(file, &item->table);
+        if (item->table_full) {
+            event_poll_remove_item(poll, link);
+            return ERROR_INVALID_ARGUMENT;
+        }
+        if ((mask & item->events) && event_poll_queue_ready(poll, item)) wait_queue_wake_all(&poll->waiters);
+        return 0;
+        
+    case EVENT_CONTROL_MODIFY:
+        if (!item) return ERROR_NOT_FOUND;
+        
+        item->events = record->events;
+        item->data = record->data;
+        if ((item->file->operations->poll(item->file, NULL) & item->events) && event_poll_queue_ready(poll, item)) {
+            wait_queue_wake_all(&poll->waiters);
+        }
+        return 0;
+        
+    case EVENT_CONTROL_DELETE:
+        if (!item) return ERROR_NOT_FOUND;
+        
+        event_poll_remove_item(poll, link);
+        return 0;
+        
+    default:
+        return ERROR_INVALID_ARGUMENT;
+    }
+}
+
+/**
+ * @brief Wait for watched files to become ready
+ * 
+ * @param poll Event poll set
+ * @param records Receives up to max events
+ * @param max Capacity of records
+ * @param timeout_milliseconds 0 to poll, EVENT_WAIT_FOREVER to block
+ * @return Number of events stored
+ * 
+ * Only items on the ready list are examined. Each is polled once more to
+ * confirm it is still ready, since a wakeup does not guarantee it.
+ */
+int32_t event_poll_wait(struct event_poll* poll, struct event_record* records, uint32_t max,
+                        uint32_t timeout_milliseconds) {
+    uint32_t deadline = timer_ticks + timeout_milliseconds * (TIMER_FREQUENCY / 1000);
+    uint32_t count = 0;
+    
+    for (;;) {
+        struct event_item* item = poll->ready_head;
+        struct event_item* requeue_head = NULL;
+        struct event_item* requeue_tail = NULL;
+        
+        poll->ready_head = poll->ready_tail = NULL;
+        while (item && count < max) {
+            struct event_item* next = item->ready_next;
+            uint32_t interest = item->events | POLL_ERROR | POLL_HANG_UP;
+            uint32_t mask = item->file->operations->poll(item->file, NULL) & interest;
+            
+            item->ready = 0;
+            if (mask && (item->events & ~(uint32_t)(EVENT_ONE_SHOT | EVENT_EDGE_TRIGGERED))) {
+                records[count].events = mask;
+                records[count].data = item->data;
+                count++;
+                
+                if (item->events & EVENT_ONE_SHOT) {
+                    item->events &= EVENT_ONE_SHOT | EVENT_EDGE_TRIGGERED;
+                } else if (!(item->events & EVENT_EDGE_TRIGGERED) && !item->ready) {
+                    // Level-triggered: stays listed until a wait finds it idle
+                    item->ready = 1;
+                    item->ready_next = NULL;
+                    if (requeue_tail) {
+                        requeue_tail->ready_next = item;
+                    } else {
+                        requeue_head = item;
+                    }
+                    requeue_tail = item;
+                }
+            }
+            item = next;
+        }
+        
+        // Unexamined items keep their place ahead of the requeued ones and
+        // of anything woken meanwhile
+        if (item) {
+            struct event_item* tail = item;
+            while (tail->ready_next) tail = tail->ready_next;
+            tail->ready_next = poll->ready_head;
+            if (!poll->ready_head) poll->ready_tail = tail;
+            poll->ready_head = item;
+        }
+        if (requeue_head) {
+            if (poll->ready_tail) {
+                poll->ready_tail->ready_next = requeue_head;
+            } else {
+                poll->ready_head = requeue_head;
+            }
+            poll->ready_tail = requeue_tail;
+        }
+        
+        if (count || timeout_milliseconds == 0) break;
+        if (timeout_milliseconds != EVENT_WAIT_FOREVER) {
+            if ((int32_t)(deadline - timer_ticks) <= 0) break;
+            timer_arm(&poll->timer, deadline, &poll->waiters);
+        }
+        wait_queue_sleep(&poll->waiters);
+    }
+    timer_cancel(&poll->timer);
+    return (int32_t)count;
+}
+
+/**
+ * @brief Remove every item and free the set
+ * 
+ * @param poll Event poll set
+ */
+void event_poll_destroy(struct event_poll* poll) {
+    for (uint32_t i = 0; i < EVENT_POLL_HASH_SIZE; ++i) {
+        while (poll->interest[i]) {
+            event_poll_control(poll, EVENT_CONTROL_DELETE, poll->interest[i]->fd, NULL, NULL);
+        }
+    }
+    timer_cancel(&poll->timer);
+    wait_queue_wake_all(&poll->waiters);
+    heap_free(poll);
+}
+
+// An event poll set is itself pollable, so sets can be nested
+static uint32_t event_poll_file_poll(struct file* file, struct poll_table* table) {
+    struct event_poll* poll = (struct event_poll*)file->private_data;
+    
+    poll_wait(table, &poll->waiters);
+    return poll->ready_head ? POLL_IN : 0;
+}
+
+static void event_poll_file_close(struct file* file) {
+    event_poll_destroy((struct event_poll*)file->private_data);
+}
+
+static const struct file_operations event_poll_operations = {
+    .poll = event_poll_file_poll,
+    .close = event_poll_file_close,
+};
+
+// =============================================================================
+// Futexes
+// =============================================================================
+
+// Fast user-space mutexes: locks live in ordinary memory and are taken
+// with atomic instructions; the kernel is only entered to sleep on a
+// contended word or to wake its sleepers. Waiters are keyed by the word's
+// physical address, so processes mapping the same shared page under
+// different virtual addresses meet in the same place, and kernel code can
+// use the identity-mapped address directly. Waiters hang off a hash table
+// of buckets; requeue moves them between words without waking them, so a
+// condition-variable broadcast wakes one waiter instead of a herd.
+// Source: Drepper, "Futexes Are Tricky" (2011) and Linux kernel/futex
+#define FUTEX_HASH_BUCKETS         64      // Power of two
+#define FUTEX_WAIT_FOREVER         0xFFFFFFFF
+
+struct futex_waiter {
+    uint32_t key;                   // Physical address of the word
+    struct wait_queue queue;        // Only this waiter sleeps here
+    int woken;
+    struct futex_waiter* next;
+};
+
+static struct futex_waiter* futex_buckets[FUTEX_HASH_BUCKETS];
+
+static struct futex_waiter** futex_bucket(uint32_t key) {
+    // Fibonacci hashing of the word index
+    return &futex_buckets[((key >> 2) * 2654435769u) >> 26];
+}
+
+static void futex_unlink(struct futex_waiter* waiter) {
+    for (struct futex_waiter** link = futex_bucket(waiter->key); *link; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Translate a user futex address to its key
+ * 
+ * @param address 4-byte aligned user address
+ * @param key Receives the physical address of the word
+ * @return 0 on success, otherwise a negative error
+ * 
+ * The page is faulted in first. A copy-on-write page in a writable area is
+ * made private, since the next write would move the word to another frame.
+ */
+int32_t futex_key(uint32_t address, uint32_t* key) {
+    struct process* owner = current_process->memory_owner ? current_process->memory_owner : current_process;
+    
+    if ((address & 3) != 0 || !user_buffer_valid(address, sizeof(uint32_t), 0)) {
+        return ERROR_BAD_ADDRESS;
+    }
+    
+    int writable = (vm_area_find(owner, address)->flags & VM_WRITE) != 0;
+    for (;;) {
+        uint32_t* entry = paging_get_entry(owner->page_directory, address, 0);
+        uint32_t error_code;
+        
+        if (!entry || !(*entry & PAGE_PRESENT)) {
+            error_code = writable ? PAGE_FAULT_WRITE : 0;
+        } else if ((*entry & PAGE_COPY_ON_WRITE) && writable) {
+            error_code = PAGE_FAULT_PRESENT | PAGE_FAULT_WRITE;
+        } else {
+            *key = (*entry & ~(uint32_t)PAGE_FLAGS_MASK) | (address & (PAGE_SIZE - 1));
+            return 0;
+        }
+        
+        int32_t result = vm_area_fault(owner, address, error_code);
+        if (result != 0) return result;
+    }
+}
+
+/**
+ * @brief Sleep until woken, if the word still holds an expected value
+ * 
+ * @param key Physical address of the word
+ * @param expected Value the caller saw before deciding to sleep
+ * @param timeout_milliseconds FUTEX_WAIT_FOREVER for no timeout
+ * @return 0 when woken, ERROR_WOULD_BLOCK if the word had changed,
+ *         ERROR_TIMED_OUT on timeout
+ * 
+ * Checking the value and queueing happen without anything else running
+ * in between, so a wake that follows the caller's change cannot be lost.
+ */
+int32_t futex_wait_key(uint32_t key, uint32_t expected, uint32_t timeout_milliseconds) {
+    struct futex_waiter waiter;
+    struct timer timer;
+    uint32_t deadline = timer_ticks + timeout_milliseconds * (TIMER_FREQUENCY / 1000);
+    
+    if (*(volatile uint32_t*)key != expected) return ERROR_WOULD_BLOCK;
+    
+    memset(&waiter, 0, sizeof(waiter));
+    memset(&timer, 0, sizeof(timer));
+    waiter.key = key;
+    waiter.next = *futex_bucket(key);
+    *futex_bucket(key) = &waiter;
+    
+    if (timeout_milliseconds != FUTEX_WAIT_FOREVER) {
+        timer_arm(&timer, deadline, &waiter.queue);
+    }
+    while (!waiter.woken) {
+        if (timeout_milliseconds != FUTEX_WAIT_FOREVER && (int32_t)(deadline - timer_ticks) <= 0) {
+            futex_unlink(&waiter);      // Requeue may have changed the key
+            timer_cancel(&timer);
+            return ERROR_TIMED_OUT;
+        }
+        wait_queue_sleep(&waiter.queue);
+    }
+    timer_cancel(&timer);
+    return 0;
+}
+
+/**
+ * @brief Wake sleepers on a word
+ * 
+ * @param key Physical address of the word
+ * @param count Maximum number of sleepers to wake
+ * @return Number woken
+ */
+int32_t futex_wake_key(uint32_t key, uint32_t count) {
+    struct futex_waiter** link = futex_bucket(key);
+    uint32_t woken = 0;
+    
+    while (*link && woken < count) {
+        struct futex_waiter* waiter = *link;
+        
+        if (waiter->key != key) {
+            link = &waiter->next;
+            continue;
+        }
+        *link = waiter->next;
+        waiter->woken = 1;
+        wait_queue_wake_all(&waiter->queue);
+        woken++;
+    }
+    return (int32_t)woken;
+}
+
+/**
+ * @brief Wake some sleepers on one word and move others to another word
+ * 
+ * @param key Word the sleepers wait on
+ * @param wake_count Sleepers to wake
+ * @param requeue_count Further sleepers to move to target without waking
+ * @param target Word to move them to (typically the mutex guarding a
+ *               condition variable)
+ * @param expected Value key must still hold
+ * @return Number woken plus number moved, or ERROR_WOULD_BLOCK if the
+ *         word had changed
+ */
+int32_t futex_requeue_key(uint32_t key, uint32_t wake_count, uint32_t requeue_count,
+                          uint32_t target, uint32_t expected) {
+    if (*(volatile uint32_t*)key != expected) return ERROR_WOULD_BLOCK;
+    
+    int32_t woken = futex_wake_key(key, wake_count);
+    struct futex_waiter** link = futex_bucket(key);
+    uint32_t moved = 0;
+    
+    while (*link && moved < requeue_count) {
+        struct futex_waiter* waiter = *link;
+        
+        if (waiter->key != key) {
+            link = &waiter->next;
+            continue;
+        }
+        *link = waiter->next;
+        waiter->key = target;
+        waiter->next = *futex_bucket(target);
+        *futex_bucket(target) = waiter;
+        moved++;
+    }
+    return woken + (int32_t)moved;
+}
+
+// Reference mutex built on the primitive: 0 unlocked, 1 locked, 2 locked
+// with possible sleepers. Uncontended lock and unlock are one atomic each.
+// Source: Drepper, "Futexes Are Tricky", mutex3
+
+/**
+ * @brief Acquire a futex mutex word in kernel memory
+ * 
+ * @param word Mutex word (its address is its key)
+ */
+void futex_mutex_lock(volatile uint32_t* word) {
+    uint32_t state = 0;
+    
+    if (__atomic_compare_exchange_n(word, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (state != 2) {
+        state = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+    }
+    while (state != 0) {
+        futex_wait_key((uint32_t)word, 2, FUTEX_WAIT_FOREVER);
+        state = __atomic_exchange_n(word, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+/**
+ * @brief Release a futex mutex word
+ * 
+ * @param word Mutex word
+ */
+void futex_mutex_unlock(volatile uint32_t* word) {
+    if (__atomic_fetch_sub(word, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(word, 0, __ATOMIC_RELEASE);
+        futex_wake_key((uint32_t)word, 1);
+    }
+}
+
+// =============================================================================
+// vDSO
+// =============================================================================
+
+// A read-only page mapped at VDSO_ADDRESS in every process. It starts
+// with struct vdso_data, which the timer interrupt keeps current, and
+// carries small position-dependent functions that user code can call
+// (cdecl) to read the clock without a system call:
+//   uint64_t clock(void)   nanoseconds since boot (seqlock + TSC)
+//   uint32_t uptime(void)  milliseconds since boot
+//   uint32_t cpu(void)     current CPU number
+// Their addresses are published in the page's header. Readers of the
+// clock retry while the sequence count is odd or changes under them.
+// Source: Linux arch/x86/entry/vdso and Documentation/locking/seqlock
+#define VDSO_CODE_OFFSET           0x100
+#define VDSO_STRINGIFY_(value)     #value
+#define VDSO_STRINGIFY(value)      VDSO_STRINGIFY_(value)
+#define VDSO_FIELD(offset)         VDSO_STRINGIFY(VDSO_ADDRESS) "+" #offset
+
+extern const uint8_t vdso_code_start[];
+extern const uint8_t vdso_code_end[];
+extern const uint8_t vdso_stub_clock[];
+extern const uint8_t vdso_stub_uptime[];
+extern const uint8_t vdso_stub_cpu[];
+
+// Field offsets below match struct vdso_data
+__asm__(
+    ".section .text\n"
+    ".globl vdso_code_start, vdso_code_end\n"
+    ".globl vdso_stub_clock, vdso_stub_uptime, vdso_stub_cpu\n"
+    "vdso_code_start:\n"
+    "vdso_stub_clock:\n"
+    "    push %ebx\n"
+    "    push %esi\n"
+    "    push %edi\n"
+    "    push %ebp\n"
+    "1:  mov " VDSO_FIELD(0) ", %ecx\n"       // sequence
+    "    test $1, %ecx\n"
+    "    jnz 1b\n"
+    "    mov " VDSO_FIELD(4) ", %esi\n"       // milliseconds
+    "    mov " VDSO_FIELD(8) ", %edi\n"       // tsc_low
+    "    mov " VDSO_FIELD(16) ", %ebp\n"      // multiplier
+    "    rdtsc\n"
+    "    cmp " VDSO_FIELD(0) ", %ecx\n"
+    "    jne 1b\n"
+    "    sub %edi, %eax\n"                    // Cycles since the last tick
+    "    mul %ebp\n"
+    "    shrd $" VDSO_STRINGIFY(VDSO_MULTIPLIER_SHIFT) ", %edx, %eax\n"
+    "    shr $" VDSO_STRINGIFY(VDSO_MULTIPLIER_SHIFT) ", %edx\n"
+    "    mov %eax, %ebx\n"
+    "    mov %edx, %edi\n"
+    "    mov %esi, %eax\n"
+    "    mov $1000000, %ecx\n"
+    "    mul %ecx\n"
+    "    add %ebx, %eax\n"
+    "    adc %edi, %edx\n"
+    "    pop %ebp\n"
+    "    pop %edi\n"
+    "    pop %esi\n"
+    "    pop %ebx\n"
+    "    ret\n"
+    "vdso_stub_uptime:\n"
+    "    mov " VDSO_FIELD(4) ", %eax\n"
+    "    ret\n"
+    "vdso_stub_cpu:\n"
+    "    mov " VDSO_FIELD(20) ", %eax\n"
+    "    ret\n"
+    "vdso_code_end:\n"
+);
+
+static struct shared_memory* vdso_memory;
+
+/**
+ * @brief Build the vDSO page and start publishing the clock in it
+ * 
+ * Must run after timer_initialize() has calibrated the TSC.
+ */
+void vdso_initialize(void) {
+    uint32_t code_size = (uint32_t)(vdso_code_end - vdso_code_start);
+    
+    if (VDSO_CODE_OFFSET + code_size > PAGE_SIZE) {
+        kernel_panic("vdso_initialize: stub does not fit in one page");
+    }
+    
+    vdso_memory = shared_memory_create(1);
+    if (!vdso_memory) return;
+    
+    struct vdso_data* data = (struct vdso_data*)vdso_memory->base;
+    memcpy((uint8_t*)vdso_memory->base + VDSO_CODE_OFFSET, vdso_code_start, code_size);
+    
+    data->multiplier = divide_u64((uint64_t)1000000 << VDSO_MULTIPLIER_SHIFT, tsc_cycles_per_millisecond);
+    data->cpu = cpu_current();          // Only the boot CPU runs
+    data->clock_entry = VDSO_ADDRESS + VDSO_CODE_OFFSET + (uint32_t)(vdso_stub_clock - vdso_code_start);
+    data->uptime_entry = VDSO_ADDRESS + VDSO_CODE_OFFSET + (uint32_t)(vdso_stub_uptime - vdso_code_start);
+    data->cpu_entry = VDSO_ADDRESS + VDSO_CODE_OFFSET + (uint32_t)(vdso_stub_cpu - vdso_code_start);
+    vdso_update(data);
+    vdso_data = data;
+}
+
+/**
+ * @brief Map the vDSO page into a new address space
+ * 
+ * @param process Process being loaded
+ * @return 0 on success, ERROR_NO_MEMORY otherwise
+ */
+int32_t vdso_map(struct process* process) {
+    if (!vdso_memory) return 0;
+    
+    struct vm_area* area = vm_area_create(process, VDSO_ADDRESS, VDSO_ADDRESS + PAGE_SIZE,
+                                          VM_READ | VM_EXEC | VM_SHARED);
+    if (!area) return ERROR_NO_MEMORY;
+    
+    area->shared = vdso_memory;
+    vdso_memory->references++;
+    return 0;
+}
+
+// =============================================================================
+// PCI Configuration Space
+// =============================================================================
+
+// Configuration mechanism #1: write a bus/device/function/register address
+// to CONFIG_ADDRESS, then access the dword through CONFIG_DATA. Devices are
+// enumerated once at boot into pci_devices for drivers to claim.
+// Source: PCI Local Bus Specification 3.0, Section 3.2.2.3.2 and
+//         OSDev Wiki "PCI"
+#define PCI_CONFIG_ADDRESS         0xCF8
+#define PCI_CONFIG_DATA            0xCFC
+#define PCI_CONFIG_ENABLE          0x80000000
+
+#define PCI_VENDOR_ID              0x00
+#define PCI_COMMAND                0x04
+#define PCI_CLASS_REVISION         0x08
+#define PCI_HEADER_TYPE            0x0E
+#define PCI_BAR0                   0x10
+#define PCI_INTERRUPT_LINE         0x3C
+#define PCI_COMMAND_IO             0x0001
+#define PCI_COMMAND_MEMORY         0x0002
+#define PCI_COMMAND_BUS_MASTER     0x0004
+#define PCI_HEADER_MULTI_FUNCTION  0x80
+#define PCI_STATUS_CAPABILITIES    0x00100000  // In the COMMAND dword's status half
+#define PCI_CAPABILITY_POINTER     0x34
+#define PCI_BAR_IO                 0x1
+#define PCI_BAR_TYPE_MASK          0x6
+#define PCI_BAR_TYPE_64            0x4
+#define PCI_VENDOR_NONE            0xFFFF
+
+#define MAX_PCI_DEVICES            32
+#define PCI_BUSES                  256
+#define PCI_SLOTS                  32
+#define PCI_FUNCTIONS              8
+
+struct pci_device {
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t function;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint32_t bars[6];
+};
+
+static struct pci_device pci_devices[MAX_PCI_DEVICES];
+static uint32_t pci_device_count;
+
+static uint32_t pci_config_address(const struct pci_device* device, uint8_t offset) {
+    return PCI_CONFIG_ENABLE | ((uint32_t)device->bus << 16) | ((uint32_t)device->slot << 11) |
+           ((uint32_t)device->function << 8) | (offset & 0xFC);
+}
+
+/**
+ * @brief Read a dword from a function's configuration space
+ * 
+ * @param device Function to address (bus, slot and function are used)
+ * @param offset Register offset (dword aligned)
+ * @return Register value
+ */
+uint32_t pci_config_read(const struct pci_device* device, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(device, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+/**
+ * @brief Write a dword to a function's configuration space
+ * 
+ * @param device Function to address
+ * @param offset Register offset (dword aligned)
+ * @param value Value to write
+ */
+void pci_config_write(const struct pci_device* device, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_config_address(device, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+/**
+ * @brief Turn on decoding and bus mastering for a function
+ * 
+ * @param device Function to enable
+ */
+void pci_enable_bus_master(const struct pci_device* device) {
+    uint32_t command = pci_config_read(device, PCI_COMMAND);
+    
+    command |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER;
+    pci_config_write(device, PCI_COMMAND, command);
+}
+
+/**
+ * @brief Walk a function's capability list
+ * 
+ * @param device Function to search
+ * @param id Capability ID (e.g. 0x09 vendor-specific, 0x11 MSI-X)
+ * @param after Offset of the capability to continue after, or 0 to start
+ * @return Configuration space offset of the capability, or 0 if none
+ */
+uint8_t pci_find_capability(const struct pci_device* device, uint8_t id, uint8_t after) {
+    if (!(pci_config_read(device, PCI_COMMAND) & PCI_STATUS_CAPABILITIES)) return 0;
+    
+    uint8_t offset = after ? (uint8_t)(pci_config_read(device, after) >> 8)
+                           : (uint8_t)pci_config_read(device, PCI_CAPABILITY_POINTER);
+    for (uint32_t hops = 0; offset && hops < 48; ++hops) {
+        uint32_t header = pci_config_read(device, offset);
+        if ((uint8_t)header == id) return offset;
+        offset = (uint8_t)(header >> 8);
+    }
+    return 0;
+}
+
+/**
+ * @brief Get the physical address a memory BAR decodes
+ * 
+ * @param device Function owning the BAR
+ * @param bar BAR index (the lower half of a 64-bit pair)
+ * @return Address, or 0 for I/O BARs and 64-bit BARs placed above 4GB
+ */
+uint32_t pci_bar_address(const struct pci_device* device, uint32_t bar) {
+    uint32_t value = device->bars[bar];
+    
+    if (value & PCI_BAR_IO) return 0;
+    if ((value & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64 && (bar == 5 || device->bars[bar + 1])) return 0;
+    return value & ~0xFu;
+}
+
+/**
+ * @brief Find the nth function of a given class
+ * 
+ * @param class_code Base class (e.g. 0x01 mass storage)
+ * @param subclass Subclass (e.g. 0x01 IDE)
+ * @param index Which match to return, counting from 0
+ * @return The function, or NULL if there are not that many
+ */
+struct pci_device* pci_find_class(uint8_t class_code, uint8_t subclass, uint32_t index) {
+    for (uint32_t i = 0; i < pci_device_count; ++i) {
+        if (pci_devices[i].class_code == class_code && pci_devices[i].subclass == subclass &&
+            index-- == 0) {
+            return &pci_devices[i];
+        }
+    }
+    return NULL;
+}
+
+static void pci_probe_function(uint8_t bus, uint8_t slot, uint8_t function) {
+    struct pci_device probe;
+    
+    memset(&probe, 0, sizeof(probe));
+    probe.bus = bus;
+    probe.slot = slot;
+    probe.function = function;
+    
+    uint32_t id = pci_config_read(&probe, PCI_VENDOR_ID);
+    if ((id & 0xFFFF) == PCI_VENDOR_NONE || pci_device_count == MAX_PCI_DEVICES) return;
+    
+    uint32_t class_revision = pci_config_read(&probe, PCI_CLASS_REVISION);
+    probe.vendor_id = (uint16_t)id;
+    probe.device_id = (uint16_t)(id >> 16);
+    probe.class_code = (uint8_t)(class_revision >> 24);
+    probe.subclass = (uint8_t)(class_revision >> 16);
+    probe.prog_if = (uint8_t)(class_revision >> 8);
+    probe.irq_line = (uint8_t)pci_config_read(&probe, PCI_INTERRUPT_LINE);
+    for (uint32_t bar = 0; bar < 6; ++bar) {
+        probe.bars[bar] = pci_config_read(&probe, (uint8_t)(PCI_BAR0 + bar * 4));
+    }
+    pci_devices[pci_device_count++] = probe;
+}
+
+/**
+ * @brief Enumerate every PCI function into pci_devices
+ * 
+ * Brute-force scan of all buses; the BIOS has already assigned BARs and
+ * interrupt lines.
+ */
+void pci_initialize(void) {
+    struct pci_device probe;
+    
+    memset(&probe, 0, sizeof(probe));
+    for (uint32_t bus = 0; bus < PCI_BUSES; ++bus) {
+        for (uint32_t slot = 0; slot < PCI_SLOTS; ++slot) {
+            probe.bus = (uint8_t)bus;
+            probe.slot = (uint8_t)slot;
+            probe.function = 0;
+            if ((pci_config_read(&probe, PCI_VENDOR_ID) & 0xFFFF) == PCI_VENDOR_NONE) continue;
+            
+            uint8_t header = (uint8_t)(pci_config_read(&probe, PCI_HEADER_TYPE & 0xFC) >> 16);
+            uint32_t functions = (header & PCI_HEADER_MULTI_FUNCTION) ? PCI_FUNCTIONS : 1;
+            for (uint32_t function = 0; function < functions; ++function) {
+                pci_probe_function((uint8_t)bus, (uint8_t)slot, (uint8_t)function);
+            }
+        }
+    }
+}
+
+// =============================================================================
+// ISA DMA Controller
+// =============================================================================
+
+// 8237A DMA controller, channels 0-3 (8-bit transfers). A transfer must sit
+// below 16MB and must not cross a 64KB boundary, because the page register
+// supplies address bits 16-23 and does not increment.
+// Source: Intel 8237A datasheet and OSDev Wiki "ISA DMA"
+#define ISA_DMA_MASK_PORT          0x0A
+#define ISA_DMA_MODE_PORT          0x0B
+#define ISA_DMA_FLIP_FLOP_PORT     0x0C
+#define ISA_DMA_MASK_ON            0x04
+#define ISA_DMA_MODE_SINGLE        0x40
+#define ISA_DMA_MODE_TO_MEMORY     0x04    // Device writes memory (a "write" transfer)
+#define ISA_DMA_MODE_FROM_MEMORY   0x08    // Device reads memory
+#define ISA_DMA_LIMIT              0x1000000
+
+// Address, count and page register ports, indexed by channel
+static const uint8_t isa_dma_address_ports[4] = {0x00, 0x02, 0x04, 0x06};
+static const uint8_t isa_dma_count_ports[4] = {0x01, 0x03, 0x05, 0x07};
+static const uint8_t isa_dma_page_ports[4] = {0x87, 0x83, 0x81, 0x82};
+
+/**
+ * @brief Program a single-cycle transfer on an 8-bit DMA channel
+ * 
+ * @param channel Channel 0-3
+ * @param address Physical buffer address (below 16MB, within one 64KB block)
+ * @param length Bytes to transfer (1-65536)
+ * @param to_memory 1 when the device writes the buffer, 0 when it reads it
+ * 
+ * The channel is left unmasked; the device starts the transfer by raising
+ * its DREQ line.
+ */
+static void isa_dma_start(uint8_t channel, uint32_t address, uint32_t length, int to_memory) {
+    uint8_t mode = ISA_DMA_MODE_SINGLE | channel |
+                   (to_memory ? ISA_DMA_MODE_TO_MEMORY : ISA_DMA_MODE_FROM_MEMORY);
+    uint32_t count = length - 1;
+    
+    outb(ISA_DMA_MASK_PORT, ISA_DMA_MASK_ON | channel);
+    outb(ISA_DMA_FLIP_FLOP_PORT, 0xFF);
+    outb(isa_dma_address_ports[channel], (uint8_t)address);
+    outb(isa_dma_address_ports[channel], (uint8_t)(address >> 8));
+    outb(isa_dma_page_ports[channel], (uint8_t)(address >> 16));
+    outb(ISA_DMA_FLIP_FLOP_PORT, 0xFF);
+    outb(isa_dma_count_ports[channel], (uint8_t)count);
+    outb(isa_dma_count_ports[channel], (uint8_t)(count >> 8));
+    outb(ISA_DMA_MODE_PORT, mode);
+    outb(ISA_DMA_MASK_PORT, channel);
+}
+
+// =============================================================================
+// Floppy Disk Controller
+// =============================================================================
+
+// Driver for the 82077AA floppy controller and a 1.44MB drive 0. Data moves
+// by ISA DMA on channel 2 and every command completes with IRQ6. Reads
+// fetch a whole cylinder (both heads, 36 sectors) with one multi-track READ
+// DATA into a DMA buffer that doubles as a one-cylinder cache, so reading a
+// file sector by sector costs one command per 18KB instead of one per
+// sector. The motor stays on for FLOPPY_MOTOR_IDLE ms after the last use.
+// Source: Intel 82077AA datasheet and OSDev Wiki "Floppy Disk Controller"
+#define FLOPPY_DOR_PORT            0x3F2   // Digital output register
+#define FLOPPY_MSR_PORT            0x3F4   // Main status register
+#define FLOPPY_FIFO_PORT           0x3F5
+#define FLOPPY_CCR_PORT            0x3F7   // Configuration control (write)
+#define FLOPPY_IRQ                 6
+#define FLOPPY_DMA_CHANNEL         2
+
+#define FLOPPY_DOR_NOT_RESET       0x04
+#define FLOPPY_DOR_DMA_ENABLE      0x08
+#define FLOPPY_DOR_MOTOR_A         0x10
+#define FLOPPY_MSR_READY           0x80    // RQM: FIFO ready for a transfer
+#define FLOPPY_MSR_TO_CPU          0x40    // DIO: controller has a byte for us
+
+#define FLOPPY_CMD_SPECIFY         0x03
+#define FLOPPY_CMD_RECALIBRATE     0x07
+#define FLOPPY_CMD_SENSE_INTERRUPT 0x08
+#define FLOPPY_CMD_SEEK            0x0F
+#define FLOPPY_CMD_CONFIGURE       0x13
+#define FLOPPY_CMD_READ_DATA       0xE6    // Multi-track, MFM, skip deleted data
+#define FLOPPY_CONFIGURE_FLAGS     0x57    // Implied seek off, FIFO on, polling off, threshold 8
+#define FLOPPY_SPECIFY_STEP_UNLOAD 0xDF    // 3ms step rate, 240ms head unload
+#define FLOPPY_SPECIFY_LOAD_DMA    0x02    // 4ms head load, DMA mode
+#define FLOPPY_RATE_500K           0x00    // 1.44MB media
+
+#define FLOPPY_ST0_ERROR_MASK      0xC0
+#define FLOPPY_CMOS_DRIVE_TYPES    0x10    // High nibble: drive 0
+#define FLOPPY_CMOS_TYPE_1440K     4
+
+// 1.44MB geometry
+#define FLOPPY_SECTOR_SIZE         512
+#define FLOPPY_SECTORS_PER_TRACK   18
+#define FLOPPY_HEADS               2
+#define FLOPPY_CYLINDERS           80
+#define FLOPPY_SECTORS_PER_CYLINDER (FLOPPY_SECTORS_PER_TRACK * FLOPPY_HEADS)
+#define FLOPPY_SECTOR_COUNT        (FLOPPY_SECTORS_PER_CYLINDER * FLOPPY_CYLINDERS)
+#define FLOPPY_CYLINDER_BYTES      (FLOPPY_SECTORS_PER_CYLINDER * FLOPPY_SECTOR_SIZE)
+#define FLOPPY_GAP3_LENGTH         0x1B
+#define FLOPPY_SIZE_CODE_512       2
+
+#define FLOPPY_IRQ_TIMEOUT         500     // ms a command may take to interrupt
+#define FLOPPY_MOTOR_SPIN_UP       300     // ms
+#define FLOPPY_MOTOR_IDLE          2000    // ms before the motor is switched off
+#define FLOPPY_FIFO_SPIN_LIMIT     100000
+#define FLOPPY_RETRIES             3
+#define FLOPPY_NO_CYLINDER         0xFFFFFFFF
+
+static int floppy_present;
+static int floppy_motor_on;
+static int floppy_busy;                 // A request owns the controller
+static volatile int floppy_interrupted;
+static uint32_t floppy_cached_cylinder = FLOPPY_NO_CYLINDER;
+static uint8_t* floppy_track_buffer;    // One cylinder, DMA-reachable
+static struct wait_queue floppy_irq_queue;
+static struct wait_queue floppy_idle_queue;     // Waiters for floppy_busy
+static struct wait_queue floppy_motor_queue;    // Woken by the idle timer
+static struct wait_callback floppy_motor_callback;
+static struct timer floppy_motor_timer;
+
+static void floppy_interrupt(struct trap_frame* frame, void* context) {
+    (void)frame; (void)context;
+    
+    floppy_interrupted = 1;
+    wait_queue_wake_all(&floppy_irq_queue);
+}
+
+/**
+ * @brief Wait for the interrupt that ends the current command
+ * 
+ * @return 0 on success, ERROR_TIMED_OUT if IRQ6 did not arrive
+ * 
+ * floppy_interrupted must be cleared before the command is issued; the
+ * kernel runs with interrupts off, so the IRQ cannot be lost in between.
+ */
+static int32_t floppy_wait_interrupt(void) {
+    struct timer timer;
+    uint32_t deadline = timer_ticks + FLOPPY_IRQ_TIMEOUT * (TIMER_FREQUENCY / 1000);
+    
+    memset(&timer, 0, sizeof(timer));
+    timer_arm(&timer, deadline, &floppy_irq_queue);
+    while (!floppy_interrupted && (int32_t)(deadline - timer_ticks) > 0) {
+        wait_queue_sleep(&floppy_irq_queue);
+    }
+    timer_cancel(&timer);
+    
+    if (!floppy_interrupted) return ERROR_TIMED_OUT;
+    floppy_interrupted = 0;
+    return 0;
+}
+
+static int32_t floppy_write_byte(uint8_t value) {
+    for (uint32_t spin = 0; spin < FLOPPY_FIFO_SPIN_LIMIT; ++spin) {
+        if ((inb(FLOPPY_MSR_PORT) & (FLOPPY_MSR_READY | FLOPPY_MSR_TO_CPU)) == FLOPPY_MSR_READY) {
+            outb(FLOPPY_FIFO_PORT, value);
+            return 0;
+        }
+    }
+    return ERROR_TIMED_OUT;
+}
+
+static int32_t floppy_read_byte(uint8_t* value) {
+    for (uint32_t spin = 0; spin < FLOPPY_FIFO_SPIN_LIMIT; ++spin) {
+        if ((inb(FLOPPY_MSR_PORT) & (FLOPPY_MSR_READY | FLOPPY_MSR_TO_CPU)) ==
+            (FLOPPY_MSR_READY | FLOPPY_MSR_TO_CPU)) {
+            *value = inb(FLOPPY_FIFO_PORT);
+            return 0;
+        }
+    }
+    return ERROR_TIMED_OUT;
+}
+
+/**
+ * @brief Send a command and its parameter bytes to the FIFO
+ * 
+ * @param bytes Command byte followed by its parameters
+ * @param count Number of bytes
+ * @return 0 on success, ERROR_TIMED_OUT if the controller stalls
+ */
+static int32_t floppy_command(const uint8_t* bytes, uint32_t count) {
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t result = floppy_write_byte(bytes[i]);
+        if (result != 0) return result;
+    }
+    return 0;
+}
+
+/**
+ * @brief Acknowledge a seek, recalibrate or reset interrupt
+ * 
+ * @param cylinder Receives the present cylinder number, or NULL
+ * @return Status register 0, or a negative error
+ */
+static int32_t floppy_sense_interrupt(uint8_t* cylinder) {
+    static const uint8_t command[] = {FLOPPY_CMD_SENSE_INTERRUPT};
+    uint8_t st0, present;
+    
+    if (floppy_command(command, sizeof(command)) != 0 ||
+        floppy_read_byte(&st0) != 0 || floppy_read_byte(&present) != 0) {
+        return ERROR_TIMED_OUT;
+    }
+    if (cylinder) *cylinder = present;
+    return st0;
+}
+
+static void floppy_motor_start(void) {
+    if (!floppy_motor_on) {
+        outb(FLOPPY_DOR_PORT, FLOPPY_DOR_MOTOR_A | FLOPPY_DOR_DMA_ENABLE | FLOPPY_DOR_NOT_RESET);
+        timer_sleep(FLOPPY_MOTOR_SPIN_UP);
+        floppy_motor_on = 1;
+    }
+}
+
+// Switch the motor off once the drive has been idle for FLOPPY_MOTOR_IDLE
+static void floppy_motor_arm_idle(void) {
+    timer_arm(&floppy_motor_timer, timer_ticks + FLOPPY_MOTOR_IDLE * (TIMER_FREQUENCY / 1000),
+              &floppy_motor_queue);
+}
+
+// Runs from the timer interrupt when the idle timer fires
+static void floppy_motor_idle(struct wait_callback* callback) {
+    (void)callback;
+    
+    if (floppy_busy || !floppy_motor_on) return;
+    outb(FLOPPY_DOR_PORT, FLOPPY_DOR_DMA_ENABLE | FLOPPY_DOR_NOT_RESET);
+    floppy_motor_on = 0;
+}
+
+/**
+ * @brief Move the heads of drive 0 to cylinder 0
+ * 
+ * @return 0 on success, otherwise a negative error
+ * 
+ * A single recalibrate steps at most 79 times, so it is retried once.
+ */
+static int32_t floppy_recalibrate(void) {
+    static const uint8_t command[] = {FLOPPY_CMD_RECALIBRATE, 0};
+    
+    for (uint32_t attempt = 0; attempt < 2; ++attempt) {
+        uint8_t cylinder;
+        
+        floppy_interrupted = 0;
+        if (floppy_command(command, sizeof(command)) != 0 || floppy_wait_interrupt() != 0) {
+            return ERROR_TIMED_OUT;
+        }
+        int32_t st0 = floppy_sense_interrupt(&cylinder);
+        if (st0 < 0) return st0;
+        if (!(st0 & FLOPPY_ST0_ERROR_MASK) && cylinder == 0) return 0;
+    }
+    return ERROR_IO;
+}
+
+/**
+ * @brief Reset the controller and program drive parameters
+ * 
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t floppy_reset(void) {
+    static const uint8_t configure[] = {FLOPPY_CMD_CONFIGURE, 0, FLOPPY_CONFIGURE_FLAGS, 0};
+    static const uint8_t specify[] = {FLOPPY_CMD_SPECIFY, FLOPPY_SPECIFY_STEP_UNLOAD, FLOPPY_SPECIFY_LOAD_DMA};
+    uint8_t motor = floppy_motor_on ? FLOPPY_DOR_MOTOR_A : 0;
+    
+    floppy_interrupted = 0;
+    outb(FLOPPY_DOR_PORT, 0);
+    io_wait();
+    outb(FLOPPY_DOR_PORT, motor | FLOPPY_DOR_DMA_ENABLE | FLOPPY_DOR_NOT_RESET);
+    if (floppy_wait_interrupt() != 0) return ERROR_TIMED_OUT;
+    
+    // One sense per drive clears the reset's emulated polling interrupts
+    for (uint32_t drive = 0; drive < 4; ++drive) {
+        if (floppy_sense_interrupt(NULL) < 0) return ERROR_TIMED_OUT;
+    }
+    
+    outb(FLOPPY_CCR_PORT, FLOPPY_RATE_500K);
+    if (floppy_command(configure, sizeof(configure)) != 0 ||
+        floppy_command(specify, sizeof(specify)) != 0) {
+        return ERROR_TIMED_OUT;
+    }
+    floppy_cached_cylinder = FLOPPY_NO_CYLINDER;
+    return floppy_recalibrate();
+}
+
+/**
+ * @brief Read both tracks of a cylinder into the track buffer
+ * 
+ * @param cylinder Cylinder number
+ * @return 0 on success, otherwise a negative error
+ * 
+ * The motor must be running. Seeks explicitly, then issues one multi-track
+ * READ DATA for sectors 1-18 of head 0, which continues on head 1.
+ */
+static int32_t floppy_read_cylinder(uint32_t cylinder) {
+    uint8_t seek[] = {FLOPPY_CMD_SEEK, 0, (uint8_t)cylinder};
+    uint8_t read[] = {FLOPPY_CMD_READ_DATA, 0, (uint8_t)cylinder, 0, 1, FLOPPY_SIZE_CODE_512,
+                      FLOPPY_SECTORS_PER_TRACK, FLOPPY_GAP3_LENGTH, 0xFF};
+    uint8_t status[7];
+    uint8_t present;
+    
+    floppy_interrupted = 0;
+    if (floppy_command(seek, sizeof(seek)) != 0 || floppy_wait_interrupt() != 0) {
+        return ERROR_TIMED_OUT;
+    }
+    int32_t st0 = floppy_sense_interrupt(&present);
+    if (st0 < 0) return st0;
+    if ((st0 & FLOPPY_ST0_ERROR_MASK) || present != cylinder) return ERROR_IO;
+    
+    isa_dma_start(FLOPPY_DMA_CHANNEL, (uint32_t)floppy_track_buffer, FLOPPY_CYLINDER_BYTES, 1);
+    floppy_interrupted = 0;
+    if (floppy_command(read, sizeof(read)) != 0 || floppy_wait_interrupt() != 0) {
+        return ERROR_TIMED_OUT;
+    }
+    for (uint32_t i = 0; i < sizeof(status); ++i) {
+        if (floppy_read_byte(&status[i]) != 0) return ERROR_TIMED_OUT;
+    }
+    if ((status[0] & FLOPPY_ST0_ERROR_MASK) || status[1] || status[2]) return ERROR_IO;
+    return 0;
+}
+
+/**
+ * @brief Read sectors from the floppy in drive 0
+ * 
+ * @param lba First sector (0-based, linear)
+ * @param count Number of sectors
+ * @param buffer Kernel buffer of count * 512 bytes
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Sectors come from the cached cylinder when possible. A failed cylinder
+ * read resets the controller and is retried up to FLOPPY_RETRIES times.
+ * Concurrent callers are serialised; the caller may sleep.
+ */
+int32_t floppy_read(uint32_t lba, uint32_t count, void* buffer) {
+    uint8_t* destination = (uint8_t*)buffer;
+    int32_t result = 0;
+    
+    if (!floppy_present) return ERROR_NOT_FOUND;
+    if (lba >= FLOPPY_SECTOR_COUNT || count > FLOPPY_SECTOR_COUNT - lba) return ERROR_INVALID_ARGUMENT;
+    
+    while (floppy_busy) {
+        wait_queue_sleep(&floppy_idle_queue);
+    }
+    floppy_busy = 1;
+    
+    while (count > 0 && result == 0) {
+        uint32_t cylinder = lba / FLOPPY_SECTORS_PER_CYLINDER;
+        uint32_t first = lba % FLOPPY_SECTORS_PER_CYLINDER;
+        uint32_t run = FLOPPY_SECTORS_PER_CYLINDER - first;
+        
+        if (run > count) run = count;
+        if (cylinder != floppy_cached_cylinder) {
+            floppy_cached_cylinder = FLOPPY_NO_CYLINDER;
+            floppy_motor_start();
+            result = floppy_read_cylinder(cylinder);
+            for (uint32_t retry = 0; result != 0 && retry < FLOPPY_RETRIES; ++retry) {
+                result = floppy_reset();
+                if (result == 0) result = floppy_read_cylinder(cylinder);
+            }
+            if (result != 0) break;
+            floppy_cached_cylinder = cylinder;
+        }
+        
+        memcpy(destination, floppy_track_buffer + first * FLOPPY_SECTOR_SIZE, run * FLOPPY_SECTOR_SIZE);
+        destination += run * FLOPPY_SECTOR_SIZE;
+        lba += run;
+        count -= run;
+    }
+    
+    floppy_busy = 0;
+    if (floppy_motor_on) floppy_motor_arm_idle();
+    wait_queue_wake_one(&floppy_idle_queue);
+    return result;
+}
+
+/**
+ * @brief Detect drive 0 and bring up the controller
+ * 
+ * Only a 1.44MB drive reported by the CMOS is driven. Must run after
+ * timer_initialize(), since every step waits on IRQ6 or the timer.
+ */
+void floppy_initialize(void) {
+    if ((cmos_read(FLOPPY_CMOS_DRIVE_TYPES) >> 4) != FLOPPY_CMOS_TYPE_1440K) return;
+    
+    // Five pages aligned to 32KB never straddle a 64KB DMA boundary
+    uint32_t pages = PAGE_ALIGN_UP(FLOPPY_CYLINDER_BYTES) / PAGE_SIZE;
+    uint32_t buffer = page_frame_allocate_contiguous(pages, 0x8000, ISA_DMA_LIMIT);
+    if (!buffer) return;
+    floppy_track_buffer = (uint8_t*)buffer;
+    
+    floppy_motor_callback.function = floppy_motor_idle;
+    wait_queue_add_callback(&floppy_motor_queue, &floppy_motor_callback);
+    irq_register_handler(FLOPPY_IRQ, floppy_interrupt, NULL);
+    
+    floppy_motor_start();
+    if (floppy_reset() == 0) floppy_present = 1;
+    floppy_motor_arm_idle();
+}
+
+// =============================================================================
+// ATA Disks
+// =============================================================================
+
+// ATA hard disks on the PCI IDE controller (PIIX3/4 in QEMU's i440FX).
+// Transfers use bus-master DMA when the controller has a bus-master BAR:
+// the buffer is described by a PRD (physical region descriptor) table, the
+// controller moves the data and completion arrives as the channel's IRQ.
+// PIO remains available for drives or controllers without DMA, and for
+// comparison. 48-bit LBA is used whenever a request reaches past the 28-bit
+// limit.
+// Source: ATA/ATAPI-7 Volume 1 (T13/1532D), "Programming Interface for Bus
+//         Master IDE Controller" (SFF-8038i) and Intel PIIX4 datasheet
+#define ATA_REG_DATA               0
+#define ATA_REG_ERROR              1
+#define ATA_REG_SECTOR_COUNT       2
+#define ATA_REG_LBA_LOW            3
+#define ATA_REG_LBA_MID            4
+#define ATA_REG_LBA_HIGH           5
+#define ATA_REG_DEVICE             6
+#define ATA_REG_STATUS             7       // Reads status, writes command
+#define ATA_REG_COMMAND            7
+
+#define ATA_STATUS_ERROR           0x01
+#define ATA_STATUS_DRQ             0x08
+#define ATA_STATUS_FAULT           0x20
+#define ATA_STATUS_READY           0x40
+#define ATA_STATUS_BUSY            0x80
+#define ATA_CONTROL_NO_INTERRUPT   0x02    // nIEN
+#define ATA_DEVICE_LBA             0x40
+#define ATA_DEVICE_LEGACY          0xA0    // Obsolete bits 7 and 5, set by convention
+#define ATA_DEVICE_SLAVE           0x10
+
+#define ATA_CMD_READ_PIO           0x20
+#define ATA_CMD_READ_PIO_EXT       0x24
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_WRITE_PIO          0x30
+#define ATA_CMD_WRITE_PIO_EXT      0x34
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_READ_DMA           0xC8
+#define ATA_CMD_WRITE_DMA          0xCA
+#define ATA_CMD_FLUSH_CACHE        0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
+#define ATA_CMD_IDENTIFY           0xEC
+
+// IDENTIFY DEVICE words
+#define ATA_ID_MODEL               27
+#define ATA_ID_MODEL_WORDS         20
+#define ATA_ID_CAPABILITIES        49
+#define ATA_ID_LBA28_SECTORS       60
+#define ATA_ID_COMMAND_SETS        83
+#define ATA_ID_LBA48_SECTORS       100
+#define ATA_CAPABILITY_DMA         0x0100
+#define ATA_COMMAND_SET_LBA48      0x0400
+
+// Bus-master IDE registers, per channel
+#define ATA_BM_COMMAND             0
+#define ATA_BM_STATUS              2
+#define ATA_BM_PRD_TABLE           4
+#define ATA_BM_SECONDARY           8       // Offset of the secondary channel's block
+#define ATA_BM_START               0x01
+#define ATA_BM_TO_MEMORY           0x08    // Device-to-memory (a disk read)
+#define ATA_BM_STATUS_ACTIVE       0x01
+#define ATA_BM_STATUS_ERROR        0x02
+#define ATA_BM_STATUS_INTERRUPT    0x04
+#define ATA_PRD_END_OF_TABLE       0x8000
+#define ATA_PRD_BOUNDARY           0x10000 // A region may not cross 64KB
+
+// Compatibility-mode resources
+#define ATA_PRIMARY_IO             0x1F0
+#define ATA_PRIMARY_CONTROL        0x3F6
+#define ATA_PRIMARY_IRQ            14
+#define ATA_SECONDARY_IO           0x170
+#define ATA_SECONDARY_CONTROL      0x376
+#define ATA_SECONDARY_IRQ          15
+#define ATA_PROG_IF_PRIMARY_NATIVE 0x01
+#define ATA_PROG_IF_SECONDARY_NATIVE 0x04
+#define ATA_PROG_IF_BUS_MASTER     0x80
+#define PCI_CLASS_STORAGE          0x01
+#define PCI_SUBCLASS_IDE           0x01
+
+#define ATA_SECTOR_SIZE            512
+#define ATA_MAX_SECTORS            256     // Per command (also fits LBA28)
+#define ATA_LBA28_LIMIT            0x10000000
+#define ATA_CHANNELS               2
+#define ATA_DRIVES                 (ATA_CHANNELS * 2)
+#define ATA_IRQ_TIMEOUT            5000    // ms
+#define ATA_SPIN_LIMIT             1000000
+
+// Transfer flags for ata_transfer()
+#define ATA_TRANSFER_WRITE         0x1
+#define ATA_TRANSFER_PIO           0x2     // Use PIO even if DMA is available
+
+struct ata_prd {
+    uint32_t address;               // Physical address of the region
+    uint16_t byte_count;            // 0 means 64KB
+    uint16_t flags;
+};
+
+struct ata_channel {
+    uint16_t io_base;
+    uint16_t control_base;
+    uint16_t bus_master;            // 0 if the controller cannot bus-master
+    uint8_t irq;
+    volatile int interrupted;
+    volatile uint8_t bm_status;     // Bus-master status latched by the IRQ
+    volatile uint8_t status;        // Device status latched by the IRQ
+    int busy;                       // A transfer owns the channel
+    struct wait_queue irq_queue;
+    struct wait_queue idle_queue;
+    struct ata_prd* prd_table;      // One page, PAGE_SIZE / 8 entries
+};
+
+struct ata_drive {
+    struct ata_channel* channel;
+    uint8_t slave;
+    int present;
+    int lba48;
+    int dma;
+    uint64_t sector_count;
+    char model[ATA_ID_MODEL_WORDS * 2 + 1];
+};
+
+static struct ata_channel ata_channels[ATA_CHANNELS];
+static struct ata_drive ata_drives[ATA_DRIVES];
+
+static void ata_interrupt(struct trap_frame* frame, void* context) {
+    struct ata_channel* channel = (struct ata_channel*)context;
+    (void)frame;
+    
+    if (channel->bus_master) {
+        uint8_t bm_status = inb(channel->bus_master + ATA_BM_STATUS);
+        if (!(bm_status & ATA_BM_STATUS_INTERRUPT)) return;    // Shared line, not ours
+        channel->bm_status = bm_status;
+        outb(channel->bus_master + ATA_BM_STATUS, bm_status | ATA_BM_STATUS_INTERRUPT | ATA_BM_STATUS_ERROR);
+    }
+    channel->status = inb(channel->io_base + ATA_REG_STATUS);  // Also acknowledges the device
+    channel->interrupted = 1;
+    wait_queue_wake_all(&channel->irq_queue);
+}
+
+// Reading the alternate status four times gives the 400ns a drive needs
+// to present valid status after a select or command
+static void ata_delay(struct ata_channel* channel) {
+    for (uint32_t i = 0; i < 4; ++i) {
+        inb(channel->control_base);
+    }
+}
+
+/**
+ * @brief Spin until the channel is not busy
+ * 
+ * @param channel Channel to poll
+ * @return Final status, or ERROR_TIMED_OUT
+ */
+static int32_t ata_wait_idle(struct ata_channel* channel) {
+    for (uint32_t spin = 0; spin < ATA_SPIN_LIMIT; ++spin) {
+        uint8_t status = inb(channel->control_base);
+        if (!(status & ATA_STATUS_BUSY)) return status;
+    }
+    return ERROR_TIMED_OUT;
+}
+
+/**
+ * @brief Spin until the drive asks for or offers a data block
+ * 
+ * @param channel Channel to poll
+ * @return 0 when DRQ is set, ERROR_IO on a device error, ERROR_TIMED_OUT
+ */
+static int32_t ata_wait_data(struct ata_channel* channel) {
+    int32_t status = ata_wait_idle(channel);
+    
+    if (status < 0) return status;
+    if (status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT)) return ERROR_IO;
+    return (status & ATA_STATUS_DRQ) ? 0 : ERROR_IO;
+}
+
+static int32_t ata_wait_interrupt(struct ata_channel* channel) {
+    struct timer timer;
+    uint32_t deadline = timer_ticks + ATA_IRQ_TIMEOUT * (TIMER_FREQUENCY / 1000);
+    
+    memset(&timer, 0, sizeof(timer));
+    timer_arm(&timer, deadline, &channel->irq_queue);
+    while (!channel->interrupted && (int32_t)(deadline - timer_ticks) > 0) {
+        wait_queue_sleep(&channel->irq_queue);
+    }
+    timer_cancel(&timer);
+    
+    if (!channel->interrupted) return ERROR_TIMED_OUT;
+    channel->interrupted = 0;
+    return 0;
+}
+
+/**
+ * @brief Load the task file and issue a command
+ * 
+ * @param drive Target drive
+ * @param lba First sector
+ * @param count Sectors (1-ATA_MAX_SECTORS)
+ * @param command LBA28 command byte
+ * @param command_ext LBA48 equivalent
+ * @param interrupts Whether the drive should raise its IRQ
+ * @return 0 on success, ERROR_TIMED_OUT if the drive stays busy
+ */
+static int32_t ata_issue(struct ata_drive* drive, uint64_t lba, uint32_t count,
+                         uint8_t command, uint8_t command_ext, int interrupts) {
+    struct ata_channel* channel = drive->channel;
+    uint16_t io = channel->io_base;
+    int extended = drive->lba48 && lba + count > ATA_LBA28_LIMIT;
+    uint8_t device = ATA_DEVICE_LEGACY | ATA_DEVICE_LBA | (drive->slave ? ATA_DEVICE_SLAVE : 0);
+    
+    if (!extended) device |= (uint8_t)((lba >> 24) & 0x0F);
+    
+    outb(channel->control_base, interrupts ? 0 : ATA_CONTROL_NO_INTERRUPT);
+    outb(io + ATA_REG_DEVICE, device);
+    ata_delay(channel);
+    if (ata_wait_idle(channel) < 0) return ERROR_TIMED_OUT;
+    
+    if (extended) {
+        // High-order bytes first; each register is a two-deep FIFO
+        outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)(count >> 8));
+        outb(io + ATA_REG_LBA_LOW, (uint8_t)(lba >> 24));
+        outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 32));
+        outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 40));
+    }
+    outb(io + ATA_REG_SECTOR_COUNT, (uint8_t)count);          // 0 means 256 in LBA28
+    outb(io + ATA_REG_LBA_LOW, (uint8_t)lba);
+    outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+    outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 16));
+    outb(io + ATA_REG_COMMAND, extended ? command_ext : command);
+    return 0;
+}
+
+/**
+ * @brief Move sectors with programmed I/O, one 512-byte block per DRQ
+ * 
+ * @param drive Target drive
+ * @param lba First sector
+ * @param count Sectors (1-ATA_MAX_SECTORS)
+ * @param buffer Data buffer
+ * @param write Non-zero to write to the disk
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ata_transfer_pio(struct ata_drive* drive, uint64_t lba, uint32_t count,
+                                uint8_t* buffer, int write) {
+    struct ata_channel* channel = drive->channel;
+    int32_t result = write ? ata_issue(drive, lba, count, ATA_CMD_WRITE_PIO, ATA_CMD_WRITE_PIO_EXT, 0)
+                           : ata_issue(drive, lba, count, ATA_CMD_READ_PIO, ATA_CMD_READ_PIO_EXT, 0);
+    
+    for (uint32_t sector = 0; sector < count && result == 0; ++sector) {
+        ata_delay(channel);
+        result = ata_wait_data(channel);
+        if (result != 0) break;
+        
+        if (write) {
+            outsw(channel->io_base + ATA_REG_DATA, buffer, ATA_SECTOR_SIZE / 2);
+        } else {
+            insw(channel->io_base + ATA_REG_DATA, buffer, ATA_SECTOR_SIZE / 2);
+        }
+        buffer += ATA_SECTOR_SIZE;
+    }
+    if (result == 0 && write) {
+        result = ata_issue(drive, lba, 0, ATA_CMD_FLUSH_CACHE, ATA_CMD_FLUSH_CACHE_EXT, 0);
+        if (result == 0) {
+            ata_delay(channel);
+            int32_t status = ata_wait_idle(channel);
+            if (status < 0) result = status;
+            else if (status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT)) result = ERROR_IO;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Describe a kernel buffer in the channel's PRD table
+ * 
+ * @param channel Channel whose table to fill
+ * @param buffer Identity-mapped kernel buffer
+ * @param length Bytes
+ * 
+ * Kernel memory is identity-mapped, so the buffer is physically contiguous;
+ * it only has to be split where it crosses a 64KB boundary.
+ */
+static void ata_build_prd_table(struct ata_channel* channel, uint32_t buffer, uint32_t length) {
+    struct ata_prd* prd = channel->prd_table;
+    
+    while (length > 0) {
+        uint32_t chunk = ATA_PRD_BOUNDARY - (buffer & (ATA_PRD_BOUNDARY - 1));
+        if (chunk > length) chunk = length;
+        
+        prd->address = buffer;
+        prd->byte_count = (uint16_t)chunk;              // 64KB wraps to 0 as required
+        prd->flags = 0;
+        buffer += chunk;
+        length -= chunk;
+        prd++;
+    }
+    prd[-1].flags = ATA_PRD_END_OF_TABLE;
+}
+
+/**
+ * @brief Move sectors by bus-master DMA and wait for the completion IRQ
+ * 
+ * @param drive Target drive (drive->dma must be set)
+ * @param lba First sector
+ * @param count Sectors (1-ATA_MAX_SECTORS)
+ * @param buffer Identity-mapped kernel buffer
+ * @param write Non-zero to write to the disk
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ata_transfer_dma(struct ata_drive* drive, uint64_t lba, uint32_t count,
+                                uint8_t* buffer, int write) {
+    struct ata_channel* channel = drive->channel;
+    uint16_t bus_master = channel->bus_master;
+    
+    ata_build_prd_table(channel, (uint32_t)buffer, count * ATA_SECTOR_SIZE);
+    outb(bus_master + ATA_BM_COMMAND, write ? 0 : ATA_BM_TO_MEMORY);
+    outl(bus_master + ATA_BM_PRD_TABLE, (uint32_t)channel->prd_table);
+    outb(bus_master + ATA_BM_STATUS,
+         inb(bus_master + ATA_BM_STATUS) | ATA_BM_STATUS_INTERRUPT | ATA_BM_STATUS_ERROR);
+    
+    channel->interrupted = 0;
+    int32_t result = write ? ata_issue(drive, lba, count, ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT, 1)
+                           : ata_issue(drive, lba, count, ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT, 1);
+    if (result != 0) return result;
+    
+    outb(bus_master + ATA_BM_COMMAND, (write ? 0 : ATA_BM_TO_MEMORY) | ATA_BM_START);
+    result = ata_wait_interrupt(channel);
+    outb(bus_master + ATA_BM_COMMAND, write ? 0 : ATA_BM_TO_MEMORY);
+    
+    if (result != 0) return result;
+    if ((channel->bm_status & ATA_BM_STATUS_ERROR) ||
+        (channel->status & (ATA_STATUS_ERROR | ATA_STATUS_FAULT))) {
+        return ERROR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read or write sectors on an ATA drive
+ * 
+ * @param index Drive number (0 primary master ... 3 secondary slave)
+ * @param lba First sector
+ * @param count Number of sectors
+ * @param buffer Kernel buffer of count * 512 bytes (identity-mapped)
+ * @param flags ATA_TRANSFER_WRITE, ATA_TRANSFER_PIO
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Large requests are split into ATA_MAX_SECTORS commands. Callers sharing
+ * a channel are serialised; the caller may sleep.
+ */
+int32_t ata_transfer(uint32_t index, uint64_t lba, uint32_t count, void* buffer, uint32_t flags) {
+    struct ata_drive* drive = index < ATA_DRIVES ? &ata_drives[index] : NULL;
+    uint8_t* data = (uint8_t*)buffer;
+    int write = (flags & ATA_TRANSFER_WRITE) != 0;
+    int32_t result = 0;
+    
+    if (!drive || !drive->present) return ERROR_NOT_FOUND;
+    if (lba >= drive->sector_count || count > drive->sector_count - lba) return ERROR_INVALID_ARGUMENT;
+    if ((uint32_t)data + count * ATA_SECTOR_SIZE > KERNEL_SPACE_END) return ERROR_BAD_ADDRESS;
+    
+    struct ata_channel* channel = drive->channel;
+    int dma = drive->dma && !(flags & ATA_TRANSFER_PIO);
+    
+    while (channel->busy) {
+        wait_queue_sleep(&channel->idle_queue);
+    }
+    channel->busy = 1;
+    
+    while (count > 0 && result == 0) {
+        uint32_t chunk = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        
+        result = dma ? ata_transfer_dma(drive, lba, chunk, data, write)
+                     : ata_transfer_pio(drive, lba, chunk, data, write);
+        lba += chunk;
+        count -= chunk;
+        data += chunk * ATA_SECTOR_SIZE;
+    }
+    
+    channel->busy = 0;
+    wait_queue_wake_one(&channel->idle_queue);
+    return result;
+}
+
+/**
+ * @brief Probe a drive position with IDENTIFY DEVICE
+ * 
+ * @param drive Drive slot with channel and slave set
+ * 
+ * ATAPI and SATA devices answer with a signature in the LBA registers and
+ * are left alone.
+ */
+static void ata_identify(struct ata_drive* drive) {
+    struct ata_channel* channel = drive->channel;
+    uint16_t io = channel->io_base;
+    uint16_t identify[256];
+    
+    if (ata_issue(drive, 0, 0, ATA_CMD_IDENTIFY, ATA_CMD_IDENTIFY, 0) != 0) return;
+    ata_delay(channel);
+    if (inb(io + ATA_REG_STATUS) == 0) return;                 // No device
+    if (ata_wait_idle(channel) < 0) return;
+    if (inb(io + ATA_REG_LBA_MID) || inb(io + ATA_REG_LBA_HIGH)) return;
+    if (ata_wait_data(channel) != 0) return;
+    insw(io + ATA_REG_DATA, identify, 256);
+    
+    for (uint32_t i = 0; i < ATA_ID_MODEL_WORDS; ++i) {
+        drive->model[i * 2] = (char)(identify[ATA_ID_MODEL + i] >> 8);
+        drive->model[i * 2 + 1] = (char)identify[ATA_ID_MODEL + i];
+    }
+    for (int32_t i = ATA_ID_MODEL_WORDS * 2 - 1; i >= 0 && drive->model[i] == ' '; --i) {
+        drive->model[i] = '\0';
+    }
+    
+    drive->lba48 = (identify[ATA_ID_COMMAND_SETS] & ATA_COMMAND_SET_LBA48) != 0;
+    if (drive->lba48) {
+        drive->sector_count = 0;
+        for (uint32_t i = 4; i-- > 0;) {
+            drive->sector_count = (drive->sector_count << 16) | identify[ATA_ID_LBA48_SECTORS + i];
+        }
+    } else {
+        drive->sector_count = identify[ATA_ID_LBA28_SECTORS] |
+                              ((uint32_t)identify[ATA_ID_LBA28_SECTORS + 1] << 16);
+    }
+    drive->dma = channel->bus_master && channel->prd_table &&
+                 (identify[ATA_ID_CAPABILITIES] & ATA_CAPABILITY_DMA);
+    drive->present = drive->sector_count != 0;
+}
+
+/**
+ * @brief Find the IDE controller and identify the drives on it
+ * 
+ * Channels in compatibility mode use the legacy ports and IRQs 14/15;
+ * channels in native mode use BARs 0-3 and the function's interrupt line.
+ * BAR4 holds the bus-master registers for both channels.
+ */
+void ata_initialize(void) {
+    struct pci_device* controller = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, 0);
+    uint8_t prog_if = controller ? controller->prog_if : 0;
+    uint16_t bus_master = 0;
+    
+    if (controller && (prog_if & ATA_PROG_IF_BUS_MASTER) && (controller->bars[4] & PCI_BAR_IO)) {
+        bus_master = (uint16_t)(controller->bars[4] & ~3u);
+        pci_enable_bus_master(controller);
+    }
+    
+    for (uint32_t index = 0; index < ATA_CHANNELS; ++index) {
+        struct ata_channel* channel = &ata_channels[index];
+        uint8_t native = index == 0 ? ATA_PROG_IF_PRIMARY_NATIVE : ATA_PROG_IF_SECONDARY_NATIVE;
+        
+        if (controller && (prog_if & native)) {
+            channel->io_base = (uint16_t)(controller->bars[index * 2] & ~3u);
+            channel->control_base = (uint16_t)((controller->bars[index * 2 + 1] & ~3u) + 2);
+            channel->irq = controller->irq_line;
+        } else {
+            channel->io_base = index == 0 ? ATA_PRIMARY_IO : ATA_SECONDARY_IO;
+            channel->control_base = index == 0 ? ATA_PRIMARY_CONTROL : ATA_SECONDARY_CONTROL;
+            channel->irq = index == 0 ? ATA_PRIMARY_IRQ : ATA_SECONDARY_IRQ;
+        }
+        if (inb(channel->io_base + ATA_REG_STATUS) == 0xFF) continue;   // Floating bus
+        
+        if (bus_master) {
+            channel->bus_master = (uint16_t)(bus_master + index * ATA_BM_SECONDARY);
+            channel->prd_table = (struct ata_prd*)page_frame_allocate();
+        }
+        irq_register_handler(channel->irq, ata_interrupt, channel);
+        
+        for (uint32_t slave = 0; slave < 2; ++slave) {
+            struct ata_drive* drive = &ata_drives[index * 2 + slave];
+            drive->channel = channel;
+            drive->slave = (uint8_t)slave;
+            ata_identify(drive);
+        }
+    }
+}
+
+// =============================================================================
+// AHCI SATA Disks
+// =============================================================================
+
+// Serial ATA disks behind an AHCI host bus adapter (QEMU -device ahci).
+// Each port has a command list of up to 32 slots; a slot names a command
+// table holding the FIS and a PRD scatter-gather list. With native command
+// queuing every free slot can carry a READ/WRITE FPDMA QUEUED command at
+// the same time and the drive completes them in any order, reporting them
+// with Set Device Bits FISes that clear PxSACT bits.
+//
+// The interrupt handler only latches and clears the port interrupt status
+// and schedules a bottom half. The bottom half reaps every slot whose
+// PxSACT and PxCI bits have both cleared in one pass, so a burst of
+// completions costs one run. Without NCQ (HBA or drive) the same slots are
+// used with READ/WRITE DMA EXT, which the HBA issues one at a time.
+// Source: Serial ATA AHCI 1.3.1 Specification, ATA/ATAPI-8 ACS
+//         Section 7.43 "NCQ Feature Set" and OSDev Wiki "AHCI"
+#define PCI_SUBCLASS_SATA          0x06
+#define AHCI_PROG_IF               0x01
+#define AHCI_BAR                   5
+
+// HBA registers
+#define AHCI_CAP                   0x00
+#define AHCI_GHC                   0x04
+#define AHCI_IS                    0x08
+#define AHCI_PI                    0x0C
+#define AHCI_CAP_SNCQ              0x40000000
+#define AHCI_CAP_SLOTS_SHIFT       8
+#define AHCI_GHC_ENABLE            0x80000000
+#define AHCI_GHC_INTERRUPTS        0x00000002
+#define AHCI_REGISTERS_SIZE        0x1100
+
+// Port registers, at 0x100 + port * 0x80
+#define AHCI_PORT_BASE             0x100
+#define AHCI_PORT_SIZE             0x80
+#define AHCI_PX_CLB                0x00
+#define AHCI_PX_CLBU               0x04
+#define AHCI_PX_FB                 0x08
+#define AHCI_PX_FBU                0x0C
+#define AHCI_PX_IS                 0x10
+#define AHCI_PX_IE                 0x14
+#define AHCI_PX_CMD                0x18
+#define AHCI_PX_TFD                0x20
+#define AHCI_PX_SIG                0x24
+#define AHCI_PX_SSTS               0x28
+#define AHCI_PX_SERR               0x30
+#define AHCI_PX_SACT               0x34
+#define AHCI_PX_CI                 0x38
+
+#define AHCI_CMD_START             0x0001
+#define AHCI_CMD_FIS_RECEIVE       0x0010
+#define AHCI_CMD_FIS_RUNNING       0x4000
+#define AHCI_CMD_LIST_RUNNING      0x8000
+#define AHCI_SSTS_PRESENT          0x3     // DET: device present, link up
+#define AHCI_SSTS_ACTIVE           0x1     // IPM: interface active
+#define AHCI_SIGNATURE_ATA         0x00000101
+
+#define AHCI_IS_D2H                0x00000001
+#define AHCI_IS_SET_DEVICE_BITS    0x00000008
+#define AHCI_IS_ERRORS             0x78000010  // TFES, HBFS, HBDS, IFS, UFS
+#define AHCI_PORT_INTERRUPTS       (AHCI_IS_D2H | AHCI_IS_SET_DEVICE_BITS | AHCI_IS_ERRORS)
+
+// Command header flags and FIS layout
+#define AHCI_HEADER_FIS_DWORDS     5
+#define AHCI_HEADER_WRITE          0x0040
+#define AHCI_HEADER_CLEAR_BUSY     0x0400
+#define AHCI_FIS_HOST_TO_DEVICE    0x27
+#define AHCI_FIS_COMMAND           0x80
+#define AHCI_PRD_MAX_BYTES         0x400000
+#define AHCI_CMD_READ_FPDMA        0x60
+#define AHCI_CMD_WRITE_FPDMA       0x61
+#define AHCI_CMD_READ_DMA_EXT      0x25
+#define AHCI_CMD_WRITE_DMA_EXT     0x35
+#define AHCI_CMD_IDENTIFY          0xEC
+#define AHCI_ID_QUEUE_DEPTH        75
+#define AHCI_ID_SATA_CAPABILITIES  76
+#define AHCI_SATA_NCQ              0x0100
+#define AHCI_TFD_BUSY_DRQ          0x88
+
+#define AHCI_MAX_PORTS             32
+#define AHCI_MAX_SLOTS             32
+#define AHCI_MAX_SEGMENTS          8       // PRD entries per command
+#define AHCI_MAX_SECTORS           8192    // Per request (4MB)
+#define AHCI_SPIN_LIMIT            1000000
+
+struct ahci_command_header {
+    uint16_t flags;                 // FIS length in dwords, W, C, ...
+    uint16_t prd_count;
+    volatile uint32_t bytes_transferred;
+    uint32_t table_low;
+    uint32_t table_high;
+    uint32_t reserved[4];
+};
+
+struct ahci_prd {
+    uint32_t address_low;
+    uint32_t address_high;
+    uint32_t reserved;
+    uint32_t byte_count;            // Bytes - 1, bit 31 interrupt on completion
+};
+
+struct ahci_command_table {
+    uint8_t command_fis[64];
+    uint8_t atapi_command[16];
+    uint8_t reserved[48];
+    struct ahci_prd prd[AHCI_MAX_SEGMENTS];
+};
+
+#define AHCI_TABLE_PAGES           (PAGE_ALIGN_UP(AHCI_MAX_SLOTS * sizeof(struct ahci_command_table)) / PAGE_SIZE)
+
+// One region of a request's buffer
+struct ahci_segment {
+    void* buffer;                   // Identity-mapped kernel memory
+    uint32_t length;                // Even number of bytes
+};
+
+// A read or write in flight. Submitted with ahci_submit() and reaped by
+// the bottom half, which sets done and result and wakes queue.
+struct ahci_request {
+    uint64_t lba;
+    uint32_t count;                 // Sectors
+    int write;
+    uint32_t segment_count;
+    struct ahci_segment segments[AHCI_MAX_SEGMENTS];
+    volatile int done;
+    int32_t result;
+    struct wait_queue queue;
+};
+
+struct ahci_port {
+    uint8_t* registers;
+    struct ahci_command_header* command_list;
+    struct ahci_command_table* tables;
+    int present;
+    int ncq;
+    uint32_t slot_mask;             // Slots usable on this port
+    uint32_t outstanding;           // Slots issued and not yet reaped
+    uint32_t pending_status;        // PxIS bits latched by the interrupt
+    uint64_t sector_count;
+    struct ahci_request* requests[AHCI_MAX_SLOTS];
+    struct wait_queue slot_queue;   // Submitters waiting for a free slot
+};
+
+static uint8_t* ahci_registers;
+static struct ahci_port ahci_ports[AHCI_MAX_PORTS];
+static struct deferred_work ahci_completion_work;
+
+static inline uint32_t ahci_port_read(struct ahci_port* port, uint32_t reg) {
+    return *(volatile uint32_t*)(port->registers + reg);
+}
+
+static inline void ahci_port_write(struct ahci_port* port, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(port->registers + reg) = value;
+}
+
+/**
+ * @brief Stop or start a port's command list and FIS receive engines
+ * 
+ * @param port Port to control
+ * @param running 1 to start, 0 to stop
+ * @return 0 on success, ERROR_TIMED_OUT if the engines do not respond
+ */
+static int32_t ahci_port_engines(struct ahci_port* port, int running) {
+    uint32_t command = ahci_port_read(port, AHCI_PX_CMD);
+    
+    if (running) {
+        ahci_port_write(port, AHCI_PX_CMD, command | AHCI_CMD_FIS_RECEIVE);
+        for (uint32_t spin = 0; ahci_port_read(port, AHCI_PX_TFD) & AHCI_TFD_BUSY_DRQ; ++spin) {
+            if (spin == AHCI_SPIN_LIMIT) return ERROR_TIMED_OUT;
+        }
+        ahci_port_write(port, AHCI_PX_CMD, command | AHCI_CMD_FIS_RECEIVE | AHCI_CMD_START);
+        return 0;
+    }
+    
+    ahci_port_write(port, AHCI_PX_CMD, command & ~(uint32_t)AHCI_CMD_START);
+    for (uint32_t spin = 0; ahci_port_read(port, AHCI_PX_CMD) & AHCI_CMD_LIST_RUNNING; ++spin) {
+        if (spin == AHCI_SPIN_LIMIT) return ERROR_TIMED_OUT;
+    }
+    ahci_port_write(port, AHCI_PX_CMD, ahci_port_read(port, AHCI_PX_CMD) & ~(uint32_t)AHCI_CMD_FIS_RECEIVE);
+    for (uint32_t spin = 0; ahci_port_read(port, AHCI_PX_CMD) & AHCI_CMD_FIS_RUNNING; ++spin) {
+        if (spin == AHCI_SPIN_LIMIT) return ERROR_TIMED_OUT;
+    }
+    return 0;
+}
+
+/**
+ * @brief Fill a slot's command header, FIS and PRD table
+ * 
+ * @param port Port owning the slot
+ * @param slot Command slot (also the NCQ tag)
+ * @param command ATA command byte
+ * @param lba First sector
+ * @param count Sectors
+ * @param segments Buffer regions
+ * @param segment_count Number of regions (at most AHCI_MAX_SEGMENTS)
+ * @param write Non-zero if data flows to the device
+ */
+static void ahci_build_command(struct ahci_port* port, uint32_t slot, uint8_t command, uint64_t lba,
+                               uint32_t count, const struct ahci_segment* segments,
+                               uint32_t segment_count, int write) {
+    struct ahci_command_header* header = &port->command_list[slot];
+    struct ahci_command_table* table = &port->tables[slot];
+    uint8_t* fis = table->command_fis;
+    
+    memset(fis, 0, sizeof(table->command_fis));
+    fis[0] = AHCI_FIS_HOST_TO_DEVICE;
+    fis[1] = AHCI_FIS_COMMAND;
+    fis[2] = command;
+    fis[4] = (uint8_t)lba;
+    fis[5] = (uint8_t)(lba >> 8);
+    fis[6] = (uint8_t)(lba >> 16);
+    fis[7] = ATA_DEVICE_LBA;
+    fis[8] = (uint8_t)(lba >> 24);
+    fis[9] = (uint8_t)(lba >> 32);
+    fis[10] = (uint8_t)(lba >> 40);
+    if (command == AHCI_CMD_READ_FPDMA || command == AHCI_CMD_WRITE_FPDMA) {
+        fis[3] = (uint8_t)count;            // Queued commands carry the count in FEATURES
+        fis[11] = (uint8_t)(count >> 8);
+        fis[12] = (uint8_t)(slot << 3);     // and the tag in COUNT
+    } else {
+        fis[12] = (uint8_t)count;
+        fis[13] = (uint8_t)(count >> 8);
+    }
+    
+    for (uint32_t i = 0; i < segment_count; ++i) {
+        table->prd[i].address_low = (uint32_t)segments[i].buffer;
+        table->prd[i].address_high = 0;
+        table->prd[i].reserved = 0;
+        table->prd[i].byte_count = segments[i].length - 1;
+    }
+    
+    header->flags = AHCI_HEADER_FIS_DWORDS | AHCI_HEADER_CLEAR_BUSY | (write ? AHCI_HEADER_WRITE : 0);
+    header->prd_count = (uint16_t)segment_count;
+    header->bytes_transferred = 0;
+}
+
+/**
+ * @brief Queue a request on a port without waiting for it
+ * 
+ * @param index Port number
+ * @param request Request with lba, count, write and segments set; must
+ *        stay valid until reaped
+ * @return 0 once issued, otherwise a negative error
+ * 
+ * Sleeps only while every slot is busy. Call ahci_wait() for the result.
+ */
+int32_t ahci_submit(uint32_t index, struct ahci_request* request) {
+    struct ahci_port* port = index < AHCI_MAX_PORTS ? &ahci_ports[index] : NULL;
+    uint32_t bytes = 0;
+    
+    if (!port || !port->present) return ERROR_NOT_FOUND;
+    if (request->count == 0 || request->count > AHCI_MAX_SECTORS ||
+        request->lba >= port->sector_count || request->count > port->sector_count - request->lba ||
+        request->segment_count == 0 || request->segment_count > AHCI_MAX_SEGMENTS) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    for (uint32_t i = 0; i < request->segment_count; ++i) {
+        const struct ahci_segment* segment = &request->segments[i];
+        if (segment->length == 0 || segment->length > AHCI_PRD_MAX_BYTES || (segment->length & 1) ||
+            (uint32_t)segment->buffer + segment->length > KERNEL_SPACE_END) {
+            return ERROR_INVALID_ARGUMENT;
+        }
+        bytes += segment->length;
+    }
+    if (bytes != request->count * ATA_SECTOR_SIZE) return ERROR_INVALID_ARGUMENT;
+    
+    while (!(port->slot_mask & ~port->outstanding)) {
+        wait_queue_sleep(&port->slot_queue);
+        if (!port->present) return ERROR_IO;
+    }
+    uint32_t slot = (uint32_t)__builtin_ctz(port->slot_mask & ~port->outstanding);
+    uint8_t command = port->ncq ? (request->write ? AHCI_CMD_WRITE_FPDMA : AHCI_CMD_READ_FPDMA)
+                                : (request->write ? AHCI_CMD_WRITE_DMA_EXT : AHCI_CMD_READ_DMA_EXT);
+    
+    ahci_build_command(port, slot, command, request->lba, request->count, request->segments,
+                       request->segment_count, request->write);
+    request->done = 0;
+    request->result = 0;
+    port->requests[slot] = request;
+    port->outstanding |= 1u << slot;
+    
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // Command table before the doorbell
+    if (port->ncq) ahci_port_write(port, AHCI_PX_SACT, 1u << slot);
+    ahci_port_write(port, AHCI_PX_CI, 1u << slot);
+    return 0;
+}
+
+/**
+ * @brief Wait for a submitted request to complete
+ * 
+ * @param request Request passed to ahci_submit()
+ * @return 0 on success, ERROR_IO if the device reported an error
+ */
+int32_t ahci_wait(struct ahci_request* request) {
+    while (!request->done) {
+        wait_queue_sleep(&request->queue);
+    }
+    return request->result;
+}
+
+/**
+ * @brief Read or write a contiguous kernel buffer and wait for it
+ * 
+ * @param index Port number
+ * @param lba First sector
+ * @param count Number of sectors
+ * @param buffer Identity-mapped kernel buffer of count * 512 bytes
+ * @param write Non-zero to write to the disk
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t ahci_transfer(uint32_t index, uint64_t lba, uint32_t count, void* buffer, int write) {
+    struct ahci_request request;
+    uint8_t* data = (uint8_t*)buffer;
+    int32_t result = 0;
+    
+    memset(&request, 0, sizeof(request));
+    while (count > 0 && result == 0) {
+        uint32_t chunk = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+        
+        request.lba = lba;
+        request.count = chunk;
+        request.write = write;
+        request.segment_count = 1;
+        request.segments[0].buffer = data;
+        request.segments[0].length = chunk * ATA_SECTOR_SIZE;
+        result = ahci_submit(index, &request);
+        if (result == 0) result = ahci_wait(&request);
+        
+        lba += chunk;
+        count -= chunk;
+        data += chunk * ATA_SECTOR_SIZE;
+    }
+    return result;
+}
+
+static void ahci_finish(struct ahci_port* port, uint32_t slots, int32_t result) {
+    for (uint32_t pending = slots; pending; pending &= pending - 1) {
+        uint32_t slot = (uint32_t)__builtin_ctz(pending);
+        struct ahci_request* request = port->requests[slot];
+        
+        port->requests[slot] = NULL;
+        request->result = result;
+        request->done = 1;
+        wait_queue_wake_all(&request->queue);
+    }
+    port->outstanding &= ~slots;
+    if (slots) wait_queue_wake_all(&port->slot_queue);
+}
+
+/**
+ * @brief Bottom half: reap every finished slot on every port
+ * 
+ * A slot is finished when both its PxCI and PxSACT bits are clear. After
+ * an error the device has aborted every queued command, so all
+ * outstanding slots fail and the port is restarted.
+ */
+static void ahci_complete(struct deferred_work* work) {
+    (void)work;
+    
+    for (uint32_t index = 0; index < AHCI_MAX_PORTS; ++index) {
+        struct ahci_port* port = &ahci_ports[index];
+        uint32_t status = port->pending_status;
+        
+        if (!port->present || !status) continue;
+        port->pending_status = 0;
+        
+        if (status & AHCI_IS_ERRORS) {
+            ahci_port_engines(port, 0);
+            ahci_port_write(port, AHCI_PX_SERR, 0xFFFFFFFF);
+            ahci_port_write(port, AHCI_PX_IS, 0xFFFFFFFF);
+            ahci_finish(port, port->outstanding, ERROR_IO);
+            if (ahci_port_engines(port, 1) != 0) port->present = 0;
+            continue;
+        }
+        
+        uint32_t busy = ahci_port_read(port, AHCI_PX_CI) | ahci_port_read(port, AHCI_PX_SACT);
+        ahci_finish(port, port->outstanding & ~busy, 0);
+    }
+}
+
+// Top half: latch and clear port status, leave the reaping to the bottom half
+static void ahci_interrupt(struct trap_frame* frame, void* context) {
+    uint32_t pending = *(volatile uint32_t*)(ahci_registers + AHCI_IS);
+    (void)frame; (void)context;
+    
+    if (!pending) return;                       // Shared line, not ours
+    for (uint32_t bits = pending; bits; bits &= bits - 1) {
+        struct ahci_port* port = &ahci_ports[__builtin_ctz(bits)];
+        if (!port->registers) continue;
+        
+        uint32_t status = ahci_port_read(port, AHCI_PX_IS);
+        
+        ahci_port_write(port, AHCI_PX_IS, status);
+        port->pending_status |= status;
+    }
+    *(volatile uint32_t*)(ahci_registers + AHCI_IS) = pending;
+    deferred_work_schedule(&ahci_completion_work);
+}
+
+/**
+ * @brief Run IDENTIFY DEVICE on a port by polling, before interrupts are on
+ * 
+ * @param port Port with running engines
+ * @param identify Receives the 256 identify words
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ahci_identify(struct ahci_port* port, uint16_t* identify) {
+    struct ahci_segment segment = {identify, ATA_SECTOR_SIZE};
+    
+    ahci_build_command(port, 0, AHCI_CMD_IDENTIFY, 0, 0, &segment, 1, 0);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ahci_port_write(port, AHCI_PX_CI, 1);
+    
+    for (uint32_t spin = 0; ahci_port_read(port, AHCI_PX_CI) & 1; ++spin) {
+        if ((ahci_port_read(port, AHCI_PX_IS) & AHCI_IS_ERRORS) || spin == AHCI_SPIN_LIMIT) {
+            return ERROR_IO;
+        }
+    }
+    ahci_port_write(port, AHCI_PX_IS, 0xFFFFFFFF);
+    return 0;
+}
+
+/**
+ * @brief Undo a failed port bring-up
+ * 
+ * @param port Port whose engines may be running
+ * @param list Command list and received FIS page, or 0
+ * @param tables Command tables, or 0
+ * @param identify IDENTIFY buffer, or 0
+ * 
+ * Stops the engines and clears the addresses they were given before
+ * freeing the frames. Frames the HBA might still write, because its
+ * engines would not stop, are leaked instead.
+ */
+static void ahci_port_abandon(struct ahci_port* port, uint32_t list, uint32_t tables, uint32_t identify) {
+    if (identify) page_frame_free(identify);
+    if (ahci_port_engines(port, 0) != 0) return;
+    
+    ahci_port_write(port, AHCI_PX_CLB, 0);
+    ahci_port_write(port, AHCI_PX_FB, 0);
+    port->command_list = NULL;
+    port->tables = NULL;
+    if (list) page_frame_free(list);
+    for (uint32_t i = 0; tables && i < AHCI_TABLE_PAGES; ++i) {
+        page_frame_free(tables + i * PAGE_SIZE);
+    }
+}
+
+/**
+ * @brief Bring up one implemented port and identify its drive
+ * 
+ * @param port Port with registers set
+ * @param slots Command slots supported by the HBA
+ * @param hba_ncq Whether the HBA supports NCQ
+ */
+static void ahci_port_initialize(struct ahci_port* port, uint32_t slots, int hba_ncq) {
+    uint32_t sata_status = ahci_port_read(port, AHCI_PX_SSTS);
+    uint16_t* identify;
+    
+    if ((sata_status & 0xF) != AHCI_SSTS_PRESENT || ((sata_status >> 8) & 0xF) != AHCI_SSTS_ACTIVE ||
+        ahci_port_read(port, AHCI_PX_SIG) != AHCI_SIGNATURE_ATA) {
+        return;
+    }
+    if (ahci_port_engines(port, 0) != 0) return;
+    
+    // Command list (1KB) and received FIS area (256 bytes) share a page
+    uint32_t list = page_frame_allocate();
+    uint32_t tables = page_frame_allocate_contiguous(AHCI_TABLE_PAGES, PAGE_SIZE, 0);
+    identify = (uint16_t*)page_frame_allocate();
+    if (!list || !tables || !identify) {
+        ahci_port_abandon(port, list, tables, (uint32_t)identify);
+        return;
+    }
+    
+    memset((void*)list, 0, PAGE_SIZE);
+    memset((void*)tables, 0, AHCI_MAX_SLOTS * sizeof(struct ahci_command_table));
+    port->command_list = (struct ahci_command_header*)list;
+    port->tables = (struct ahci_command_table*)tables;
+    for (uint32_t slot = 0; slot < AHCI_MAX_SLOTS; ++slot) {
+        port->command_list[slot].table_low = (uint32_t)&port->tables[slot];
+    }
+    
+    ahci_port_write(port, AHCI_PX_CLB, list);
+    ahci_port_write(port, AHCI_PX_CLBU, 0);
+    ahci_port_write(port, AHCI_PX_FB, list + AHCI_MAX_SLOTS * sizeof(struct ahci_command_header));
+    ahci_port_write(port, AHCI_PX_FBU, 0);
+    ahci_port_write(port, AHCI_PX_SERR, 0xFFFFFFFF);
+    ahci_port_write(port, AHCI_PX_IS, 0xFFFFFFFF);
+    if (ahci_port_engines(port, 1) != 0 || ahci_identify(port, identify) != 0) {
+        ahci_port_abandon(port, list, tables, (uint32_t)identify);
+        return;
+    }
+    
+    if (identify[ATA_ID_COMMAND_SETS] & ATA_COMMAND_SET_LBA48) {
+        for (uint32_t i = 4; i-- > 0;) {
+            port->sector_count = (port->sector_count << 16) | identify[ATA_ID_LBA48_SECTORS + i];
+        }
+    } else {
+        port->sector_count = identify[ATA_ID_LBA28_SECTORS] |
+                             ((uint32_t)identify[ATA_ID_LBA28_SECTORS + 1] << 16);
+    }
+    
+    // NCQ needs both ends; the drive also caps the queue depth
+    uint32_t depth = slots;
+    port->ncq = hba_ncq && (identify[AHCI_ID_SATA_CAPABILITIES] & AHCI_SATA_NCQ);
+    if (port->ncq && (identify[AHCI_ID_QUEUE_DEPTH] & 0x1F) + 1u < depth) {
+        depth = (identify[AHCI_ID_QUEUE_DEPTH] & 0x1F) + 1u;
+    }
+    port->slot_mask = depth == 32 ? 0xFFFFFFFF : (1u << depth) - 1;
+    page_frame_free((uint32_t)identify);
+    
+    ahci_port_write(port, AHCI_PX_IE, AHCI_PORT_INTERRUPTS);
+    port->present = port->sector_count != 0;
+}
+
+/**
+ * @brief Find the AHCI controller and bring up its ports
+ * 
+ * Must run before the first process is created (see paging_map_device()).
+ */
+void ahci_initialize(void) {
+    struct pci_device* controller = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_SATA, 0);
+    
+    if (!controller || controller->prog_if != AHCI_PROG_IF || (controller->bars[AHCI_BAR] & PCI_BAR_IO)) {
+        return;
+    }
+    ahci_registers = paging_map_device(controller->bars[AHCI_BAR] & ~0xFu, AHCI_REGISTERS_SIZE);
+    if (!ahci_registers) return;
+    pci_enable_bus_master(controller);
+    
+    volatile uint32_t* ghc = (volatile uint32_t*)(ahci_registers + AHCI_GHC);
+    *ghc |= AHCI_GHC_ENABLE;
+    
+    uint32_t capabilities = *(volatile uint32_t*)(ahci_registers + AHCI_CAP);
+    uint32_t implemented = *(volatile uint32_t*)(ahci_registers + AHCI_PI);
+    uint32_t slots = ((capabilities >> AHCI_CAP_SLOTS_SHIFT) & 0x1F) + 1;
+    
+    for (uint32_t index = 0; index < AHCI_MAX_PORTS; ++index) {
+        if (!(implemented & (1u << index))) continue;
+        
+        ahci_ports[index].registers = ahci_registers + AHCI_PORT_BASE + index * AHCI_PORT_SIZE;
+        ahci_port_initialize(&ahci_ports[index], slots, (capabilities & AHCI_CAP_SNCQ) != 0);
+    }
+    
+    ahci_completion_work.function = ahci_complete;
+    irq_register_handler(controller->irq_line, ahci_interrupt, NULL);
+    *(volatile uint32_t*)(ahci_registers + AHCI_IS) = 0xFFFFFFFF;
+    *ghc |= AHCI_GHC_INTERRUPTS;
+}
+
+// =============================================================================
+// Virtio Block Devices
+// =============================================================================
+
+// virtio-blk over the modern (virtio 1.0) PCI transport. The common,
+// notify, ISR and device configuration structures are found through
+// vendor-specific PCI capabilities and mapped from the device's memory BARs.
+//
+// Requests travel on split virtqueues as a chain of header, data segments
+// and status byte. With VIRTIO_RING_F_INDIRECT_DESC, chains longer than
+// VIRTIO_DIRECT_CHAIN_MAX go into a per-head indirect table and take one
+// ring descriptor, so large scatter-gather requests do not exhaust the
+// ring. With VIRTIO_RING_F_EVENT_IDX each side publishes the index it next
+// wants to hear about (avail_event, used_event), so the device is kicked
+// and we are interrupted only when the other side has gone idle. With
+// VIRTIO_BLK_F_MQ there is one queue per CPU, up to the device's limit.
+//
+// As with AHCI, the interrupt handler only reads the ISR and schedules a
+// bottom half that reaps the used rings.
+// Source: Virtual I/O Device (VIRTIO) Version 1.1, Sections 2.6 "Split
+//         Virtqueues", 4.1 "Virtio Over PCI Bus" and 5.2 "Block Device"
+#define VIRTIO_VENDOR_ID           0x1AF4
+#define VIRTIO_DEVICE_BLOCK_LEGACY 0x1001  // Transitional; also offers the modern interface
+#define VIRTIO_DEVICE_BLOCK        0x1042
+
+// struct virtio_pci_cap offsets
+#define PCI_CAPABILITY_VENDOR      0x09
+#define VIRTIO_CAP_TYPE            3
+#define VIRTIO_CAP_BAR             4
+#define VIRTIO_CAP_OFFSET          8
+#define VIRTIO_CAP_LENGTH          12
+#define VIRTIO_CAP_NOTIFY_MULTIPLIER 16
+#define VIRTIO_CAP_COMMON          1
+#define VIRTIO_CAP_NOTIFY          2
+#define VIRTIO_CAP_ISR             3
+#define VIRTIO_CAP_DEVICE          4
+
+// struct virtio_pci_common_cfg offsets
+#define VIRTIO_COMMON_DEVICE_FEATURE_SELECT 0x00
+#define VIRTIO_COMMON_DEVICE_FEATURE        0x04
+#define VIRTIO_COMMON_DRIVER_FEATURE_SELECT 0x08
+#define VIRTIO_COMMON_DRIVER_FEATURE        0x0C
+#define VIRTIO_COMMON_NUM_QUEUES   0x12
+#define VIRTIO_COMMON_STATUS       0x14
+#define VIRTIO_COMMON_QUEUE_SELECT 0x16
+#define VIRTIO_COMMON_QUEUE_SIZE   0x18
+#define VIRTIO_COMMON_QUEUE_MSIX   0x1A
+#define VIRTIO_COMMON_QUEUE_ENABLE 0x1C
+#define VIRTIO_COMMON_QUEUE_NOTIFY_OFF 0x1E
+#define VIRTIO_COMMON_QUEUE_DESC   0x20
+#define VIRTIO_COMMON_QUEUE_DRIVER 0x28
+#define VIRTIO_COMMON_QUEUE_DEVICE 0x30
+#define VIRTIO_MSIX_NO_VECTOR      0xFFFF
+
+#define VIRTIO_STATUS_ACKNOWLEDGE  0x01
+#define VIRTIO_STATUS_DRIVER       0x02
+#define VIRTIO_STATUS_DRIVER_OK    0x04
+#define VIRTIO_STATUS_FEATURES_OK  0x08
+#define VIRTIO_STATUS_FAILED       0x80
+#define VIRTIO_ISR_QUEUE           0x01
+
+// Feature bits in the low feature word, and VERSION_1 (bit 32) in the high
+#define VIRTIO_BLK_F_SEG_MAX       (1u << 2)
+#define VIRTIO_BLK_F_MQ            (1u << 12)
+#define VIRTIO_RING_F_INDIRECT_DESC (1u << 28)
+#define VIRTIO_RING_F_EVENT_IDX    (1u << 29)
+#define VIRTIO_F_VERSION_1_HIGH    (1u << 0)
+
+// Block device configuration and request layout
+#define VIRTIO_BLK_CONFIG_CAPACITY 0
+#define VIRTIO_BLK_CONFIG_SEG_MAX  12
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+#define VIRTIO_BLK_T_IN            0
+#define VIRTIO_BLK_T_OUT           1
+#define VIRTIO_BLK_S_OK            0
+#define VIRTIO_BLK_SECTOR_SIZE     512
+
+#define VIRTQ_DESC_F_NEXT          0x1
+#define VIRTQ_DESC_F_WRITE         0x2     // Device writes the buffer
+#define VIRTQ_DESC_F_INDIRECT      0x4
+#define VIRTQ_USED_F_NO_NOTIFY     0x1
+#define VIRTQ_AVAIL_ALIGN          2
+#define VIRTQ_USED_ALIGN           4
+
+#define VIRTIO_QUEUE_MAX_SIZE      128
+#define VIRTIO_BLK_MAX_DEVICES     4
+#define VIRTIO_BLK_MAX_QUEUES      CPU_COUNT
+#define VIRTIO_BLK_MAX_SEGMENTS    32
+#define VIRTIO_BLK_MAX_DESCRIPTORS (VIRTIO_BLK_MAX_SEGMENTS + 2)
+#define VIRTIO_DIRECT_CHAIN_MAX    3       // Header, one segment, status
+#define VIRTIO_BLK_MAX_SECTORS     8192    // Per request from virtio_blk_transfer()
+
+struct virtq_desc {
+    uint64_t address;
+    uint32_t length;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct virtq_avail {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];                // Followed by used_event
+};
+
+struct virtq_used_element {
+    uint32_t id;                    // Head of the completed chain
+    uint32_t length;
+};
+
+struct virtq_used {
+    uint16_t flags;
+    uint16_t index;
+    struct virtq_used_element ring[];   // Followed by avail_event
+};
+
+struct virtqueue {
+    uint16_t size;
+    uint16_t free_head;             // Free descriptors are linked through next
+    uint16_t free_count;
+    uint16_t avail_index;           // Our copy of avail->index
+    uint16_t kicked_index;          // avail_index when the device was last considered for a kick
+    uint16_t last_used;             // Next used ring entry to reap
+    uint16_t queue_index;
+    int event_index;                // VIRTIO_RING_F_EVENT_IDX negotiated
+    uint32_t ring_pages;            // Contiguous frames holding the three rings
+    struct virtq_desc* descriptors;
+    volatile struct virtq_avail* avail;
+    volatile struct virtq_used* used;
+    volatile uint16_t* notify;
+    struct virtq_desc* indirect;    // VIRTIO_BLK_MAX_DESCRIPTORS per head, or NULL
+    void* tokens[VIRTIO_QUEUE_MAX_SIZE];    // Request owning each chain head
+    struct wait_queue free_queue;   // Submitters waiting for descriptors
+};
+
+struct virtio_blk_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+struct virtio_blk_segment {
+    void* buffer;                   // Identity-mapped kernel memory
+    uint32_t length;
+};
+
+// A read or write in flight. Like struct ahci_request it must stay valid,
+// in identity-mapped memory, until virtio_blk_wait() returns.
+struct virtio_blk_request {
+    uint64_t sector;
+    uint32_t count;                 // Sectors
+    int write;
+    uint32_t segment_count;
+    struct virtio_blk_segment segments[VIRTIO_BLK_MAX_SEGMENTS];
+    volatile int done;
+    int32_t result;
+    struct wait_queue queue;
+    struct virtio_blk_header header;    // Read by the device
+    volatile uint8_t status;            // Written by the device
+};
+
+struct virtio_blk_device {
+    int present;
+    uint8_t* common;
+    volatile uint8_t* isr;
+    uint8_t* config;
+    uint32_t segment_max;
+    uint64_t capacity;              // Sectors
+    uint32_t queue_count;
+    struct virtqueue queues[VIRTIO_BLK_MAX_QUEUES];
+};
+
+static struct virtio_blk_device virtio_blk_devices[VIRTIO_BLK_MAX_DEVICES];
+static struct deferred_work virtio_blk_completion_work;
+
+// Whether moving the index from old_index to new_index passed event
+static inline int virtq_need_event(uint16_t event, uint16_t new_index, uint16_t old_index) {
+    return (uint16_t)(new_index - event - 1) < (uint16_t)(new_index - old_index);
+}
+
+static inline volatile uint16_t* virtq_used_event(struct virtqueue* queue) {
+    return &queue->avail->ring[queue->size];
+}
+
+static inline volatile uint16_t* virtq_avail_event(struct virtqueue* queue) {
+    return (volatile uint16_t*)&queue->used->ring[queue->size];
+}
+
+/**
+ * @brief Make a chain available to the device, kicking it only if needed
+ * 
+ * @param queue Queue the chain was built in
+ * @param head First descriptor of the chain
+ */
+static void virtqueue_publish(struct virtqueue* queue, uint16_t head) {
+    queue->avail->ring[queue->avail_index % queue->size] = head;
+    __atomic_thread_fence(__ATOMIC_RELEASE);            // Ring entry before the index
+    queue->avail->index = ++queue->avail_index;
+    
+    // The index store must be visible before avail_event or flags is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint16_t old_index = queue->kicked_index;
+    queue->kicked_index = queue->avail_index;
+    
+    int kick = queue->event_index ? virtq_need_event(*virtq_avail_event(queue), queue->avail_index, old_index)
+                                  : !(queue->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    if (kick) mmio_write16(queue->notify, queue->queue_index);
+}
+
+/**
+ * @brief Return a chain's descriptors to the free list
+ * 
+ * @param queue Queue owning the chain
+ * @param head First descriptor of the chain
+ */
+static void virtqueue_free_chain(struct virtqueue* queue, uint16_t head) {
+    uint16_t last = head;
+    uint16_t count = 1;
+    
+    while (queue->descriptors[last].flags & VIRTQ_DESC_F_NEXT) {
+        last = queue->descriptors[last].next;
+        count++;
+    }
+    queue->descriptors[last].next = queue->free_head;
+    queue->descriptors[last].flags = 0;
+    queue->free_head = head;
+    queue->free_count = (uint16_t)(queue->free_count + count);
+}
+
+/**
+ * @brief Fill a descriptor array with a block request's chain
+ * 
+ * @param table Descriptors to fill (ring or indirect table)
+ * @param indices Ring indices of the descriptors, or NULL for a table
+ *        where entry i links to i + 1
+ * @param request Request to describe
+ */
+static void virtio_blk_build_chain(struct virtq_desc* table, const uint16_t* indices,
+                                   struct virtio_blk_request* request) {
+    uint32_t total = request->segment_count + 2;
+    
+    for (uint32_t i = 0; i < total; ++i) {
+        struct virtq_desc* descriptor = &table[indices ? indices[i] : i];
+        
+        if (i == 0) {
+            descriptor->address = (uint32_t)&request->header;
+            descriptor->length = sizeof(request->header);
+            descriptor->flags = 0;
+        } else if (i == total - 1) {
+            descriptor->address = (uint32_t)&request->status;
+            descriptor->length = 1;
+            descriptor->flags = VIRTQ_DESC_F_WRITE;
+        } else {
+            descriptor->address = (uint32_t)request->segments[i - 1].buffer;
+            descriptor->length = request->segments[i - 1].length;
+            descriptor->flags = request->write ? 0 : VIRTQ_DESC_F_WRITE;
+        }
+        if (i + 1 < total) {
+            descriptor->flags |= VIRTQ_DESC_F_NEXT;
+            descriptor->next = (uint16_t)(indices ? indices[i + 1] : i + 1);
+        }
+    }
+}
+
+/**
+ * @brief Queue a request on the current CPU's queue without waiting
+ * 
+ * @param index Device number
+ * @param request Request with sector, count, write and segments set
+ * @return 0 once queued, otherwise a negative error
+ * 
+ * Sleeps only while the ring is out of descriptors. Call
+ * virtio_blk_wait() for the result.
+ */
+int32_t virtio_blk_submit(uint32_t index, struct virtio_blk_request* request) {
+    struct virtio_blk_device* device = index < VIRTIO_BLK_MAX_DEVICES ? &virtio_blk_devices[index] : NULL;
+    uint32_t bytes = 0;
+    
+    if (!device || !device->present) return ERROR_NOT_FOUND;
+    if (request->count == 0 || request->sector >= device->capacity ||
+        request->count > device->capacity - request->sector ||
+        request->segment_count == 0 || request->segment_count > device->segment_max) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    for (uint32_t i = 0; i < request->segment_count; ++i) {
+        const struct virtio_blk_segment* segment = &request->segments[i];
+        if (segment->length == 0 || (uint32_t)segment->buffer + segment->length > KERNEL_SPACE_END) {
+            return ERROR_INVALID_ARGUMENT;
+        }
+        bytes += segment->length;
+    }
+    if (bytes != request->count * VIRTIO_BLK_SECTOR_SIZE) return ERROR_INVALID_ARGUMENT;
+    
+    struct virtqueue* queue = &device->queues[cpu_current() % device->queue_count];
+    uint32_t total = request->segment_count + 2;
+    int indirect = queue->indirect && total > VIRTIO_DIRECT_CHAIN_MAX;
+    uint32_t needed = indirect ? 1 : total;
+    
+    if (needed > queue->size) return ERROR_INVALID_ARGUMENT;
+    while (queue->free_count < needed) {
+        wait_queue_sleep(&queue->free_queue);
+    }
+    
+    request->header.type = request->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    request->header.reserved = 0;
+    request->header.sector = request->sector;
+    request->status = 0xFF;
+    request->done = 0;
+    request->result = 0;
+    
+    uint16_t indices[VIRTIO_BLK_MAX_DESCRIPTORS];
+    for (uint32_t i = 0; i < needed; ++i) {
+        indices[i] = queue->free_head;
+        queue->free_head = queue->descriptors[queue->free_head].next;
+    }
+    queue->free_count = (uint16_t)(queue->free_count - needed);
+    uint16_t head = indices[0];
+    
+    if (indirect) {
+        struct virtq_desc* table = &queue->indirect[head * VIRTIO_BLK_MAX_DESCRIPTORS];
+        virtio_blk_build_chain(table, NULL, request);
+        queue->descriptors[head].address = (uint32_t)table;
+        queue->descriptors[head].length = total * sizeof(struct virtq_desc);
+        queue->descriptors[head].flags = VIRTQ_DESC_F_INDIRECT;
+    } else {
+        virtio_blk_build_chain(queue->descriptors, indices, request);
+    }
+    
+    queue->tokens[head] = request;
+    virtqueue_publish(queue, head);
+    return 0;
+}
+
+/**
+ * @brief Wait for a submitted request to complete
+ * 
+ * @param request Request passed to virtio_blk_submit()
+ * @return 0 on success, ERROR_IO if the device reported an error
+ */
+int32_t virtio_blk_wait(struct virtio_blk_request* request) {
+    while (!request->done) {
+        wait_queue_sleep(&request->queue);
+    }
+    return request->result;
+}
+
+/**
+ * @brief Read or write a contiguous kernel buffer and wait for it
+ * 
+ * @param index Device number
+ * @param sector First sector
+ * @param count Number of sectors
+ * @param buffer Identity-mapped kernel buffer of count * 512 bytes
+ * @param write Non-zero to write to the disk
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t virtio_blk_transfer(uint32_t index, uint64_t sector, uint32_t count, void* buffer, int write) {
+    struct virtio_blk_request request;
+    uint8_t* data = (uint8_t*)buffer;
+    int32_t result = 0;
+    
+    memset(&request, 0, sizeof(request));
+    while (count > 0 && result == 0) {
+        uint32_t chunk = count < VIRTIO_BLK_MAX_SECTORS ? count : VIRTIO_BLK_MAX_SECTORS;
+        
+        request.sector = sector;
+        request.count = chunk;
+        request.write = write;
+        request.segment_count = 1;
+        request.segments[0].buffer = data;
+        request.segments[0].length = chunk * VIRTIO_BLK_SECTOR_SIZE;
+        result = virtio_blk_submit(index, &request);
+        if (result == 0) result = virtio_blk_wait(&request);
+        
+        sector += chunk;
+        count -= chunk;
+        data += chunk * VIRTIO_BLK_SECTOR_SIZE;
+    }
+    return result;
+}
+
+/**
+ * @brief Reap a queue's used ring and re-arm its completion interrupt
+ * 
+ * @param queue Queue to reap
+ * 
+ * used_event is set to the next entry we have not seen, then the ring is
+ * checked once more, since the device may have completed a request
+ * before it saw the new value.
+ */
+static void virtqueue_reap(struct virtqueue* queue) {
+    uint16_t freed = 0;
+    
+    do {
+        while (queue->last_used != queue->used->index) {
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);    // Index before the entry
+            struct virtq_used_element element = queue->used->ring[queue->last_used % queue->size];
+            struct virtio_blk_request* request = (struct virtio_blk_request*)queue->tokens[element.id];
+            
+            queue->tokens[element.id] = NULL;
+            virtqueue_free_chain(queue, (uint16_t)element.id);
+            queue->last_used++;
+            freed = 1;
+            
+            request->result = request->status == VIRTIO_BLK_S_OK ? 0 : ERROR_IO;
+            request->done = 1;
+            wait_queue_wake_all(&request->queue);
+        }
+        if (queue->event_index) *virtq_used_event(queue) = queue->last_used;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } while (queue->last_used != queue->used->index);
+    
+    if (freed) wait_queue_wake_all(&queue->free_queue);
+}
+
+// Bottom half: reap every queue of every device
+static void virtio_blk_complete(struct deferred_work* work) {
+    (void)work;
+    
+    for (uint32_t index = 0; index < VIRTIO_BLK_MAX_DEVICES; ++index) {
+        struct virtio_blk_device* device = &virtio_blk_devices[index];
+        
+        for (uint32_t queue = 0; device->present && queue < device->queue_count; ++queue) {
+            virtqueue_reap(&device->queues[queue]);
+        }
+    }
+}
+
+// Top half: reading the ISR acknowledges the interrupt
+static void virtio_blk_interrupt(struct trap_frame* frame, void* context) {
+    struct virtio_blk_device* device = (struct virtio_blk_device*)context;
+    (void)frame;
+    
+    if (mmio_read8(device->isr) & VIRTIO_ISR_QUEUE) {
+        deferred_work_schedule(&virtio_blk_completion_work);
+    }
+}
+
+/**
+ * @brief Map the structure a virtio capability points at
+ * 
+ * @param pci Function owning the capability
+ * @param capability Configuration space offset of the capability
+ * @return Kernel pointer to the structure, or NULL if it cannot be mapped
+ */
+static uint8_t* virtio_map_capability(const struct pci_device* pci, uint8_t capability) {
+    uint32_t bar = pci_config_read(pci, (uint8_t)(capability + VIRTIO_CAP_BAR)) & 0xFF;
+    uint32_t offset = pci_config_read(pci, (uint8_t)(capability + VIRTIO_CAP_OFFSET));
+    uint32_t length = pci_config_read(pci, (uint8_t)(capability + VIRTIO_CAP_LENGTH));
+    uint32_t base = bar < 6 ? pci_bar_address(pci, bar) : 0;
+    
+    if (!base) return NULL;
+    return paging_map_device(base + offset, length);
+}
+
+/**
+ * @brief Allocate and register one virtqueue
+ * 
+ * @param device Device in FEATURES_OK state
+ * @param queue Queue to set up
+ * @param index Queue number
+ * @param notify_base Start of the notify structure
+ * @param notify_multiplier Bytes between queue notify addresses
+ * @param features Negotiated low feature word
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t virtqueue_initialize(struct virtio_blk_device* device, struct virtqueue* queue, uint16_t index,
+                                    uint8_t* notify_base, uint32_t notify_multiplier, uint32_t features) {
+    uint8_t* common = device->common;
+    
+    mmio_write16(common + VIRTIO_COMMON_QUEUE_SELECT, index);
+    uint16_t size = mmio_read16(common + VIRTIO_COMMON_QUEUE_SIZE);
+    if (size == 0) return ERROR_NOT_FOUND;
+    if (size > VIRTIO_QUEUE_MAX_SIZE) size = VIRTIO_QUEUE_MAX_SIZE;
+    
+    uint32_t avail_offset = size * sizeof(struct virtq_desc);
+    uint32_t used_offset = avail_offset + sizeof(struct virtq_avail) + (size + 1) * sizeof(uint16_t);
+    used_offset = (used_offset + VIRTQ_USED_ALIGN - 1) & ~(uint32_t)(VIRTQ_USED_ALIGN - 1);
+    uint32_t total = used_offset + sizeof(struct virtq_used) +
+                     size * sizeof(struct virtq_used_element) + sizeof(uint16_t);
+    uint32_t memory = page_frame_allocate_contiguous(PAGE_ALIGN_UP(total) / PAGE_SIZE, PAGE_SIZE, 0);
+    if (!memory) return ERROR_NO_MEMORY;
+    memset((void*)memory, 0, PAGE_ALIGN_UP(total));
+    
+    if (features & VIRTIO_RING_F_INDIRECT_DESC) {
+        queue->indirect = heap_allocate(size * VIRTIO_BLK_MAX_DESCRIPTORS * sizeof(struct virtq_desc));
+    }
+    
+    queue->size = size;
+    queue->queue_index = index;
+    queue->event_index = (features & VIRTIO_RING_F_EVENT_IDX) != 0;
+    queue->ring_pages = PAGE_ALIGN_UP(total) / PAGE_SIZE;
+    queue->descriptors = (struct virtq_desc*)memory;
+    queue->avail = (volatile struct virtq_avail*)(memory + avail_offset);
+    queue->used = (volatile struct virtq_used*)(memory + used_offset);
+    for (uint16_t i = 0; i < size; ++i) {
+        queue->descriptors[i].next = (uint16_t)(i + 1);
+    }
+    queue->free_head = 0;
+    queue->free_count = size;
+    
+    uint16_t notify_offset = mmio_read16(common + VIRTIO_COMMON_QUEUE_NOTIFY_OFF);
+    queue->notify = (volatile uint16_t*)(notify_base + notify_offset * notify_multiplier);
+    
+    mmio_write16(common + VIRTIO_COMMON_QUEUE_SIZE, size);
+    mmio_write16(common + VIRTIO_COMMON_QUEUE_MSIX, VIRTIO_MSIX_NO_VECTOR);
+    mmio_write32(common + VIRTIO_COMMON_QUEUE_DESC, memory);
+    mmio_write32(common + VIRTIO_COMMON_QUEUE_DESC + 4, 0);
+    mmio_write32(common + VIRTIO_COMMON_QUEUE_DRIVER, memory + avail_offset);
+    mmio_write32(common + VIRTIO_COMMON_QUEUE_DRIVER + 4, 0);
+    mmio_write32(common + VIRTIO_COMMON_QUEUE_DEVICE, memory + used_offset);
+    mmio_write32(common + VIRTIO_COMMON_QUEUE_DEVICE + 4, 0);
+    mmio_write16(common + VIRTIO_COMMON_QUEUE_ENABLE, 1);
+    return 0;
+}
+
+// Give back a queue's memory once the device has been reset
+static void virtqueue_free(struct virtqueue* queue) {
+    for (uint32_t i = 0; i < queue->ring_pages; ++i) {
+        page_frame_free((uint32_t)queue->descriptors + i * PAGE_SIZE);
+    }
+    if (queue->indirect) heap_free(queue->indirect);
+    memset(queue, 0, sizeof(*queue));
+}
+
+// Reset a device that failed to come up, free its queues and tell it the
+// driver gave up
+static void virtio_blk_abandon(struct virtio_blk_device* device) {
+    uint8_t* common = device->common;
+    
+    mmio_write8(common + VIRTIO_COMMON_STATUS, 0);
+    while (mmio_read8(common + VIRTIO_COMMON_STATUS) != 0) {
+    }
+    for (uint32_t queue = 0; queue < VIRTIO_BLK_MAX_QUEUES; ++queue) {
+        virtqueue_free(&device->queues[queue]);
+    }
+    mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+}
+
+/**
+ * @brief Negotiate features and bring up one virtio-blk function
+ * 
+ * @param pci PCI function
+ * @param device Slot to fill, zeroed
+ * 
+ * If the device cannot be used, any queues set up so far are freed and
+ * present stays 0.
+ */
+static void virtio_blk_probe(const struct pci_device* pci, struct virtio_blk_device* device) {
+    uint8_t* notify_base = NULL;
+    uint32_t notify_multiplier = 0;
+    
+    for (uint8_t cap = pci_find_capability(pci, PCI_CAPABILITY_VENDOR, 0); cap;
+         cap = pci_find_capability(pci, PCI_CAPABILITY_VENDOR, cap)) {
+        uint8_t type = (uint8_t)(pci_config_read(pci, cap) >> (VIRTIO_CAP_TYPE * 8));
+        
+        if (type == VIRTIO_CAP_COMMON && !device->common) {
+            device->common = virtio_map_capability(pci, cap);
+        } else if (type == VIRTIO_CAP_NOTIFY && !notify_base) {
+            notify_base = virtio_map_capability(pci, cap);
+            notify_multiplier = pci_config_read(pci, (uint8_t)(cap + VIRTIO_CAP_NOTIFY_MULTIPLIER));
+        } else if (type == VIRTIO_CAP_ISR && !device->isr) {
+            device->isr = virtio_map_capability(pci, cap);
+        } else if (type == VIRTIO_CAP_DEVICE && !device->config) {
+            device->config = virtio_map_capability(pci, cap);
+        }
+    }
+    if (!device->common || !notify_base || !device->isr || !device->config) return;
+    
+    uint8_t* common = device->common;
+    mmio_write8(common + VIRTIO_COMMON_STATUS, 0);              // Reset
+    while (mmio_read8(common + VIRTIO_COMMON_STATUS) != 0) {
+    }
+    mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+    
+    mmio_write32(common + VIRTIO_COMMON_DEVICE_FEATURE_SELECT, 0);
+    uint32_t features = mmio_read32(common + VIRTIO_COMMON_DEVICE_FEATURE) &
+                        (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_MQ | VIRTIO_RING_F_INDIRECT_DESC |
+                         VIRTIO_RING_F_EVENT_IDX);
+    mmio_write32(common + VIRTIO_COMMON_DEVICE_FEATURE_SELECT, 1);
+    if (!(mmio_read32(common + VIRTIO_COMMON_DEVICE_FEATURE) & VIRTIO_F_VERSION_1_HIGH)) {
+        mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    mmio_write32(common + VIRTIO_COMMON_DRIVER_FEATURE_SELECT, 0);
+    mmio_write32(common + VIRTIO_COMMON_DRIVER_FEATURE, features);
+    mmio_write32(common + VIRTIO_COMMON_DRIVER_FEATURE_SELECT, 1);
+    mmio_write32(common + VIRTIO_COMMON_DRIVER_FEATURE, VIRTIO_F_VERSION_1_HIGH);
+    mmio_write8(common + VIRTIO_COMMON_STATUS,
+                VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+    if (!(mmio_read8(common + VIRTIO_COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    
+    device->capacity = mmio_read32(device->config + VIRTIO_BLK_CONFIG_CAPACITY) |
+                       ((uint64_t)mmio_read32(device->config + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32);
+    if (device->capacity == 0) {
+        mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return;
+    }
+    
+    // Indirect tables hold every segment; without them a chain must fit in the ring
+    device->segment_max = VIRTIO_BLK_MAX_SEGMENTS;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t segment_max = mmio_read32(device->config + VIRTIO_BLK_CONFIG_SEG_MAX);
+        if (segment_max && segment_max < device->segment_max) device->segment_max = segment_max;
+    }
+    
+    // One queue per CPU when the device has enough
+    uint32_t queues = 1;
+    if (features & VIRTIO_BLK_F_MQ) {
+        queues = mmio_read16(device->config + VIRTIO_BLK_CONFIG_NUM_QUEUES);
+        if (queues > VIRTIO_BLK_MAX_QUEUES) queues = VIRTIO_BLK_MAX_QUEUES;
+        if (queues == 0) queues = 1;
+    }
+    for (uint32_t queue = 0; queue < queues; ++queue) {
+        if (virtqueue_initialize(device, &device->queues[queue], (uint16_t)queue, notify_base,
+                                 notify_multiplier, features) != 0) {
+            virtio_blk_abandon(device);
+            return;
+        }
+        if (!device->queues[queue].indirect && device->queues[queue].size < device->segment_max + 2) {
+            device->segment_max = device->queues[queue].size - 2u;
+        }
+    }
+    device->queue_count = queues;
+    
+    irq_register_handler(pci->irq_line, virtio_blk_interrupt, device);
+    mmio_write8(common + VIRTIO_COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER |
+                                               VIRTIO_STATUS_FEATURES_OK | VIRTIO_STATUS_DRIVER_OK);
+    device->present = 1;
+}
+
+/**
+ * @brief Find and bring up every virtio-blk PCI function
+ * 
+ * Must run before the first process is created (see paging_map_device()).
+ */
+void virtio_blk_initialize(void) {
+    uint32_t count = 0;
+    
+    virtio_blk_completion_work.function = virtio_blk_complete;
+    for (uint32_t i = 0; i < pci_device_count && count < VIRTIO_BLK_MAX_DEVICES; ++i) {
+        const struct pci_device* pci = &pci_devices[i];
+        
+        if (pci->vendor_id != VIRTIO_VENDOR_ID ||
+            (pci->device_id != VIRTIO_DEVICE_BLOCK && pci->device_id != VIRTIO_DEVICE_BLOCK_LEGACY)) {
+            continue;
+        }
+        pci_enable_bus_master(pci);
+        virtio_blk_probe(pci, &virtio_blk_devices[count]);
+        if (virtio_blk_devices[count].present) {
+            count++;
+        } else {
+            // Clear what the failed probe left for the next device
+            memset(&virtio_blk_devices[count], 0, sizeof(virtio_blk_devices[count]));
+        }
+    }
+}
+
+// =============================================================================
+// NVMe Disks
+// =============================================================================
+
+// NVMe controllers take commands on submission queues (SQ) in memory and
+// post results to completion queues (CQ); a doorbell write publishes a new
+// SQ tail or consumes CQ entries. Each CPU gets its own I/O queue pair so
+// submitters never share a tail, plus a second pair created with
+// interrupts disabled for polled requests, which spin on their CQ instead
+// of sleeping.
+//
+// Completions are found by the phase tag, which the controller inverts on
+// each pass through the CQ. Transfers are described with PRPs: the first
+// page in PRP1, then either the second page or a per-command PRP list in
+// PRP2.
+//
+// Interrupts arrive on the function's INTx line, the only delivery the
+// 8259 PICs offer. The top half masks the controller's interrupt (INTMS)
+// and schedules the bottom half, which reaps the interrupt-driven CQs and
+// unmasks it again (INTMC).
+// Source: NVM Express Base Specification 1.4, Sections 3.1 "Register
+//         Definition", 4 "Data Structures" and 5 "Admin Command Set"
+#define PCI_SUBCLASS_NVM           0x08
+
+// Controller registers
+#define NVME_CAP                   0x00    // 64-bit
+#define NVME_INTMS                 0x0C
+#define NVME_INTMC                 0x10
+#define NVME_CC                    0x14
+#define NVME_CSTS                  0x1C
+#define NVME_AQA                   0x24
+#define NVME_ASQ                   0x28    // 64-bit
+#define NVME_ACQ                   0x30    // 64-bit
+#define NVME_DOORBELLS             0x1000
+#define NVME_REGISTER_BYTES        0x4000
+
+#define NVME_CAP_MQES(low)         ((low) & 0xFFFF)             // Zero-based
+#define NVME_CAP_DSTRD(high)       ((high) & 0xF)
+#define NVME_CAP_TO(low)           ((low) >> 24)                // Ready timeout, 500ms units
+#define NVME_CC_ENABLE             0x1
+#define NVME_CC_IOSQES             (6 << 16)                    // 64-byte entries
+#define NVME_CC_IOCQES             (4 << 20)                    // 16-byte entries
+#define NVME_CSTS_READY            0x1
+#define NVME_CSTS_FATAL            0x2
+
+// Admin and NVM command opcodes
+#define NVME_ADMIN_CREATE_SQ       0x01
+#define NVME_ADMIN_CREATE_CQ       0x05
+#define NVME_ADMIN_ABORT           0x08
+#define NVME_ADMIN_IDENTIFY        0x06
+#define NVME_ADMIN_SET_FEATURES    0x09
+#define NVME_CMD_WRITE             0x01
+#define NVME_CMD_READ              0x02
+
+#define NVME_IDENTIFY_NAMESPACE    0
+#define NVME_IDENTIFY_CONTROLLER   1
+#define NVME_FEATURE_QUEUES        0x07
+#define NVME_QUEUE_CONTIGUOUS      0x1
+#define NVME_QUEUE_INTERRUPTS      0x2
+#define NVME_ID_MDTS               77      // Controller: log2 max transfer in pages
+#define NVME_ID_NSZE               0       // Namespace: size in blocks
+#define NVME_ID_FLBAS              26
+#define NVME_ID_LBAF               128
+#define NVME_NAMESPACE             1
+
+#define NVME_PAGE_SIZE             4096
+#define NVME_MAX_CONTROLLERS       2
+#define NVME_ADMIN_QUEUE_SIZE      16
+#define NVME_QUEUE_SIZE            64
+#define NVME_QUEUE_COMMANDS        32      // In flight per queue; below NVME_QUEUE_SIZE so the SQ never fills
+#define NVME_MAX_TRANSFER          (128 * 1024)
+#define NVME_PRP_LIST_ENTRIES      (NVME_MAX_TRANSFER / NVME_PAGE_SIZE)
+#define NVME_MAX_QUEUES            (2 * CPU_COUNT)             // Interrupt-driven and polled per CPU
+#define NVME_ADMIN_TIMEOUT_MS      1000
+#define NVME_POLL_TIMEOUT_MS       5000    // Longest a polled request may spin
+#define NVME_PRP_LIST_BYTES        (NVME_QUEUE_COMMANDS * NVME_PRP_LIST_ENTRIES * sizeof(uint64_t))
+#define NVME_PRP_LIST_PAGES        (PAGE_ALIGN_UP(NVME_PRP_LIST_BYTES) / PAGE_SIZE)
+
+struct nvme_command {
+    uint32_t opcode_id;             // Opcode in bits 7:0, command ID in 31:16
+    uint32_t namespace_id;
+    uint32_t reserved[2];
+    uint64_t metadata;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t dwords[6];             // Command dwords 10-15
+};
+
+struct nvme_completion {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t command_id;
+    uint16_t status;                // Phase tag in bit 0
+};
+
+// A read or write in flight. Submitted with nvme_submit() and reaped by
+// the bottom half, or by nvme_wait() itself for polled requests.
+struct nvme_request {
+    uint64_t lba;
+    uint32_t count;                 // Logical blocks
+    int write;
+    int polled;                     // Complete by spinning on a polled queue
+    void* buffer;                   // Identity-mapped kernel memory
+    volatile int done;
+    int32_t result;
+    struct wait_queue queue;
+};
+
+struct nvme_queue {
+    struct nvme_command* submissions;
+    volatile struct nvme_completion* completions;
+    volatile uint32_t* sq_doorbell;
+    volatile uint32_t* cq_doorbell;
+    uint16_t id;
+    uint16_t size;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint16_t phase;                 // Phase tag of new entries
+    uint32_t busy;                  // Command IDs in flight
+    uint64_t* prp_lists;            // NVME_PRP_LIST_ENTRIES per command ID
+    struct nvme_request* requests[NVME_QUEUE_COMMANDS];
+    struct wait_queue slot_queue;   // Submitters waiting for a command ID
+};
+
+struct nvme_controller {
+    int present;
+    uint8_t* registers;
+    uint32_t doorbell_stride;
+    uint32_t ready_timeout;         // Milliseconds CSTS.RDY may take to follow CC.EN
+    uint32_t block_size;
+    uint64_t block_count;
+    uint32_t max_blocks;            // Per command
+    uint32_t queue_count;           // Interrupt-driven pairs
+    uint32_t polled_count;          // Polled pairs
+    struct nvme_queue admin;
+    struct nvme_queue queues[NVME_MAX_QUEUES];  // Interrupt-driven, then polled
+};
+
+static struct nvme_controller nvme_controllers[NVME_MAX_CONTROLLERS];
+static struct deferred_work nvme_completion_work;
+
+/**
+ * @brief Allocate a queue pair's rings and PRP lists and point its doorbells
+ * 
+ * @param controller Controller owning the queue
+ * @param queue Queue to set up
+ * @param id Queue ID (0 for admin)
+ * @param size Entries in each ring
+ * @return 0 on success, ERROR_NO_MEMORY if the rings cannot be allocated
+ */
+static int32_t nvme_queue_allocate(struct nvme_controller* controller, struct nvme_queue* queue,
+                                   uint16_t id, uint16_t size) {
+    uint32_t submissions = page_frame_allocate();
+    uint32_t completions = page_frame_allocate();
+    uint32_t lists = page_frame_allocate_contiguous(NVME_PRP_LIST_PAGES, PAGE_SIZE, 0);
+    if (!submissions || !completions || !lists) {
+        if (submissions) page_frame_free(submissions);
+        if (completions) page_frame_free(completions);
+        for (uint32_t i = 0; lists && i < NVME_PRP_LIST_PAGES; ++i) {
+            page_frame_free(lists + i * PAGE_SIZE);
+        }
+        return ERROR_NO_MEMORY;
+    }
+    
+    memset((void*)submissions, 0, PAGE_SIZE);
+    memset((void*)completions, 0, PAGE_SIZE);
+    queue->submissions = (struct nvme_command*)submissions;
+    queue->completions = (volatile struct nvme_completion*)completions;
+    queue->prp_lists = (uint64_t*)lists;
+    queue->sq_doorbell = (volatile uint32_t*)(controller->registers + NVME_DOORBELLS +
+                                              (2u * id) * controller->doorbell_stride);
+    queue->cq_doorbell = (volatile uint32_t*)(controller->registers + NVME_DOORBELLS +
+                                              (2u * id + 1) * controller->doorbell_stride);
+    queue->id = id;
+    queue->size = size;
+    queue->sq_tail = 0;
+    queue->cq_head = 0;
+    queue->phase = 1;
+    queue->busy = 0;
+    return 0;
+}
+
+// Give back a queue's rings and PRP lists, once the controller no longer
+// uses them
+static void nvme_queue_free(struct nvme_queue* queue) {
+    if (!queue->submissions) return;
+    
+    page_frame_free((uint32_t)queue->submissions);
+    page_frame_free((uint32_t)queue->completions);
+    for (uint32_t i = 0; i < NVME_PRP_LIST_PAGES; ++i) {
+        page_frame_free((uint32_t)queue->prp_lists + i * PAGE_SIZE);
+    }
+    queue->submissions = NULL;
+}
+
+/**
+ * @brief Wait for CSTS.RDY to follow CC.EN
+ * 
+ * @param controller Controller with registers and ready_timeout set
+ * @param ready NVME_CSTS_READY to wait for enabling, 0 for disabling
+ * @return 0 once it has, ERROR_IO on a fatal status while enabling,
+ *         ERROR_TIMED_OUT after ready_timeout
+ * 
+ * Runs during boot with interrupts off, so it halts between reads to let
+ * timer_ticks advance.
+ */
+static int32_t nvme_wait_ready(struct nvme_controller* controller, uint32_t ready) {
+    uint32_t deadline = timer_ticks + controller->ready_timeout * (TIMER_FREQUENCY / 1000);
+    
+    for (;;) {
+        uint32_t status = mmio_read32(controller->registers + NVME_CSTS);
+        
+        if ((status & NVME_CSTS_READY) == ready) return 0;
+        if (ready && (status & NVME_CSTS_FATAL)) return ERROR_IO;
+        if ((int32_t)(deadline - timer_ticks) <= 0) return ERROR_TIMED_OUT;
+        __asm__ volatile("sti; hlt; cli");
+    }
+}
+
+/**
+ * @brief Copy a command into the SQ and ring its tail doorbell
+ * 
+ * @param queue Queue to submit on
+ * @param command Command with everything but the command ID filled in
+ * @param id Command ID
+ */
+static void nvme_queue_push(struct nvme_queue* queue, struct nvme_command* command, uint16_t id) {
+    command->opcode_id = (command->opcode_id & 0xFF) | ((uint32_t)id << 16);
+    queue->submissions[queue->sq_tail] = *command;
+    queue->sq_tail = (uint16_t)((queue->sq_tail + 1) % queue->size);
+    
+    __atomic_thread_fence(__ATOMIC_RELEASE);    // Entry before the doorbell
+    mmio_write32(queue->sq_doorbell, queue->sq_tail);
+}
+
+/**
+ * @brief Take the next CQ entry if the controller has posted one
+ * 
+ * @param queue Queue to check
+ * @param completion Receives the entry
+ * @return 1 if an entry was taken, 0 if the CQ is empty
+ * 
+ * The caller rings the CQ head doorbell once it has taken a batch.
+ */
+static int nvme_queue_next(struct nvme_queue* queue, struct nvme_completion* completion) {
+    volatile struct nvme_completion* entry = &queue->completions[queue->cq_head];
+    
+    if ((entry->status & 1) != queue->phase) return 0;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);    // Phase tag before the rest of the entry
+    *completion = *entry;
+    if (++queue->cq_head == queue->size) {
+        queue->cq_head = 0;
+        queue->phase ^= 1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Run an admin command by polling, during boot or to abort a
+ *        polled request
+ * 
+ * @param controller Enabled controller
+ * @param command Command to run
+ * @param result Receives completion dword 0, or NULL
+ * @return 0 on success, ERROR_IO on a command error, ERROR_TIMED_OUT if
+ *         it does not complete within NVME_ADMIN_TIMEOUT_MS
+ * 
+ * Halts between checks of the CQ, as nvme_wait_ready() does.
+ */
+static int32_t nvme_admin(struct nvme_controller* controller, struct nvme_command* command, uint32_t* result) {
+    struct nvme_queue* queue = &controller->admin;
+    struct nvme_completion completion;
+    uint32_t deadline = timer_ticks + NVME_ADMIN_TIMEOUT_MS * (TIMER_FREQUENCY / 1000);
+    
+    nvme_queue_push(queue, command, 0);
+    while (!nvme_queue_next(queue, &completion)) {
+        if ((int32_t)(deadline - timer_ticks) <= 0) return ERROR_TIMED_OUT;
+        __asm__ volatile("sti; hlt; cli");
+    }
+    mmio_write32(queue->cq_doorbell, queue->cq_head);
+    if (result) *result = completion.result;
+    return (completion.status >> 1) ? ERROR_IO : 0;
+}
+
+/**
+ * @brief Fill a command's PRP entries for a contiguous buffer
+ * 
+ * @param command Command to fill
+ * @param list This command ID's PRP list
+ * @param buffer Start of the data
+ * @param length Bytes, at most NVME_MAX_TRANSFER
+ * 
+ * PRP1 may start mid-page; every later entry is page-aligned.
+ */
+static void nvme_build_prps(struct nvme_command* command, uint64_t* list, uint32_t buffer, uint32_t length) {
+    uint32_t first = NVME_PAGE_SIZE - (buffer & (NVME_PAGE_SIZE - 1));
+    
+    command->prp1 = buffer;
+    command->prp2 = 0;
+    if (length <= first) return;
+    
+    uint32_t page = buffer + first;
+    uint32_t remaining = length - first;
+    if (remaining <= NVME_PAGE_SIZE) {
+        command->prp2 = page;
+        return;
+    }
+    
+    for (uint32_t i = 0; remaining > 0; ++i) {
+        list[i] = page;
+        page += NVME_PAGE_SIZE;
+        remaining = remaining > NVME_PAGE_SIZE ? remaining - NVME_PAGE_SIZE : 0;
+    }
+    command->prp2 = (uint32_t)list;
+}
+
+/**
+ * @brief Complete every request the controller has posted to a queue
+ * 
+ * @param queue I/O queue to reap
+ * @return Number of requests completed
+ */
+static uint32_t nvme_queue_reap(struct nvme_queue* queue) {
+    struct nvme_completion completion;
+    uint32_t reaped = 0;
+    
+    while (nvme_queue_next(queue, &completion)) {
+        uint16_t id = completion.command_id;
+        struct nvme_request* request;
+        
+        if (id >= NVME_QUEUE_COMMANDS || !(queue->busy & (1u << id))) continue;
+        request = queue->requests[id];
+        queue->requests[id] = NULL;
+        queue->busy &= ~(1u << id);
+        reaped++;
+        if (!request) continue;         // Given up on by nvme_wait()
+        
+        request->result = (completion.status >> 1) ? ERROR_IO : 0;
+        request->done = 1;
+        wait_queue_wake_all(&request->queue);
+    }
+    if (reaped) {
+        mmio_write32(queue->cq_doorbell, queue->cq_head);
+        wait_queue_wake_all(&queue->slot_queue);
+    }
+    return reaped;
+}
+
+/**
+ * @brief Give up on a polled request that has not completed in time
+ * 
+ * @param controller Controller the request was submitted to
+ * @param queue Polled queue it is on
+ * @param request Request to drop
+ * 
+ * Asks the controller to abort the command, which then completes with
+ * an error. Abort is best effort: if the request is still not done, it
+ * is detached from its command ID, which stays busy until the controller
+ * posts a completion for it, so a late completion touches no request.
+ */
+static void nvme_abort(struct nvme_controller* controller, struct nvme_queue* queue, struct nvme_request* request) {
+    for (uint16_t id = 0; id < NVME_QUEUE_COMMANDS; ++id) {
+        if (queue->requests[id] != request) continue;
+        
+        struct nvme_command command;
+        memset(&command, 0, sizeof(command));
+        command.opcode_id = NVME_ADMIN_ABORT;
+        command.dwords[0] = queue->id | ((uint32_t)id << 16);
+        nvme_admin(controller, &command, NULL);
+        nvme_queue_reap(queue);
+        if (!request->done) queue->requests[id] = NULL;
+        return;
+    }
+}
+
+/**
+ * @brief Queue a read or write on the current CPU's queue without waiting
+ * 
+ * @param index Controller number
+ * @param request Request with lba, count, write, polled and buffer set
+ * @return 0 once queued, otherwise a negative error
+ * 
+ * Sleeps only while every command ID on the queue is in flight. Call
+ * nvme_wait() for the result.
+ */
+int32_t nvme_submit(uint32_t index, struct nvme_request* request) {
+    struct nvme_controller* controller = index < NVME_MAX_CONTROLLERS ? &nvme_controllers[index] : NULL;
+    
+    if (!controller || !controller->present) return ERROR_NOT_FOUND;
+    if (request->count == 0 || request->count > controller->max_blocks ||
+        request->lba >= controller->block_count || request->count > controller->block_count - request->lba) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    uint32_t length = request->count * controller->block_size;
+    if ((uint32_t)request->buffer & 3 || (uint32_t)request->buffer + length > KERNEL_SPACE_END) {
+        return ERROR_INVALID_ARGUMENT;          // PRP entries must be dword-aligned
+    }
+    
+    uint32_t cpu = cpu_current();
+    struct nvme_queue* queue = request->polled && controller->polled_count
+        ? &controller->queues[controller->queue_count + cpu % controller->polled_count]
+        : &controller->queues[cpu % controller->queue_count];
+    
+    while (queue->busy == 0xFFFFFFFF) {         // All NVME_QUEUE_COMMANDS IDs in flight
+        if (queue->id > controller->queue_count) nvme_queue_reap(queue);
+        else wait_queue_sleep(&queue->slot_queue);
+    }
+    uint16_t id = (uint16_t)__builtin_ctz(~queue->busy);
+    
+    struct nvme_command command;
+    memset(&command, 0, sizeof(command));
+    command.opcode_id = request->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+    command.namespace_id = NVME_NAMESPACE;
+    command.dwords[0] = (uint32_t)request->lba;
+    command.dwords[1] = (uint32_t)(request->lba >> 32);
+    command.dwords[2] = request->count - 1;         // Zero-based
+    nvme_build_prps(&command, &queue->prp_lists[id * NVME_PRP_LIST_ENTRIES], (uint32_t)request->buffer, length);
+    
+    request->done = 0;
+    request->result = 0;
+    queue->requests[id] = request;
+    queue->busy |= 1u << id;
+    nvme_queue_push(queue, &command, id);
+    return 0;
+}
+
+/**
+ * @brief Wait for a submitted request to complete
+ * 
+ * @param index Controller the request was submitted to
+ * @param request Request passed to nvme_submit()
+ * @return 0 on success, ERROR_IO if the controller reported an error or
+ *         a polled request did not complete within NVME_POLL_TIMEOUT_MS
+ * 
+ * Polled requests spin on their CQ, reaping whatever else completes on
+ * it, rather than waiting for an interrupt and a context switch. The
+ * spin runs with interrupts off, so its deadline is kept on the TSC. A
+ * request that misses it is aborted (see nvme_abort()).
+ */
+int32_t nvme_wait(uint32_t index, struct nvme_request* request) {
+    struct nvme_controller* controller = &nvme_controllers[index];
+    
+    if (request->polled && controller->polled_count) {
+        struct nvme_queue* queue =
+            &controller->queues[controller->queue_count + cpu_current() % controller->polled_count];
+        uint64_t deadline = timestamp_read() + (uint64_t)NVME_POLL_TIMEOUT_MS * tsc_cycles_per_millisecond;
+        
+        while (!request->done) {
+            if (nvme_queue_reap(queue) == 0 && (int64_t)(timestamp_read() - deadline) >= 0) {
+                nvme_abort(controller, queue, request);
+                if (!request->done) return ERROR_IO;
+            }
+        }
+    }
+    while (!request->done) {
+        wait_queue_sleep(&request->queue);
+    }
+    return request->result;
+}
+
+/**
+ * @brief Read or write a contiguous kernel buffer and wait for it
+ * 
+ * @param index Controller number
+ * @param lba First logical block
+ * @param count Number of blocks
+ * @param buffer Identity-mapped, dword-aligned kernel buffer
+ * @param write Non-zero to write to the disk
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t nvme_transfer(uint32_t index, uint64_t lba, uint32_t count, void* buffer, int write) {
+    struct nvme_request request;
+    uint8_t* data = (uint8_t*)buffer;
+    int32_t result = 0;
+    
+    if (index >= NVME_MAX_CONTROLLERS || !nvme_controllers[index].present) return ERROR_NOT_FOUND;
+    
+    struct nvme_controller* controller = &nvme_controllers[index];
+    memset(&request, 0, sizeof(request));
+    while (count > 0 && result == 0) {
+        uint32_t chunk = count < controller->max_blocks ? count : controller->max_blocks;
+        
+        request.lba = lba;
+        request.count = chunk;
+        request.write = write;
+        request.buffer = data;
+        result = nvme_submit(index, &request);
+        if (result == 0) result = nvme_wait(index, &request);
+        
+        lba += chunk;
+        count -= chunk;
+        data += chunk * controller->block_size;
+    }
+    return result;
+}
+
+// Bottom half: reap the interrupt-driven queues, then unmask the controller
+static void nvme_complete(struct deferred_work* work) {
+    (void)work;
+    
+    for (uint32_t index = 0; index < NVME_MAX_CONTROLLERS; ++index) {
+        struct nvme_controller* controller = &nvme_controllers[index];
+        
+        if (!controller->present) continue;
+        for (uint32_t queue = 0; queue < controller->queue_count; ++queue) {
+            nvme_queue_reap(&controller->queues[queue]);
+        }
+        mmio_write32(controller->registers + NVME_INTMC, 1);
+    }
+}
+
+// Top half: mask the pin interrupt until the bottom half has consumed the CQs
+static void nvme_interrupt(struct trap_frame* frame, void* context) {
+    struct nvme_controller* controller = (struct nvme_controller*)context;
+    (void)frame;
+    
+    for (uint32_t queue = 0; queue < controller->queue_count; ++queue) {
+        struct nvme_queue* pair = &controller->queues[queue];
+        
+        if ((pair->completions[pair->cq_head].status & 1) == pair->phase) {
+            mmio_write32(controller->registers + NVME_INTMS, 1);
+            deferred_work_schedule(&nvme_completion_work);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Create an I/O queue pair on the controller
+ * 
+ * @param controller Enabled controller
+ * @param queue Queue to set up
+ * @param id Queue ID, from 1
+ * @param interrupts Non-zero to raise an interrupt on completion
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t nvme_create_queue(struct nvme_controller* controller, struct nvme_queue* queue,
+                                 uint16_t id, int interrupts) {
+    struct nvme_command command;
+    int32_t result = nvme_queue_allocate(controller, queue, id, NVME_QUEUE_SIZE);
+    if (result != 0) return result;
+    
+    // Pin-based interrupts all use vector 0
+    memset(&command, 0, sizeof(command));
+    command.opcode_id = NVME_ADMIN_CREATE_CQ;
+    command.prp1 = (uint32_t)queue->completions;
+    command.dwords[0] = ((uint32_t)(queue->size - 1) << 16) | id;
+    command.dwords[1] = NVME_QUEUE_CONTIGUOUS | (interrupts ? NVME_QUEUE_INTERRUPTS : 0);
+    result = nvme_admin(controller, &command, NULL);
+    if (result != 0) return result;
+    
+    memset(&command, 0, sizeof(command));
+    command.opcode_id = NVME_ADMIN_CREATE_SQ;
+    command.prp1 = (uint32_t)queue->submissions;
+    command.dwords[0] = ((uint32_t)(queue->size - 1) << 16) | id;
+    command.dwords[1] = ((uint32_t)id << 16) | NVME_QUEUE_CONTIGUOUS;
+    return nvme_admin(controller, &command, NULL);
+}
+
+/**
+ * @brief Enable a reset controller, identify namespace 1 and create its
+ *        I/O queues
+ * 
+ * @param pci NVMe PCI function
+ * @param controller Controller with registers mapped, disabled
+ * @param identify Page for identify data
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t nvme_start(const struct pci_device* pci, struct nvme_controller* controller, uint8_t* identify) {
+    uint8_t* registers = controller->registers;
+    uint32_t cap_low = mmio_read32(registers + NVME_CAP);
+    struct nvme_command command;
+    uint32_t granted;
+    int32_t result;
+    
+    uint16_t admin_size = NVME_CAP_MQES(cap_low) + 1u < NVME_ADMIN_QUEUE_SIZE
+                          ? (uint16_t)(NVME_CAP_MQES(cap_low) + 1) : NVME_ADMIN_QUEUE_SIZE;
+    if (NVME_CAP_MQES(cap_low) + 1u < NVME_QUEUE_SIZE) return ERROR_INVALID_ARGUMENT;
+    result = nvme_queue_allocate(controller, &controller->admin, 0, admin_size);
+    if (result != 0) return result;
+    
+    mmio_write32(registers + NVME_AQA, ((uint32_t)(admin_size - 1) << 16) | (admin_size - 1u));
+    mmio_write32(registers + NVME_ASQ, (uint32_t)controller->admin.submissions);
+    mmio_write32(registers + NVME_ASQ + 4, 0);
+    mmio_write32(registers + NVME_ACQ, (uint32_t)controller->admin.completions);
+    mmio_write32(registers + NVME_ACQ + 4, 0);
+    mmio_write32(registers + NVME_INTMS, 1);       // Until the handler is registered
+    mmio_write32(registers + NVME_CC, NVME_CC_ENABLE | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    result = nvme_wait_ready(controller, NVME_CSTS_READY);
+    if (result != 0) return result;
+    
+    memset(&command, 0, sizeof(command));
+    command.opcode_id = NVME_ADMIN_IDENTIFY;
+    command.prp1 = (uint32_t)identify;
+    command.dwords[0] = NVME_IDENTIFY_CONTROLLER;
+    result = nvme_admin(controller, &command, NULL);
+    if (result != 0) return result;
+    uint32_t max_transfer = NVME_MAX_TRANSFER;
+    if (identify[NVME_ID_MDTS] && identify[NVME_ID_MDTS] < 16 &&
+        ((uint32_t)NVME_PAGE_SIZE << identify[NVME_ID_MDTS]) < max_transfer) {
+        max_transfer = (uint32_t)NVME_PAGE_SIZE << identify[NVME_ID_MDTS];
+    }
+    
+    memset(&command, 0, sizeof(command));
+    command.opcode_id = NVME_ADMIN_IDENTIFY;
+    command.namespace_id = NVME_NAMESPACE;
+    command.prp1 = (uint32_t)identify;
+    command.dwords[0] = NVME_IDENTIFY_NAMESPACE;
+    result = nvme_admin(controller, &command, NULL);
+    if (result != 0) return result;
+    
+    uint32_t format = identify[NVME_ID_FLBAS] & 0xF;
+    uint32_t block_shift = identify[NVME_ID_LBAF + format * 4 + 2];
+    memcpy(&controller->block_count, identify + NVME_ID_NSZE, sizeof(controller->block_count));
+    if (controller->block_count == 0 || block_shift < 9 || block_shift > 12) return ERROR_INVALID_ARGUMENT;
+    controller->block_size = 1u << block_shift;
+    controller->max_blocks = max_transfer / controller->block_size;
+    
+    // Ask for an interrupt-driven and a polled pair per CPU
+    memset(&command, 0, sizeof(command));
+    command.opcode_id = NVME_ADMIN_SET_FEATURES;
+    command.dwords[0] = NVME_FEATURE_QUEUES;
+    command.dwords[1] = ((NVME_MAX_QUEUES - 1u) << 16) | (NVME_MAX_QUEUES - 1u);
+    result = nvme_admin(controller, &command, &granted);
+    if (result != 0) return result;
+    granted = ((granted & 0xFFFF) < (granted >> 16) ? (granted & 0xFFFF) : (granted >> 16)) + 1;
+    if (granted > NVME_MAX_QUEUES) granted = NVME_MAX_QUEUES;
+    
+    controller->queue_count = granted < CPU_COUNT ? granted : CPU_COUNT;
+    controller->polled_count = granted - controller->queue_count;
+    for (uint32_t queue = 0; queue < controller->queue_count + controller->polled_count; ++queue) {
+        result = nvme_create_queue(controller, &controller->queues[queue], (uint16_t)(queue + 1),
+                                   queue < controller->queue_count);
+        if (result != 0) {
+            if (queue < controller->queue_count) return result;
+            controller->polled_count = queue - controller->queue_count;
+            break;
+        }
+    }
+    
+    irq_register_handler(pci->irq_line, nvme_interrupt, controller);
+    mmio_write32(registers + NVME_INTMC, 1);
+    return 0;
+}
+
+/**
+ * @brief Reset and start one controller
+ * 
+ * @param pci NVMe PCI function
+ * @param controller Slot to fill
+ * 
+ * If starting fails, the controller is reset again, so that it lets go
+ * of its queues, and they are freed. A controller that does not respond
+ * to the reset keeps them, since it might still write to them.
+ */
+static void nvme_probe(const struct pci_device* pci, struct nvme_controller* controller) {
+    uint32_t base = pci_bar_address(pci, 0);
+    
+    if (!base) return;
+    controller->registers = paging_map_device(base, NVME_REGISTER_BYTES);
+    if (!controller->registers) return;
+    
+    uint8_t* registers = controller->registers;
+    uint32_t cap_low = mmio_read32(registers + NVME_CAP);
+    uint32_t cap_high = mmio_read32(registers + NVME_CAP + 4);
+    controller->doorbell_stride = 4u << NVME_CAP_DSTRD(cap_high);
+    controller->ready_timeout = (NVME_CAP_TO(cap_low) ? NVME_CAP_TO(cap_low) : 1) * 500;
+    
+    mmio_write32(registers + NVME_CC, 0);
+    if (nvme_wait_ready(controller, 0) != 0) return;
+    
+    uint8_t* identify = (uint8_t*)page_frame_allocate();
+    if (!identify) return;
+    
+    if (nvme_start(pci, controller, identify) == 0) {
+        controller->present = 1;
+        page_frame_free((uint32_t)identify);
+        return;
+    }
+    
+    mmio_write32(registers + NVME_CC, 0);
+    if (nvme_wait_ready(controller, 0) != 0) return;
+    for (uint32_t queue = 0; queue < NVME_MAX_QUEUES; ++queue) {
+        nvme_queue_free(&controller->queues[queue]);
+    }
+    nvme_queue_free(&controller->admin);
+    page_frame_free((uint32_t)identify);
+}
+
+/**
+ * @brief Find and bring up every NVMe controller
+ * 
+ * Must run before the first process is created (see paging_map_device()).
+ */
+void nvme_initialize(void) {
+    nvme_completion_work.function = nvme_complete;
+    for (uint32_t index = 0; index < NVME_MAX_CONTROLLERS; ++index) {
+        struct pci_device* pci = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_NVM, index);
+        
+        if (!pci) break;
+        pci_enable_bus_master(pci);
+        nvme_probe(pci, &nvme_controllers[index]);
+    }
+}
+
+// =============================================================================
+// Page Cache
+// =============================================================================
+
+// Cached file and block data, one page per (address space, page index).
+// An address space is the cacheable contents of one object (a block
+// device, or a file's data). Its resident pages hang off a radix tree
+// indexed by page number, so lookups cost one node per RADIX_TREE_SHIFT
+// bits of the index and sparse objects stay cheap.
+//
+// Replacement is 2Q. A page first read goes to the FIFO "recent" queue,
+// which is capped at PAGE_CACHE_RECENT_PERCENT of the cache; pages evicted
+// from it are remembered as keys only, in a ghost FIFO. A later miss on a
+// remembered key proves reuse beyond the recent window and brings the page
+// straight into the LRU "frequent" queue. A long sequential scan therefore
+// only churns the recent queue and cannot flush the frequent one.
+// Re-reading a page while it is still recent does not promote it, so
+// back-to-back accesses within one operation count only once.
+//
+// Pages being read are locked; lookups of a locked page wait on it.
+// Referenced pages are never evicted, nor are pages mapped into a
+// process (their frame has references beyond the cache's). Pages that
+// are the only copy of their data (tmpfs files) are pinned: they move to
+// a third, unevictable list that eviction never scans and that does not
+// count against the cache's capacity.
+//
+// Writes complete into the cache: a filesystem marks the pages it changed
+// dirty, and they are written back later. Each address space keeps its
+// dirty pages sorted by index, and the spaces with dirty pages are kept
+// oldest first. A flusher thread wakes every WRITEBACK_INTERVAL_MS, or
+// once more than WRITEBACK_BACKGROUND_PERCENT of the cache is dirty. It
+// then writes the oldest spaces in sorted batches of up to WRITEBACK_BATCH
+// pages, until the cache is back under that threshold and no space has
+// been dirty for longer than WRITEBACK_EXPIRE_MS. A writer that finds more
+// than WRITEBACK_DIRTY_PERCENT dirty writes batches back itself, so it
+// cannot outpace the device. Dirty pages and pages being written are not
+// evicted.
+//
+// Sequential readers pass a readahead state (one per open file or
+// stream). A miss at the page after the last one read starts a window of
+// READAHEAD_INITIAL_PAGES, doubling on each further sequential miss up to
+// READAHEAD_MAX_PAGES. Once the reader reaches the window's marker page,
+// the next window is read asynchronously, so later reads find their pages
+// already resident or in flight. A miss anywhere else halves the window
+// and reads just that page.
+// Source: T. Johnson, D. Shasha, "2Q: A Low Overhead High Performance
+//         Buffer Management Replacement Algorithm", VLDB 1994; Linux
+//         lib/radix-tree.c, mm/readahead.c, mm/page-writeback.c
+//         (balance_dirty_pages), fs/fs-writeback.c
+#define PAGE_CACHE_CAPACITY        2048    // Pages (8MB)
+#define PAGE_CACHE_RECENT_PERCENT  25      // Kin
+#define PAGE_CACHE_GHOSTS          1024    // Kout: evicted keys remembered
+#define PAGE_CACHE_GHOST_BUCKETS   256
+#define PAGE_CACHE_GHOST_NONE      0xFFFF
+#define READAHEAD_INITIAL_PAGES    4
+#define READAHEAD_MAX_PAGES        32      // 128KB
+#define WRITEBACK_BATCH            64      // Pages per write_pages() call (256KB)
+#define WRITEBACK_BACKGROUND_PERCENT 10    // Dirty share that wakes the flusher
+#define WRITEBACK_DIRTY_PERCENT    20      // Dirty share that throttles writers
+#define WRITEBACK_EXPIRE_MS        3000    // Age at which dirty data is written
+#define WRITEBACK_INTERVAL_MS      500     // Flusher's periodic wakeup
+
+#define RADIX_TREE_SHIFT           6
+#define RADIX_TREE_SLOTS           (1u << RADIX_TREE_SHIFT)
+#define RADIX_TREE_MASK            (RADIX_TREE_SLOTS - 1)
+#define RADIX_TREE_MAX_HEIGHT      ((32 + RADIX_TREE_SHIFT - 1) / RADIX_TREE_SHIFT)
+
+// Page flags
+#define PAGE_CACHE_UPTODATE        0x1
+#define PAGE_CACHE_LOCKED          0x2     // Read in progress
+#define PAGE_CACHE_ERROR           0x4     // Last read failed
+#define PAGE_CACHE_DIRTY           0x8     // Newer than the backing store
+#define PAGE_CACHE_WRITEBACK       0x10    // Being written back
+
+#define PAGE_CACHE_RECENT          0       // Queue numbers
+#define PAGE_CACHE_FREQUENT        1
+#define PAGE_CACHE_UNEVICTABLE     2       // Pinned pages
+
+struct radix_tree_node {
+    void* slots[RADIX_TREE_SLOTS];  // Children, or items at the bottom level
+    uint32_t count;                 // Non-NULL slots
+};
+
+// Empty when height is 0; otherwise the root covers indexes below
+// 1 << (height * RADIX_TREE_SHIFT)
+struct radix_tree {
+    struct radix_tree_node* root;
+    uint32_t height;
+};
+
+struct address_space;
+
+struct cached_page;
+
+struct address_space_operations {
+    // Fill a PAGE_SIZE buffer with the object's bytes from index * PAGE_SIZE.
+    // May sleep.
+    int32_t (*read_page)(struct address_space* mapping, uint32_t index, void* page);
+    // Optional: start reading a batch of locked pages without waiting and
+    // pass each to page_cache_unlock() when it arrives
+    void (*read_pages)(struct address_space* mapping, struct cached_page** pages, uint32_t count);
+    // For spaces whose pages are dirtied: write a batch of pages, sorted
+    // by index, and wait for it. May sleep.
+    int32_t (*write_pages)(struct address_space* mapping, struct cached_page** pages, uint32_t count);
+    // Optional: keep the owner alive while the space has dirty pages or
+    // pages being written. get comes with the first dirty page and must
+    // not sleep; put comes once the last one is written, from a caller
+    // that holds no locks, and may free the space.
+    void (*get)(struct address_space* mapping);
+    void (*put)(struct address_space* mapping);
+    // Optional: get a page ready to be written through a shared mapping,
+    // e.g. give it blocks to be written back to. May sleep.
+    int32_t (*page_mkwrite)(struct address_space* mapping, struct cached_page* page);
+};
+
+struct address_space {
+    const struct address_space_operations* operations;
+    void* host;                     // Owning object
+    uint64_t size;                  // Bytes; readahead stops at the end
+    uint32_t id;                    // Tells mappings apart in the ghost list
+    struct radix_tree pages;        // struct cached_page by index
+    uint32_t page_count;
+    struct cached_page* dirty_head; // Dirty pages, by index
+    struct cached_page* dirty_tail;
+    uint32_t dirty_count;
+    uint32_t writeback_count;       // Pages being written
+    uint32_t dirtied_when;          // Tick its first dirty page was dirtied
+    struct address_space* dirty_previous;   // Spaces with dirty pages, oldest first
+    struct address_space* dirty_next;
+    struct wait_queue writeback_queue;      // Woken as writes finish
+    int32_t error;                  // Last writeback error, until synced
+};
+
+struct cached_page {
+    struct address_space* mapping;
+    uint32_t index;
+    uint8_t* data;                  // PAGE_SIZE frame
+    uint32_t flags;                 // PAGE_CACHE_*
+    uint32_t references;
+    uint32_t queue;                 // PAGE_CACHE_RECENT, _FREQUENT or _UNEVICTABLE
+    struct cached_page* previous;   // Towards the queue head (newest)
+    struct cached_page* next;
+    struct cached_page* dirty_previous;
+    struct cached_page* dirty_next;
+    struct wait_queue wait;         // Woken when the page is unlocked or written
+};
+
+struct page_cache_queue {
+    struct cached_page* head;       // Newest or most recently used
+    struct cached_page* tail;
+    uint32_t count;
+};
+
+// Per-reader sequential detection; zero-initialized
+struct readahead_state {
+    uint32_t start;                 // First page of the newest window
+    uint32_t size;                  // Pages in it, 0 while access looks random
+    uint32_t marker;                // Page whose access starts the next window
+    uint32_t next;                  // Page a sequential reader asks for next
+};
+
+// Key of a page evicted from the recent queue
+struct page_cache_ghost {
+    uint32_t mapping_id;            // 0 when the entry is unused
+    uint32_t index;
+    uint16_t next;                  // Hash chain
+};
+
+// Counters exported by SYSCALL_PAGE_CACHE_STATS
+struct page_cache_statistics {
+    uint32_t pages;                 // Resident
+    uint32_t capacity;
+    uint32_t recent_pages;
+    uint32_t frequent_pages;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t ghost_hits;            // Misses admitted straight to the frequent queue
+    uint32_t recent_evictions;
+    uint32_t frequent_evictions;
+    uint32_t read_errors;
+    uint32_t readahead_pages;       // Pages read before they were asked for
+    uint32_t pinned_pages;          // Unevictable, not counted against capacity
+    uint32_t dirty_pages;
+    uint32_t writeback_pages;       // Being written
+    uint32_t written_pages;         // Written back since boot
+    uint32_t write_errors;
+    uint32_t throttled;             // Writes that had to write back first
+};
+
+static struct page_cache_queue page_cache_queues[3];
+static struct page_cache_ghost page_cache_ghosts[PAGE_CACHE_GHOSTS];
+static uint16_t page_cache_ghost_buckets[PAGE_CACHE_GHOST_BUCKETS];
+static uint32_t page_cache_ghost_next;      // Oldest entry, overwritten next
+static uint32_t page_cache_next_id = 1;
+static struct page_cache_statistics page_cache_statistics;
+static struct address_space* writeback_head;    // Oldest dirty space
+static struct address_space* writeback_tail;
+static struct wait_queue writeback_queue;       // The flusher sleeps here
+static struct timer writeback_timer;
+
+/**
+ * @brief Find the slot for an index, optionally building the path to it
+ * 
+ * @param tree Tree to search
+ * @param index Item index
+ * @param create Non-zero to grow the tree and allocate missing nodes
+ * @return Slot pointer, or NULL if absent (or out of memory when creating)
+ */
+static void** radix_tree_slot(struct radix_tree* tree, uint32_t index, int create) {
+    if (!tree->root) {
+        if (!create) return NULL;
+        tree->root = heap_allocate(sizeof(struct radix_tree_node));
+        if (!tree->root) return NULL;
+        memset(tree->root, 0, sizeof(struct radix_tree_node));
+        tree->height = 1;
+    }
+    
+    while (tree->height < RADIX_TREE_MAX_HEIGHT && (index >> (tree->height * RADIX_TREE_SHIFT))) {
+        if (!create) return NULL;
+        
+        struct radix_tree_node* root = heap_allocate(sizeof(struct radix_tree_node));
+        if (!root) return NULL;
+        memset(root, 0, sizeof(*root));
+        root->slots[0] = tree->root;
+        root->count = 1;
+        tree->root = root;
+        tree->height++;
+    }
+    
+    struct radix_tree_node* node = tree->root;
+    for (uint32_t level = tree->height - 1; level > 0; --level) {
+        uint32_t offset = (index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
+        
+        if (!node->slots[offset]) {
+            if (!create) return NULL;
+            
+            struct radix_tree_node* child = heap_allocate(sizeof(struct radix_tree_node));
+            if (!child) return NULL;
+            memset(child, 0, sizeof(*child));
+            node->slots[offset] = child;
+            node->count++;
+        }
+        node = (struct radix_tree_node*)node->slots[offset];
+    }
+    return &node->slots[index & RADIX_TREE_MASK];
+}
+
+static void* radix_tree_lookup(struct radix_tree* tree, uint32_t index) {
+    void** slot = radix_tree_slot(tree, index, 0);
+    return slot ? *slot : NULL;
+}
+
+/**
+ * @brief Store an item at an empty index
+ * 
+ * @return 0 on success, ERROR_BUSY if the index is taken, ERROR_NO_MEMORY
+ */
+static int32_t radix_tree_insert(struct radix_tree* tree, uint32_t index, void* item) {
+    void** slot = radix_tree_slot(tree, index, 1);
+    
+    if (!slot) return ERROR_NO_MEMORY;
+    if (*slot) return ERROR_BUSY;
+    *slot = item;
+    
+    // The bottom node's count is kept here; radix_tree_slot() counts children
+    struct radix_tree_node* node = tree->root;
+    for (uint32_t level = tree->height - 1; level > 0; --level) {
+        node = (struct radix_tree_node*)node->slots[(index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK];
+    }
+    node->count++;
+    return 0;
+}
+
+/**
+ * @brief Remove the item at an index, freeing nodes left empty
+ * 
+ * @param tree Tree to modify
+ * @param index Index to clear (no-op if absent)
+ */
+static void radix_tree_delete(struct radix_tree* tree, uint32_t index) {
+    struct radix_tree_node* path[RADIX_TREE_MAX_HEIGHT];
+    uint32_t offsets[RADIX_TREE_MAX_HEIGHT];
+    struct radix_tree_node* node = tree->root;
+    
+    if (!node || (tree->height < RADIX_TREE_MAX_HEIGHT && (index >> (tree->height * RADIX_TREE_SHIFT)))) return;
+    
+    for (uint32_t depth = 0; depth < tree->height; ++depth) {
+        uint32_t level = tree->height - 1 - depth;
+        
+        path[depth] = node;
+        offsets[depth] = (index >> (level * RADIX_TREE_SHIFT)) & RADIX_TREE_MASK;
+        if (!node->slots[offsets[depth]]) return;
+        if (level > 0) node = (struct radix_tree_node*)node->slots[offsets[depth]];
+    }
+    
+    for (uint32_t depth = tree->height; depth-- > 0;) {
+        path[depth]->slots[offsets[depth]] = NULL;
+        if (--path[depth]->count > 0) return;
+        heap_free(path[depth]);
+        if (depth > 0) continue;
+        tree->root = NULL;
+        tree->height = 0;
+    }
+}
+
+static void page_cache_unlink(struct cached_page* page) {
+    struct page_cache_queue* queue = &page_cache_queues[page->queue];
+    
+    if (page->previous) page->previous->next = page->next;
+    else queue->head = page->next;
+    if (page->next) page->next->previous = page->previous;
+    else queue->tail = page->previous;
+    queue->count--;
+}
+
+static void page_cache_push(struct cached_page* page, uint32_t queue_number) {
+    struct page_cache_queue* queue = &page_cache_queues[queue_number];
+    
+    page->queue = queue_number;
+    page->previous = NULL;
+    page->next = queue->head;
+    if (queue->head) queue->head->previous = page;
+    else queue->tail = page;
+    queue->head = page;
+    queue->count++;
+}
+
+static uint32_t page_cache_ghost_bucket(uint32_t mapping_id, uint32_t index) {
+    return (mapping_id * 2654435761u ^ index * 40503u) % PAGE_CACHE_GHOST_BUCKETS;
+}
+
+/**
+ * @brief Look for a key in the ghost list, removing it if found
+ * 
+ * @return 1 if the key had been evicted from the recent queue lately
+ */
+static int page_cache_ghost_take(uint32_t mapping_id, uint32_t index) {
+    uint16_t* link = &page_cache_ghost_buckets[page_cache_ghost_bucket(mapping_id, index)];
+    
+    while (*link != PAGE_CACHE_GHOST_NONE) {
+        struct page_cache_ghost* ghost = &page_cache_ghosts[*link];
+        
+        if (ghost->mapping_id == mapping_id && ghost->index == index) {
+            *link = ghost->next;
+            ghost->mapping_id = 0;
+            return 1;
+        }
+        link = &ghost->next;
+    }
+    return 0;
+}
+
+// Remember an evicted key, forgetting the oldest one
+static void page_cache_ghost_add(uint32_t mapping_id, uint32_t index) {
+    uint16_t slot = (uint16_t)page_cache_ghost_next;
+    struct page_cache_ghost* ghost = &page_cache_ghosts[slot];
+    
+    page_cache_ghost_next = (page_cache_ghost_next + 1) % PAGE_CACHE_GHOSTS;
+    if (ghost->mapping_id) page_cache_ghost_take(ghost->mapping_id, ghost->index);
+    
+    uint16_t* bucket = &page_cache_ghost_buckets[page_cache_ghost_bucket(mapping_id, index)];
+    ghost->mapping_id = mapping_id;
+    ghost->index = index;
+    ghost->next = *bucket;
+    *bucket = slot;
+}
+
+// Take a page off its space's dirty list, and the space off the
+// writeback list once it has no dirty pages left
+static void page_cache_clean(struct cached_page* page) {
+    struct address_space* mapping = page->mapping;
+    
+    if (page->dirty_previous) page->dirty_previous->dirty_next = page->dirty_next;
+    else mapping->dirty_head = page->dirty_next;
+    if (page->dirty_next) page->dirty_next->dirty_previous = page->dirty_previous;
+    else mapping->dirty_tail = page->dirty_previous;
+    page->dirty_previous = page->dirty_next = NULL;
+    page->flags &= ~(uint32_t)PAGE_CACHE_DIRTY;
+    page_cache_statistics.dirty_pages--;
+    if (--mapping->dirty_count) return;
+    
+    if (mapping->dirty_previous) mapping->dirty_previous->dirty_next = mapping->dirty_next;
+    else writeback_head = mapping->dirty_next;
+    if (mapping->dirty_next) mapping->dirty_next->dirty_previous = mapping->dirty_previous;
+    else writeback_tail = mapping->dirty_previous;
+    mapping->dirty_previous = mapping->dirty_next = NULL;
+}
+
+// Drop an unreferenced page from its queue, its mapping and memory. A
+// dirty page is dropped unwritten.
+static void page_cache_free(struct cached_page* page) {
+    if (page->flags & PAGE_CACHE_DIRTY) page_cache_clean(page);
+    page_cache_unlink(page);
+    radix_tree_delete(&page->mapping->pages, page->index);
+    page->mapping->page_count--;
+    page_cache_statistics.pages--;
+    page_frame_free((uint32_t)page->data);
+    heap_free(page);
+}
+
+static struct cached_page* page_cache_victim(uint32_t queue_number) {
+    struct cached_page* page = page_cache_queues[queue_number].tail;
+    
+    while (page && (page->references ||
+                    (page->flags & (PAGE_CACHE_LOCKED | PAGE_CACHE_DIRTY | PAGE_CACHE_WRITEBACK)) ||
+                    page_frame_reference_count((uint32_t)page->data) > 1)) {
+        page = page->previous;
+    }
+    return page;
+}
+
+/**
+ * @brief Evict one page to make room
+ * 
+ * @return 1 if a page was evicted, 0 if every page is in use
+ * 
+ * The recent queue gives up its oldest page while it holds more than its
+ * share, and that page's key moves to the ghost list. Otherwise the least
+ * recently used frequent page goes.
+ */
+static int page_cache_evict(void) {
+    uint32_t recent_limit = PAGE_CACHE_CAPACITY * PAGE_CACHE_RECENT_PERCENT / 100;
+    struct cached_page* page = NULL;
+    
+    if (page_cache_queues[PAGE_CACHE_RECENT].count > recent_limit) page = page_cache_victim(PAGE_CACHE_RECENT);
+    if (!page) page = page_cache_victim(PAGE_CACHE_FREQUENT);
+    if (!page) page = page_cache_victim(PAGE_CACHE_RECENT);
+    if (!page) return 0;
+    
+    if (page->queue == PAGE_CACHE_RECENT) {
+        page_cache_ghost_add(page->mapping->id, page->index);
+        page_cache_statistics.recent_evictions++;
+    } else {
+        page_cache_statistics.frequent_evictions++;
+    }
+    page_cache_free(page);
+    return 1;
+}
+
+/**
+ * @brief Set up an empty address space
+ * 
+ * @param mapping Address space to initialize
+ * @param operations How to read its pages
+ * @param host Owning object, available to the operations
+ */
+void address_space_initialize(struct address_space* mapping, const struct address_space_operations* operations,
+                              void* host) {
+    memset(mapping, 0, sizeof(*mapping));
+    mapping->operations = operations;
+    mapping->host = host;
+    mapping->id = page_cache_next_id++;
+}
+
+/**
+ * @brief Find a resident page without reading it
+ * 
+ * @param mapping Address space
+ * @param index Page number
+ * @return Referenced page (possibly still locked), or NULL
+ */
+struct cached_page* page_cache_find(struct address_space* mapping, uint32_t index) {
+    struct cached_page* page = (struct cached_page*)radix_tree_lookup(&mapping->pages, index);
+    
+    if (page) page->references++;
+    return page;
+}
+
+// Evict until an unpinned page can be added without exceeding the capacity
+static void page_cache_make_room(void) {
+    while (page_cache_statistics.pages - page_cache_queues[PAGE_CACHE_UNEVICTABLE].count >= PAGE_CACHE_CAPACITY &&
+           page_cache_evict()) {
+    }
+}
+
+/**
+ * @brief Enter a frame into an address space
+ * 
+ * @return Referenced page with the given flags, or NULL if out of memory
+ *         (the caller keeps the frame)
+ */
+static struct cached_page* page_cache_insert(struct address_space* mapping, uint32_t index, uint32_t frame,
+                                             uint32_t flags) {
+    struct cached_page* page = heap_allocate(sizeof(struct cached_page));
+    
+    if (!page || radix_tree_insert(&mapping->pages, index, page) != 0) {
+        if (page) heap_free(page);
+        return NULL;
+    }
+    
+    memset(page, 0, sizeof(*page));
+    page->mapping = mapping;
+    page->index = index;
+    page->data = (uint8_t*)frame;
+    page->flags = flags;
+    page->references = 1;
+    if (page_cache_ghost_take(mapping->id, index)) {
+        page_cache_statistics.ghost_hits++;
+        page_cache_push(page, PAGE_CACHE_FREQUENT);
+    } else {
+        page_cache_push(page, PAGE_CACHE_RECENT);
+    }
+    mapping->page_count++;
+    page_cache_statistics.pages++;
+    return page;
+}
+
+/**
+ * @brief Add a new, locked page to an address space
+ * 
+ * @param mapping Address space
+ * @param index Page number, not yet resident
+ * @return Referenced, locked page, or NULL if out of memory
+ * 
+ * The caller fills the page and calls page_cache_unlock(). Keys found in
+ * the ghost list enter the frequent queue, everything else the recent one.
+ */
+struct cached_page* page_cache_add(struct address_space* mapping, uint32_t index) {
+    page_cache_make_room();
+    
+    uint32_t frame = page_frame_allocate();
+    while (!frame && page_cache_evict()) {
+        frame = page_frame_allocate();
+    }
+    if (!frame) return NULL;
+    
+    struct cached_page* page = page_cache_insert(mapping, index, frame, PAGE_CACHE_LOCKED);
+    if (!page) page_frame_free(frame);
+    return page;
+}
+
+/**
+ * @brief Add a page whose data already sits in a frame
+ * 
+ * @param mapping Address space
+ * @param index Page number, not yet resident
+ * @param frame Page-aligned frame holding the data; the page takes over
+ *        one reference to it
+ * @return Referenced, up-to-date page, or NULL if out of memory (the
+ *         reference stays with the caller)
+ * 
+ * Lets data that is already in memory, such as the boot archive, become
+ * cached file contents without a copy.
+ */
+struct cached_page* page_cache_add_frame(struct address_space* mapping, uint32_t index, uint32_t frame) {
+    page_cache_make_room();
+    return page_cache_insert(mapping, index, frame, PAGE_CACHE_UPTODATE);
+}
+
+/**
+ * @brief Mark a page's read finished and wake anyone waiting for it
+ * 
+ * @param page Locked page
+ * @param result 0 if the page now holds valid data, otherwise the error
+ */
+void page_cache_unlock(struct cached_page* page, int32_t result) {
+    page->flags &= ~(uint32_t)(PAGE_CACHE_LOCKED | PAGE_CACHE_ERROR);
+    if (result == 0) {
+        page->flags |= PAGE_CACHE_UPTODATE;
+    } else {
+        page->flags |= PAGE_CACHE_ERROR;
+        page_cache_statistics.read_errors++;
+    }
+    wait_queue_wake_all(&page->wait);
+}
+
+/**
+ * @brief Drop a reference taken by page_cache_find(), page_cache_add() or
+ *        page_cache_get()
+ * 
+ * @param page Page to release
+ * 
+ * A page whose read failed is discarded with its last reference, so the
+ * next lookup retries it.
+ */
+void page_cache_put(struct cached_page* page) {
+    if (--page->references == 0 && (page->flags & PAGE_CACHE_ERROR)) page_cache_free(page);
+}
+
+/**
+ * @brief Keep a page resident until it is unpinned
+ * 
+ * @param page Page; the pin takes over the caller's reference, or drops
+ *        it if the page is pinned already
+ */
+void page_cache_pin(struct cached_page* page) {
+    if (page->queue == PAGE_CACHE_UNEVICTABLE) {
+        page_cache_put(page);
+        return;
+    }
+    page_cache_unlink(page);
+    page_cache_push(page, PAGE_CACHE_UNEVICTABLE);
+}
+
+/**
+ * @brief Make a pinned page evictable again and drop the pin's reference
+ * 
+ * @param page Pinned page
+ */
+void page_cache_unpin(struct cached_page* page) {
+    page_cache_unlink(page);
+    page_cache_push(page, PAGE_CACHE_RECENT);
+    page_cache_put(page);
+}
+
+/**
+ * @brief Read the missing pages of a range as one batch
+ * 
+ * @param mapping Address space
+ * @param start First page
+ * @param count Pages, at most READAHEAD_MAX_PAGES
+ * 
+ * Uses the mapping's read_pages operation when it has one, so the reads
+ * can be merged and overlap with the caller; otherwise reads each page in
+ * turn. Stops at the end of the object.
+ */
+static void page_cache_read_range(struct address_space* mapping, uint32_t start, uint32_t count) {
+    struct cached_page* batch[READAHEAD_MAX_PAGES];
+    uint64_t pages = (mapping->size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t batched = 0;
+    
+    for (uint32_t index = start; index - start < count && index < pages; ++index) {
+        if (radix_tree_lookup(&mapping->pages, index)) continue;
+        
+        struct cached_page* page = page_cache_add(mapping, index);
+        if (!page) break;
+        batch[batched++] = page;
+        page_cache_statistics.readahead_pages++;
+    }
+    if (batched == 0) return;
+    
+    if (mapping->operations->read_pages) {
+        mapping->operations->read_pages(mapping, batch, batched);
+    } else {
+        for (uint32_t i = 0; i < batched; ++i) {
+            page_cache_unlock(batch[i], mapping->operations->read_page(mapping, batch[i]->index, batch[i]->data));
+        }
+    }
+    for (uint32_t i = 0; i < batched; ++i) {
+        page_cache_put(batch[i]);
+    }
+}
+
+static uint32_t readahead_grow(uint32_t size) {
+    if (size == 0) return READAHEAD_INITIAL_PAGES;
+    return size * 2 < READAHEAD_MAX_PAGES ? size * 2 : READAHEAD_MAX_PAGES;
+}
+
+/**
+ * @brief Update a reader's readahead state for an access and start reads
+ * 
+ * @param mapping Address space being read
+ * @param state Reader's state
+ * @param index Page being accessed
+ * @param resident Whether the page was already cached or in flight
+ */
+static void readahead_access(struct address_space* mapping, struct readahead_state* state, uint32_t index,
+                             int resident) {
+    if (resident && state->size && index == state->marker) {
+        // Reader caught up with the window: fetch the next one behind its back
+        state->start += state->size;
+        state->size = readahead_grow(state->size);
+        state->marker = state->start;
+        page_cache_read_range(mapping, state->start, state->size);
+    } else if (!resident) {
+        if (index == state->next) {
+            state->size = readahead_grow(state->size);
+            state->start = index;
+            state->marker = index + state->size / 2;
+            page_cache_read_range(mapping, index, state->size);
+        } else {
+            state->size /= 2;
+        }
+    }
+    state->next = index + 1;
+}
+
+/**
+ * @brief Get a page with valid contents, reading it on a miss
+ * 
+ * @param mapping Address space
+ * @param state Reader's readahead state, or NULL for a one-off access
+ * @param index Page number
+ * @param result Receives the referenced page
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t page_cache_get_readahead(struct address_space* mapping, struct readahead_state* state, uint32_t index,
+                                 struct cached_page** result) {
+    struct cached_page* page = page_cache_find(mapping, index);
+    
+    if (page) {
+        page_cache_statistics.hits++;
+    } else {
+        page_cache_statistics.misses++;
+    }
+    if (state) {
+        readahead_access(mapping, state, index, page != NULL);
+        if (!page) page = page_cache_find(mapping, index);
+    }
+    
+    if (page) {
+        if (page->queue == PAGE_CACHE_FREQUENT) {
+            page_cache_unlink(page);
+            page_cache_push(page, PAGE_CACHE_FREQUENT);
+        }
+        while (page->flags & PAGE_CACHE_LOCKED) {
+            wait_queue_sleep(&page->wait);
+        }
+        if (page->flags & PAGE_CACHE_ERROR) {
+            page_cache_put(page);
+            return ERROR_IO;
+        }
+        *result = page;
+        return 0;
+    }
+    
+    page = page_cache_add(mapping, index);
+    if (!page) return ERROR_NO_MEMORY;
+    
+    int32_t status = mapping->operations->read_page(mapping, index, page->data);
+    page_cache_unlock(page, status);
+    if (status != 0) {
+        page_cache_put(page);
+        return status;
+    }
+    *result = page;
+    return 0;
+}
+
+/**
+ * @brief Get a page with valid contents, reading it on a miss
+ * 
+ * @param mapping Address space
+ * @param index Page number
+ * @param result Receives the referenced page
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t page_cache_get(struct address_space* mapping, uint32_t index, struct cached_page** result) {
+    return page_cache_get_readahead(mapping, NULL, index, result);
+}
+
+/**
+ * @brief Copy bytes out of an address space through the cache
+ * 
+ * @param mapping Address space
+ * @param state Reader's readahead state, or NULL
+ * @param offset Byte offset
+ * @param buffer Kernel destination
+ * @param length Bytes to copy
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t page_cache_read(struct address_space* mapping, struct readahead_state* state, uint64_t offset,
+                        void* buffer, uint32_t length) {
+    uint8_t* destination = (uint8_t*)buffer;
+    
+    while (length > 0) {
+        uint32_t within = (uint32_t)offset & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - within < length ? PAGE_SIZE - within : length;
+        struct cached_page* page;
+        int32_t result = page_cache_get_readahead(mapping, state, (uint32_t)(offset / PAGE_SIZE), &page);
+        
+        if (result != 0) return result;
+        memcpy(destination, page->data + within, chunk);
+        page_cache_put(page);
+        
+        destination += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+int32_t page_cache_sync(struct address_space* mapping);
+
+/**
+ * @brief Drop every unreferenced page of an address space
+ * 
+ * @param mapping Address space, e.g. of an object being destroyed
+ * 
+ * Dirty pages are written back first (through page_cache_sync(), so the
+ * owner's put runs as usual), and pages being read or written are waited
+ * for, so no I/O in flight is left pointing at the space. May sleep.
+ * Pages someone still references stay cached: the caller may free the
+ * owner only once mapping->page_count is 0.
+ */
+void page_cache_invalidate(struct address_space* mapping) {
+    for (;;) {
+        struct cached_page* busy = NULL;
+        
+        if (mapping->dirty_count) page_cache_sync(mapping);
+        for (uint32_t queue = 0; queue < 2 && mapping->page_count; ++queue) {
+            struct cached_page* page = page_cache_queues[queue].head;
+            
+            while (page && mapping->page_count) {
+                struct cached_page* next = page->next;
+                
+                if (page->mapping == mapping && !page->references) {
+                    if (page->flags & (PAGE_CACHE_LOCKED | PAGE_CACHE_DIRTY | PAGE_CACHE_WRITEBACK)) {
+                        busy = page;
+                    } else {
+                        page_cache_free(page);
+                    }
+                }
+                page = next;
+            }
+        }
+        if (!busy) return;
+        
+        // Wait for the read or write in flight (a page dirtied again is
+        // written by the next pass), then look again
+        busy->references++;
+        while (busy->flags & (PAGE_CACHE_LOCKED | PAGE_CACHE_WRITEBACK)) {
+            wait_queue_sleep(&busy->wait);
+        }
+        page_cache_put(busy);
+    }
+}
+
+/**
+ * @brief Mark a page as changed, to be written back later
+ * 
+ * @param page Referenced, up-to-date page of a space with write_pages
+ * 
+ * The page joins its space's dirty list in index order; appends are
+ * found from the tail in one step. The first dirty page of a space puts
+ * it at the end of the writeback list and takes the owner's get. Wakes
+ * the flusher once the background threshold is crossed.
+ */
+void page_cache_dirty(struct cached_page* page) {
+    struct address_space* mapping = page->mapping;
+    struct cached_page* previous = mapping->dirty_tail;
+    
+    if (page->flags & PAGE_CACHE_DIRTY) return;
+    
+    if (!mapping->dirty_count) {
+        if (!mapping->writeback_count && mapping->operations->get) mapping->operations->get(mapping);
+        mapping->dirtied_when = timer_ticks;
+        mapping->dirty_previous = writeback_tail;
+        mapping->dirty_next = NULL;
+        if (writeback_tail) writeback_tail->dirty_next = mapping;
+        else writeback_head = mapping;
+        writeback_tail = mapping;
+    }
+    
+    while (previous && previous->index > page->index) {
+        previous = previous->dirty_previous;
+    }
+    page->dirty_previous = previous;
+    page->dirty_next = previous ? previous->dirty_next : mapping->dirty_head;
+    if (page->dirty_next) page->dirty_next->dirty_previous = page;
+    else mapping->dirty_tail = page;
+    if (previous) previous->dirty_next = page;
+    else mapping->dirty_head = page;
+    page->flags |= PAGE_CACHE_DIRTY;
+    mapping->dirty_count++;
+    
+    if (++page_cache_statistics.dirty_pages > PAGE_CACHE_CAPACITY * WRITEBACK_BACKGROUND_PERCENT / 100) {
+        wait_queue_wake_all(&writeback_queue);
+    }
+}
+
+/**
+ * @brief Write back one batch of a space's dirty pages
+ * 
+ * @param mapping Space with dirty pages
+ * @param limit Most pages to write, at most WRITEBACK_BATCH
+ * @return Pages written (0 if all dirty pages are being written already)
+ * 
+ * Takes the lowest-numbered dirty pages not already being written, marks
+ * them clean and under writeback, and hands them to write_pages in index
+ * order. A page dirtied again meanwhile stays dirty. A failed write is
+ * recorded for page_cache_sync(); the pages stay clean. If this leaves
+ * the space with nothing dirty or in flight, its owner's put runs last,
+ * and the space may be gone on return.
+ */
+uint32_t page_cache_writeback(struct address_space* mapping, uint32_t limit) {
+    struct cached_page* batch[WRITEBACK_BATCH];
+    struct cached_page* page = mapping->dirty_head;
+    uint32_t count = 0;
+    
+    if (limit > WRITEBACK_BATCH) limit = WRITEBACK_BATCH;
+    while (page && count < limit) {
+        struct cached_page* next = page->dirty_next;
+        
+        if (!(page->flags & PAGE_CACHE_WRITEBACK)) {
+            page_cache_clean(page);
+            page->flags |= PAGE_CACHE_WRITEBACK;
+            page->references++;
+            batch[count++] = page;
+        }
+        page = next;
+    }
+    if (count == 0) return 0;
+    mapping->writeback_count += count;
+    page_cache_statistics.writeback_pages += count;
+    
+    int32_t result = mapping->operations->write_pages(mapping, batch, count);
+    if (result != 0) {
+        mapping->error = result;
+        page_cache_statistics.write_errors++;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        batch[i]->flags &= ~(uint32_t)PAGE_CACHE_WRITEBACK;
+        wait_queue_wake_all(&batch[i]->wait);
+        page_cache_put(batch[i]);
+    }
+    mapping->writeback_count -= count;
+    page_cache_statistics.writeback_pages -= count;
+    page_cache_statistics.written_pages += count;
+    wait_queue_wake_all(&mapping->writeback_queue);
+    
+    if (!mapping->dirty_count && !mapping->writeback_count && mapping->operations->put) {
+        mapping->operations->put(mapping);
+    }
+    return count;
+}
+
+/**
+ * @brief Write back a space's dirty pages and wait for them
+ * 
+ * @param mapping Space whose owner the caller keeps alive
+ * @return 0 on success, otherwise the first writeback error since the
+ *         last sync
+ * 
+ * Writes as many pages as were dirty on entry, so a writer that keeps
+ * dirtying the space cannot hold the caller here, then waits for writes
+ * started by anyone else.
+ */
+int32_t page_cache_sync(struct address_space* mapping) {
+    uint32_t budget = mapping->dirty_count;
+    
+    while (budget && mapping->dirty_count) {
+        uint32_t written = page_cache_writeback(mapping, budget);
+        
+        if (written) {
+            budget = written < budget ? budget - written : 0;
+        } else {
+            // Every dirty page is being written by someone else
+            wait_queue_sleep(&mapping->writeback_queue);
+        }
+    }
+    while (mapping->writeback_count) {
+        wait_queue_sleep(&mapping->writeback_queue);
+    }
+    
+    int32_t result = mapping->error;
+    mapping->error = 0;
+    return result;
+}
+
+/**
+ * @brief Write back the oldest spaces while the cache is over a limit, or
+ *        while they have been dirty too long
+ * 
+ * @param limit Dirty pages to get down to
+ * @param expire Non-zero to also write spaces older than WRITEBACK_EXPIRE_MS
+ */
+static void writeback_run(uint32_t limit, int expire) {
+    uint32_t age = WRITEBACK_EXPIRE_MS * (TIMER_FREQUENCY / 1000);
+    struct address_space* mapping;
+    
+    while ((mapping = writeback_head) != NULL) {
+        if (page_cache_statistics.dirty_pages <= limit &&
+            !(expire && (int32_t)(timer_ticks - mapping->dirtied_when) >= (int32_t)age)) {
+            break;
+        }
+        if (page_cache_writeback(mapping, WRITEBACK_BATCH) == 0) break;
+    }
+}
+
+/**
+ * @brief Throttle a writer while too much of the cache is dirty
+ * 
+ * Called by filesystems after a write, holding no locks. Above
+ * WRITEBACK_DIRTY_PERCENT the writer writes the oldest data back itself
+ * until the cache is under the threshold again, so it proceeds at the
+ * device's pace. The idle process can do this too, unlike waiting for
+ * the flusher.
+ */
+void page_cache_balance(void) {
+    uint32_t limit = PAGE_CACHE_CAPACITY * WRITEBACK_DIRTY_PERCENT / 100;
+    
+    if (page_cache_statistics.dirty_pages <= limit) return;
+    page_cache_statistics.throttled++;
+    wait_queue_wake_all(&writeback_queue);
+    writeback_run(limit, 0);
+}
+
+// Body of the flusher thread
+static void writeback_thread(void* argument) {
+    (void)argument;
+    
+    for (;;) {
+        timer_arm(&writeback_timer, timer_ticks + WRITEBACK_INTERVAL_MS * (TIMER_FREQUENCY / 1000),
+                  &writeback_queue);
+        wait_queue_sleep(&writeback_queue);
+        writeback_run(PAGE_CACHE_CAPACITY * WRITEBACK_BACKGROUND_PERCENT / 100, 1);
+    }
+}
+
+/**
+ * @brief Snapshot the cache counters
+ * 
+ * @param statistics Receives the counters
+ */
+void page_cache_statistics_read(struct page_cache_statistics* statistics) {
+    *statistics = page_cache_statistics;
+    statistics->capacity = PAGE_CACHE_CAPACITY;
+    statistics->recent_pages = page_cache_queues[PAGE_CACHE_RECENT].count;
+    statistics->frequent_pages = page_cache_queues[PAGE_CACHE_FREQUENT].count;
+    statistics->pinned_pages = page_cache_queues[PAGE_CACHE_UNEVICTABLE].count;
+}
+
+/**
+ * @brief Print the hit ratio and eviction counters, and the write-back
+ *        counters once anything has been dirtied
+ */
+void page_cache_statistics_print(void) {
+    struct page_cache_statistics statistics;
+    uint32_t lookups;
+    
+    page_cache_statistics_read(&statistics);
+    lookups = statistics.hits + statistics.misses;
+    print_string("  page cache: ");
+    print_unsigned(statistics.pages);
+    print_string(" pages (");
+    print_unsigned(statistics.recent_pages);
+    print_string(" recent, ");
+    print_unsigned(statistics.frequent_pages);
+    print_string(" frequent, ");
+    print_unsigned(statistics.pinned_pages);
+    print_string(" pinned), hit ratio ");
+    print_unsigned(lookups ? divide_u64((uint64_t)statistics.hits * 100, lookups) : 0);
+    print_string("%, ");
+    print_unsigned(statistics.ghost_hits);
+    print_string(" ghost hits, ");
+    print_unsigned(statistics.recent_evictions + statistics.frequent_evictions);
+    print_string(" evictions\n");
+    if (statistics.written_pages || statistics.dirty_pages) {
+        print_string("  write-back: ");
+        print_unsigned(statistics.dirty_pages);
+        print_string(" dirty, ");
+        print_unsigned(statistics.written_pages);
+        print_string(" written, ");
+        print_unsigned(statistics.throttled);
+        print_string(" throttled writes, ");
+        print_unsigned(statistics.write_errors);
+        print_string(" errors\n");
+    }
+}
+
+void page_cache_initialize(void) {
+    memset(page_cache_ghost_buckets, 0xFF, sizeof(page_cache_ghost_buckets));
+    if (!kernel_thread_create(writeback_thread, NULL)) kernel_panic("page_cache_initialize: no flusher thread");
+}
+
+// =============================================================================
+// File Mappings
+// =============================================================================
+
+// A VM_FILE area maps a file's cached pages straight into a process, so a
+// program reads a mapped file with one page fault per page and no copy.
+// Faults go through the open file's readahead state, so walking through a
+// mapping reads ahead just like read() does. Eviction skips mapped pages.
+//
+// Shared mappings (VM_SHARED) write to the cached page itself, where read()
+// and the file's other mappings see the change at once. A page is mapped
+// read-only until its first write, which gives the address space's
+// page_mkwrite a chance to prepare it: ext2 allocates the blocks of a hole,
+// tmpfs pins the page. After that the CPU's dirty bit records writes, and
+// msync, munmap and exit hand those bits to the page cache, which writes
+// the pages back like any other (see page_cache_dirty()).
+//
+// Private mappings share the cached page read-only, like fork does, and
+// copy it on the first write. Later changes to the file show through until
+// then.
+//
+// Only whole mappings are unmapped. Touching a page past the end of the
+// file kills the process.
+// Source: Linux mm/filemap.c (filemap_fault), mm/memory.c (do_wp_page,
+//         page_mkwrite), mm/msync.c
+
+// SYSCALL_MMAP protection is VM_READ, VM_WRITE and VM_EXEC (Linux PROT_*
+// values). Flags and SYSCALL_MSYNC flags are Linux values too.
+#define MAP_SHARED             0x01
+#define MAP_PRIVATE            0x02
+#define MS_ASYNC               0x01    // Queue dirty pages for the flusher
+#define MS_INVALIDATE          0x02    // Accepted; mappings are always coherent
+#define MS_SYNC                0x04    // Also wait until they are on the disk
+
+/**
+ * @brief Resolve a fault in a file mapping
+ * 
+ * @param process Faulting process
+ * @param area VM_FILE area holding the page
+ * @param page Page-aligned faulting address
+ * @param error_code Page fault error code pushed by the CPU
+ * @return 0 if resolved, ERROR_IO if the page lies past the end of the
+ *         file or cannot be read, otherwise a negative error
+ * 
+ * Maps the cached page itself, with its frame gaining a reference. A
+ * shared page becomes writable on its first write (which may be a fault
+ * on the page mapped read-only). A private page is mapped copy-on-write,
+ * or copied straight away if the fault was a write.
+ */
+int32_t file_map_fault(struct process* process, struct vm_area* area, uint32_t page, uint32_t error_code) {
+    struct address_space* mapping = area->mapping;
+    uint32_t index = (area->offset + (page - area->start)) / PAGE_SIZE;
+    int write = (error_code & PAGE_FAULT_WRITE) != 0;
+    struct cached_page* cached;
+    
+    if ((uint64_t)index * PAGE_SIZE >= mapping->size) return ERROR_IO;
+    int32_t result = page_cache_get_readahead(mapping, area->readahead, index, &cached);
+    if (result != 0) return result == ERROR_NO_MEMORY ? result : ERROR_IO;
+    
+    uint32_t frame = (uint32_t)cached->data;
+    uint32_t flags = PAGE_USER;
+    if (area->flags & VM_SHARED) {
+        flags |= PAGE_SHARED;
+        if (write && mapping->operations->page_mkwrite) result = mapping->operations->page_mkwrite(mapping, cached);
+        if ((area->flags & VM_WRITE) && (write || !mapping->operations->page_mkwrite)) flags |= PAGE_WRITABLE;
+    } else if (write) {
+        // Copy now rather than map the page only to fault on it again
+        frame = page_frame_allocate();
+        if (frame) {
+            memcpy((void*)frame, cached->data, PAGE_SIZE);
+            flags |= PAGE_WRITABLE;
+        } else {
+            result = ERROR_NO_MEMORY;
+        }
+    } else if (area->flags & VM_WRITE) {
+        flags |= PAGE_COPY_ON_WRITE;
+    }
+    
+    if (result == 0 && (error_code & PAGE_FAULT_PRESENT)) {
+        // Shared page mapped read-only: the frame is already referenced
+        uint32_t* entry = paging_get_entry(process->page_directory, page, 0);
+        
+        *entry = frame | flags | PAGE_PRESENT;
+        invalidate_page(page);
+    } else if (result == 0) {
+        result = paging_map_page(process->page_directory, page, frame, flags);
+        if (result == 0) {
+            if (frame == (uint32_t)cached->data) page_frame_reference(frame);
+            process->resident_pages++;
+        }
+    }
+    if (result != 0 && frame && frame != (uint32_t)cached->data) page_frame_free(frame);
+    page_cache_put(cached);
+    return result;
+}
+
+/**
+ * @brief Hand the dirty bits of part of a shared file mapping to the page
+ *        cache
+ * 
+ * @param process Process owning the area
+ * @param area VM_FILE area
+ * @param start First page-aligned address to look at
+ * @param end End of the range, exclusive
+ * 
+ * Every page the CPU has marked dirty is marked dirty in the cache, to
+ * be written back, and its bit is cleared so that the next write sets
+ * it again. Private mappings and spaces with nothing to write back to
+ * have nothing to hand on.
+ */
+void file_map_collect_dirty(struct process* process, struct vm_area* area, uint32_t start, uint32_t end) {
+    int active = process->page_directory == (uint32_t*)read_cr3();
+    
+    if (!(area->flags & VM_SHARED) || !area->mapping->operations->write_pages) return;
+    for (uint32_t page = start; page < end; page += PAGE_SIZE) {
+        uint32_t* entry = paging_get_entry(process->page_directory, page, 0);
+        
+        if (!entry) {
+            page |= LARGE_PAGE_SIZE - PAGE_SIZE;    // No page table: skip to the next one
+            continue;
+        }
+        if ((*entry & (PAGE_PRESENT | PAGE_DIRTY)) != (PAGE_PRESENT | PAGE_DIRTY)) continue;
+        *entry &= ~(uint32_t)PAGE_DIRTY;
+        if (active) invalidate_page(page);
+        
+        struct cached_page* cached = page_cache_find(area->mapping, (area->offset + (page - area->start)) / PAGE_SIZE);
+        if (!cached) continue;
+        if ((uint32_t)cached->data == (*entry & ~(uint32_t)PAGE_FLAGS_MASK)) page_cache_dirty(cached);
+        page_cache_put(cached);
+    }
+}
+
+/**
+ * @brief Map part of an open file into a process
+ * 
+ * @param process Process to map into
+ * @param file Open file; the mapping takes a reference
+ * @param offset Page-aligned offset of the first byte to map
+ * @param length Bytes to map, rounded up to whole pages
+ * @param flags VM_READ, VM_WRITE and VM_EXEC, and VM_SHARED for writes
+ *              to reach the file
+ * @param address Receives the start of the mapping
+ * @return 0 on success, otherwise a negative error
+ * 
+ * The file must be open for reading, and for writing too if a shared
+ * mapping is writable. Nothing is read until the pages are touched.
+ */
+int32_t file_map_create(struct process* process, struct file* file, uint32_t offset, uint32_t length,
+                        uint32_t flags, uint32_t* address) {
+    uint32_t size = PAGE_ALIGN_UP(length);
+    
+    if (!file->operations->mmap || !(file->flags & FILE_READABLE)) return ERROR_INVALID_ARGUMENT;
+    if ((flags & VM_SHARED) && (flags & VM_WRITE) && !(file->flags & FILE_WRITABLE)) return ERROR_INVALID_ARGUMENT;
+    if (size == 0 || (offset & (PAGE_SIZE - 1)) || offset + size < offset) return ERROR_INVALID_ARGUMENT;
+    
+    uint32_t start = vm_area_find_free(process, size);
+    if (!start) return ERROR_NO_MEMORY;
+    
+    struct vm_area* area = vm_area_create(process, start, start + size, flags | VM_FILE);
+    if (!area) return ERROR_NO_MEMORY;
+    
+    area->offset = offset;
+    int32_t result = file->operations->mmap(file, area);
+    if (result != 0) {
+        vm_area_remove(process, area);
+        return result;
+    }
+    area->file = file;
+    file->references++;
+    *address = start;
+    return 0;
+}
+
+/**
+ * @brief Write back the file pages changed through a range of mappings
+ *        (msync)
+ * 
+ * @param process Calling process
+ * @param address Page-aligned start of the range
+ * @param length Bytes in the range
+ * @param flags MS_ASYNC or MS_SYNC, optionally with MS_INVALIDATE
+ * @return 0 on success, ERROR_BAD_ADDRESS if part of the range is not
+ *         mapped, otherwise the first error syncing a file
+ * 
+ * Other areas in the range are left alone. With MS_SYNC each shared
+ * file mapping's file is synced, which waits for its data and inode to
+ * reach the disk.
+ */
+int32_t file_map_sync(struct process* process, uint32_t address, uint32_t length, uint32_t flags) {
+    uint32_t end = address + PAGE_ALIGN_UP(length);
+    int32_t result = 0;
+    
+    if ((address & (PAGE_SIZE - 1)) || end < address || (flags & ~(uint32_t)(MS_ASYNC | MS_INVALIDATE | MS_SYNC)) ||
+        (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    while (address < end) {
+        struct vm_area* area = vm_area_find(process, address);
+        if (!area) return ERROR_BAD_ADDRESS;
+        
+        uint32_t stop = area->end < end ? area->end : end;
+        if (area->file && (area->flags & VM_SHARED)) {
+            file_map_collect_dirty(process, area, address, stop);
+            if ((flags & MS_SYNC) && area->file->operations->sync) {
+                int32_t status = area->file->operations->sync(area->file);
+                if (result == 0) result = status;
+            }
+        }
+        address = stop;
+    }
+    return result;
+}
+
+// =============================================================================
+// Block Layer
+// =============================================================================
+
+// Every disk the drivers above find is registered here as a block device
+// with its own request queue. Callers submit bios: a run of blocks and one
+// contiguous kernel buffer. A bio that continues or precedes a queued
+// request in the same direction is merged into it, so the driver sees one
+// larger command; buffers that are not adjacent in memory become extra
+// segments, up to what the driver can take.
+//
+// While a device is plugged (block_plug()), requests collect in the queue
+// and reach the driver only on block_unplug(), once BLOCK_PLUG_LIMIT are
+// waiting, or when a submitter waits for a result. That gives merging a
+// chance when bios are submitted one at a time.
+//
+// The device's scheduler chooses the dispatch order. "none" keeps arrival
+// order, for devices with no seek penalty (virtio, NVMe). "deadline" sweeps
+// upwards in sector order in batches, but starts from the oldest request
+// once one has waited past its deadline. It also lets writes go only after
+// BLOCK_DEADLINE_STARVED read batches, so a stream of writes cannot hold up
+// reads. It suits rotational-style devices (floppy, ATA, AHCI).
+//
+// Synchronous drivers (floppy, ATA) finish a request inside submit, in
+// the dispatching process. Asynchronous drivers (AHCI, virtio, NVMe)
+// complete from their bottom half. The device is then refilled from a
+// bottom half of its own, which runs after the driver's has finished.
+// Source: Linux block layer (block/blk-merge.c, block/blk-core.c
+//         plugging, block/mq-deadline.c)
+#define MAX_BLOCK_DEVICES          16
+#define BLOCK_NAME_LENGTH          12
+#define BLOCK_MAX_BYTES            (128 * 1024)     // Per request after merging
+#define BLOCK_MAX_SEGMENTS         32
+#define BLOCK_QUEUE_DEPTH          32      // Requests in flight per device
+#define BLOCK_REQUEST_POOL         64      // Queued plus in flight per device
+#define BLOCK_PLUG_LIMIT           16      // Queued requests that end a plug
+#define BLOCK_DEADLINE_READ        500     // Milliseconds
+#define BLOCK_DEADLINE_WRITE       5000
+#define BLOCK_DEADLINE_BATCH       16      // Sorted dispatches between FIFO checks
+#define BLOCK_DEADLINE_STARVED     2       // Read batches before writes get a turn
+#define BLOCK_PAGE_READS           64      // Readahead pages in flight
+
+struct block_device;
+
+// A read or write of whole blocks. The caller owns the bio; it must stay
+// valid until block_wait() returns.
+struct bio {
+    uint64_t sector;                // In device blocks
+    uint32_t count;                 // Blocks
+    int write;
+    void* buffer;                   // Identity-mapped kernel memory
+    volatile int done;
+    int32_t result;
+    struct wait_queue queue;
+    struct block_device* device;    // Set by block_submit()
+    struct bio* next;               // Within its request
+};
+
+// One memory-contiguous run of a request's buffers
+struct block_segment {
+    void* buffer;
+    uint32_t length;
+};
+
+// One or more merged bios, handed to the driver as a single command
+struct block_request {
+    struct block_device* device;
+    uint64_t sector;
+    uint32_t count;
+    int write;
+    struct bio* bios;               // In sector order
+    struct bio* last_bio;
+    uint32_t segment_count;
+    uint32_t deadline;              // timer_ticks by which it should be dispatched
+    uint64_t queued_at;             // timestamp_read() values
+    uint64_t dispatched_at;
+    struct block_request* next;     // Arrival-order queue, or the free list
+    struct block_request* sorted_next;  // Deadline scheduler's sector-order list
+    struct wait_callback completion;    // Asynchronous drivers: on the driver request's queue
+    union {
+        struct ahci_request ahci;
+        struct virtio_blk_request virtio;
+        struct nvme_request nvme;
+    } driver;
+};
+
+struct block_device_operations {
+    // Start a request. Synchronous drivers return its result; asynchronous
+    // ones return 0 once it is queued and later pass the result to
+    // block_request_complete(). A negative return fails the request.
+    int32_t (*submit)(struct block_device* device, struct block_request* request);
+};
+
+struct block_scheduler {
+    const char* name;
+    void (*add)(struct block_device* device, struct block_request* request);
+    void (*remove)(struct block_device* device, struct block_request* request);
+    // Take the next request to dispatch from the scheduler, or NULL
+    struct block_request* (*dispatch)(struct block_device* device);
+};
+
+struct block_statistics {
+    uint32_t reads;                 // Requests completed
+    uint32_t writes;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint32_t merges;                // Bios merged into a queued request
+    uint32_t errors;
+    uint64_t wait_cycles;           // Queued to dispatched, summed
+    uint64_t service_cycles;        // Dispatched to completed, summed
+    uint64_t max_latency;           // Queued to completed
+    uint64_t depth_sum;             // Requests in flight, sampled at each dispatch
+    uint32_t depth_samples;
+    uint32_t max_depth;
+};
+
+struct block_device {
+    char name[BLOCK_NAME_LENGTH];
+    const struct block_device_operations* operations;
+    const struct block_scheduler* scheduler;
+    uint32_t unit;                  // Driver's own device number
+    uint32_t block_size;
+    uint64_t block_count;
+    uint32_t max_blocks;            // Per request
+    uint32_t max_segments;          // Per request
+    uint32_t max_depth;             // Requests the driver accepts at once
+    int asynchronous;
+    int read_only;
+    uint32_t plugged;               // Nesting depth of block_plug()
+    int dispatching;
+    uint32_t queued_count;
+    uint32_t in_flight;
+    struct block_request* queued;   // Not yet dispatched, in arrival order
+    struct block_request* queued_tail;
+    struct block_request* free_requests;
+    struct wait_queue free_queue;   // Submitters waiting for a request
+    struct block_request* sorted[2];    // Deadline: queued reads and writes by sector
+    uint64_t next_sector;           // Deadline: end of the last dispatch
+    uint32_t batch;                 // Deadline: dispatches in the current batch
+    uint32_t starved;               // Deadline: read batches chosen over waiting writes
+    int direction;                  // Deadline: 1 while writing
+    struct block_statistics statistics;
+    struct address_space cache;     // Device blocks by page, for metadata reads
+};
+
+static struct block_device block_devices[MAX_BLOCK_DEVICES];
+static uint32_t block_device_count;
+static struct deferred_work block_dispatch_work;
+
+static void block_dispatch(struct block_device* device);
+
+// "none": arrival order, straight from the device queue
+static void block_none_add(struct block_device* device, struct block_request* request) {
+    (void)device; (void)request;
+}
+
+static void block_none_remove(struct block_device* device, struct block_request* request) {
+    (void)device; (void)request;
+}
+
+static struct block_request* block_none_dispatch(struct block_device* device) {
+    return device->queued;
+}
+
+static void block_deadline_add(struct block_device* device, struct block_request* request) {
+    struct block_request** link = &device->sorted[request->write];
+    
+    while (*link && (*link)->sector < request->sector) {
+        link = &(*link)->sorted_next;
+    }
+    request->sorted_next = *link;
+    *link = request;
+}
+
+static void block_deadline_remove(struct block_device* device, struct block_request* request) {
+    for (struct block_request** link = &device->sorted[request->write]; *link; link = &(*link)->sorted_next) {
+        if (*link == request) {
+            *link = request->sorted_next;
+            break;
+        }
+    }
+}
+
+// First request in a direction at or above the end of the last dispatch
+static struct block_request* block_deadline_next(struct block_device* device, int write) {
+    struct block_request* request = device->sorted[write];
+    
+    while (request && request->sector < device->next_sector) {
+        request = request->sorted_next;
+    }
+    return request;
+}
+
+/**
+ * @brief Pick the deadline scheduler's next request
+ * 
+ * @param device Device to dispatch for
+ * @return Request, removed from the sorted lists, or NULL if none is queued
+ * 
+ * Continues the current sweep until BLOCK_DEADLINE_BATCH requests have
+ * gone out. A new batch picks a direction, reads first unless writes have
+ * been passed over BLOCK_DEADLINE_STARVED times. It then restarts from
+ * that direction's oldest request if its deadline has passed or nothing
+ * lies ahead of the last dispatch.
+ */
+static struct block_request* block_deadline_dispatch(struct block_device* device) {
+    struct block_request* request = NULL;
+    
+    if (device->batch < BLOCK_DEADLINE_BATCH) {
+        request = block_deadline_next(device, device->direction);
+    }
+    if (!request) {
+        int reads = device->sorted[0] != NULL;
+        int writes = device->sorted[1] != NULL;
+        int write;
+        
+        if (!reads && !writes) return NULL;
+        if (reads && (!writes || device->starved < BLOCK_DEADLINE_STARVED)) {
+            write = 0;
+            if (writes) device->starved++;
+        } else {
+            write = 1;
+            device->starved = 0;
+        }
+        
+        struct block_request* oldest = device->queued;
+        while (oldest->write != write) {
+            oldest = oldest->next;
+        }
+        request = block_deadline_next(device, write);
+        if (!request || (int32_t)(timer_ticks - oldest->deadline) >= 0) request = oldest;
+        device->direction = write;
+        device->batch = 0;
+    }
+    
+    block_deadline_remove(device, request);
+    device->batch++;
+    device->next_sector = request->sector + request->count;
+    return request;
+}
+
+static const struct block_scheduler block_schedulers[] = {
+    {"none", block_none_add, block_none_remove, block_none_dispatch},
+    {"deadline", block_deadline_add, block_deadline_remove, block_deadline_dispatch},
+};
+
+#define BLOCK_SCHEDULER_NONE       (&block_schedulers[0])
+#define BLOCK_SCHEDULER_DEADLINE   (&block_schedulers[1])
+
+/**
+ * @brief Split a request's buffers into memory-contiguous segments
+ * 
+ * @param request Request to map
+ * @param segments Receives request->segment_count entries
+ */
+static void block_request_segments(const struct block_request* request, struct block_segment* segments) {
+    uint32_t count = 0;
+    
+    for (const struct bio* bio = request->bios; bio; bio = bio->next) {
+        uint32_t length = bio->count * request->device->block_size;
+        
+        if (count && (uint8_t*)segments[count - 1].buffer + segments[count - 1].length == bio->buffer) {
+            segments[count - 1].length += length;
+        } else {
+            segments[count].buffer = bio->buffer;
+            segments[count].length = length;
+            count++;
+        }
+    }
+}
+
+/**
+ * @brief Finish a request and every bio merged into it
+ * 
+ * @param request Dispatched request
+ * @param result 0 or a negative error, given to each bio
+ */
+static void block_request_complete(struct block_request* request, int32_t result) {
+    struct block_device* device = request->device;
+    struct block_statistics* statistics = &device->statistics;
+    uint64_t now = timestamp_read();
+    
+    if (request->write) {
+        statistics->writes++;
+        statistics->blocks_written += request->count;
+    } else {
+        statistics->reads++;
+        statistics->blocks_read += request->count;
+    }
+    if (result != 0) statistics->errors++;
+    statistics->wait_cycles += request->dispatched_at - request->queued_at;
+    statistics->service_cycles += now - request->dispatched_at;
+    if (now - request->queued_at > statistics->max_latency) statistics->max_latency = now - request->queued_at;
+    
+    for (struct bio* bio = request->bios; bio;) {
+        struct bio* next = bio->next;       // The owner may reuse it once done
+        
+        bio->result = result;
+        bio->done = 1;
+        wait_queue_wake_all(&bio->queue);
+        bio = next;
+    }
+    
+    device->in_flight--;
+    request->next = device->free_requests;
+    device->free_requests = request;
+    wait_queue_wake_all(&device->free_queue);
+    if (device->asynchronous) deferred_work_schedule(&block_dispatch_work);
+}
+
+/**
+ * @brief Hand queued requests to the driver until it is full
+ * 
+ * @param device Device to dispatch for
+ * 
+ * A synchronous driver runs each request to completion here, so other
+ * submitters meanwhile only queue theirs; this loop picks them up.
+ */
+static void block_dispatch(struct block_device* device) {
+    if (device->dispatching) return;
+    device->dispatching = 1;
+    
+    while (device->in_flight < device->max_depth) {
+        struct block_request* request = device->scheduler->dispatch(device);
+        if (!request) break;
+        
+        struct block_request** link = &device->queued;
+        struct block_request* previous = NULL;
+        while (*link != request) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        *link = request->next;
+        if (device->queued_tail == request) device->queued_tail = previous;
+        device->queued_count--;
+        
+        device->in_flight++;
+        device->statistics.depth_sum += device->in_flight;
+        device->statistics.depth_samples++;
+        if (device->in_flight > device->statistics.max_depth) device->statistics.max_depth = device->in_flight;
+        
+        request->dispatched_at = timestamp_read();
+        int32_t result = device->operations->submit(device, request);
+        if (!device->asynchronous || result != 0) block_request_complete(request, result);
+    }
+    
+    device->dispatching = 0;
+}
+
+// Bottom half: refill asynchronous devices after completions
+static void block_dispatch_pending(struct deferred_work* work) {
+    (void)work;
+    
+    for (uint32_t i = 0; i < block_device_count; ++i) {
+        struct block_device* device = &block_devices[i];
+        
+        if (device->asynchronous && !device->plugged && device->queued) block_dispatch(device);
+    }
+}
+
+/**
+ * @brief Try to add a bio to a queued request it continues or precedes
+ * 
+ * @param device Device the bio is for
+ * @param bio Bio to merge
+ * @return 1 if merged, 0 if it needs a request of its own
+ */
+static int block_merge(struct block_device* device, struct bio* bio) {
+    uint32_t bytes = bio->count * device->block_size;
+    
+    for (struct block_request* request = device->queued; request; request = request->next) {
+        if (request->write != bio->write || request->count + bio->count > device->max_blocks) continue;
+        
+        if (request->sector + request->count == bio->sector) {
+            struct bio* last = request->last_bio;
+            int joined = (uint8_t*)last->buffer + last->count * device->block_size == bio->buffer;
+            if (!joined && request->segment_count == device->max_segments) continue;
+            
+            last->next = bio;
+            request->last_bio = bio;
+            request->count += bio->count;
+            request->segment_count += !joined;
+            device->statistics.merges++;
+            return 1;
+        }
+        if (bio->sector + bio->count == request->sector) {
+            int joined = (uint8_t*)bio->buffer + bytes == request->bios->buffer;
+            if (!joined && request->segment_count == device->max_segments) continue;
+            
+            device->scheduler->remove(device, request);
+            bio->next = request->bios;
+            request->bios = bio;
+            request->sector = bio->sector;
+            request->count += bio->count;
+            request->segment_count += !joined;
+            device->scheduler->add(device, request);
+            device->statistics.merges++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Queue a bio on a device
+ * 
+ * @param device Target device
+ * @param bio Bio with sector, count, write and buffer set
+ * @return 0 once queued, otherwise a negative error
+ * 
+ * Dispatches straight away unless the device is plugged. Sleeps only
+ * while every request of the device is in use. Call block_wait() for the
+ * result.
+ */
+int32_t block_submit(struct block_device* device, struct bio* bio) {
+    if (!device) return ERROR_NOT_FOUND;
+    if (bio->write && device->read_only) return ERROR_INVALID_ARGUMENT;
+    if (bio->count == 0 || bio->count > device->max_blocks || bio->sector >= device->block_count ||
+        bio->count > device->block_count - bio->sector ||
+        (uint32_t)bio->buffer + bio->count * device->block_size > KERNEL_SPACE_END) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    bio->device = device;
+    bio->next = NULL;
+    bio->done = 0;
+    bio->result = 0;
+    
+    if (!block_merge(device, bio)) {
+        while (!device->free_requests) {
+            block_dispatch(device);
+            if (device->free_requests) break;
+            wait_queue_sleep(&device->free_queue);
+        }
+        
+        struct block_request* request = device->free_requests;
+        device->free_requests = request->next;
+        request->sector = bio->sector;
+        request->count = bio->count;
+        request->write = bio->write;
+        request->bios = bio;
+        request->last_bio = bio;
+        request->segment_count = 1;
+        request->queued_at = timestamp_read();
+        request->deadline = timer_ticks + (bio->write ? BLOCK_DEADLINE_WRITE : BLOCK_DEADLINE_READ) *
+                                          TIMER_FREQUENCY / 1000;
+        request->next = NULL;
+        if (device->queued_tail) {
+            device->queued_tail->next = request;
+        } else {
+            device->queued = request;
+        }
+        device->queued_tail = request;
+        device->queued_count++;
+        device->scheduler->add(device, request);
+    }
+    
+    if (!device->plugged || device->queued_count >= BLOCK_PLUG_LIMIT) block_dispatch(device);
+    return 0;
+}
+
+/**
+ * @brief Wait for a submitted bio to complete
+ * 
+ * @param bio Bio passed to block_submit()
+ * @return 0 on success, otherwise the driver's error
+ * 
+ * Dispatches the bio's device first, even if it is plugged, so a caller
+ * never waits on a request held back for merging.
+ */
+int32_t block_wait(struct bio* bio) {
+    if (!bio->done) block_dispatch(bio->device);
+    while (!bio->done) {
+        wait_queue_sleep(&bio->queue);
+    }
+    return bio->result;
+}
+
+/**
+ * @brief Hold back dispatch so bios submitted next can be merged
+ * 
+ * @param device Device to plug; calls nest
+ */
+void block_plug(struct block_device* device) {
+    device->plugged++;
+}
+
+/**
+ * @brief Undo block_plug() and dispatch whatever has been queued
+ * 
+ * @param device Plugged device
+ */
+void block_unplug(struct block_device* device) {
+    if (device->plugged && --device->plugged == 0) block_dispatch(device);
+}
+
+/**
+ * @brief Read or write a contiguous kernel buffer and wait for it
+ * 
+ * @param device Target device
+ * @param sector First block
+ * @param count Number of blocks
+ * @param buffer Identity-mapped kernel buffer of count blocks
+ * @param write Non-zero to write to the device
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Splits the transfer into requests of up to max_blocks, all submitted
+ * under one plug.
+ */
+int32_t block_transfer(struct block_device* device, uint64_t sector, uint32_t count, void* buffer, int write) {
+    struct bio bios[8];
+    uint8_t* data = (uint8_t*)buffer;
+    int32_t result = 0;
+    
+    if (!device) return ERROR_NOT_FOUND;
+    memset(bios, 0, sizeof(bios));
+    while (count > 0 && result == 0) {
+        uint32_t submitted = 0;
+        
+        block_plug(device);
+        while (count > 0 && submitted < sizeof(bios) / sizeof(bios[0])) {
+            struct bio* bio = &bios[submitted];
+            uint32_t chunk = count < device->max_blocks ? count : device->max_blocks;
+            
+            bio->sector = sector;
+            bio->count = chunk;
+            bio->write = write;
+            bio->buffer = data;
+            result = block_submit(device, bio);
+            if (result != 0) break;
+            
+            submitted++;
+            sector += chunk;
+            count -= chunk;
+            data += chunk * device->block_size;
+        }
+        block_unplug(device);
+        
+        for (uint32_t i = 0; i < submitted; ++i) {
+            int32_t status = block_wait(&bios[i]);
+            if (result == 0) result = status;
+        }
+    }
+    return result;
+}
+
+static int32_t block_cache_read_page(struct address_space* mapping, uint32_t index, void* page) {
+    struct block_device* device = (struct block_device*)mapping->host;
+    uint32_t per_page = PAGE_SIZE / device->block_size;
+    uint64_t first = (uint64_t)index * per_page;
+    
+    if (first >= device->block_count) return ERROR_INVALID_ARGUMENT;
+    
+    uint32_t count = device->block_count - first < per_page ? (uint32_t)(device->block_count - first) : per_page;
+    memset((uint8_t*)page + count * device->block_size, 0, (per_page - count) * device->block_size);
+    return block_transfer(device, first, count, page, 0);
+}
+
+// A readahead page in flight. Slots are recycled rather than freed from
+// the completion callback, which runs inside the wakeup of bio.queue.
+struct block_page_read {
+    struct bio bio;
+    struct wait_callback completion;
+    struct cached_page* page;
+    int busy;
+};
+
+static struct block_page_read block_page_reads[BLOCK_PAGE_READS];
+
+static void block_cache_page_done(struct wait_callback* callback) {
+    struct block_page_read* read = (struct block_page_read*)callback->context;
+    
+    wait_queue_remove_callback(callback);
+    page_cache_unlock(read->page, read->bio.result);
+    read->busy = 0;
+}
+
+/**
+ * @brief Start reading a batch of locked pages under one plug
+ * 
+ * Consecutive pages become adjacent bios, which the request queue merges
+ * into as few commands as the driver's segment limit allows. Pages that
+ * cannot get a slot are read synchronously.
+ */
+static void block_cache_read_pages(struct address_space* mapping, struct cached_page** pages, uint32_t count) {
+    struct block_device* device = (struct block_device*)mapping->host;
+    uint32_t per_page = PAGE_SIZE / device->block_size;
+    uint32_t slot = 0;
+    
+    block_plug(device);
+    for (uint32_t i = 0; i < count; ++i) {
+        struct cached_page* page = pages[i];
+        uint64_t first = (uint64_t)page->index * per_page;
+        
+        while (slot < BLOCK_PAGE_READS && block_page_reads[slot].busy) {
+            slot++;
+        }
+        if (slot == BLOCK_PAGE_READS || first >= device->block_count ||
+            device->block_count - first < per_page) {
+            page_cache_unlock(page, block_cache_read_page(mapping, page->index, page->data));
+            continue;
+        }
+        
+        struct block_page_read* read = &block_page_reads[slot];
+        memset(read, 0, sizeof(*read));
+        read->busy = 1;
+        read->page = page;
+        read->bio.sector = first;
+        read->bio.count = per_page;
+        read->bio.buffer = page->data;
+        read->completion.function = block_cache_page_done;
+        read->completion.context = read;
+        wait_queue_add_callback(&read->bio.queue, &read->completion);
+        
+        int32_t result = block_submit(device, &read->bio);
+        if (result != 0) {
+            wait_queue_remove_callback(&read->completion);
+            read->busy = 0;
+            page_cache_unlock(page, result);
+        }
+    }
+    block_unplug(device);
+}
+
+static const struct address_space_operations block_cache_operations = {block_cache_read_page,
+                                                                       block_cache_read_pages, NULL, NULL, NULL, NULL};
+
+/**
+ * @brief Read bytes from a device through the page cache
+ * 
+ * @param device Source device
+ * @param offset Byte offset on the device
+ * @param buffer Kernel destination
+ * @param length Bytes to read
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t block_read_cached(struct block_device* device, uint64_t offset, void* buffer, uint32_t length) {
+    if (!device) return ERROR_NOT_FOUND;
+    if (offset > device->block_count * device->block_size ||
+        length > device->block_count * device->block_size - offset) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    return page_cache_read(&device->cache, NULL, offset, buffer, length);
+}
+
+/**
+ * @brief Write whole blocks to a device and keep its cache coherent
+ * 
+ * @param device Target device
+ * @param offset Byte offset on the device, a multiple of the block size
+ * @param buffer Kernel source
+ * @param length Bytes to write, a multiple of the block size
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Writes through to the device, then updates any cached pages the range
+ * covers so later block_read_cached() calls see the new contents.
+ */
+int32_t block_write_cached(struct block_device* device, uint64_t offset, const void* buffer, uint32_t length) {
+    if (!device) return ERROR_NOT_FOUND;
+    if (device->read_only) return ERROR_INVALID_ARGUMENT;
+    if ((uint32_t)offset % device->block_size || length % device->block_size ||
+        offset > device->block_count * device->block_size ||
+        length > device->block_count * device->block_size - offset) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    int32_t result = block_transfer(device, divide_u64(offset, device->block_size), length / device->block_size,
+                                    (void*)buffer, 1);
+    if (result != 0) return result;
+    
+    const uint8_t* source = (const uint8_t*)buffer;
+    while (length > 0) {
+        uint32_t within = (uint32_t)offset & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - within < length ? PAGE_SIZE - within : length;
+        struct cached_page* page = page_cache_find(&device->cache, (uint32_t)(offset / PAGE_SIZE));
+        
+        if (page) {
+            // A read in flight would overwrite the copy with old data
+            while (page->flags & PAGE_CACHE_LOCKED) {
+                wait_queue_sleep(&page->wait);
+            }
+            memcpy(page->data + within, source, chunk);
+            page_cache_put(page);
+        }
+        source += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * @brief Look a block device up by name
+ * 
+ * @param name Device name, e.g. "hda" or "nvme0n1"
+ * @return Device, or NULL if there is none by that name
+ */
+struct block_device* block_device_find(const char* name) {
+    for (uint32_t i = 0; i < block_device_count; ++i) {
+        if (string_length(block_devices[i].name) == string_length(name) &&
+            memcmp(block_devices[i].name, name, string_length(name)) == 0) {
+            return &block_devices[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Switch a device's I/O scheduler
+ * 
+ * @param device Device to change
+ * @param name "none" or "deadline"
+ * @return 0 on success, ERROR_NOT_FOUND for an unknown scheduler,
+ *         ERROR_BUSY while requests are queued
+ */
+int32_t block_set_scheduler(struct block_device* device, const char* name) {
+    for (uint32_t i = 0; i < sizeof(block_schedulers) / sizeof(block_schedulers[0]); ++i) {
+        const struct block_scheduler* scheduler = &block_schedulers[i];
+        
+        if (string_length(scheduler->name) != string_length(name) ||
+            memcmp(scheduler->name, name, string_length(name)) != 0) {
+            continue;
+        }
+        if (device->queued) return ERROR_BUSY;
+        device->scheduler = scheduler;
+        return 0;
+    }
+    return ERROR_NOT_FOUND;
+}
+
+/**
+ * @brief Print a device's request counts, latencies and queue depth
+ * 
+ * @param device Device to report on
+ */
+void block_statistics_print(const struct block_device* device) {
+    const struct block_statistics* statistics = &device->statistics;
+    uint32_t completed = statistics->reads + statistics->writes;
+    
+    print_string("  ");
+    print_string(device->name);
+    print_string(" (");
+    print_string(device->scheduler->name);
+    print_string("): ");
+    print_unsigned(statistics->reads);
+    print_string(" reads, ");
+    print_unsigned(statistics->writes);
+    print_string(" writes, ");
+    print_unsigned(statistics->merges);
+    print_string(" merges, ");
+    print_unsigned(statistics->errors);
+    print_string(" errors\n");
+    if (completed == 0) return;
+    
+    print_string("    latency us: wait ");
+    print_unsigned(timestamp_to_microseconds(divide_u64(statistics->wait_cycles, completed)));
+    print_string(", service ");
+    print_unsigned(timestamp_to_microseconds(divide_u64(statistics->service_cycles, completed)));
+    print_string(", max ");
+    print_unsigned(timestamp_to_microseconds(statistics->max_latency));
+    print_string("; depth avg ");
+    print_unsigned(divide_u64(statistics->depth_sum, statistics->depth_samples));
+    print_string(", max ");
+    print_unsigned(statistics->max_depth);
+    print_string("\n");
+}
+
+/**
+ * @brief Add a block device with a free request pool
+ * 
+ * @param name Device name (truncated to BLOCK_NAME_LENGTH - 1)
+ * @param operations Driver entry points
+ * @param unit Driver's device number, passed back through device->unit
+ * @param block_size Bytes per block
+ * @param block_count Capacity in blocks
+ * @return Device, synchronous with one segment and the deadline
+ *         scheduler, for the caller to adjust; NULL if out of slots
+ */
+static struct block_device* block_device_register(const char* name, const struct block_device_operations* operations,
+                                                  uint32_t unit, uint32_t block_size, uint64_t block_count) {
+    if (block_device_count == MAX_BLOCK_DEVICES) return NULL;
+    
+    struct block_request* requests = heap_allocate(BLOCK_REQUEST_POOL * sizeof(struct block_request));
+    if (!requests) return NULL;
+    
+    struct block_device* device = &block_devices[block_device_count++];
+    uint32_t length = (uint32_t)string_length(name);
+    
+    memset(device, 0, sizeof(*device));
+    memset(requests, 0, BLOCK_REQUEST_POOL * sizeof(struct block_request));
+    memcpy(device->name, name, length < BLOCK_NAME_LENGTH ? length : BLOCK_NAME_LENGTH - 1);
+    device->operations = operations;
+    device->scheduler = BLOCK_SCHEDULER_DEADLINE;
+    device->unit = unit;
+    device->block_size = block_size;
+    device->block_count = block_count;
+    device->max_blocks = BLOCK_MAX_BYTES / block_size;
+    device->max_segments = 1;
+    device->max_depth = 1;
+    address_space_initialize(&device->cache, &block_cache_operations, device);
+    device->cache.size = block_count * block_size;
+    for (uint32_t i = 0; i < BLOCK_REQUEST_POOL; ++i) {
+        requests[i].device = device;
+        requests[i].completion.context = &requests[i];
+        requests[i].next = device->free_requests;
+        device->free_requests = &requests[i];
+    }
+    return device;
+}
+
+static int32_t block_floppy_submit(struct block_device* device, struct block_request* request) {
+    (void)device;
+    return floppy_read((uint32_t)request->sector, request->count, request->bios->buffer);
+}
+
+static int32_t block_ata_submit(struct block_device* device, struct block_request* request) {
+    return ata_transfer(device->unit, request->sector, request->count, request->bios->buffer,
+                        request->write ? ATA_TRANSFER_WRITE : 0);
+}
+
+static void block_ahci_done(struct wait_callback* callback) {
+    struct block_request* request = (struct block_request*)callback->context;
+    
+    wait_queue_remove_callback(callback);
+    block_request_complete(request, request->driver.ahci.result);
+}
+
+static int32_t block_ahci_submit(struct block_device* device, struct block_request* request) {
+    struct ahci_request* command = &request->driver.ahci;
+    struct block_segment segments[BLOCK_MAX_SEGMENTS];
+    
+    memset(command, 0, sizeof(*command));
+    block_request_segments(request, segments);
+    command->lba = request->sector;
+    command->count = request->count;
+    command->write = request->write;
+    command->segment_count = request->segment_count;
+    for (uint32_t i = 0; i < request->segment_count; ++i) {
+        command->segments[i].buffer = segments[i].buffer;
+        command->segments[i].length = segments[i].length;
+    }
+    
+    request->completion.function = block_ahci_done;
+    wait_queue_add_callback(&command->queue, &request->completion);
+    int32_t result = ahci_submit(device->unit, command);
+    if (result != 0) wait_queue_remove_callback(&request->completion);
+    return result;
+}
+
+static void block_virtio_done(struct wait_callback* callback) {
+    struct block_request* request = (struct block_request*)callback->context;
+    
+    wait_queue_remove_callback(callback);
+    block_request_complete(request, request->driver.virtio.result);
+}
+
+static int32_t block_virtio_submit(struct block_device* device, struct block_request* request) {
+    struct virtio_blk_request* command = &request->driver.virtio;
+    struct block_segment segments[BLOCK_MAX_SEGMENTS];
+    
+    memset(command, 0, sizeof(*command));
+    block_request_segments(request, segments);
+    command->sector = request->sector;
+    command->count = request->count;
+    command->write = request->write;
+    command->segment_count = request->segment_count;
+    for (uint32_t i = 0; i < request->segment_count; ++i) {
+        command->segments[i].buffer = segments[i].buffer;
+        command->segments[i].length = segments[i].length;
+    }
+    
+    request->completion.function = block_virtio_done;
+    wait_queue_add_callback(&command->queue, &request->completion);
+    int32_t result = virtio_blk_submit(device->unit, command);
+    if (result != 0) wait_queue_remove_callback(&request->completion);
+    return result;
+}
+
+static void block_nvme_done(struct wait_callback* callback) {
+    struct block_request* request = (struct block_request*)callback->context;
+    
+    wait_queue_remove_callback(callback);
+    block_request_complete(request, request->driver.nvme.result);
+}
+
+static int32_t block_nvme_submit(struct block_device* device, struct block_request* request) {
+    struct nvme_request* command = &request->driver.nvme;
+    
+    memset(command, 0, sizeof(*command));
+    command->lba = request->sector;
+    command->count = request->count;
+    command->write = request->write;
+    command->buffer = request->bios->buffer;    // max_segments is 1
+    
+    request->completion.function = block_nvme_done;
+    wait_queue_add_callback(&command->queue, &request->completion);
+    int32_t result = nvme_submit(device->unit, command);
+    if (result != 0) wait_queue_remove_callback(&request->completion);
+    return result;
+}
+
+static const struct block_device_operations block_floppy_operations = {block_floppy_submit};
+static const struct block_device_operations block_ata_operations = {block_ata_submit};
+static const struct block_device_operations block_ahci_operations = {block_ahci_submit};
+static const struct block_device_operations block_virtio_operations = {block_virtio_submit};
+static const struct block_device_operations block_nvme_operations = {block_nvme_submit};
+
+/**
+ * @brief Register every disk the drivers found
+ * 
+ * Runs after the drivers' own initialization. Devices are named fd0,
+ * hda-hdd (ATA), sda... (AHCI), vda... (virtio) and nvme0n1....
+ */
+void block_initialize(void) {
+    struct block_device* device;
+    char name[BLOCK_NAME_LENGTH];
+    uint32_t letter = 0;
+    
+    block_dispatch_work.function = block_dispatch_pending;
+    
+    if (floppy_present) {
+        device = block_device_register("fd0", &block_floppy_operations, 0, FLOPPY_SECTOR_SIZE,
+                                       FLOPPY_SECTOR_COUNT);
+        if (device) device->read_only = 1;
+    }
+    
+    for (uint32_t i = 0; i < ATA_DRIVES; ++i) {
+        if (!ata_drives[i].present) continue;
+        memcpy(name, "hda", 4);
+        name[2] = (char)('a' + i);
+        block_device_register(name, &block_ata_operations, i, ATA_SECTOR_SIZE, ata_drives[i].sector_count);
+    }
+    
+    for (uint32_t i = 0; i < AHCI_MAX_PORTS; ++i) {
+        const struct ahci_port* port = &ahci_ports[i];
+        
+        if (!port->present) continue;
+        memcpy(name, "sda", 4);
+        name[2] = (char)('a' + letter++);
+        device = block_device_register(name, &block_ahci_operations, i, ATA_SECTOR_SIZE, port->sector_count);
+        if (!device) continue;
+        device->asynchronous = 1;
+        device->max_segments = AHCI_MAX_SEGMENTS;
+        device->max_depth = 0;
+        for (uint32_t slots = port->slot_mask; slots && device->max_depth < BLOCK_QUEUE_DEPTH; slots &= slots - 1) {
+            device->max_depth++;
+        }
+    }
+    
+    for (uint32_t i = 0; i < VIRTIO_BLK_MAX_DEVICES; ++i) {
+        const struct virtio_blk_device* virtio = &virtio_blk_devices[i];
+        
+        if (!virtio->present) continue;
+        memcpy(name, "vda", 4);
+        name[2] = (char)('a' + i);
+        device = block_device_register(name, &block_virtio_operations, i, VIRTIO_BLK_SECTOR_SIZE,
+                                       virtio->capacity);
+        if (!device) continue;
+        device->asynchronous = 1;
+        device->scheduler = BLOCK_SCHEDULER_NONE;
+        device->max_segments = virtio->segment_max;
+        // Without indirect descriptors a request takes segments + 2 ring entries
+        device->max_depth = virtio->queues[0].indirect ? virtio->queues[0].size
+                                                       : virtio->queues[0].size / (virtio->segment_max + 2);
+        if (device->max_depth > BLOCK_QUEUE_DEPTH) device->max_depth = BLOCK_QUEUE_DEPTH;
+    }
+    
+    for (uint32_t i = 0; i < NVME_MAX_CONTROLLERS; ++i) {
+        const struct nvme_controller* controller = &nvme_controllers[i];
+        
+        if (!controller->present) continue;
+        memcpy(name, "nvme0n1", 8);
+        name[4] = (char)('0' + i);
+        device = block_device_register(name, &block_nvme_operations, i, controller->block_size,
+                                       controller->block_count);
+        if (!device) continue;
+        device->asynchronous = 1;
+        device->scheduler = BLOCK_SCHEDULER_NONE;
+        if (controller->max_blocks < device->max_blocks) device->max_blocks = controller->max_blocks;
+        device->max_depth = NVME_QUEUE_COMMANDS;
+    }
+}
+
+// =============================================================================
+// FAT Filesystem
+// =============================================================================
+
+// Read-only FAT12 and FAT16 volumes on any block device. The boot floppy
+// carries one after the sectors reserved for the boot sector and kernel
+// (see the Makefile), mounted at boot as fat_boot_volume.
+//
+// Each volume keeps its whole FAT in memory, so following a chain never
+// touches the disk. The first open of a file walks its chain once and
+// records it as runs of consecutive clusters. A file page is then read
+// with one multi-sector request per run it covers rather than one per
+// cluster. File data is cached per file in the page cache, directories
+// and the fixed FAT12/16 root directory in the device's cache.
+//
+// Open files are nodes in a per-volume table keyed by first cluster,
+// which keeps their runs and cached pages across opens. Nodes no one has
+// open are recycled when the table fills.
+// Source: Microsoft FAT32 File System Specification (FAT: General Overview
+//         of On-Disk Format), Sections 3-6
+#define MAX_FAT_VOLUMES        4
+#define FAT_MAX_NODES          32
+#define FAT_SECTOR_SIZE        512
+#define FAT_DIRECTORY_ENTRY_SIZE 32
+#define FAT_NAME_LENGTH        11      // 8.3 name, space padded, no dot
+#define FAT12_MAX_CLUSTERS     4084
+#define FAT16_MAX_CLUSTERS     65524
+#define FAT12_END_OF_CHAIN     0xFF8
+#define FAT16_END_OF_CHAIN     0xFFF8
+#define FAT_FIRST_CLUSTER      2
+
+// Directory entry attributes
+#define FAT_ATTRIBUTE_VOLUME_ID 0x08
+#define FAT_ATTRIBUTE_DIRECTORY 0x10
+#define FAT_ATTRIBUTE_LONG_NAME 0x0F
+
+#define FAT_ENTRY_END          0x00    // First name byte: no entries follow
+#define FAT_ENTRY_DELETED      0xE5
+
+// BIOS parameter block, at the start of the volume's first sector
+struct fat_boot_sector {
+    uint8_t jump[3];
+    char oem_name[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t fat_count;
+    uint16_t root_entries;
+    uint16_t total_sectors_16;
+    uint8_t media;
+    uint16_t fat_sectors;
+    uint16_t sectors_per_track;
+    uint16_t heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors_32;
+} __attribute__((packed));
+
+struct fat_directory_entry {
+    char name[FAT_NAME_LENGTH];
+    uint8_t attributes;
+    uint8_t reserved;
+    uint8_t create_time_tenths;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t access_date;
+    uint16_t cluster_high;          // FAT32 only
+    uint16_t modify_time;
+    uint16_t modify_date;
+    uint16_t cluster_low;
+    uint32_t size;
+} __attribute__((packed));
+
+// Clusters file_cluster.. of a file are clusters cluster.. on disk
+struct fat_run {
+    uint32_t file_cluster;
+    uint32_t cluster;
+    uint32_t count;
+};
+
+struct fat_volume;
+
+struct fat_node {
+    struct fat_volume* volume;
+    uint32_t first_cluster;         // 0 for an empty file
+    uint32_t size;                  // Bytes; whole chain for directories
+    int directory;
+    struct fat_run* runs;           // In file order
+    uint32_t run_count;
+    uint32_t references;            // Open files
+    struct address_space mapping;
+};
+
+struct fat_volume {
+    struct block_device* device;
+    uint32_t type;                  // 12 or 16
+    uint32_t sectors_per_cluster;
+    uint32_t root_entries;
+    uint32_t first_root_sector;
+    uint32_t first_data_sector;
+    uint32_t cluster_count;
+    uint8_t* fat;                   // First FAT, cached whole
+    struct fat_node nodes[FAT_MAX_NODES];
+    uint32_t node_clock;            // Next node to consider recycling
+};
+
+// An open file. The caller owns it; fat_close() releases the node.
+struct fat_file {
+    struct fat_node* node;
+    struct readahead_state readahead;
+};
+
+static struct fat_volume fat_volumes[MAX_FAT_VOLUMES];
+static uint32_t fat_volume_count;
+
+struct fat_volume* fat_boot_volume;
+
+/**
+ * @brief Look up a cluster's FAT entry in the cached table
+ * 
+ * @param volume Mounted volume
+ * @param cluster Cluster number
+ * @return The next cluster, or at least the type's end-of-chain value
+ */
+static uint32_t fat_entry(const struct fat_volume* volume, uint32_t cluster) {
+    if (volume->type == 16) {
+        return (uint32_t)volume->fat[cluster * 2] | (uint32_t)volume->fat[cluster * 2 + 1] << 8;
+    }
+    
+    // FAT12 packs two entries into three bytes
+    uint32_t offset = cluster + cluster / 2;
+    uint32_t pair = (uint32_t)volume->fat[offset] | (uint32_t)volume->fat[offset + 1] << 8;
+    return cluster & 1 ? pair >> 4 : pair & 0xFFF;
+}
+
+/**
+ * @brief Walk a cluster chain once and record it as runs
+ * 
+ * @param node Node whose first_cluster is set
+ * @return Number of clusters in the chain, or a negative error for a
+ *         chain that leaves the volume or loops
+ */
+static int32_t fat_node_build_runs(struct fat_node* node) {
+    struct fat_volume* volume = node->volume;
+    uint32_t end = volume->type == 16 ? FAT16_END_OF_CHAIN : FAT12_END_OF_CHAIN;
+    uint32_t limit = volume->cluster_count + FAT_FIRST_CLUSTER;
+    uint32_t runs = 0;
+    uint32_t clusters = 0;
+    
+    if (node->first_cluster == 0) return 0;
+    if (node->first_cluster < FAT_FIRST_CLUSTER || node->first_cluster >= limit) return ERROR_IO;
+    
+    // Count the runs first so the array is allocated once
+    for (uint32_t cluster = node->first_cluster, previous = 0; cluster < end; cluster = fat_entry(volume, cluster)) {
+        if (cluster < FAT_FIRST_CLUSTER || cluster >= limit || clusters == volume->cluster_count) return ERROR_IO;
+        if (cluster != previous + 1) runs++;
+        previous = cluster;
+        clusters++;
+    }
+    
+    node->runs = heap_allocate(runs * sizeof(struct fat_run));
+    if (!node->runs) return ERROR_NO_MEMORY;
+    
+    struct fat_run* run = NULL;
+    uint32_t file_cluster = 0;
+    for (uint32_t cluster = node->first_cluster; cluster < end; cluster = fat_entry(volume, cluster)) {
+        if (!run || cluster != run->cluster + run->count) {
+            run = run ? run + 1 : node->runs;
+            run->file_cluster = file_cluster;
+            run->cluster = cluster;
+            run->count = 0;
+        }
+        run->count++;
+        file_cluster++;
+    }
+    node->run_count = runs;
+    return (int32_t)clusters;
+}
+
+/**
+ * @brief Map a sector of a file to the device
+ * 
+ * @param node File
+ * @param sector Sector within the file, inside its chain
+ * @param device_sector Receives the sector on the device
+ * @return Consecutive sectors from there to the end of the run
+ */
+static uint32_t fat_node_map(const struct fat_node* node, uint32_t sector, uint32_t* device_sector) {
+    const struct fat_volume* volume = node->volume;
+    uint32_t file_cluster = sector / volume->sectors_per_cluster;
+    uint32_t low = 0;
+    uint32_t high = node->run_count - 1;
+    
+    // Last run starting at or before the cluster
+    while (low < high) {
+        uint32_t middle = (low + high + 1) / 2;
+        if (node->runs[middle].file_cluster <= file_cluster) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    
+    const struct fat_run* run = &node->runs[low];
+    uint32_t run_sector = run->file_cluster * volume->sectors_per_cluster;
+    *device_sector = volume->first_data_sector + (run->cluster - FAT_FIRST_CLUSTER) * volume->sectors_per_cluster +
+                     (sector - run_sector);
+    return run_sector + run->count * volume->sectors_per_cluster - sector;
+}
+
+// Sectors of a file page that hold data, starting at *first; the rest of
+// the page lies past the end of the file
+static uint32_t fat_page_sectors(const struct fat_node* node, uint32_t index, uint32_t* first) {
+    uint32_t sectors = (node->size + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+    
+    *first = index * (PAGE_SIZE / FAT_SECTOR_SIZE);
+    if (*first >= sectors) return 0;
+    return sectors - *first < PAGE_SIZE / FAT_SECTOR_SIZE ? sectors - *first : PAGE_SIZE / FAT_SECTOR_SIZE;
+}
+
+static int32_t fat_read_page(struct address_space* mapping, uint32_t index, void* page) {
+    struct fat_node* node = (struct fat_node*)mapping->host;
+    uint8_t* data = (uint8_t*)page;
+    uint32_t sector;
+    uint32_t remaining = fat_page_sectors(node, index, &sector);
+    
+    memset(data + remaining * FAT_SECTOR_SIZE, 0, PAGE_SIZE - remaining * FAT_SECTOR_SIZE);
+    while (remaining > 0) {
+        uint32_t device_sector;
+        uint32_t count = fat_node_map(node, sector, &device_sector);
+        
+        if (count > remaining) count = remaining;
+        int32_t result = block_transfer(node->volume->device, device_sector, count, data, 0);
+        if (result != 0) return result;
+        
+        data += count * FAT_SECTOR_SIZE;
+        sector += count;
+        remaining -= count;
+    }
+    return 0;
+}
+
+// One contiguous piece of a page in a batch read
+struct fat_page_read {
+    struct bio bio;
+    uint32_t page;                  // Position in the batch
+};
+
+/**
+ * @brief Read a batch of locked pages with all their runs under one plug
+ * 
+ * Runs that continue from one page into the next become adjacent bios,
+ * which the request queue merges when the pages' frames allow. Unlike
+ * the device cache's reads this waits for the batch before returning.
+ */
+static void fat_read_pages(struct address_space* mapping, struct cached_page** pages, uint32_t count) {
+    struct fat_node* node = (struct fat_node*)mapping->host;
+    struct block_device* device = node->volume->device;
+    struct fat_page_read* reads;
+    int32_t results[READAHEAD_MAX_PAGES];
+    uint32_t total = 0;
+    uint32_t submitted = 0;
+    
+    // Size the batch: one bio per run a page touches
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t sector;
+        uint32_t remaining = fat_page_sectors(node, pages[i]->index, &sector);
+        
+        while (remaining > 0) {
+            uint32_t device_sector;
+            uint32_t chunk = fat_node_map(node, sector, &device_sector);
+            
+            if (chunk > remaining) chunk = remaining;
+            sector += chunk;
+            remaining -= chunk;
+            total++;
+        }
+    }
+    
+    reads = total ? heap_allocate(total * sizeof(struct fat_page_read)) : NULL;
+    if (!reads) {
+        for (uint32_t i = 0; i < count; ++i) {
+            page_cache_unlock(pages[i], fat_read_page(mapping, pages[i]->index, pages[i]->data));
+        }
+        return;
+    }
+    memset(reads, 0, total * sizeof(struct fat_page_read));
+    
+    block_plug(device);
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t* data = pages[i]->data;
+        uint32_t sector;
+        uint32_t remaining = fat_page_sectors(node, pages[i]->index, &sector);
+        
+        results[i] = 0;
+        memset(data + remaining * FAT_SECTOR_SIZE, 0, PAGE_SIZE - remaining * FAT_SECTOR_SIZE);
+        while (remaining > 0) {
+            struct fat_page_read* read = &reads[submitted];
+            uint32_t device_sector;
+            uint32_t chunk = fat_node_map(node, sector, &device_sector);
+            
+            if (chunk > remaining) chunk = remaining;
+            read->page = i;
+            read->bio.sector = device_sector;
+            read->bio.count = chunk;
+            read->bio.buffer = data;
+            if (block_submit(device, &read->bio) != 0) {
+                results[i] = ERROR_IO;
+                break;
+            }
+            submitted++;
+            data += chunk * FAT_SECTOR_SIZE;
+            sector += chunk;
+            remaining -= chunk;
+        }
+    }
+    block_unplug(device);
+    
+    for (uint32_t i = 0; i < submitted; ++i) {
+        int32_t result = block_wait(&reads[i].bio);
+        if (result != 0) results[reads[i].page] = result;
+    }
+    heap_free(reads);
+    for (uint32_t i = 0; i < count; ++i) {
+        page_cache_unlock(pages[i], results[i]);
+    }
+}
+
+static const struct address_space_operations fat_operations = {fat_read_page, fat_read_pages, NULL, NULL, NULL, NULL};
+
+/**
+ * @brief Find or set up the node for a directory entry and reference it
+ * 
+ * @param volume Mounted volume
+ * @param entry Directory entry of a file or subdirectory
+ * @param result Receives the node
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t fat_node_get(struct fat_volume* volume, const struct fat_directory_entry* entry,
+                            struct fat_node** result) {
+    uint32_t first_cluster = entry->cluster_low;
+    struct fat_node* node = NULL;
+    
+    if (first_cluster) {
+        for (uint32_t i = 0; i < FAT_MAX_NODES; ++i) {
+            if (volume->nodes[i].volume && volume->nodes[i].first_cluster == first_cluster) {
+                node = &volume->nodes[i];
+                node->references++;
+                *result = node;
+                return 0;
+            }
+        }
+    }
+    
+    // Recycle the next node no one has open
+    for (uint32_t tried = 0; tried < FAT_MAX_NODES && !node; ++tried) {
+        struct fat_node* candidate = &volume->nodes[volume->node_clock];
+        
+        volume->node_clock = (volume->node_clock + 1) % FAT_MAX_NODES;
+        if (candidate->references) continue;
+        if (candidate->volume) {
+            page_cache_invalidate(&candidate->mapping);
+            if (candidate->mapping.page_count) continue;
+            if (candidate->runs) heap_free(candidate->runs);
+        }
+        node = candidate;
+    }
+    if (!node) return ERROR_BUSY;
+    
+    memset(node, 0, sizeof(*node));
+    node->first_cluster = first_cluster;
+    node->volume = volume;
+    node->directory = (entry->attributes & FAT_ATTRIBUTE_DIRECTORY) != 0;
+    
+    int32_t clusters = fat_node_build_runs(node);
+    if (clusters < 0) {
+        node->volume = NULL;
+        return clusters;
+    }
+    // Directories record no size; the chain holds their entries
+    node->size = node->directory ? (uint32_t)clusters * volume->sectors_per_cluster * FAT_SECTOR_SIZE : entry->size;
+    if (node->size > (uint32_t)clusters * volume->sectors_per_cluster * FAT_SECTOR_SIZE) {
+        if (node->runs) heap_free(node->runs);
+        node->volume = NULL;
+        return ERROR_IO;
+    }
+    
+    address_space_initialize(&node->mapping, &fat_operations, node);
+    node->mapping.size = node->size;
+    node->references = 1;
+    *result = node;
+    return 0;
+}
+
+/**
+ * @brief Convert a path component to a space-padded 8.3 name
+ * 
+ * @param component Start of the component
+ * @param length Characters up to the next '/' or the end
+ * @param name Receives FAT_NAME_LENGTH characters
+ * @return 0 on success, ERROR_INVALID_ARGUMENT if it does not fit 8.3
+ */
+static int32_t fat_name_from_path(const char* component, uint32_t length, char* name) {
+    uint32_t base = 0;
+    
+    memset(name, ' ', FAT_NAME_LENGTH);
+    if ((length == 1 || length == 2) && memcmp(component, "..", length) == 0) {
+        memcpy(name, component, length);
+        return 0;
+    }
+    
+    while (base < length && component[base] != '.') {
+        base++;
+    }
+    uint32_t extension = base < length ? length - base - 1 : 0;
+    if (base == 0 || base > 8 || extension > 3) return ERROR_INVALID_ARGUMENT;
+    
+    for (uint32_t i = 0; i < length; ++i) {
+        char c = component[i];
+        uint32_t position = i < base ? i : 8 + i - base - 1;
+        
+        if (i == base) continue;
+        if (c == '.' || c == ' ') return ERROR_INVALID_ARGUMENT;
+        name[position] = c >= 'a' && c <= 'z' ? (char)(c - 'a' + 'A') : c;
+    }
+    return 0;
+}
+
+/**
+ * @brief Search a directory for an 8.3 name
+ * 
+ * @param volume Mounted volume
+ * @param directory Subdirectory node, or NULL for the root directory
+ * @param name Space-padded 8.3 name
+ * @param result Receives the matching entry
+ * @return 0 on success, ERROR_NOT_FOUND, or an I/O error
+ */
+static int32_t fat_directory_find(struct fat_volume* volume, struct fat_node* directory, const char* name,
+                                  struct fat_directory_entry* result) {
+    struct fat_directory_entry entries[FAT_SECTOR_SIZE / FAT_DIRECTORY_ENTRY_SIZE];
+    uint32_t size = directory ? directory->size : volume->root_entries * FAT_DIRECTORY_ENTRY_SIZE;
+    
+    for (uint32_t offset = 0; offset < size; offset += FAT_SECTOR_SIZE) {
+        int32_t status = directory ? page_cache_read(&directory->mapping, NULL, offset, entries, FAT_SECTOR_SIZE)
+                                   : block_read_cached(volume->device,
+                                                       (uint64_t)volume->first_root_sector * FAT_SECTOR_SIZE + offset,
+                                                       entries, FAT_SECTOR_SIZE);
+        if (status != 0) return status;
+        
+        for (uint32_t i = 0; i < FAT_SECTOR_SIZE / FAT_DIRECTORY_ENTRY_SIZE; ++i) {
+            const struct fat_directory_entry* entry = &entries[i];
+            
+            if ((uint8_t)entry->name[0] == FAT_ENTRY_END) return ERROR_NOT_FOUND;
+            if ((uint8_t)entry->name[0] == FAT_ENTRY_DELETED) continue;
+            if ((entry->attributes & FAT_ATTRIBUTE_LONG_NAME) == FAT_ATTRIBUTE_LONG_NAME) continue;
+            if (entry->attributes & FAT_ATTRIBUTE_VOLUME_ID) continue;
+            if (memcmp(entry->name, name, FAT_NAME_LENGTH) == 0) {
+                *result = *entry;
+                return 0;
+            }
+        }
+    }
+    return ERROR_NOT_FOUND;
+}
+
+static void fat_node_put(struct fat_node* node) {
+    if (node) node->references--;
+}
+
+/**
+ * @brief Mount a FAT12 or FAT16 volume
+ * 
+ * @param device Device holding the volume from its first block
+ * @param result Receives the volume
+ * @return 0 on success, ERROR_INVALID_ARGUMENT if the device holds no
+ *         FAT12/16 volume, otherwise a negative error
+ */
+int32_t fat_mount(struct block_device* device, struct fat_volume** result) {
+    struct fat_boot_sector boot;
+    uint8_t signature[2];
+    
+    if (!device || device->block_size != FAT_SECTOR_SIZE) return ERROR_INVALID_ARGUMENT;
+    if (fat_volume_count == MAX_FAT_VOLUMES) return ERROR_NO_MEMORY;
+    
+    int32_t status = block_read_cached(device, 0, &boot, sizeof(boot));
+    if (status == 0) status = block_read_cached(device, 510, signature, sizeof(signature));
+    if (status != 0) return status;
+    
+    uint32_t total_sectors = boot.total_sectors_16 ? boot.total_sectors_16 : boot.total_sectors_32;
+    uint32_t cluster_size = boot.sectors_per_cluster;
+    if (signature[0] != 0x55 || signature[1] != 0xAA || boot.bytes_per_sector != FAT_SECTOR_SIZE ||
+        cluster_size == 0 || (cluster_size & (cluster_size - 1)) || boot.reserved_sectors == 0 ||
+        boot.fat_count == 0 || boot.fat_sectors == 0 || total_sectors > device->block_count) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    struct fat_volume* volume = &fat_volumes[fat_volume_count];
+    uint32_t root_sectors = (boot.root_entries * FAT_DIRECTORY_ENTRY_SIZE + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+    
+    memset(volume, 0, sizeof(*volume));
+    volume->device = device;
+    volume->sectors_per_cluster = cluster_size;
+    volume->root_entries = boot.root_entries;
+    volume->first_root_sector = boot.reserved_sectors + boot.fat_count * boot.fat_sectors;
+    volume->first_data_sector = volume->first_root_sector + root_sectors;
+    if (volume->first_data_sector >= total_sectors) return ERROR_INVALID_ARGUMENT;
+    volume->cluster_count = (total_sectors - volume->first_data_sector) / cluster_size;
+    
+    // The cluster count alone decides the FAT type
+    if (volume->cluster_count <= FAT12_MAX_CLUSTERS) {
+        volume->type = 12;
+    } else if (volume->cluster_count <= FAT16_MAX_CLUSTERS) {
+        volume->type = 16;
+    } else {
+        return ERROR_INVALID_ARGUMENT;      // FAT32
+    }
+    
+    uint32_t entries = volume->cluster_count + FAT_FIRST_CLUSTER;
+    uint32_t needed = volume->type == 16 ? entries * 2 : entries + (entries + 1) / 2;
+    if (needed > (uint32_t)boot.fat_sectors * FAT_SECTOR_SIZE) return ERROR_INVALID_ARGUMENT;
+    
+    volume->fat = heap_allocate((uint32_t)boot.fat_sectors * FAT_SECTOR_SIZE);
+    if (!volume->fat) return ERROR_NO_MEMORY;
+    status = block_transfer(device, boot.reserved_sectors, boot.fat_sectors, volume->fat, 0);
+    if (status != 0) {
+        heap_free(volume->fat);
+        return status;
+    }
+    
+    fat_volume_count++;
+    *result = volume;
+    return 0;
+}
+
+/**
+ * @brief Look one name up in a directory
+ * 
+ * @param volume Mounted volume
+ * @param directory Subdirectory node, or NULL for the root directory
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param result Receives the referenced node, or NULL when ".." leads
+ *        back to the root directory
+ * @return 0 on success, ERROR_NOT_FOUND (also for names that do not fit
+ *         8.3), otherwise a negative error
+ */
+int32_t fat_lookup(struct fat_volume* volume, struct fat_node* directory, const char* name, uint32_t length,
+                   struct fat_node** result) {
+    char short_name[FAT_NAME_LENGTH];
+    struct fat_directory_entry entry;
+    
+    if (directory && !directory->directory) return ERROR_NOT_FOUND;
+    if (fat_name_from_path(name, length, short_name) != 0) return ERROR_NOT_FOUND;
+    
+    int32_t status = fat_directory_find(volume, directory, short_name, &entry);
+    if (status != 0) return status;
+    if (entry.cluster_low == 0 && (entry.attributes & FAT_ATTRIBUTE_DIRECTORY)) {
+        // ".." back to the root, which has no node
+        *result = NULL;
+        return 0;
+    }
+    return fat_node_get(volume, &entry, result);
+}
+
+/**
+ * @brief Open a file or subdirectory by path
+ * 
+ * @param volume Mounted volume
+ * @param path '/'-separated 8.3 names, case-insensitive, from the root
+ * @param file Receives the open file
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t fat_open(struct fat_volume* volume, const char* path, struct fat_file* file) {
+    struct fat_node* node = NULL;
+    
+    while (*path) {
+        struct fat_node* child;
+        uint32_t length = 0;
+        
+        while (*path == '/') {
+            path++;
+        }
+        while (path[length] && path[length] != '/') {
+            length++;
+        }
+        if (length == 0) break;
+        
+        int32_t status = fat_lookup(volume, node, path, length, &child);
+        fat_node_put(node);
+        if (status != 0) return status;
+        
+        node = child;
+        path += length;
+    }
+    
+    // The root directory is not a cluster chain and cannot be opened
+    if (!node) return ERROR_INVALID_ARGUMENT;
+    memset(file, 0, sizeof(*file));
+    file->node = node;
+    return 0;
+}
+
+/**
+ * @brief Read from a node's data through the page cache
+ * 
+ * @param node File or subdirectory
+ * @param state Reader's readahead state, or NULL
+ * @param offset Byte offset
+ * @param buffer Kernel destination
+ * @param length Bytes wanted
+ * @return Bytes read, short at the end of the file, or a negative error
+ */
+int32_t fat_node_read(struct fat_node* node, struct readahead_state* state, uint32_t offset, void* buffer,
+                      uint32_t length) {
+    uint32_t size = node->size;
+    
+    if (offset >= size) return 0;
+    if (length > size - offset) length = size - offset;
+    if (length > 0x7FFFFFFF) length = 0x7FFFFFFF;
+    
+    int32_t status = page_cache_read(&node->mapping, state, offset, buffer, length);
+    return status != 0 ? status : (int32_t)length;
+}
+
+/**
+ * @brief Read from an open file through the page cache
+ * 
+ * @param file Open file
+ * @param offset Byte offset
+ * @param buffer Kernel destination
+ * @param length Bytes wanted
+ * @return Bytes read, short at the end of the file, or a negative error
+ */
+int32_t fat_read(struct fat_file* file, uint32_t offset, void* buffer, uint32_t length) {
+    return fat_node_read(file->node, &file->readahead, offset, buffer, length);
+}
+
+/**
+ * @brief Size of an open file in bytes
+ */
+uint32_t fat_size(const struct fat_file* file) {
+    return file->node->size;
+}
+
+/**
+ * @brief Close a file opened by fat_open()
+ * 
+ * Its node and cached pages stay until the node table needs the slot.
+ */
+void fat_close(struct fat_file* file) {
+    fat_node_put(file->node);
+    file->node = NULL;
+}
+
+/**
+ * @brief Mount the boot floppy's filesystem, if it has one
+ */
+void fat_initialize(void) {
+    struct fat_volume* volume;
+    
+    if (fat_mount(block_device_find("fd0"), &volume) == 0) fat_boot_volume = volume;
+}
+
+// =============================================================================
+// ext2 Filesystem
+// =============================================================================
+
+// Read-write ext2 (revision 0 and 1) on any block device, probed and
+// mounted at boot. File and directory contents are cached per inode in
+// the page cache. A write allocates the blocks it needs, updates the
+// cached pages and marks them dirty; the page cache writes them back
+// later, in sorted batches with a bio per run of blocks under one plug.
+// An inode with dirty pages holds a reference on itself and sits on its
+// volume's dirty list. Once its pages are written, its own changes (size
+// and times) are written, so they never point past data that is not on
+// the disk yet. Metadata (superblock, group descriptors, bitmaps, inode
+// tables and indirect blocks) is read and written through the device's
+// cache.
+//
+// Allocation keeps files contiguous. A file's next block is looked for
+// right after its previous one, and a file's first block near its inode.
+// When the goal is taken, a wholly free bitmap byte is preferred, which
+// leaves room for the file to keep growing. Each data allocation also
+// reserves up to EXT2_PREALLOCATE_BLOCKS following blocks for the inode.
+// An appending writer then takes them without searching the bitmap, and
+// the unused ones are freed when the inode is no longer in use. New
+// directories go to a group with above-average free inodes and the most
+// free blocks, spreading the tree. New files go to their parent's group.
+//
+// Inodes in use are kept in a hash table by number. When their last user
+// drops them, the most recent EXT2_INODE_CACHE stay cached, with their
+// pages. A volume's lock serializes everything that changes it. Reads of
+// file data only take it to look inodes up.
+//
+// A volume with an ext3 journal (an inode holding a JBD2 log) journals
+// its metadata and directory blocks. Their changes go to the cached
+// pages and join the running transaction; nothing reaches the home
+// locations yet. An operation other than a file write ends by waiting
+// for its transaction to commit, and the checkpoint thread commits
+// every EXT2_COMMIT_INTERVAL_MS as well. The first waiter writes every block changed since the last
+// commit to the log in one sequential run, then a commit block, so
+// concurrent operations share one commit (group commit). A block changed
+// again while its committed contents are still unwritten is copied first.
+// When the log is half full, a kernel thread checkpoints: it writes the
+// committed blocks home, sorted, and empties the log. Freed blocks still
+// in the log are revoked, so a replay does not overwrite their new
+// contents. A commit first writes back the data of every inode on the
+// dirty list (ordered mode), and mount replays the log if the volume was
+// not shut down.
+// Source: Dave Poirier, "The Second Extended File System: Internal Layout";
+//         Linux fs/ext2 (balloc.c goal and preallocation, ialloc.c
+//         find_group_dir/find_group_other);
+//         Stephen Tweedie, "Journaling the Linux ext2fs Filesystem",
+//         LinuxExpo 1998; Linux fs/jbd2 (commit.c, checkpoint.c, recovery.c)
+#define MAX_EXT2_VOLUMES       4
+#define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_MAGIC             0xEF53
+#define EXT2_ROOT_INODE        2
+#define EXT2_OLD_INODE_SIZE    128     // Revision 0, and the part used here
+#define EXT2_OLD_FIRST_INODE   11      // First non-reserved inode, revision 0
+#define EXT2_MAX_LOG_BLOCK_SIZE 2      // 1024 << 2 = 4096 = PAGE_SIZE
+#define EXT2_MIN_BLOCK_SIZE    1024
+#define EXT2_DIRECT_BLOCKS     12
+#define EXT2_INDIRECT_SLOT     12      // i_block[] slots of the three trees
+#define EXT2_DOUBLE_SLOT       13
+#define EXT2_TRIPLE_SLOT       14
+#define EXT2_BLOCK_SLOTS       15
+#define EXT2_NAME_MAX          255
+#define EXT2_ENTRY_HEADER      8       // Directory entry without its name
+#define EXT2_PREALLOCATE_BLOCKS 8
+#define EXT2_INODE_CACHE       64      // Unused inodes kept cached
+#define EXT2_INODE_HASH        64      // Hash buckets
+#define EXT2_JOURNAL_HASH      64      // Hash buckets for journaled blocks
+#define EXT2_CHECKPOINT_BATCH  64      // Blocks a checkpoint writes at once
+#define EXT2_PAGE_READS        64      // Readahead pages in flight
+#define EXT2_COMMIT_INTERVAL_MS 5000   // Longest a transaction stays open
+
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL     0x0004
+#define EXT2_FEATURE_INCOMPAT_FILETYPE      0x0002
+#define EXT2_FEATURE_INCOMPAT_RECOVER       0x0004  // The journal may need replaying
+#define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+#define EXT2_FEATURE_RO_COMPAT_LARGE_FILE   0x0002
+#define EXT2_FEATURE_RO_COMPAT_SUPPORTED    0x0003
+
+// i_mode file types and default permissions
+#define EXT2_MODE_TYPE         0xF000
+#define EXT2_MODE_FILE         0x8000
+#define EXT2_MODE_DIRECTORY    0x4000
+#define EXT2_MODE_FILE_DEFAULT 0644
+#define EXT2_MODE_DIRECTORY_DEFAULT 0755
+
+// Directory entry file types
+#define EXT2_FILE_TYPE_FILE    1
+#define EXT2_FILE_TYPE_DIRECTORY 2
+
+// JBD2 journal: block types, descriptor tag flags and features
+#define JOURNAL_MAGIC          0xC03B3998
+#define JOURNAL_DESCRIPTOR     1
+#define JOURNAL_COMMIT         2
+#define JOURNAL_SUPERBLOCK_V1  3
+#define JOURNAL_SUPERBLOCK_V2  4
+#define JOURNAL_REVOKE         5
+#define JOURNAL_TAG_SIZE       8       // Block number, checksum and flags
+#define JOURNAL_UUID_SIZE      16      // After a tag without SAME_UUID
+#define JOURNAL_TAG_ESCAPE     0x1     // The block began with the magic number
+#define JOURNAL_TAG_SAME_UUID  0x2
+#define JOURNAL_TAG_LAST       0x8
+#define JOURNAL_FEATURE_INCOMPAT_REVOKE 0x1
+
+// Journal buffer flags
+#define EXT2_BUFFER_RUNNING    0x01    // Changed in the running transaction
+#define EXT2_BUFFER_PENDING    0x02    // Committed, not yet written in place
+#define EXT2_BUFFER_FREED      0x04    // Freed while pending: kept from reuse until the free commits
+
+struct ext2_superblock {
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t reserved_blocks_count;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;
+    uint32_t log_block_size;        // Block size is 1024 << log_block_size
+    uint32_t log_fragment_size;
+    uint32_t blocks_per_group;
+    uint32_t fragments_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mount_time;
+    uint32_t write_time;
+    uint16_t mount_count;
+    uint16_t max_mount_count;
+    uint16_t magic;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_revision;
+    uint32_t check_time;
+    uint32_t check_interval;
+    uint32_t creator_os;
+    uint32_t revision;
+    uint16_t reserved_uid;
+    uint16_t reserved_gid;
+    uint32_t first_inode;           // Revision 1 from here
+    uint16_t inode_size;
+    uint16_t block_group;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    uint8_t uuid[16];
+    char volume_name[16];
+    char last_mounted[64];
+    uint32_t algorithm_usage_bitmap;
+    uint8_t prealloc_blocks;
+    uint8_t prealloc_directory_blocks;
+    uint16_t reserved_gdt_blocks;
+    uint8_t journal_uuid[16];       // ext3 from here
+    uint32_t journal_inode;         // 0 for an external journal
+    uint32_t journal_device;
+    uint32_t last_orphan;
+    uint8_t unused[788];            // Kept so the whole superblock is written back
+} __attribute__((packed));
+
+struct ext2_group_descriptor {
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint16_t free_blocks_count;
+    uint16_t free_inodes_count;
+    uint16_t used_directories_count;
+    uint16_t pad;
+    uint8_t reserved[12];
+} __attribute__((packed));
+
+struct ext2_disk_inode {
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t access_time;
+    uint32_t change_time;
+    uint32_t modify_time;
+    uint32_t delete_time;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t sectors;               // 512-byte units, indirect blocks included
+    uint32_t flags;
+    uint32_t os1;
+    uint32_t block[EXT2_BLOCK_SLOTS];
+    uint32_t generation;
+    uint32_t file_acl;
+    uint32_t size_high;             // Directory ACL in revision 0
+    uint32_t fragment_address;
+    uint8_t os2[12];
+} __attribute__((packed));
+
+struct ext2_directory_entry {
+    uint32_t inode;                 // 0 for an unused entry
+    uint16_t record_length;         // To the next entry
+    uint8_t name_length;
+    uint8_t file_type;              // With EXT2_FEATURE_INCOMPAT_FILETYPE
+    char name[];
+} __attribute__((packed));
+
+// JBD2 structures are big-endian on disk
+struct journal_header {
+    uint32_t magic;
+    uint32_t block_type;
+    uint32_t sequence;              // Transaction
+} __attribute__((packed));
+
+struct journal_superblock {
+    struct journal_header header;
+    uint32_t block_size;
+    uint32_t max_length;            // Journal blocks, this one included
+    uint32_t first;                 // First log block
+    uint32_t sequence;              // First transaction expected in the log
+    uint32_t start;                 // Its first block, 0 when the log is empty
+    uint32_t error;
+    uint32_t feature_compat;        // Version 2 from here
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    uint8_t uuid[JOURNAL_UUID_SIZE];
+} __attribute__((packed));
+
+struct journal_revoke_header {
+    struct journal_header header;
+    uint32_t size;                  // Bytes used, this header included
+} __attribute__((packed));
+
+// A metadata block changed under the journal
+struct ext2_journal_buffer {
+    uint32_t block;
+    uint32_t flags;                 // EXT2_BUFFER_*
+    struct cached_page* page;       // Device cache page holding the block, referenced
+    uint8_t* frozen;                // Committed contents, once changed again before the checkpoint
+    uint32_t freed;                 // Transaction that freed the block, with EXT2_BUFFER_FREED
+    struct ext2_journal_buffer* hash_next;
+    struct ext2_journal_buffer* running_next;
+};
+
+struct ext2_journal {
+    uint32_t* map;                  // Journal block to volume block
+    uint32_t length;                // Journal blocks
+    uint32_t first;                 // First log block
+    uint32_t head;                  // Next log block to write
+    struct journal_superblock* superblock;  // A whole block, rewritten in place
+    uint32_t sequence;              // Running transaction
+    uint32_t committed;             // Last transaction on disk
+    int busy;                       // A commit or checkpoint owns the log
+    int32_t error;                  // Set when the log could not be written
+    struct ext2_journal_buffer* hash[EXT2_JOURNAL_HASH];
+    struct ext2_journal_buffer* running;    // Running transaction, newest first
+    uint32_t running_count;
+    uint32_t* revoked;              // Freed blocks the log holds
+    uint32_t revoked_count;
+    uint32_t revoked_capacity;
+    uint32_t freed_count;           // Buffers with EXT2_BUFFER_FREED
+    struct wait_queue wait;         // Woken when busy clears
+    struct wait_queue checkpoint_queue;     // Checkpoint thread
+    struct timer commit_timer;      // Wakes it for the periodic commit
+    uint32_t commits;
+    uint32_t checkpoints;
+};
+
+struct ext2_volume;
+
+struct ext2_inode {
+    struct ext2_volume* volume;
+    uint32_t number;
+    struct ext2_disk_inode disk;
+    uint32_t references;
+    struct ext2_inode* hash_next;
+    struct ext2_inode* unused_previous;     // Unused list, newest first
+    struct ext2_inode* unused_next;
+    uint32_t next_block;            // Logical block after the last allocated
+    uint32_t next_goal;             // Where to look for it
+    uint32_t prealloc_block;        // Reserved blocks, allocated in the bitmap
+    uint32_t prealloc_count;
+    int dirty;                      // disk not written since it changed
+    struct ext2_inode* dirty_previous;      // Volume's dirty list, while pages are
+    struct ext2_inode* dirty_next;          // dirty or being written
+    struct address_space mapping;
+};
+
+struct ext2_volume {
+    struct block_device* device;
+    struct ext2_superblock superblock;
+    struct ext2_group_descriptor* groups;
+    uint8_t* group_dirty;           // Descriptors changed since the last commit
+    uint32_t group_count;
+    uint32_t block_size;
+    uint32_t sectors_per_block;     // Device blocks per filesystem block
+    uint32_t pointers_per_block;
+    uint32_t inode_size;
+    uint32_t first_inode;
+    uint32_t inode_table_blocks;    // Per group
+    int read_only;
+    int file_types;                 // Directory entries record types
+    int superblock_dirty;
+    struct ext2_journal* journal;   // NULL without a journal, or read-only
+    int locked;
+    struct wait_queue lock_queue;
+    struct ext2_inode* inode_hash[EXT2_INODE_HASH];
+    struct ext2_inode* unused_head;
+    struct ext2_inode* unused_tail;
+    uint32_t unused_count;
+    struct ext2_inode* dirty_inodes;        // With data to write back
+    uint32_t dirty_inode_count;
+};
+
+static struct ext2_volume ext2_volumes[MAX_EXT2_VOLUMES];
+static uint32_t ext2_volume_count;
+
+static void ext2_lock(struct ext2_volume* volume) {
+    while (volume->locked) {
+        wait_queue_sleep(&volume->lock_queue);
+    }
+    volume->locked = 1;
+}
+
+static void ext2_unlock(struct ext2_volume* volume) {
+    volume->locked = 0;
+    wait_queue_wake_all(&volume->lock_queue);
+}
+
+// Seconds since boot, for timestamps: there is no real-time clock driver
+static uint32_t ext2_now(void) {
+    return timer_ticks / TIMER_FREQUENCY;
+}
+
+// JBD2 fields are big-endian
+static uint32_t ext2_be32(uint32_t value) {
+    return __builtin_bswap32(value);
+}
+
+static struct ext2_journal_buffer** ext2_journal_slot(struct ext2_journal* journal, uint32_t block) {
+    struct ext2_journal_buffer** link = &journal->hash[block % EXT2_JOURNAL_HASH];
+    
+    while (*link && (*link)->block != block) {
+        link = &(*link)->hash_next;
+    }
+    return link;
+}
+
+// A buffer's block within its device cache page
+static uint8_t* ext2_journal_data(const struct ext2_volume* volume, const struct ext2_journal_buffer* buffer) {
+    return buffer->page->data + buffer->block * volume->block_size % PAGE_SIZE;
+}
+
+static void ext2_journal_buffer_free(struct ext2_journal* journal, struct ext2_journal_buffer* buffer) {
+    *ext2_journal_slot(journal, buffer->block) = buffer->hash_next;
+    if (buffer->flags & EXT2_BUFFER_FREED) journal->freed_count--;
+    page_cache_put(buffer->page);
+    if (buffer->frozen) heap_free(buffer->frozen);
+    heap_free(buffer);
+}
+
+// Drop freed blocks once their free is committed: the log revokes them,
+// so their old contents need not be written in place any more
+static void ext2_journal_release_freed(struct ext2_journal* journal) {
+    for (uint32_t bucket = 0; bucket < EXT2_JOURNAL_HASH && journal->freed_count; ++bucket) {
+        struct ext2_journal_buffer* buffer = journal->hash[bucket];
+        
+        while (buffer) {
+            struct ext2_journal_buffer* next = buffer->hash_next;
+            
+            if ((buffer->flags & EXT2_BUFFER_FREED) && (int32_t)(buffer->freed - journal->committed) <= 0) {
+                ext2_journal_buffer_free(journal, buffer);
+            }
+            buffer = next;
+        }
+    }
+}
+
+// Append to a growable array of block numbers
+static int32_t ext2_array_append(uint32_t** array, uint32_t* count, uint32_t* capacity, uint32_t value) {
+    if (*count == *capacity) {
+        uint32_t grown = *capacity ? *capacity * 2 : 64;
+        uint32_t* larger = heap_allocate(grown * sizeof(uint32_t));
+        
+        if (!larger) return ERROR_NO_MEMORY;
+        if (*array) {
+            memcpy(larger, *array, *count * sizeof(uint32_t));
+            heap_free(*array);
+        }
+        *array = larger;
+        *capacity = grown;
+    }
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+/**
+ * @brief Add a block to the running transaction
+ * 
+ * @param volume Journaled volume, locked
+ * @param block Block about to be changed
+ * @param result Receives its buffer, whose data is the cached block
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Committed contents that are still to be written in place are copied
+ * first, for the checkpoint to write instead.
+ */
+static int32_t ext2_journal_get(struct ext2_volume* volume, uint32_t block, struct ext2_journal_buffer** result) {
+    struct ext2_journal* journal = volume->journal;
+    struct ext2_journal_buffer** slot = ext2_journal_slot(journal, block);
+    struct ext2_journal_buffer* buffer = *slot;
+    
+    if (!buffer) {
+        buffer = heap_allocate(sizeof(struct ext2_journal_buffer));
+        if (!buffer) return ERROR_NO_MEMORY;
+        memset(buffer, 0, sizeof(*buffer));
+        int32_t status = page_cache_get(&volume->device->cache,
+                                        (uint32_t)((uint64_t)block * volume->block_size / PAGE_SIZE), &buffer->page);
+        if (status != 0) {
+            heap_free(buffer);
+            return status;
+        }
+        buffer->block = block;
+        *slot = buffer;
+    }
+    if (!(buffer->flags & EXT2_BUFFER_RUNNING)) {
+        if ((buffer->flags & EXT2_BUFFER_PENDING) && !buffer->frozen) {
+            buffer->frozen = heap_allocate(volume->block_size);
+            if (!buffer->frozen) return ERROR_NO_MEMORY;
+            memcpy(buffer->frozen, ext2_journal_data(volume, buffer), volume->block_size);
+        }
+        buffer->flags |= EXT2_BUFFER_RUNNING;
+        buffer->running_next = journal->running;
+        journal->running = buffer;
+        journal->running_count++;
+        
+        // Reused since it was freed: a revocation would hide the new contents
+        for (uint32_t i = 0; i < journal->revoked_count; ++i) {
+            if (journal->revoked[i] == block) journal->revoked[i--] = journal->revoked[--journal->revoked_count];
+        }
+    }
+    *result = buffer;
+    return 0;
+}
+
+/**
+ * @brief Change bytes of metadata in the running transaction
+ * 
+ * @param volume Journaled volume, locked
+ * @param offset Byte offset on the device
+ * @param data New bytes
+ * @param length Number of bytes
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ext2_journal_patch(struct ext2_volume* volume, uint64_t offset, const void* data, uint32_t length) {
+    const uint8_t* source = (const uint8_t*)data;
+    
+    while (length > 0) {
+        uint32_t within = (uint32_t)offset & (volume->block_size - 1);
+        uint32_t chunk = volume->block_size - within < length ? volume->block_size - within : length;
+        struct ext2_journal_buffer* buffer;
+        int32_t result = ext2_journal_get(volume, (uint32_t)(offset >> (10 + volume->superblock.log_block_size)),
+                                          &buffer);
+        
+        if (result != 0) return result;
+        memcpy(ext2_journal_data(volume, buffer) + within, source, chunk);
+        source += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * @brief Take a freed block out of the journal
+ * 
+ * @param volume Journaled volume, locked
+ * @param block Block just freed
+ * 
+ * A block the log holds is revoked, so that replaying the log cannot
+ * overwrite what the block is used for next. Committed contents not yet
+ * written in place keep their buffer, in case the free is lost in a
+ * crash: the allocator passes over the block until the transaction that
+ * freed it has committed, and the buffer is dropped then, unwritten.
+ */
+static void ext2_journal_forget(struct ext2_volume* volume, uint32_t block) {
+    struct ext2_journal* journal = volume->journal;
+    struct ext2_journal_buffer* buffer = *ext2_journal_slot(journal, block);
+    
+    if (!buffer) return;
+    if ((buffer->flags & EXT2_BUFFER_PENDING) &&
+        ext2_array_append(&journal->revoked, &journal->revoked_count, &journal->revoked_capacity, block) != 0) {
+        journal->error = ERROR_NO_MEMORY;
+        volume->read_only = 1;
+    }
+    if (buffer->flags & EXT2_BUFFER_RUNNING) {
+        struct ext2_journal_buffer** link = &journal->running;
+        
+        while (*link != buffer) {
+            link = &(*link)->running_next;
+        }
+        *link = buffer->running_next;
+        buffer->running_next = NULL;
+        buffer->flags &= ~(uint32_t)EXT2_BUFFER_RUNNING;
+        journal->running_count--;
+    }
+    if (!(buffer->flags & EXT2_BUFFER_PENDING)) {
+        ext2_journal_buffer_free(journal, buffer);
+    } else if (!(buffer->flags & EXT2_BUFFER_FREED)) {
+        buffer->flags |= EXT2_BUFFER_FREED;
+        buffer->freed = journal->sequence;
+        journal->freed_count++;
+    }
+}
+
+// Add a block to a list of writes, extending the last bio if it follows on
+static uint32_t ext2_bio_add(struct ext2_volume* volume, struct bio* bios, uint32_t count, uint32_t block,
+                             uint8_t* data) {
+    struct bio* last = count ? &bios[count - 1] : NULL;
+    uint64_t sector = (uint64_t)block * volume->sectors_per_block;
+    
+    if (last && sector == last->sector + last->count &&
+        data == (uint8_t*)last->buffer + last->count * volume->device->block_size &&
+        last->count + volume->sectors_per_block <= volume->device->max_blocks) {
+        last->count += volume->sectors_per_block;
+        return count;
+    }
+    memset(&bios[count], 0, sizeof(struct bio));
+    bios[count].sector = sector;
+    bios[count].count = volume->sectors_per_block;
+    bios[count].write = 1;
+    bios[count].buffer = data;
+    return count + 1;
+}
+
+// Submit writes under one plug and wait for all of them
+static int32_t ext2_bios_write(struct ext2_volume* volume, struct bio* bios, uint32_t count) {
+    uint32_t submitted = 0;
+    int32_t result = 0;
+    
+    block_plug(volume->device);
+    while (submitted < count && result == 0) {
+        result = block_submit(volume->device, &bios[submitted]);
+        if (result == 0) submitted++;
+    }
+    block_unplug(volume->device);
+    for (uint32_t i = 0; i < submitted; ++i) {
+        int32_t status = block_wait(&bios[i]);
+        if (result == 0) result = status;
+    }
+    return result;
+}
+
+static int32_t ext2_journal_superblock_write(struct ext2_volume* volume) {
+    return block_transfer(volume->device, (uint64_t)volume->journal->map[0] * volume->sectors_per_block,
+                          volume->sectors_per_block, volume->journal->superblock, 1);
+}
+
+// Stop using the journal after a failed write, as ext3 aborts it
+static void ext2_journal_abort(struct ext2_volume* volume, int32_t error) {
+    volume->journal->error = error;
+    volume->read_only = 1;
+}
+
+/**
+ * @brief Write every committed block in place and empty the log
+ * 
+ * @param volume Journaled volume, locked; unlocked while writing
+ * 
+ * Blocks go out in ascending order in batches of EXT2_CHECKPOINT_BATCH,
+ * each copied under the lock and written under one plug. Commits wait
+ * for the log to be empty again, but operations go on adding to the
+ * running transaction meanwhile.
+ */
+static void ext2_journal_checkpoint(struct ext2_volume* volume) {
+    struct ext2_journal* journal = volume->journal;
+    struct ext2_journal_buffer* batch[EXT2_CHECKPOINT_BATCH];
+    uint8_t* copies;
+    struct bio* bios;
+    int32_t result = 0;
+    
+    while (journal->busy) {
+        ext2_unlock(volume);
+        wait_queue_sleep(&journal->wait);
+        ext2_lock(volume);
+    }
+    if (journal->error) return;
+    copies = heap_allocate(EXT2_CHECKPOINT_BATCH * volume->block_size);
+    bios = heap_allocate(EXT2_CHECKPOINT_BATCH * sizeof(struct bio));
+    if (!copies || !bios) {
+        if (copies) heap_free(copies);
+        if (bios) heap_free(bios);
+        ext2_journal_abort(volume, ERROR_NO_MEMORY);
+        wait_queue_wake_all(&journal->wait);
+        return;
+    }
+    journal->busy = 1;
+    
+    for (;;) {
+        uint32_t count = 0;
+        uint32_t bio_count = 0;
+        
+        // The lowest-numbered blocks still to be written, in order
+        for (uint32_t bucket = 0; bucket < EXT2_JOURNAL_HASH; ++bucket) {
+            for (struct ext2_journal_buffer* buffer = journal->hash[bucket]; buffer; buffer = buffer->hash_next) {
+                if (!(buffer->flags & EXT2_BUFFER_PENDING)) continue;
+                if (count == EXT2_CHECKPOINT_BATCH && buffer->block > batch[count - 1]->block) continue;
+                
+                uint32_t i = count < EXT2_CHECKPOINT_BATCH ? count++ : count - 1;
+                while (i > 0 && batch[i - 1]->block > buffer->block) {
+                    batch[i] = batch[i - 1];
+                    i--;
+                }
+                batch[i] = buffer;
+            }
+        }
+        if (count == 0) break;
+        
+        for (uint32_t i = 0; i < count; ++i) {
+            struct ext2_journal_buffer* buffer = batch[i];
+            uint8_t* copy = copies + i * volume->block_size;
+            
+            memcpy(copy, buffer->frozen ? buffer->frozen : ext2_journal_data(volume, buffer), volume->block_size);
+            bio_count = ext2_bio_add(volume, bios, bio_count, buffer->block, copy);
+            buffer->flags &= ~(uint32_t)EXT2_BUFFER_PENDING;
+            if (buffer->frozen) {
+                heap_free(buffer->frozen);
+                buffer->frozen = NULL;
+            }
+            if (!(buffer->flags & (EXT2_BUFFER_RUNNING | EXT2_BUFFER_FREED))) ext2_journal_buffer_free(journal, buffer);
+        }
+        ext2_unlock(volume);
+        result = ext2_bios_write(volume, bios, bio_count);
+        ext2_lock(volume);
+        if (result != 0) break;
+    }
+    
+    if (result == 0) {
+        // Everything committed is in place: restart the log empty
+        journal->head = journal->first;
+        journal->superblock->sequence = ext2_be32(journal->sequence);
+        journal->superblock->start = 0;
+        ext2_unlock(volume);
+        result = ext2_journal_superblock_write(volume);
+        ext2_lock(volume);
+    }
+    if (result == 0) {
+        journal->checkpoints++;
+    } else {
+        ext2_journal_abort(volume, result);
+    }
+    journal->busy = 0;
+    wait_queue_wake_all(&journal->wait);
+    heap_free(copies);
+    heap_free(bios);
+}
+
+static void ext2_journal_header(uint8_t* block, uint32_t type, uint32_t sequence) {
+    struct journal_header* header = (struct journal_header*)block;
+    
+    header->magic = ext2_be32(JOURNAL_MAGIC);
+    header->block_type = ext2_be32(type);
+    header->sequence = ext2_be32(sequence);
+}
+
+// Whether the log is past half full, time for a checkpoint
+static int ext2_journal_half_full(const struct ext2_journal* journal) {
+    return journal->head - journal->first > (journal->length - journal->first) / 2;
+}
+
+static void ext2_inode_release(struct ext2_inode* inode);
+
+/**
+ * @brief Write back the file data of a volume ahead of a commit
+ * 
+ * @param volume Journaled volume, locked, with the log busy; unlocked
+ *               while writing
+ * @return 0 on success, otherwise the first writeback error
+ * 
+ * Ordered mode: blocks the transaction allocates must hold their data
+ * before the commit makes them part of the filesystem. Every inode on the
+ * dirty list now is held and synced; later writes belong to the next
+ * transaction.
+ */
+static int32_t ext2_journal_write_data(struct ext2_volume* volume) {
+    uint32_t count = volume->dirty_inode_count;
+    struct ext2_inode** inodes;
+    struct ext2_inode* inode;
+    int32_t result = 0;
+    
+    if (count == 0) return 0;
+    inodes = heap_allocate(count * sizeof(struct ext2_inode*));
+    if (!inodes) return ERROR_NO_MEMORY;
+    count = 0;
+    for (inode = volume->dirty_inodes; inode; inode = inode->dirty_next) {
+        inode->references++;
+        inodes[count++] = inode;
+    }
+    
+    ext2_unlock(volume);
+    for (uint32_t i = 0; i < count; ++i) {
+        int32_t status = page_cache_sync(&inodes[i]->mapping);
+        if (result == 0) result = status;
+    }
+    ext2_lock(volume);
+    for (uint32_t i = 0; i < count; ++i) {
+        ext2_inode_release(inodes[i]);
+    }
+    heap_free(inodes);
+    return result;
+}
+
+/**
+ * @brief Write the running transaction to the log
+ * 
+ * @param volume Journaled volume, locked, with the log idle; unlocked
+ *               while writing
+ * 
+ * The transaction is copied under the lock: descriptor blocks each
+ * followed by the blocks they tag, then revoke blocks. Once the file data
+ * is written back, these go out under one plug, with the journal
+ * superblock if the log was empty, and the commit block once they are on
+ * disk. A transaction that does not fit
+ * after the head of the log waits for a checkpoint instead; one larger
+ * than the whole log is written in place, without the log's atomicity.
+ */
+static void ext2_journal_commit(struct ext2_volume* volume) {
+    struct ext2_journal* journal = volume->journal;
+    uint32_t block_size = volume->block_size;
+    uint32_t tags = (block_size - sizeof(struct journal_header) - JOURNAL_UUID_SIZE) / JOURNAL_TAG_SIZE;
+    uint32_t records = (block_size - sizeof(struct journal_revoke_header)) / sizeof(uint32_t);
+    uint32_t needed = (journal->running_count + tags - 1) / tags + journal->running_count +
+                      (journal->revoked_count + records - 1) / records + 1;
+    uint32_t sequence = journal->sequence;
+    struct ext2_journal_buffer* buffer;
+    struct ext2_journal_buffer* next;
+    
+    if (needed > journal->length - journal->first) {
+        ext2_journal_checkpoint(volume);
+        for (buffer = journal->running; buffer; buffer = next) {
+            next = buffer->running_next;
+            buffer->running_next = NULL;
+            buffer->flags = EXT2_BUFFER_PENDING;
+        }
+        journal->running = NULL;
+        journal->running_count = 0;
+        journal->revoked_count = 0;
+        journal->sequence++;
+        journal->busy = 1;
+        int32_t result = ext2_journal_write_data(volume);
+        journal->busy = 0;
+        if (result != 0) {
+            ext2_journal_abort(volume, result);
+            wait_queue_wake_all(&journal->wait);
+            return;
+        }
+        ext2_journal_checkpoint(volume);
+        if (!journal->error) {
+            journal->committed = sequence;
+            ext2_journal_release_freed(journal);
+        }
+        return;
+    }
+    if (journal->head + needed > journal->length) {
+        ext2_journal_checkpoint(volume);
+        return;
+    }
+    
+    uint8_t* log = heap_allocate(needed * block_size);
+    struct bio* bios = heap_allocate((needed + 1) * sizeof(struct bio));
+    if (!log || !bios) {
+        if (log) heap_free(log);
+        if (bios) heap_free(bios);
+        ext2_journal_abort(volume, ERROR_NO_MEMORY);
+        wait_queue_wake_all(&journal->wait);
+        return;
+    }
+    memset(log, 0, needed * block_size);
+    
+    uint32_t position = 0;
+    uint8_t* descriptor = NULL;
+    uint8_t* tag = NULL;
+    buffer = journal->running;
+    for (uint32_t i = 0; buffer; ++i, buffer = next) {
+        uint32_t flags = JOURNAL_TAG_SAME_UUID;
+        
+        next = buffer->running_next;
+        if (i % tags == 0) {
+            descriptor = log + position++ * block_size;
+            ext2_journal_header(descriptor, JOURNAL_DESCRIPTOR, sequence);
+            tag = descriptor + sizeof(struct journal_header);
+            flags = 0;
+        }
+        
+        uint8_t* copy = log + position++ * block_size;
+        memcpy(copy, ext2_journal_data(volume, buffer), block_size);
+        if (*(uint32_t*)copy == ext2_be32(JOURNAL_MAGIC)) {
+            // Would be taken for a journal block: stored zeroed, restored on replay
+            *(uint32_t*)copy = 0;
+            flags |= JOURNAL_TAG_ESCAPE;
+        }
+        if (i % tags == tags - 1 || !next) flags |= JOURNAL_TAG_LAST;
+        *(uint32_t*)tag = ext2_be32(buffer->block);
+        tag[6] = (uint8_t)(flags >> 8);
+        tag[7] = (uint8_t)flags;
+        tag += JOURNAL_TAG_SIZE;
+        if (!(flags & JOURNAL_TAG_SAME_UUID)) {
+            memcpy(tag, journal->superblock->uuid, JOURNAL_UUID_SIZE);
+            tag += JOURNAL_UUID_SIZE;
+        }
+        
+        buffer->flags = EXT2_BUFFER_PENDING;
+        buffer->running_next = NULL;
+        if (buffer->frozen) {
+            heap_free(buffer->frozen);
+            buffer->frozen = NULL;
+        }
+    }
+    for (uint32_t i = 0; i < journal->revoked_count; i += records) {
+        struct journal_revoke_header* revoke = (struct journal_revoke_header*)(log + position++ * block_size);
+        uint32_t* entries = (uint32_t*)(revoke + 1);
+        uint32_t count = journal->revoked_count - i < records ? journal->revoked_count - i : records;
+        
+        ext2_journal_header((uint8_t*)revoke, JOURNAL_REVOKE, sequence);
+        revoke->size = ext2_be32(sizeof(*revoke) + count * sizeof(uint32_t));
+        for (uint32_t j = 0; j < count; ++j) {
+            entries[j] = ext2_be32(journal->revoked[i + j]);
+        }
+    }
+    ext2_journal_header(log + position * block_size, JOURNAL_COMMIT, sequence);
+    
+    uint32_t start = journal->head;
+    uint32_t bio_count = 0;
+    for (uint32_t i = 0; i < position; ++i) {
+        bio_count = ext2_bio_add(volume, bios, bio_count, journal->map[start + i], log + i * block_size);
+    }
+    if (journal->superblock->start == 0) {
+        // The log was empty: point the superblock at this transaction
+        journal->superblock->sequence = ext2_be32(sequence);
+        journal->superblock->start = ext2_be32(start);
+        bio_count = ext2_bio_add(volume, bios, bio_count, journal->map[0], (uint8_t*)journal->superblock);
+    }
+    journal->running = NULL;
+    journal->running_count = 0;
+    journal->revoked_count = 0;
+    journal->head += needed;
+    journal->sequence++;
+    journal->busy = 1;
+    int32_t result = ext2_journal_write_data(volume);
+    ext2_unlock(volume);
+    
+    if (result == 0) result = ext2_bios_write(volume, bios, bio_count);
+    if (result == 0) {
+        ext2_bio_add(volume, bios, 0, journal->map[start + position], log + position * block_size);
+        result = ext2_bios_write(volume, bios, 1);
+    }
+    heap_free(log);
+    heap_free(bios);
+    
+    ext2_lock(volume);
+    if (result == 0) {
+        journal->committed = sequence;
+        journal->commits++;
+        ext2_journal_release_freed(journal);
+    } else {
+        ext2_journal_abort(volume, result);
+    }
+    journal->busy = 0;
+    wait_queue_wake_all(&journal->wait);
+    if (ext2_journal_half_full(journal)) wait_queue_wake_all(&journal->checkpoint_queue);
+}
+
+/**
+ * @brief Wait until the running transaction is on disk
+ * 
+ * @param volume Journaled volume, locked; unlocked while waiting
+ * @return 0 on success, otherwise the journal's error
+ * 
+ * Commits the transaction, unless a commit is being written already. The
+ * transaction then takes in whatever other operations finish meanwhile,
+ * and the first of them to wake up commits it for all of them.
+ */
+static int32_t ext2_journal_wait(struct ext2_volume* volume) {
+    struct ext2_journal* journal = volume->journal;
+    uint32_t sequence = journal->sequence;
+    
+    if (!journal->running && !journal->revoked_count) return journal->error;
+    while (!journal->error && (int32_t)(journal->committed - sequence) < 0) {
+        if (journal->busy) {
+            ext2_unlock(volume);
+            wait_queue_sleep(&journal->wait);
+            ext2_lock(volume);
+        } else {
+            ext2_journal_commit(volume);
+        }
+    }
+    return journal->error;
+}
+
+static int32_t ext2_block_read(struct ext2_volume* volume, uint32_t block, void* buffer) {
+    return block_read_cached(volume->device, (uint64_t)block * volume->block_size, buffer, volume->block_size);
+}
+
+static int32_t ext2_block_write(struct ext2_volume* volume, uint32_t block, const void* buffer) {
+    if (volume->journal) {
+        return ext2_journal_patch(volume, (uint64_t)block * volume->block_size, buffer, volume->block_size);
+    }
+    return block_write_cached(volume->device, (uint64_t)block * volume->block_size, buffer, volume->block_size);
+}
+
+/**
+ * @brief Rewrite a few bytes of metadata in place
+ * 
+ * @param volume Mounted volume
+ * @param offset Byte offset on the device
+ * @param data New bytes
+ * @param length Number of bytes
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Reads the device blocks around the range from the cache, patches them
+ * and writes them back, so an inode or descriptor costs one sector. With
+ * a journal, the cached block is patched in the running transaction.
+ */
+static int32_t ext2_metadata_patch(struct ext2_volume* volume, uint64_t offset, const void* data, uint32_t length) {
+    uint32_t unit = volume->device->block_size;
+    uint32_t within = (uint32_t)offset & (unit - 1);
+    uint32_t size = (within + length + unit - 1) & ~(unit - 1);
+    uint8_t* buffer;
+    
+    if (volume->journal) return ext2_journal_patch(volume, offset, data, length);
+    buffer = heap_allocate(size);
+    if (!buffer) return ERROR_NO_MEMORY;
+    int32_t result = block_read_cached(volume->device, offset - within, buffer, size);
+    if (result == 0) {
+        memcpy(buffer + within, data, length);
+        result = block_write_cached(volume->device, offset - within, buffer, size);
+    }
+    heap_free(buffer);
+    return result;
+}
+
+/**
+ * @brief Write back the group descriptors and superblock counts changed
+ *        by an operation
+ */
+static int32_t ext2_metadata_flush(struct ext2_volume* volume) {
+    uint64_t table = (uint64_t)(volume->superblock.first_data_block + 1) * volume->block_size;
+    int32_t result = 0;
+    
+    for (uint32_t group = 0; group < volume->group_count; ++group) {
+        if (!volume->group_dirty[group]) continue;
+        
+        int32_t status = ext2_metadata_patch(volume, table + group * sizeof(struct ext2_group_descriptor),
+                                             &volume->groups[group], sizeof(struct ext2_group_descriptor));
+        if (status == 0) {
+            volume->group_dirty[group] = 0;
+        } else if (result == 0) {
+            result = status;
+        }
+    }
+    if (volume->superblock_dirty) {
+        volume->superblock.write_time = ext2_now();
+        int32_t status = ext2_metadata_patch(volume, EXT2_SUPERBLOCK_OFFSET, &volume->superblock,
+                                             sizeof(volume->superblock));
+        if (status == 0) {
+            volume->superblock_dirty = 0;
+        } else if (result == 0) {
+            result = status;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Finish an operation: write back the metadata it changed and, on
+ *        a journaled volume, wait until its transaction is committed
+ *        (dropping the lock meanwhile)
+ */
+static int32_t ext2_commit(struct ext2_volume* volume) {
+    int32_t result = ext2_metadata_flush(volume);
+    
+    if (volume->journal) {
+        int32_t status = ext2_journal_wait(volume);
+        if (result == 0) result = status;
+    }
+    return result;
+}
+
+static int ext2_bit_test(const uint8_t* bitmap, uint32_t bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void ext2_bit_set(uint8_t* bitmap, uint32_t bit) {
+    bitmap[bit / 8] |= (uint8_t)(1u << (bit % 8));
+}
+
+static void ext2_bit_clear(uint8_t* bitmap, uint32_t bit) {
+    bitmap[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+}
+
+static uint32_t ext2_group_blocks(const struct ext2_volume* volume, uint32_t group) {
+    const struct ext2_superblock* superblock = &volume->superblock;
+    uint32_t start = superblock->first_data_block + group * superblock->blocks_per_group;
+    
+    return superblock->blocks_count - start < superblock->blocks_per_group ? superblock->blocks_count - start
+                                                                            : superblock->blocks_per_group;
+}
+
+/**
+ * @brief Pick a free bit near a goal in a bitmap
+ * 
+ * @param bitmap Group bitmap
+ * @param goal Preferred bit
+ * @param limit Bits in the group
+ * @return The goal if free, else the first wholly free byte after it, else
+ *         the first free bit after it (wrapping); limit if none is free
+ */
+static uint32_t ext2_bitmap_search(const uint8_t* bitmap, uint32_t goal, uint32_t limit) {
+    if (goal < limit && !ext2_bit_test(bitmap, goal)) return goal;
+    
+    for (uint32_t byte = (goal + 7) / 8; byte < limit / 8; ++byte) {
+        if (bitmap[byte] == 0) return byte * 8;
+    }
+    for (uint32_t pass = 0; pass < 2; ++pass) {
+        uint32_t start = pass == 0 ? goal : 0;
+        uint32_t end = pass == 0 ? limit : goal;
+        
+        for (uint32_t bit = start; bit < end; ++bit) {
+            if (bitmap[bit / 8] == 0xFF) {
+                bit |= 7;
+                continue;
+            }
+            if (!ext2_bit_test(bitmap, bit)) return bit;
+        }
+    }
+    return limit;
+}
+
+// Mark the blocks of a group that the journal still holds as used in a
+// copy of its bitmap, for the allocator to pass over
+static void ext2_journal_hold_freed(struct ext2_volume* volume, uint32_t group, uint8_t* bitmap, uint32_t limit) {
+    struct ext2_journal* journal = volume->journal;
+    uint32_t start = volume->superblock.first_data_block + group * volume->superblock.blocks_per_group;
+    
+    for (uint32_t bucket = 0; bucket < EXT2_JOURNAL_HASH; ++bucket) {
+        for (struct ext2_journal_buffer* buffer = journal->hash[bucket]; buffer; buffer = buffer->hash_next) {
+            if ((buffer->flags & EXT2_BUFFER_FREED) && buffer->block >= start && buffer->block - start < limit) {
+                ext2_bit_set(bitmap, buffer->block - start);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Allocate a run of blocks as close to a goal as possible
+ * 
+ * @param volume Mounted volume, locked
+ * @param goal Preferred first block
+ * @param wanted Most blocks to allocate
+ * @param first Receives the first block of the run
+ * @return Blocks allocated (at least one), ERROR_NO_MEMORY if the volume
+ *         is full, or an I/O error
+ */
+static int32_t ext2_blocks_allocate(struct ext2_volume* volume, uint32_t goal, uint32_t wanted, uint32_t* first) {
+    struct ext2_superblock* superblock = &volume->superblock;
+    uint8_t* bitmap;
+    int32_t result = ERROR_NO_MEMORY;
+    
+    if (goal < superblock->first_data_block || goal >= superblock->blocks_count) goal = superblock->first_data_block;
+    bitmap = heap_allocate(2 * volume->block_size);
+    if (!bitmap) return ERROR_NO_MEMORY;
+    
+    uint32_t goal_group = (goal - superblock->first_data_block) / superblock->blocks_per_group;
+    for (uint32_t i = 0; i < volume->group_count; ++i) {
+        uint32_t group = (goal_group + i) % volume->group_count;
+        struct ext2_group_descriptor* descriptor = &volume->groups[group];
+        uint32_t limit = ext2_group_blocks(volume, group);
+        
+        if (descriptor->free_blocks_count == 0) continue;
+        result = ext2_block_read(volume, descriptor->block_bitmap, bitmap);
+        if (result != 0) break;
+        
+        // Freed blocks the journal may still write in place are not free yet
+        uint8_t* search = bitmap;
+        if (volume->journal && volume->journal->freed_count) {
+            search = bitmap + volume->block_size;
+            memcpy(search, bitmap, volume->block_size);
+            ext2_journal_hold_freed(volume, group, search, limit);
+        }
+        
+        uint32_t bit = ext2_bitmap_search(search, i == 0 ? (goal - superblock->first_data_block) %
+                                                            superblock->blocks_per_group : 0, limit);
+        if (bit == limit) {
+            result = ERROR_NO_MEMORY;
+            continue;
+        }
+        
+        uint32_t count = 0;
+        while (count < wanted && count < descriptor->free_blocks_count && bit + count < limit &&
+               !ext2_bit_test(search, bit + count)) {
+            ext2_bit_set(bitmap, bit + count);
+            count++;
+        }
+        result = ext2_block_write(volume, descriptor->block_bitmap, bitmap);
+        if (result != 0) break;
+        
+        descriptor->free_blocks_count -= (uint16_t)count;
+        superblock->free_blocks_count -= count;
+        volume->group_dirty[group] = 1;
+        volume->superblock_dirty = 1;
+        *first = superblock->first_data_block + group * superblock->blocks_per_group + bit;
+        result = (int32_t)count;
+        break;
+    }
+    heap_free(bitmap);
+    return result;
+}
+
+/**
+ * @brief Return a run of blocks to the free pool
+ * 
+ * @param volume Mounted volume, locked
+ * @param block First block
+ * @param count Number of blocks, which may span groups
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ext2_blocks_free(struct ext2_volume* volume, uint32_t block, uint32_t count) {
+    struct ext2_superblock* superblock = &volume->superblock;
+    uint8_t* bitmap;
+    int32_t result = 0;
+    
+    if (count == 0) return 0;
+    if (block < superblock->first_data_block || block >= superblock->blocks_count ||
+        count > superblock->blocks_count - block) {
+        return ERROR_IO;
+    }
+    bitmap = heap_allocate(volume->block_size);
+    if (!bitmap) return ERROR_NO_MEMORY;
+    
+    while (count > 0 && result == 0) {
+        uint32_t group = (block - superblock->first_data_block) / superblock->blocks_per_group;
+        uint32_t bit = (block - superblock->first_data_block) % superblock->blocks_per_group;
+        uint32_t chunk = superblock->blocks_per_group - bit < count ? superblock->blocks_per_group - bit : count;
+        struct ext2_group_descriptor* descriptor = &volume->groups[group];
+        uint32_t freed = 0;
+        
+        result = ext2_block_read(volume, descriptor->block_bitmap, bitmap);
+        if (result != 0) break;
+        for (uint32_t i = 0; i < chunk; ++i) {
+            if (ext2_bit_test(bitmap, bit + i)) freed++;
+            ext2_bit_clear(bitmap, bit + i);
+            if (volume->journal) ext2_journal_forget(volume, block + i);
+        }
+        result = ext2_block_write(volume, descriptor->block_bitmap, bitmap);
+        if (result != 0) break;
+        
+        descriptor->free_blocks_count += (uint16_t)freed;
+        superblock->free_blocks_count += freed;
+        volume->group_dirty[group] = 1;
+        volume->superblock_dirty = 1;
+        block += chunk;
+        count -= chunk;
+    }
+    heap_free(bitmap);
+    return result;
+}
+
+// Give back blocks reserved for an inode's next allocations
+static void ext2_prealloc_discard(struct ext2_inode* inode) {
+    if (inode->prealloc_count) ext2_blocks_free(inode->volume, inode->prealloc_block, inode->prealloc_count);
+    inode->prealloc_count = 0;
+}
+
+/**
+ * @brief Allocate one block for an inode, data or indirect
+ * 
+ * @param inode Inode the block belongs to
+ * @param logical Logical block being mapped, which sets the goal
+ * @param block Receives the block number
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Takes the inode's next preallocated block when it is the goal;
+ * otherwise drops the reservation and allocates a fresh run at the goal,
+ * keeping the rest of it reserved (regular files without a journal).
+ */
+static int32_t ext2_block_allocate(struct ext2_inode* inode, uint32_t logical, uint32_t* block) {
+    struct ext2_volume* volume = inode->volume;
+    uint32_t goal = inode->next_goal;
+    
+    if (logical != inode->next_block || goal == 0) {
+        uint32_t group = (inode->number - 1) / volume->superblock.inodes_per_group;
+        goal = volume->groups[group].inode_table + volume->inode_table_blocks;
+    }
+    
+    if (inode->prealloc_count && inode->prealloc_block == goal) {
+        *block = inode->prealloc_block++;
+        inode->prealloc_count--;
+    } else {
+        // Reserved blocks are set in the on-disk bitmap, so a crash would leak
+        // them: a journaled volume leans on the goal alone, as ext3 does
+        int file = (inode->disk.mode & EXT2_MODE_TYPE) == EXT2_MODE_FILE && !volume->journal;
+        
+        ext2_prealloc_discard(inode);
+        int32_t count = ext2_blocks_allocate(volume, goal, file ? 1 + EXT2_PREALLOCATE_BLOCKS : 1, block);
+        if (count < 0) return count;
+        inode->prealloc_block = *block + 1;
+        inode->prealloc_count = (uint32_t)count - 1;
+    }
+    
+    inode->disk.sectors += volume->block_size / 512;
+    inode->next_goal = *block + 1;
+    return 0;
+}
+
+/**
+ * @brief Find the block holding a logical block of an inode
+ * 
+ * @param inode Inode to map
+ * @param logical Block within the file
+ * @param create Non-zero to allocate the block and any missing indirect
+ *               blocks (volume locked); the caller writes the inode
+ * @param physical Receives the block, or 0 for a hole
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ext2_block_map(struct ext2_inode* inode, uint32_t logical, int create, uint32_t* physical) {
+    struct ext2_volume* volume = inode->volume;
+    uint32_t per_block = volume->pointers_per_block;
+    uint32_t offsets[4];
+    uint32_t depth;
+    uint32_t remaining = logical;
+    
+    if (remaining < EXT2_DIRECT_BLOCKS) {
+        offsets[0] = remaining;
+        depth = 1;
+    } else if ((remaining -= EXT2_DIRECT_BLOCKS) < per_block) {
+        offsets[0] = EXT2_INDIRECT_SLOT;
+        offsets[1] = remaining;
+        depth = 2;
+    } else if ((remaining -= per_block) < per_block * per_block) {
+        offsets[0] = EXT2_DOUBLE_SLOT;
+        offsets[1] = remaining / per_block;
+        offsets[2] = remaining % per_block;
+        depth = 3;
+    } else {
+        remaining -= per_block * per_block;
+        if (remaining / per_block / per_block >= per_block) return ERROR_INVALID_ARGUMENT;
+        offsets[0] = EXT2_TRIPLE_SLOT;
+        offsets[1] = remaining / per_block / per_block;
+        offsets[2] = remaining / per_block % per_block;
+        offsets[3] = remaining % per_block;
+        depth = 4;
+    }
+    
+    uint32_t block = inode->disk.block[offsets[0]];
+    *physical = 0;
+    for (uint32_t level = 0; level < depth; ++level) {
+        uint64_t entry = (uint64_t)block * volume->block_size + offsets[level] * sizeof(uint32_t);
+        
+        if (level > 0) {
+            int32_t result = block_read_cached(volume->device, entry, &block, sizeof(block));
+            if (result != 0) return result;
+        }
+        if (block == 0) {
+            if (!create) return 0;
+            
+            int32_t result = ext2_block_allocate(inode, logical, &block);
+            if (result == 0 && level + 1 < depth) {
+                // New indirect blocks start out with no children
+                uint8_t* zero = heap_allocate(volume->block_size);
+                
+                result = zero ? 0 : ERROR_NO_MEMORY;
+                if (zero) {
+                    memset(zero, 0, volume->block_size);
+                    result = ext2_block_write(volume, block, zero);
+                    heap_free(zero);
+                }
+            }
+            if (result == 0 && level > 0) result = ext2_metadata_patch(volume, entry, &block, sizeof(block));
+            if (result != 0) return result;
+            if (level == 0) inode->disk.block[offsets[0]] = block;
+        }
+        if (block >= volume->superblock.blocks_count) return ERROR_IO;
+    }
+    if (create) inode->next_block = logical + 1;
+    *physical = block;
+    return 0;
+}
+
+// Whether an inode's blocks go through the journal, as directories do on
+// an ext3 volume. Those are read through the device's cache, which holds
+// them until they are written in place.
+static int ext2_journaled_data(const struct ext2_inode* inode) {
+    return inode->volume->journal && (inode->disk.mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY;
+}
+
+static int32_t ext2_read_page(struct address_space* mapping, uint32_t index, void* page) {
+    struct ext2_inode* inode = (struct ext2_inode*)mapping->host;
+    struct ext2_volume* volume = inode->volume;
+    int journaled = ext2_journaled_data(inode);
+    uint32_t per_page = PAGE_SIZE / volume->block_size;
+    uint8_t* data = (uint8_t*)page;
+    uint32_t run_start = 0;
+    uint32_t run_count = 0;
+    uint8_t* run_data = data;
+    
+    for (uint32_t i = 0; i <= per_page; ++i) {
+        uint32_t physical = 0;
+        uint64_t start = ((uint64_t)index * per_page + i) * volume->block_size;
+        
+        if (i < per_page && start < inode->disk.size) {
+            int32_t result = ext2_block_map(inode, index * per_page + i, 0, &physical);
+            if (result != 0) return result;
+        }
+        if (run_count && (i == per_page || physical != run_start + run_count)) {
+            int32_t result = block_transfer(volume->device, (uint64_t)run_start * volume->sectors_per_block,
+                                            run_count * volume->sectors_per_block, run_data, 0);
+            if (result != 0) return result;
+            run_count = 0;
+        }
+        if (i == per_page) break;
+        
+        if (physical == 0) {
+            // A hole, or past the end of the file
+            memset(data + i * volume->block_size, 0, volume->block_size);
+        } else if (journaled) {
+            int32_t result = ext2_block_read(volume, physical, data + i * volume->block_size);
+            if (result != 0) return result;
+        } else if (run_count++ == 0) {
+            run_start = physical;
+            run_data = data + i * volume->block_size;
+        }
+    }
+    return 0;
+}
+
+// A readahead page in flight, with one bio per run of its blocks. Slots
+// are recycled rather than freed from the completion callback, which runs
+// inside the wakeup of a bio's queue.
+struct ext2_page_read {
+    struct bio bios[PAGE_SIZE / EXT2_MIN_BLOCK_SIZE];
+    struct wait_callback completions[PAGE_SIZE / EXT2_MIN_BLOCK_SIZE];
+    struct cached_page* page;
+    uint32_t pending;               // Bios not yet finished, plus one while submitting
+    int32_t result;
+    int busy;
+};
+
+static struct ext2_page_read ext2_page_reads[EXT2_PAGE_READS];
+
+// One bio, or the submitter, is done with a page; the last one unlocks it
+static void ext2_page_read_finish(struct ext2_page_read* read, int32_t result) {
+    if (result != 0 && read->result == 0) read->result = result;
+    if (--read->pending) return;
+    
+    page_cache_unlock(read->page, read->result);
+    read->busy = 0;
+}
+
+static void ext2_page_read_done(struct wait_callback* callback) {
+    struct ext2_page_read* read = (struct ext2_page_read*)callback->context;
+    struct bio* bio = &read->bios[callback - read->completions];
+    
+    wait_queue_remove_callback(callback);
+    ext2_page_read_finish(read, bio->result);
+}
+
+/**
+ * @brief Start reading a batch of locked pages with one bio per run of
+ *        blocks
+ * 
+ * All bios go out under one plug, so runs that continue across pages are
+ * merged by the request queue. Returns without waiting; each page is
+ * unlocked by the completion of its last bio. Pages that cannot get a
+ * slot, and journaled directories (read through the device cache), are
+ * read synchronously.
+ */
+static void ext2_read_pages(struct address_space* mapping, struct cached_page** pages, uint32_t count) {
+    struct ext2_inode* inode = (struct ext2_inode*)mapping->host;
+    struct ext2_volume* volume = inode->volume;
+    uint32_t per_page = PAGE_SIZE / volume->block_size;
+    int journaled = ext2_journaled_data(inode);
+    uint32_t slot = 0;
+    
+    block_plug(volume->device);
+    for (uint32_t i = 0; i < count; ++i) {
+        struct cached_page* page = pages[i];
+        
+        while (slot < EXT2_PAGE_READS && ext2_page_reads[slot].busy) {
+            slot++;
+        }
+        if (journaled || slot == EXT2_PAGE_READS) {
+            page_cache_unlock(page, ext2_read_page(mapping, page->index, page->data));
+            continue;
+        }
+        
+        struct ext2_page_read* read = &ext2_page_reads[slot];
+        struct bio* run = NULL;
+        uint32_t runs = 0;
+        int32_t result = 0;
+        
+        memset(read, 0, sizeof(*read));
+        read->busy = 1;
+        read->page = page;
+        for (uint32_t block = 0; block < per_page && result == 0; ++block) {
+            uint32_t logical = page->index * per_page + block;
+            uint8_t* data = page->data + block * volume->block_size;
+            uint32_t physical = 0;
+            
+            if ((uint64_t)logical * volume->block_size < inode->disk.size) {
+                result = ext2_block_map(inode, logical, 0, &physical);
+            }
+            if (physical == 0) {
+                memset(data, 0, volume->block_size);
+                run = NULL;
+            } else if (run && (uint64_t)physical * volume->sectors_per_block == run->sector + run->count) {
+                run->count += volume->sectors_per_block;
+            } else {
+                run = &read->bios[runs++];
+                run->sector = (uint64_t)physical * volume->sectors_per_block;
+                run->count = volume->sectors_per_block;
+                run->buffer = data;
+            }
+        }
+        
+        // The extra count keeps the page locked until every run is out
+        read->pending = 1;
+        for (uint32_t r = 0; r < runs && result == 0; ++r) {
+            read->completions[r].function = ext2_page_read_done;
+            read->completions[r].context = read;
+            wait_queue_add_callback(&read->bios[r].queue, &read->completions[r]);
+            read->pending++;
+            
+            int32_t status = block_submit(volume->device, &read->bios[r]);
+            if (status != 0) {
+                wait_queue_remove_callback(&read->completions[r]);
+                read->pending--;
+                result = status;
+            }
+        }
+        ext2_page_read_finish(read, result);
+    }
+    block_unplug(volume->device);
+}
+
+static uint64_t ext2_inode_offset(const struct ext2_volume* volume, uint32_t number) {
+    uint32_t group = (number - 1) / volume->superblock.inodes_per_group;
+    uint32_t index = (number - 1) % volume->superblock.inodes_per_group;
+    
+    return (uint64_t)volume->groups[group].inode_table * volume->block_size + (uint64_t)index * volume->inode_size;
+}
+
+static int32_t ext2_inode_write(struct ext2_inode* inode) {
+    int32_t result = ext2_metadata_patch(inode->volume, ext2_inode_offset(inode->volume, inode->number),
+                                         &inode->disk, sizeof(inode->disk));
+    
+    if (result == 0) inode->dirty = 0;
+    return result;
+}
+
+/**
+ * @brief Write back a batch of an inode's dirty pages
+ * 
+ * Maps the blocks without the volume lock: they were allocated when the
+ * pages were dirtied, and the inode cannot be deleted while it holds
+ * itself for its dirty pages. A bio per run of blocks, all under one plug.
+ */
+static int32_t ext2_write_pages(struct address_space* mapping, struct cached_page** pages, uint32_t count) {
+    struct ext2_inode* inode = (struct ext2_inode*)mapping->host;
+    struct ext2_volume* volume = inode->volume;
+    uint32_t per_page = PAGE_SIZE / volume->block_size;
+    struct bio* bios = heap_allocate(count * per_page * sizeof(struct bio));
+    uint32_t bio_count = 0;
+    int32_t result = 0;
+    
+    if (!bios) return ERROR_NO_MEMORY;
+    for (uint32_t i = 0; i < count && result == 0; ++i) {
+        for (uint32_t block = 0; block < per_page; ++block) {
+            uint32_t logical = pages[i]->index * per_page + block;
+            uint32_t physical;
+            
+            if ((uint64_t)logical * volume->block_size >= inode->disk.size) break;
+            result = ext2_block_map(inode, logical, 0, &physical);
+            if (result != 0) break;
+            if (physical) {
+                bio_count = ext2_bio_add(volume, bios, bio_count, physical,
+                                         pages[i]->data + block * volume->block_size);
+            }
+        }
+    }
+    if (result == 0) result = ext2_bios_write(volume, bios, bio_count);
+    heap_free(bios);
+    return result;
+}
+
+// First dirty page: the inode holds itself, on its volume's dirty list
+static void ext2_mapping_get(struct address_space* mapping) {
+    struct ext2_inode* inode = (struct ext2_inode*)mapping->host;
+    struct ext2_volume* volume = inode->volume;
+    
+    inode->references++;
+    inode->dirty_previous = NULL;
+    inode->dirty_next = volume->dirty_inodes;
+    if (volume->dirty_inodes) volume->dirty_inodes->dirty_previous = inode;
+    volume->dirty_inodes = inode;
+    volume->dirty_inode_count++;
+}
+
+// Data all written: write the inode after it and drop the hold. It leaves
+// the dirty list first, so a page dirtied while this waits for the lock
+// holds the inode afresh.
+static void ext2_mapping_put(struct address_space* mapping) {
+    struct ext2_inode* inode = (struct ext2_inode*)mapping->host;
+    struct ext2_volume* volume = inode->volume;
+    
+    if (inode->dirty_previous) inode->dirty_previous->dirty_next = inode->dirty_next;
+    else volume->dirty_inodes = inode->dirty_next;
+    if (inode->dirty_next) inode->dirty_next->dirty_previous = inode->dirty_previous;
+    inode->dirty_previous = inode->dirty_next = NULL;
+    volume->dirty_inode_count--;
+    
+    ext2_lock(volume);
+    if (inode->dirty) ext2_inode_write(inode);
+    ext2_inode_release(inode);
+    ext2_metadata_flush(volume);
+    ext2_unlock(volume);
+}
+
+// A page is about to be written through a shared mapping. Give any hole
+// in it (up to the end of the file) blocks, as write() would, so that
+// writeback has somewhere to put it.
+static int32_t ext2_page_mkwrite(struct address_space* mapping, struct cached_page* page) {
+    struct ext2_inode* inode = (struct ext2_inode*)mapping->host;
+    struct ext2_volume* volume = inode->volume;
+    uint32_t per_page = PAGE_SIZE / volume->block_size;
+    uint32_t first = page->index * per_page;
+    uint32_t block = 0;
+    int32_t result = 0;
+    
+    if (volume->read_only) return ERROR_INVALID_ARGUMENT;
+    
+    // Looking blocks up needs no lock; only filling a hole does
+    for (; block < per_page && (uint64_t)(first + block) * volume->block_size < inode->disk.size; ++block) {
+        uint32_t physical;
+        
+        result = ext2_block_map(inode, first + block, 0, &physical);
+        if (result != 0) return result;
+        if (physical == 0) break;
+    }
+    if (block == per_page || (uint64_t)(first + block) * volume->block_size >= inode->disk.size) return 0;
+    
+    ext2_lock(volume);
+    for (; block < per_page && (uint64_t)(first + block) * volume->block_size < inode->disk.size; ++block) {
+        uint32_t physical;
+        
+        result = ext2_block_map(inode, first + block, 1, &physical);
+        if (result != 0) break;
+    }
+    inode->disk.modify_time = inode->disk.change_time = ext2_now();
+    inode->dirty = 1;
+    if (volume->journal || !(mapping->dirty_count || mapping->writeback_count)) {
+        int32_t status = ext2_inode_write(inode);
+        if (result == 0) result = status;
+    }
+    int32_t flushed = ext2_metadata_flush(volume);
+    ext2_unlock(volume);
+    return result != 0 ? result : flushed;
+}
+
+static const struct address_space_operations ext2_operations = {
+    ext2_read_page, ext2_read_pages, ext2_write_pages, ext2_mapping_get, ext2_mapping_put, ext2_page_mkwrite
+};
+
+static void ext2_unused_remove(struct ext2_volume* volume, struct ext2_inode* inode) {
+    if (inode->unused_previous) {
+        inode->unused_previous->unused_next = inode->unused_next;
+    } else {
+        volume->unused_head = inode->unused_next;
+    }
+    if (inode->unused_next) {
+        inode->unused_next->unused_previous = inode->unused_previous;
+    } else {
+        volume->unused_tail = inode->unused_previous;
+    }
+    inode->unused_previous = inode->unused_next = NULL;
+    volume->unused_count--;
+}
+
+// Unhash an unused inode and free it with its cached pages, once reads
+// and writes of them have finished. May sleep.
+static void ext2_inode_destroy(struct ext2_inode* inode) {
+    struct ext2_volume* volume = inode->volume;
+    struct ext2_inode** link = &volume->inode_hash[inode->number % EXT2_INODE_HASH];
+    
+    while (*link != inode) {
+        link = &(*link)->hash_next;
+    }
+    *link = inode->hash_next;
+    page_cache_invalidate(&inode->mapping);
+    
+    // A page still referenced points at the mapping inside the inode
+    if (inode->mapping.page_count == 0) heap_free(inode);
+}
+
+/**
+ * @brief Get an inode from the cache, reading it on a miss
+ * 
+ * @param volume Mounted volume, locked
+ * @param number Inode number
+ * @param result Receives the referenced inode
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t ext2_inode_load(struct ext2_volume* volume, uint32_t number, struct ext2_inode** result) {
+    struct ext2_inode* inode;
+    
+    if (number == 0 || number > volume->superblock.inodes_count) return ERROR_INVALID_ARGUMENT;
+    for (inode = volume->inode_hash[number % EXT2_INODE_HASH]; inode; inode = inode->hash_next) {
+        if (inode->number != number) continue;
+        if (inode->references++ == 0) ext2_unused_remove(volume, inode);
+        *result = inode;
+        return 0;
+    }
+    
+    inode = heap_allocate(sizeof(struct ext2_inode));
+    if (!inode) return ERROR_NO_MEMORY;
+    memset(inode, 0, sizeof(*inode));
+    int32_t status = block_read_cached(volume->device, ext2_inode_offset(volume, number), &inode->disk,
+                                       sizeof(inode->disk));
+    if (status != 0) {
+        heap_free(inode);
+        return status;
+    }
+    
+    inode->volume = volume;
+    inode->number = number;
+    inode->references = 1;
+    address_space_initialize(&inode->mapping, &ext2_operations, inode);
+    inode->mapping.size = inode->disk.size;
+    inode->hash_next = volume->inode_hash[number % EXT2_INODE_HASH];
+    volume->inode_hash[number % EXT2_INODE_HASH] = inode;
+    *result = inode;
+    return 0;
+}
+
+// Run of consecutive blocks being collected for one ext2_blocks_free()
+struct ext2_free_run {
+    uint32_t start;
+    uint32_t count;
+};
+
+static void ext2_free_run_add(struct ext2_volume* volume, struct ext2_free_run* run, uint32_t block) {
+    if (run->count && block == run->start + run->count) {
+        run->count++;
+        return;
+    }
+    ext2_blocks_free(volume, run->start, run->count);
+    run->start = block;
+    run->count = 1;
+}
+
+// Free an indirect block and everything under it
+static void ext2_free_tree(struct ext2_volume* volume, struct ext2_free_run* run, uint32_t block, uint32_t depth) {
+    uint32_t* entries = heap_allocate(volume->block_size);
+    
+    if (entries && block < volume->superblock.blocks_count && ext2_block_read(volume, block, entries) == 0) {
+        for (uint32_t i = 0; i < volume->pointers_per_block; ++i) {
+            if (entries[i] == 0 || entries[i] >= volume->superblock.blocks_count) continue;
+            if (depth > 1) {
+                ext2_free_tree(volume, run, entries[i], depth - 1);
+            } else {
+                ext2_free_run_add(volume, run, entries[i]);
+            }
+        }
+    }
+    if (entries) heap_free(entries);
+    ext2_free_run_add(volume, run, block);
+}
+
+/**
+ * @brief Free the blocks and inode of an inode with no links left
+ * 
+ * @param inode Unreferenced inode, volume locked
+ */
+static void ext2_inode_delete(struct ext2_inode* inode) {
+    struct ext2_volume* volume = inode->volume;
+    struct ext2_free_run run = {0, 0};
+    uint32_t group = (inode->number - 1) / volume->superblock.inodes_per_group;
+    uint32_t bit = (inode->number - 1) % volume->superblock.inodes_per_group;
+    int directory = (inode->disk.mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY;
+    uint8_t* bitmap;
+    
+    ext2_prealloc_discard(inode);
+    for (uint32_t slot = 0; slot < EXT2_BLOCK_SLOTS; ++slot) {
+        uint32_t block = inode->disk.block[slot];
+        
+        if (block == 0 || block >= volume->superblock.blocks_count) continue;
+        if (slot < EXT2_DIRECT_BLOCKS) {
+            ext2_free_run_add(volume, &run, block);
+        } else {
+            ext2_free_tree(volume, &run, block, slot - EXT2_INDIRECT_SLOT + 1);
+        }
+    }
+    ext2_blocks_free(volume, run.start, run.count);
+    
+    memset(inode->disk.block, 0, sizeof(inode->disk.block));
+    inode->disk.size = 0;
+    inode->disk.sectors = 0;
+    inode->disk.delete_time = ext2_now() ? ext2_now() : 1;
+    ext2_inode_write(inode);
+    
+    bitmap = heap_allocate(volume->block_size);
+    if (bitmap && ext2_block_read(volume, volume->groups[group].inode_bitmap, bitmap) == 0) {
+        ext2_bit_clear(bitmap, bit);
+        if (ext2_block_write(volume, volume->groups[group].inode_bitmap, bitmap) == 0) {
+            volume->groups[group].free_inodes_count++;
+            if (directory) volume->groups[group].used_directories_count--;
+            volume->superblock.free_inodes_count++;
+            volume->group_dirty[group] = 1;
+            volume->superblock_dirty = 1;
+        }
+    }
+    if (bitmap) heap_free(bitmap);
+}
+
+/**
+ * @brief Drop a reference to an inode
+ * 
+ * @param inode Inode from ext2_inode_load(), volume locked
+ * 
+ * The last reference gives back its preallocated blocks, and deletes the
+ * inode if it has no links left. Otherwise it joins the unused list and
+ * the oldest unused inodes beyond EXT2_INODE_CACHE are freed.
+ */
+static void ext2_inode_release(struct ext2_inode* inode) {
+    struct ext2_volume* volume = inode->volume;
+    
+    if (--inode->references > 0) return;
+    
+    if (inode->disk.links_count == 0) {
+        ext2_inode_delete(inode);
+        ext2_inode_destroy(inode);
+        return;
+    }
+    ext2_prealloc_discard(inode);
+    
+    inode->unused_next = volume->unused_head;
+    if (volume->unused_head) {
+        volume->unused_head->unused_previous = inode;
+    } else {
+        volume->unused_tail = inode;
+    }
+    volume->unused_head = inode;
+    volume->unused_count++;
+    
+    while (volume->unused_count > EXT2_INODE_CACHE) {
+        struct ext2_inode* oldest = volume->unused_tail;
+        
+        ext2_unused_remove(volume, oldest);
+        ext2_inode_destroy(oldest);
+    }
+}
+
+/**
+ * @brief Write bytes into an inode's data through its cached pages
+ * 
+ * @param inode Inode, volume locked
+ * @param offset Byte offset, may be past the end (leaving a hole)
+ * @param buffer Kernel source
+ * @param length Bytes to write
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Pages the write covers completely, or that lie past the end of the
+ * file, are not read first. The blocks a page needs are allocated before
+ * it is changed; the page is then left dirty for writeback, and the inode
+ * is written after it. On a journaled volume the inode goes into the
+ * running transaction with the allocation, and the commit writes the data
+ * first. Blocks of journaled directories are logged instead.
+ */
+static int32_t ext2_write_locked(struct ext2_inode* inode, uint32_t offset, const void* buffer, uint32_t length) {
+    struct ext2_volume* volume = inode->volume;
+    uint32_t per_page = PAGE_SIZE / volume->block_size;
+    const uint8_t* source = (const uint8_t*)buffer;
+    int journaled = ext2_journaled_data(inode);
+    int32_t result = 0;
+    
+    if (length == 0) return 0;
+    if (offset + length < offset) return ERROR_INVALID_ARGUMENT;
+    
+    while (length > 0 && result == 0) {
+        uint32_t index = offset / PAGE_SIZE;
+        uint32_t within = offset % PAGE_SIZE;
+        uint32_t chunk = PAGE_SIZE - within < length ? PAGE_SIZE - within : length;
+        uint32_t first = within / volume->block_size;
+        uint32_t last = (within + chunk - 1) / volume->block_size;
+        struct cached_page* page = NULL;
+        uint32_t physical[PAGE_SIZE / EXT2_MIN_BLOCK_SIZE];
+        
+        for (uint32_t block = first; block <= last && result == 0; ++block) {
+            result = ext2_block_map(inode, index * per_page + block, 1, &physical[block]);
+        }
+        if (result != 0) break;
+        
+        if (!radix_tree_lookup(&inode->mapping.pages, index) &&
+            (chunk == PAGE_SIZE || (uint64_t)index * PAGE_SIZE >= inode->disk.size)) {
+            page = page_cache_add(&inode->mapping, index);
+            if (page) {
+                memset(page->data, 0, PAGE_SIZE);
+                page_cache_unlock(page, 0);
+            }
+        }
+        if (!page) {
+            result = page_cache_get(&inode->mapping, index, &page);
+            if (result != 0) break;
+        }
+        memcpy(page->data + within, source, chunk);
+        if (journaled) {
+            for (uint32_t block = first; block <= last && result == 0; ++block) {
+                result = ext2_block_write(volume, physical[block], page->data + block * volume->block_size);
+            }
+        } else {
+            page_cache_dirty(page);
+        }
+        page_cache_put(page);
+        
+        source += chunk;
+        offset += chunk;
+        length -= chunk;
+        if (offset > inode->disk.size) {
+            inode->disk.size = offset;
+            inode->mapping.size = offset;
+        }
+    }
+    
+    inode->disk.modify_time = inode->disk.change_time = ext2_now();
+    inode->dirty = 1;
+    if (!volume->journal && (inode->mapping.dirty_count || inode->mapping.writeback_count)) return result;
+    int32_t status = ext2_inode_write(inode);
+    return result != 0 ? result : status;
+}
+
+static int ext2_entry_valid(const struct ext2_directory_entry* entry, uint32_t position, uint32_t block_size) {
+    return entry->record_length >= EXT2_ENTRY_HEADER && entry->record_length % 4 == 0 &&
+           entry->record_length <= block_size - position &&
+           EXT2_ENTRY_HEADER + entry->name_length <= entry->record_length;
+}
+
+// Bytes an entry with a name of this length needs, rounded up to 4
+static uint32_t ext2_entry_size(uint32_t name_length) {
+    return (EXT2_ENTRY_HEADER + name_length + 3) & ~3u;
+}
+
+// Whether a name can be given to a new entry
+static int ext2_name_valid(const char* name, uint32_t length) {
+    if (length == 0 || length > EXT2_NAME_MAX) return 0;
+    if ((length == 1 || length == 2) && memcmp(name, "..", length) == 0) return 0;
+    for (uint32_t i = 0; i < length; ++i) {
+        if (name[i] == '/' || name[i] == '\0') return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Find a name in a directory
+ * 
+ * @param directory Directory inode
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param number Receives the inode number
+ * @param position Receives the entry's byte offset in the directory, or NULL
+ * @return 0 on success, ERROR_NOT_FOUND, or an I/O error
+ */
+static int32_t ext2_directory_find(struct ext2_inode* directory, const char* name, uint32_t length,
+                                   uint32_t* number, uint32_t* position) {
+    struct ext2_volume* volume = directory->volume;
+    uint8_t* block = heap_allocate(volume->block_size);
+    int32_t result = ERROR_NOT_FOUND;
+    
+    if (!block) return ERROR_NO_MEMORY;
+    for (uint32_t offset = 0; offset < directory->disk.size && result == ERROR_NOT_FOUND;
+         offset += volume->block_size) {
+        int32_t status = page_cache_read(&directory->mapping, NULL, offset, block, volume->block_size);
+        if (status != 0) {
+            result = status;
+            break;
+        }
+        
+        for (uint32_t within = 0; within < volume->block_size;) {
+            const struct ext2_directory_entry* entry = (const struct ext2_directory_entry*)(block + within);
+            
+            if (!ext2_entry_valid(entry, within, volume->block_size)) {
+                result = ERROR_IO;
+                break;
+            }
+            if (entry->inode && entry->name_length == length && memcmp(entry->name, name, length) == 0) {
+                *number = entry->inode;
+                if (position) *position = offset + within;
+                result = 0;
+                break;
+            }
+            within += entry->record_length;
+        }
+    }
+    heap_free(block);
+    return result;
+}
+
+/**
+ * @brief Add a name to a directory
+ * 
+ * @param directory Directory inode, volume locked
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param number Inode the name refers to
+ * @param file_type EXT2_FILE_TYPE_*
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Uses the first entry with enough slack after its own name, else
+ * appends a block to the directory.
+ */
+static int32_t ext2_directory_add(struct ext2_inode* directory, const char* name, uint32_t length,
+                                  uint32_t number, uint8_t file_type) {
+    struct ext2_volume* volume = directory->volume;
+    uint32_t needed = ext2_entry_size(length);
+    uint8_t* block = heap_allocate(volume->block_size);
+    int32_t result = 0;
+    uint32_t offset;
+    
+    if (!block) return ERROR_NO_MEMORY;
+    for (offset = 0; offset < directory->disk.size; offset += volume->block_size) {
+        result = page_cache_read(&directory->mapping, NULL, offset, block, volume->block_size);
+        if (result != 0) break;
+        
+        for (uint32_t within = 0; within < volume->block_size;) {
+            struct ext2_directory_entry* entry = (struct ext2_directory_entry*)(block + within);
+            uint32_t used = entry->inode ? ext2_entry_size(entry->name_length) : 0;
+            
+            if (!ext2_entry_valid(entry, within, volume->block_size)) {
+                result = ERROR_IO;
+                break;
+            }
+            if (entry->record_length - used < needed) {
+                within += entry->record_length;
+                continue;
+            }
+            
+            // Split the slack off into the new entry
+            struct ext2_directory_entry* added = (struct ext2_directory_entry*)(block + within + used);
+            uint16_t record_length = (uint16_t)(entry->record_length - used);
+            if (used) entry->record_length = (uint16_t)used;
+            added->inode = number;
+            added->record_length = record_length;
+            added->name_length = (uint8_t)length;
+            added->file_type = volume->file_types ? file_type : 0;
+            memcpy(added->name, name, length);
+            result = ext2_write_locked(directory, offset, block, volume->block_size);
+            heap_free(block);
+            return result;
+        }
+        if (result != 0) break;
+    }
+    
+    if (result == 0) {
+        struct ext2_directory_entry* added = (struct ext2_directory_entry*)block;
+        
+        memset(block, 0, volume->block_size);
+        added->inode = number;
+        added->record_length = (uint16_t)volume->block_size;
+        added->name_length = (uint8_t)length;
+        added->file_type = volume->file_types ? file_type : 0;
+        memcpy(added->name, name, length);
+        result = ext2_write_locked(directory, offset, block, volume->block_size);
+    }
+    heap_free(block);
+    return result;
+}
+
+/**
+ * @brief Remove the entry at a position from a directory
+ * 
+ * @param directory Directory inode, volume locked
+ * @param position Entry's offset from ext2_directory_find()
+ * @return 0 on success, otherwise a negative error
+ * 
+ * The entry's space goes to the entry before it in its block; the first
+ * entry of a block is only marked unused.
+ */
+static int32_t ext2_directory_remove(struct ext2_inode* directory, uint32_t position) {
+    struct ext2_volume* volume = directory->volume;
+    uint32_t offset = position - position % volume->block_size;
+    uint8_t* block = heap_allocate(volume->block_size);
+    struct ext2_directory_entry* previous = NULL;
+    
+    if (!block) return ERROR_NO_MEMORY;
+    int32_t result = page_cache_read(&directory->mapping, NULL, offset, block, volume->block_size);
+    for (uint32_t within = 0; result == 0 && within < position - offset;) {
+        previous = (struct ext2_directory_entry*)(block + within);
+        if (!ext2_entry_valid(previous, within, volume->block_size)) result = ERROR_IO;
+        within += previous->record_length;
+    }
+    if (result == 0) {
+        struct ext2_directory_entry* entry = (struct ext2_directory_entry*)(block + position - offset);
+        
+        if (previous) {
+            previous->record_length = (uint16_t)(previous->record_length + entry->record_length);
+        } else {
+            entry->inode = 0;
+        }
+        result = ext2_write_locked(directory, offset, block, volume->block_size);
+    }
+    heap_free(block);
+    return result;
+}
+
+/**
+ * @brief Choose the block group for a new inode
+ * 
+ * @param volume Mounted volume, locked
+ * @param parent Group of the parent directory
+ * @param directory Non-zero for a directory
+ * @return Group with a free inode, or group_count if there is none
+ * 
+ * Directories go to the group with the most free blocks among those with
+ * at least the average number of free inodes. Files stay in the parent's
+ * group when it has room, else the groups at quadratic, then linear,
+ * distances from it are tried.
+ */
+static uint32_t ext2_inode_group(const struct ext2_volume* volume, uint32_t parent, int directory) {
+    uint32_t count = volume->group_count;
+    
+    if (directory) {
+        uint32_t average = volume->superblock.free_inodes_count / count;
+        uint32_t best = count;
+        
+        for (uint32_t group = 0; group < count; ++group) {
+            const struct ext2_group_descriptor* descriptor = &volume->groups[group];
+            
+            if (descriptor->free_inodes_count == 0 || descriptor->free_inodes_count < average) continue;
+            if (best == count || descriptor->free_blocks_count > volume->groups[best].free_blocks_count) {
+                best = group;
+            }
+        }
+        if (best != count) return best;
+    } else {
+        if (volume->groups[parent].free_inodes_count && volume->groups[parent].free_blocks_count) return parent;
+        for (uint32_t step = 1, group = parent; step < count; step <<= 1) {
+            group = (group + step) % count;
+            if (volume->groups[group].free_inodes_count && volume->groups[group].free_blocks_count) return group;
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t group = (parent + i) % count;
+        if (volume->groups[group].free_inodes_count) return group;
+    }
+    return count;
+}
+
+/**
+ * @brief Allocate and initialize a new inode
+ * 
+ * @param parent Directory it will be linked into, volume locked
+ * @param mode File type and permissions
+ * @param result Receives the referenced inode, with one link
+ * @return 0 on success, ERROR_NO_MEMORY if no inode is free, or an I/O error
+ */
+static int32_t ext2_inode_allocate(struct ext2_inode* parent, uint16_t mode, struct ext2_inode** result) {
+    struct ext2_volume* volume = parent->volume;
+    int directory = (mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY;
+    uint32_t group = ext2_inode_group(volume, (parent->number - 1) / volume->superblock.inodes_per_group, directory);
+    uint8_t* bitmap;
+    uint32_t bit;
+    
+    if (group == volume->group_count) return ERROR_NO_MEMORY;
+    bitmap = heap_allocate(volume->block_size);
+    if (!bitmap) return ERROR_NO_MEMORY;
+    
+    struct ext2_group_descriptor* descriptor = &volume->groups[group];
+    int32_t status = ext2_block_read(volume, descriptor->inode_bitmap, bitmap);
+    for (bit = group == 0 ? volume->first_inode - 1 : 0; status == 0 && bit < volume->superblock.inodes_per_group;
+         ++bit) {
+        if (!ext2_bit_test(bitmap, bit)) break;
+    }
+    if (status == 0 && bit == volume->superblock.inodes_per_group) status = ERROR_IO;   // Count was wrong
+    if (status == 0) {
+        ext2_bit_set(bitmap, bit);
+        status = ext2_block_write(volume, descriptor->inode_bitmap, bitmap);
+    }
+    heap_free(bitmap);
+    if (status != 0) return status;
+    
+    descriptor->free_inodes_count--;
+    if (directory) descriptor->used_directories_count++;
+    volume->superblock.free_inodes_count--;
+    volume->group_dirty[group] = 1;
+    volume->superblock_dirty = 1;
+    
+    struct ext2_inode* inode = heap_allocate(sizeof(struct ext2_inode));
+    if (!inode) return ERROR_NO_MEMORY;
+    memset(inode, 0, sizeof(*inode));
+    inode->volume = volume;
+    inode->number = group * volume->superblock.inodes_per_group + bit + 1;
+    inode->references = 1;
+    inode->disk.mode = mode;
+    inode->disk.links_count = 1;
+    inode->disk.access_time = inode->disk.change_time = inode->disk.modify_time = ext2_now();
+    address_space_initialize(&inode->mapping, &ext2_operations, inode);
+    inode->hash_next = volume->inode_hash[inode->number % EXT2_INODE_HASH];
+    volume->inode_hash[inode->number % EXT2_INODE_HASH] = inode;
+    
+    *result = inode;
+    return ext2_inode_write(inode);
+}
+
+/**
+ * @brief Get an inode by number
+ * 
+ * @param volume Mounted volume
+ * @param number Inode number
+ * @param result Receives the referenced inode
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t ext2_inode_get(struct ext2_volume* volume, uint32_t number, struct ext2_inode** result) {
+    ext2_lock(volume);
+    int32_t status = ext2_inode_load(volume, number, result);
+    ext2_unlock(volume);
+    return status;
+}
+
+/**
+ * @brief Drop a reference from ext2_inode_get(), ext2_open() or ext2_create()
+ */
+void ext2_inode_put(struct ext2_inode* inode) {
+    struct ext2_volume* volume = inode->volume;
+    
+    ext2_lock(volume);
+    ext2_inode_release(inode);
+    ext2_commit(volume);
+    ext2_unlock(volume);
+}
+
+/**
+ * @brief Look a name up in a directory
+ * 
+ * @param directory Directory inode
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param result Receives the referenced inode
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t ext2_lookup(struct ext2_inode* directory, const char* name, uint32_t length, struct ext2_inode** result) {
+    uint32_t number;
+    
+    if ((directory->disk.mode & EXT2_MODE_TYPE) != EXT2_MODE_DIRECTORY) return ERROR_NOT_FOUND;
+    int32_t status = ext2_directory_find(directory, name, length, &number, NULL);
+    return status != 0 ? status : ext2_inode_get(directory->volume, number, result);
+}
+
+/**
+ * @brief Open a file or directory by path
+ * 
+ * @param volume Mounted volume
+ * @param path '/'-separated names from the root directory
+ * @param result Receives the referenced inode
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t ext2_open(struct ext2_volume* volume, const char* path, struct ext2_inode** result) {
+    struct ext2_inode* inode;
+    int32_t status = ext2_inode_get(volume, EXT2_ROOT_INODE, &inode);
+    
+    while (status == 0 && *path) {
+        struct ext2_inode* child;
+        uint32_t length = 0;
+        
+        while (*path == '/') {
+            path++;
+        }
+        while (path[length] && path[length] != '/') {
+            length++;
+        }
+        if (length == 0) break;
+        
+        status = ext2_lookup(inode, path, length, &child);
+        ext2_inode_put(inode);
+        inode = child;
+        path += length;
+    }
+    if (status == 0) *result = inode;
+    return status;
+}
+
+/**
+ * @brief Read from an inode's data through the page cache
+ * 
+ * @param inode File or directory
+ * @param state Reader's readahead state, or NULL
+ * @param offset Byte offset
+ * @param buffer Kernel destination
+ * @param length Bytes wanted
+ * @return Bytes read, short at the end of the file, or a negative error
+ */
+int32_t ext2_read(struct ext2_inode* inode, struct readahead_state* state, uint32_t offset, void* buffer,
+                  uint32_t length) {
+    uint32_t size = inode->disk.size;
+    
+    if (offset >= size) return 0;
+    if (length > size - offset) length = size - offset;
+    if (length > 0x7FFFFFFF) length = 0x7FFFFFFF;
+    
+    int32_t status = page_cache_read(&inode->mapping, state, offset, buffer, length);
+    return status != 0 ? status : (int32_t)length;
+}
+
+/**
+ * @brief Write to a regular file, extending it as needed
+ * 
+ * @param inode Regular file
+ * @param offset Byte offset
+ * @param buffer Kernel source
+ * @param length Bytes to write
+ * @return Bytes written, or a negative error
+ * 
+ * Returns once the data is in the page cache; ext2_sync() waits for the
+ * disk. A writer that has left too much of the cache dirty is throttled
+ * on the way out.
+ */
+int32_t ext2_write(struct ext2_inode* inode, uint32_t offset, const void* buffer, uint32_t length) {
+    struct ext2_volume* volume = inode->volume;
+    
+    if (volume->read_only) return ERROR_INVALID_ARGUMENT;
+    if ((inode->disk.mode & EXT2_MODE_TYPE) != EXT2_MODE_FILE) return ERROR_INVALID_ARGUMENT;
+    if (length > 0x7FFFFFFF) length = 0x7FFFFFFF;
+    
+    ext2_lock(volume);
+    int32_t status = ext2_write_locked(inode, offset, buffer, length);
+    int32_t flushed = ext2_metadata_flush(volume);
+    ext2_unlock(volume);
+    page_cache_balance();
+    if (status == 0) status = flushed;
+    return status != 0 ? status : (int32_t)length;
+}
+
+/**
+ * @brief Write an inode's data and the inode itself to the disk
+ * 
+ * @param inode Inode the caller holds
+ * @return 0 on success, otherwise a negative error, including a failed
+ *         writeback since the last sync
+ * 
+ * On a journaled volume, waits for the commit that holds the inode.
+ */
+int32_t ext2_sync(struct ext2_inode* inode) {
+    struct ext2_volume* volume = inode->volume;
+    int32_t result = page_cache_sync(&inode->mapping);
+    
+    ext2_lock(volume);
+    int32_t status = inode->dirty ? ext2_inode_write(inode) : 0;
+    if (result == 0) result = status;
+    status = ext2_commit(volume);
+    if (result == 0) result = status;
+    ext2_unlock(volume);
+    return result;
+}
+
+/**
+ * @brief Create a file or directory
+ * 
+ * @param directory Parent directory
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param is_directory Non-zero to create a directory
+ * @param result Receives the new referenced inode
+ * @return 0 on success, ERROR_BUSY if the name exists, otherwise a
+ *         negative error
+ */
+int32_t ext2_create(struct ext2_inode* directory, const char* name, uint32_t length, int is_directory,
+                    struct ext2_inode** result) {
+    struct ext2_volume* volume = directory->volume;
+    struct ext2_inode* inode = NULL;
+    uint32_t existing;
+    
+    if (volume->read_only) return ERROR_INVALID_ARGUMENT;
+    if ((directory->disk.mode & EXT2_MODE_TYPE) != EXT2_MODE_DIRECTORY) return ERROR_INVALID_ARGUMENT;
+    if (!ext2_name_valid(name, length)) return ERROR_INVALID_ARGUMENT;
+    
+    ext2_lock(volume);
+    int32_t status = ext2_directory_find(directory, name, length, &existing, NULL);
+    if (status == 0) status = ERROR_BUSY;
+    if (status == ERROR_NOT_FOUND) {
+        status = ext2_inode_allocate(directory, is_directory ? EXT2_MODE_DIRECTORY | EXT2_MODE_DIRECTORY_DEFAULT
+                                                             : EXT2_MODE_FILE | EXT2_MODE_FILE_DEFAULT, &inode);
+    }
+    if (status == 0 && is_directory) {
+        // "." and ".." fill the first block
+        uint8_t* block = heap_allocate(volume->block_size);
+        struct ext2_directory_entry* dot = (struct ext2_directory_entry*)block;
+        
+        status = block ? 0 : ERROR_NO_MEMORY;
+        if (block) {
+            memset(block, 0, volume->block_size);
+            dot->inode = inode->number;
+            dot->record_length = (uint16_t)ext2_entry_size(1);
+            dot->name_length = 1;
+            dot->file_type = volume->file_types ? EXT2_FILE_TYPE_DIRECTORY : 0;
+            dot->name[0] = '.';
+            struct ext2_directory_entry* dot_dot = (struct ext2_directory_entry*)(block + dot->record_length);
+            dot_dot->inode = directory->number;
+            dot_dot->record_length = (uint16_t)(volume->block_size - dot->record_length);
+            dot_dot->name_length = 2;
+            dot_dot->file_type = dot->file_type;
+            memcpy(dot_dot->name, "..", 2);
+            inode->disk.links_count = 2;
+            status = ext2_write_locked(inode, 0, block, volume->block_size);
+            heap_free(block);
+        }
+    }
+    if (status == 0) {
+        status = ext2_directory_add(directory, name, length, inode->number,
+                                    is_directory ? EXT2_FILE_TYPE_DIRECTORY : EXT2_FILE_TYPE_FILE);
+    }
+    if (status == 0 && is_directory) {
+        // The child's ".." is a link to the parent
+        directory->disk.links_count++;
+        status = ext2_inode_write(directory);
+    }
+    if (status != 0 && inode) {
+        // Not linked anywhere: releasing it frees it again
+        inode->disk.links_count = 0;
+        ext2_inode_release(inode);
+        inode = NULL;
+    }
+    int32_t committed = ext2_commit(volume);
+    ext2_unlock(volume);
+    
+    if (status == 0) status = committed;
+    if (status == 0) {
+        *result = inode;
+    } else if (inode) {
+        ext2_inode_put(inode);
+    }
+    return status;
+}
+
+/**
+ * @brief Remove a file's name, deleting it once it is no longer open
+ * 
+ * @param directory Parent directory
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @return 0 on success, ERROR_INVALID_ARGUMENT for a directory, otherwise
+ *         a negative error
+ */
+int32_t ext2_unlink(struct ext2_inode* directory, const char* name, uint32_t length) {
+    struct ext2_volume* volume = directory->volume;
+    struct ext2_inode* inode;
+    uint32_t number;
+    uint32_t position;
+    
+    if (volume->read_only) return ERROR_INVALID_ARGUMENT;
+    if ((directory->disk.mode & EXT2_MODE_TYPE) != EXT2_MODE_DIRECTORY) return ERROR_NOT_FOUND;
+    
+    ext2_lock(volume);
+    int32_t status = ext2_directory_find(directory, name, length, &number, &position);
+    if (status == 0) status = ext2_inode_load(volume, number, &inode);
+    if (status == 0) {
+        if ((inode->disk.mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY) {
+            status = ERROR_INVALID_ARGUMENT;
+        } else {
+            status = ext2_directory_remove(directory, position);
+        }
+        if (status == 0) {
+            inode->disk.links_count--;
+            inode->disk.change_time = ext2_now();
+            status = ext2_inode_write(inode);
+        }
+        ext2_inode_release(inode);
+    }
+    int32_t committed = ext2_commit(volume);
+    ext2_unlock(volume);
+    return status != 0 ? status : committed;
+}
+
+/**
+ * @brief Size of an inode's data in bytes
+ */
+uint32_t ext2_size(const struct ext2_inode* inode) {
+    return inode->disk.size;
+}
+
+/**
+ * @brief Body of a journaled volume's checkpoint thread
+ * 
+ * @param argument The volume
+ * 
+ * Empties the log whenever a commit leaves it past half full, so that
+ * commits seldom find it full and have to checkpoint first. Also commits
+ * every EXT2_COMMIT_INTERVAL_MS, for the file writes that do not wait.
+ * Exits once the journal has failed.
+ */
+static void ext2_journal_thread(void* argument) {
+    struct ext2_volume* volume = (struct ext2_volume*)argument;
+    struct ext2_journal* journal = volume->journal;
+    
+    while (!journal->error) {
+        timer_arm(&journal->commit_timer, timer_ticks + EXT2_COMMIT_INTERVAL_MS * (TIMER_FREQUENCY / 1000),
+                  &journal->checkpoint_queue);
+        wait_queue_sleep(&journal->checkpoint_queue);
+        
+        ext2_lock(volume);
+        if (!journal->error && ext2_journal_half_full(journal)) {
+            ext2_journal_checkpoint(volume);
+        } else if (!journal->commit_timer.armed) {
+            ext2_journal_wait(volume);
+        }
+        ext2_unlock(volume);
+    }
+    timer_cancel(&journal->commit_timer);
+}
+
+static int32_t ext2_journal_read(struct ext2_volume* volume, struct ext2_journal* journal, uint32_t index,
+                                 void* buffer) {
+    return block_transfer(volume->device, (uint64_t)journal->map[index] * volume->sectors_per_block,
+                          volume->sectors_per_block, buffer, 0);
+}
+
+// Whether a revocation recorded during recovery covers a block logged in a transaction
+static int ext2_journal_revoked(const uint32_t* revoked, uint32_t count, uint32_t block, uint32_t sequence) {
+    for (uint32_t i = 0; i < count; i += 2) {
+        if (revoked[i] == block && (int32_t)(revoked[i + 1] - sequence) >= 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Replay the transactions a crash left in the log
+ * 
+ * @param volume Volume being mounted, writable
+ * @param journal Its journal, with the superblock read
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Three passes over the log from its start: the first finds the end of
+ * the last committed transaction, the second collects revocations, and
+ * the third writes each logged block in place unless a revocation in the
+ * same or a later transaction covers it. The log is then empty, and the
+ * next transaction follows the last one found.
+ */
+static int32_t ext2_journal_recover(struct ext2_volume* volume, struct ext2_journal* journal) {
+    uint32_t block_size = volume->block_size;
+    uint8_t* block = heap_allocate(block_size);
+    uint8_t* data = heap_allocate(block_size);
+    uint32_t* revoked = NULL;       // Block and transaction pairs
+    uint32_t revoked_count = 0;
+    uint32_t revoked_capacity = 0;
+    uint32_t end = 0;
+    int32_t result = block && data ? 0 : ERROR_NO_MEMORY;
+    
+    for (uint32_t pass = 0; pass < 3 && result == 0; ++pass) {
+        uint32_t sequence = ext2_be32(journal->superblock->sequence);
+        uint32_t index = ext2_be32(journal->superblock->start);
+        
+        while (result == 0 && (pass == 0 || sequence != end)) {
+            const struct journal_header* header = (const struct journal_header*)block;
+            
+            if (index < journal->first || index >= journal->length) {
+                result = ERROR_IO;
+                break;
+            }
+            result = ext2_journal_read(volume, journal, index, block);
+            if (result != 0 || header->magic != ext2_be32(JOURNAL_MAGIC) ||
+                ext2_be32(header->sequence) != sequence) {
+                break;
+            }
+            index = index + 1 == journal->length ? journal->first : index + 1;
+            
+            uint32_t type = ext2_be32(header->block_type);
+            if (type == JOURNAL_COMMIT) {
+                sequence++;
+                continue;
+            }
+            if (type == JOURNAL_REVOKE) {
+                uint32_t size = ext2_be32(((const struct journal_revoke_header*)block)->size);
+                
+                if (size > block_size) size = block_size;
+                for (uint32_t offset = sizeof(struct journal_revoke_header); pass == 1 && result == 0 &&
+                     offset + sizeof(uint32_t) <= size; offset += sizeof(uint32_t)) {
+                    result = ext2_array_append(&revoked, &revoked_count, &revoked_capacity,
+                                               ext2_be32(*(const uint32_t*)(block + offset)));
+                    if (result == 0) result = ext2_array_append(&revoked, &revoked_count, &revoked_capacity, sequence);
+                }
+                continue;
+            }
+            if (type != JOURNAL_DESCRIPTOR) break;
+            
+            // Tags, each for the next block of the log
+            for (uint32_t offset = sizeof(struct journal_header); offset + JOURNAL_TAG_SIZE <= block_size;) {
+                const uint8_t* tag = block + offset;
+                uint32_t target = ext2_be32(*(const uint32_t*)tag);
+                uint32_t flags = (uint32_t)tag[6] << 8 | tag[7];
+                
+                if (pass == 2 && !ext2_journal_revoked(revoked, revoked_count, target, sequence)) {
+                    result = target < volume->superblock.blocks_count ? ext2_journal_read(volume, journal, index, data)
+                                                                      : ERROR_IO;
+                    if (flags & JOURNAL_TAG_ESCAPE) *(uint32_t*)data = ext2_be32(JOURNAL_MAGIC);
+                    if (result == 0) {
+                        result = block_write_cached(volume->device, (uint64_t)target * block_size, data, block_size);
+                    }
+                    if (result != 0) break;
+                }
+                index = index + 1 == journal->length ? journal->first : index + 1;
+                offset += JOURNAL_TAG_SIZE + (flags & JOURNAL_TAG_SAME_UUID ? 0 : JOURNAL_UUID_SIZE);
+                if (flags & JOURNAL_TAG_LAST) break;
+            }
+        }
+        if (pass == 0) end = sequence;
+    }
+    
+    journal->superblock->sequence = ext2_be32(end);
+    journal->superblock->start = 0;
+    if (block) heap_free(block);
+    if (data) heap_free(data);
+    if (revoked) heap_free(revoked);
+    return result;
+}
+
+/**
+ * @brief Open an ext3 volume's journal, replaying it if needed
+ * 
+ * @param volume Volume being mounted, with its group descriptors read
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Only a journal kept in an inode, in the JBD2 format without checksums
+ * or 64-bit block numbers, is used; with any other the volume is mounted
+ * read-only, and refused if its log needs replaying. A writable volume is
+ * flagged as needing recovery while mounted, as Linux does, and gets a
+ * checkpoint thread.
+ */
+static int32_t ext2_journal_load(struct ext2_volume* volume) {
+    struct ext2_superblock* superblock = &volume->superblock;
+    int recover = (superblock->feature_incompat & EXT2_FEATURE_INCOMPAT_RECOVER) != 0;
+    struct ext2_journal* journal;
+    struct ext2_inode* inode;
+    
+    if (!(superblock->feature_compat & EXT2_FEATURE_COMPAT_HAS_JOURNAL)) return recover ? ERROR_INVALID_ARGUMENT : 0;
+    if (superblock->journal_inode == 0) {
+        volume->read_only = 1;
+        return recover ? ERROR_INVALID_ARGUMENT : 0;
+    }
+    
+    journal = heap_allocate(sizeof(struct ext2_journal));
+    if (!journal) return ERROR_NO_MEMORY;
+    memset(journal, 0, sizeof(*journal));
+    journal->superblock = heap_allocate(volume->block_size);
+    int32_t result = journal->superblock ? ext2_inode_load(volume, superblock->journal_inode, &inode) : ERROR_NO_MEMORY;
+    if (result == 0) {
+        journal->length = inode->disk.size / volume->block_size;
+        journal->map = journal->length > 1 ? heap_allocate(journal->length * sizeof(uint32_t)) : NULL;
+        result = journal->map ? 0 : ERROR_INVALID_ARGUMENT;
+        for (uint32_t i = 0; result == 0 && i < journal->length; ++i) {
+            result = ext2_block_map(inode, i, 0, &journal->map[i]);
+            if (result == 0 && journal->map[i] == 0) result = ERROR_INVALID_ARGUMENT;
+        }
+        ext2_inode_release(inode);
+    }
+    if (result == 0) result = ext2_journal_read(volume, journal, 0, journal->superblock);
+    
+    struct journal_superblock* header = journal->superblock;
+    uint32_t type = header ? ext2_be32(header->header.block_type) : 0;
+    if (result == 0 && (header->header.magic != ext2_be32(JOURNAL_MAGIC) ||
+                        (type != JOURNAL_SUPERBLOCK_V1 && type != JOURNAL_SUPERBLOCK_V2) ||
+                        ext2_be32(header->block_size) != volume->block_size ||
+                        ext2_be32(header->max_length) > journal->length || ext2_be32(header->first) == 0 ||
+                        ext2_be32(header->first) >= ext2_be32(header->max_length))) {
+        result = ERROR_INVALID_ARGUMENT;
+    }
+    if (result == 0) {
+        int supported = type == JOURNAL_SUPERBLOCK_V1 ||
+                        (header->feature_compat == 0 && header->feature_ro_compat == 0 &&
+                         !(ext2_be32(header->feature_incompat) & ~(uint32_t)JOURNAL_FEATURE_INCOMPAT_REVOKE));
+        
+        journal->length = ext2_be32(header->max_length);
+        journal->first = ext2_be32(header->first);
+        if (!supported) volume->read_only = 1;
+        if (header->start != 0) {
+            if (volume->read_only) {
+                result = ERROR_INVALID_ARGUMENT;
+            } else {
+                result = ext2_journal_recover(volume, journal);
+            }
+            
+            // The replay may have changed the superblock and descriptors
+            uint64_t table = (uint64_t)(superblock->first_data_block + 1) * volume->block_size;
+            if (result == 0) {
+                result = block_read_cached(volume->device, EXT2_SUPERBLOCK_OFFSET, superblock, sizeof(*superblock));
+            }
+            if (result == 0) {
+                result = block_read_cached(volume->device, table, volume->groups,
+                                           volume->group_count * sizeof(struct ext2_group_descriptor));
+            }
+        }
+    }
+    if (result == 0 && !volume->read_only) {
+        journal->sequence = ext2_be32(header->sequence);
+        journal->committed = journal->sequence - 1;
+        journal->head = journal->first;
+        header->start = 0;
+        if (type == JOURNAL_SUPERBLOCK_V2) header->feature_incompat |= ext2_be32(JOURNAL_FEATURE_INCOMPAT_REVOKE);
+        result = block_transfer(volume->device, (uint64_t)journal->map[0] * volume->sectors_per_block,
+                                volume->sectors_per_block, header, 1);
+        superblock->feature_incompat |= EXT2_FEATURE_INCOMPAT_RECOVER;
+        if (result == 0) {
+            result = ext2_metadata_patch(volume, EXT2_SUPERBLOCK_OFFSET, superblock, sizeof(*superblock));
+        }
+        if (result == 0) {
+            volume->journal = journal;
+            // Without the thread, commits still checkpoint once the log is full
+            kernel_thread_create(ext2_journal_thread, volume);
+            return 0;
+        }
+    }
+    
+    if (journal->map) heap_free(journal->map);
+    if (journal->superblock) heap_free(journal->superblock);
+    heap_free(journal);
+    return result;
+}
+
+/**
+ * @brief Mount an ext2 volume
+ * 
+ * @param device Device holding the volume from its first block
+ * @param result Receives the volume
+ * @return 0 on success, ERROR_INVALID_ARGUMENT if the device holds no
+ *         ext2 volume this driver can use, otherwise a negative error
+ * 
+ * Volumes with read-only-compatible features other than sparse
+ * superblocks and large files, or on read-only devices, are mounted
+ * read-only. An ext3 volume is mounted with its journal (see
+ * ext2_journal_load()).
+ */
+int32_t ext2_mount(struct block_device* device, struct ext2_volume** result) {
+    struct ext2_volume* volume = &ext2_volumes[ext2_volume_count];
+    struct ext2_superblock* superblock = &volume->superblock;
+    
+    if (!device) return ERROR_INVALID_ARGUMENT;
+    if (ext2_volume_count == MAX_EXT2_VOLUMES) return ERROR_NO_MEMORY;
+    if (device->block_count * device->block_size < EXT2_SUPERBLOCK_OFFSET + sizeof(*superblock)) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    memset(volume, 0, sizeof(*volume));
+    int32_t status = block_read_cached(device, EXT2_SUPERBLOCK_OFFSET, superblock, sizeof(*superblock));
+    if (status != 0) return status;
+    if (superblock->magic != EXT2_MAGIC || superblock->log_block_size > EXT2_MAX_LOG_BLOCK_SIZE) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    volume->device = device;
+    volume->block_size = 1024u << superblock->log_block_size;
+    volume->inode_size = superblock->revision ? superblock->inode_size : EXT2_OLD_INODE_SIZE;
+    volume->first_inode = superblock->revision ? superblock->first_inode : EXT2_OLD_FIRST_INODE;
+    if (volume->block_size % device->block_size || superblock->blocks_per_group == 0 ||
+        superblock->blocks_per_group > volume->block_size * 8 || superblock->inodes_per_group == 0 ||
+        superblock->inodes_per_group > volume->block_size * 8 || superblock->first_data_block >= superblock->blocks_count ||
+        volume->inode_size < EXT2_OLD_INODE_SIZE || volume->inode_size > volume->block_size ||
+        (volume->inode_size & (volume->inode_size - 1)) ||
+        (uint64_t)superblock->blocks_count * volume->block_size > device->block_count * device->block_size) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    if (superblock->revision && (superblock->feature_incompat & ~(uint32_t)(EXT2_FEATURE_INCOMPAT_FILETYPE |
+                                                                           EXT2_FEATURE_INCOMPAT_RECOVER))) {
+        return ERROR_INVALID_ARGUMENT;      // Compression, meta groups...
+    }
+    volume->file_types = superblock->revision && (superblock->feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE);
+    volume->read_only = device->read_only ||
+                        (superblock->revision && (superblock->feature_ro_compat & ~(uint32_t)EXT2_FEATURE_RO_COMPAT_SUPPORTED));
+    volume->sectors_per_block = volume->block_size / device->block_size;
+    volume->pointers_per_block = volume->block_size / sizeof(uint32_t);
+    volume->inode_table_blocks = (superblock->inodes_per_group * volume->inode_size + volume->block_size - 1) /
+                                 volume->block_size;
+    volume->group_count = (superblock->blocks_count - superblock->first_data_block + superblock->blocks_per_group - 1) /
+                          superblock->blocks_per_group;
+    
+    uint32_t table_size = volume->group_count * sizeof(struct ext2_group_descriptor);
+    volume->groups = heap_allocate(table_size);
+    volume->group_dirty = heap_allocate(volume->group_count);
+    if (!volume->groups || !volume->group_dirty) {
+        if (volume->groups) heap_free(volume->groups);
+        if (volume->group_dirty) heap_free(volume->group_dirty);
+        return ERROR_NO_MEMORY;
+    }
+    memset(volume->group_dirty, 0, volume->group_count);
+    status = block_read_cached(device, (uint64_t)(superblock->first_data_block + 1) * volume->block_size,
+                               volume->groups, table_size);
+    for (uint32_t group = 0; status == 0 && group < volume->group_count; ++group) {
+        const struct ext2_group_descriptor* descriptor = &volume->groups[group];
+        
+        if (descriptor->block_bitmap >= superblock->blocks_count || descriptor->inode_bitmap >= superblock->blocks_count ||
+            descriptor->inode_table + volume->inode_table_blocks > superblock->blocks_count) {
+            status = ERROR_INVALID_ARGUMENT;
+        }
+    }
+    if (status == 0 && superblock->revision) status = ext2_journal_load(volume);
+    if (status != 0) {
+        while (volume->unused_head) {
+            struct ext2_inode* inode = volume->unused_head;
+            
+            ext2_unused_remove(volume, inode);
+            ext2_inode_destroy(inode);
+        }
+        heap_free(volume->groups);
+        heap_free(volume->group_dirty);
+        return status;
+    }
+    
+    ext2_volume_count++;
+    *result = volume;
+    return 0;
+}
+
+/**
+ * @brief Mount every block device that holds an ext2 volume
+ */
+void ext2_initialize(void) {
+    for (uint32_t i = 0; i < block_device_count; ++i) {
+        struct ext2_volume* volume;
+        
+        ext2_mount(&block_devices[i], &volume);
+    }
+}
+
+// =============================================================================
+// Virtual File System
+// =============================================================================
+
+// One namespace over every mounted filesystem. Paths are resolved through
+// the dentry cache: a dentry names one entry (parent, name) and holds the
+// filesystem's inode for it, or records that the name does not exist (a
+// negative dentry), so repeated misses such as a shell searching $PATH
+// never reach the filesystem again. Dentries are hashed by parent and
+// name. Each holds a reference to its parent, so a cached path stays
+// connected to the root. Unused dentries are kept on an LRU list of up to
+// DENTRY_CACHE entries and evicted oldest first.
+//
+// Path walks follow the RCU pattern: cached components are looked up
+// without references or locks. Only a miss, which calls the filesystem
+// and may sleep, first takes a reference on the directory. Hash chains
+// are changed so that a walker standing on any entry can go on, and
+// evicted dentries are freed from a bottom half. Bottom halves only run
+// once the kernel has reached a point where it could sleep, and a
+// lockless walker never sleeps, so none can still see the memory. With
+// one CPU and no kernel preemption that is a full grace period.
+//
+// Filesystems supply vfs_operations over their own volume and inode
+// types. "." and ".." are resolved by the walk, across mount points, and
+// never reach a filesystem.
+// Source: Linux fs/dcache.c and fs/namei.c (__d_lookup_rcu, RCU and
+//         reference path walks); McKenney and Slingwine, "Read-Copy
+//         Update: Using Execution History to Solve Concurrency Problems"
+#define MAX_VFS_MOUNTS         8
+#define DENTRY_HASH_BUCKETS    256     // Power of two
+#define DENTRY_HASH_SHIFT      24      // 32 - log2(DENTRY_HASH_BUCKETS)
+#define DENTRY_CACHE           512     // Unused dentries kept cached
+#define VFS_NAME_MAX           255
+#define VFS_PATH_MAX           256     // Longest path SYSCALL_OPEN takes
+
+// Dentry flags
+#define DENTRY_NEGATIVE        0x01    // The name does not exist
+#define DENTRY_DIRECTORY       0x02
+#define DENTRY_HASHED          0x04    // Reachable through the hash table
+
+// SYSCALL_OPEN flags, with FILE_READABLE and FILE_WRITABLE
+#define OPEN_CREATE            0x40    // Create a missing regular file
+
+// A filesystem's operations. lookup, root and create return referenced
+// inodes, which release drops. The modifying operations are NULL on
+// read-only filesystems.
+struct vfs_operations {
+    int32_t (*root)(void* volume, void** inode);
+    int32_t (*lookup)(void* volume, void* directory, const char* name, uint32_t length, void** inode);
+    void (*release)(void* inode);
+    int (*is_directory)(void* inode);
+    uint32_t (*size)(void* inode);
+    int32_t (*read)(void* inode, struct readahead_state* state, uint32_t offset, void* buffer, uint32_t length);
+    int32_t (*write)(void* inode, uint32_t offset, const void* buffer, uint32_t length);
+    int32_t (*create)(void* directory, const char* name, uint32_t length, int is_directory, void** inode);
+    int32_t (*unlink)(void* directory, const char* name, uint32_t length);
+    int32_t (*sync)(void* inode);
+    // A file's cached pages, for mapping it; NULL if it cannot be mapped
+    struct address_space* (*mapping)(void* inode);
+};
+
+struct dentry;
+
+struct vfs_mount {
+    const struct vfs_operations* operations;
+    void* volume;
+    struct dentry* root;
+    struct dentry* mountpoint;      // Covered directory; NULL for the root
+};
+
+struct dentry {
+    struct dentry* parent;          // Referenced; NULL at a filesystem root
+    struct vfs_mount* mount;        // Filesystem the entry belongs to
+    struct vfs_mount* mounted;      // Filesystem mounted on this directory
+    void* inode;                    // Filesystem inode unless negative
+    uint32_t flags;                 // DENTRY_*
+    uint32_t references;            // Users, children and a mount on it
+    uint32_t hash;
+    struct dentry* hash_next;
+    struct dentry* lru_previous;    // Unused list, while references is 0
+    struct dentry* lru_next;
+    struct dentry* retired_next;    // Waiting for the grace period
+    uint32_t length;
+    char name[];                    // Not null-terminated
+};
+
+// An open file (struct file private_data)
+struct vfs_file {
+    struct dentry* dentry;
+    uint32_t offset;
+    struct readahead_state readahead;
+};
+
+struct dcache_statistics {
+    uint32_t hits;                  // Components found in the cache
+    uint32_t negative_hits;         // Of those, names known not to exist
+    uint32_t misses;                // Components the filesystem looked up
+    uint32_t evictions;
+    uint32_t dentries;              // Allocated
+    uint32_t unused;                // On the LRU list
+};
+
+static struct dentry* dcache_buckets[DENTRY_HASH_BUCKETS];
+static struct dentry* dcache_unused_head;       // Most recently used
+static struct dentry* dcache_unused_tail;
+static struct dentry* dcache_retired;
+static struct deferred_work dcache_free_work;
+static struct dcache_statistics dcache_statistics;
+
+static struct vfs_mount vfs_mounts[MAX_VFS_MOUNTS];
+static uint32_t vfs_mount_count;
+static struct dentry* vfs_root;
+
+/**
+ * @brief Hash a name within a directory (FNV-1a seeded with the parent)
+ */
+static uint32_t dentry_hash(const struct dentry* parent, const char* name, uint32_t length) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent;
+    
+    for (uint32_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct dentry** dcache_bucket(uint32_t hash) {
+    return &dcache_buckets[(hash * 2654435769u) >> DENTRY_HASH_SHIFT];
+}
+
+/**
+ * @brief Find a cached entry without taking a reference
+ * 
+ * @param parent Directory
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param hash dentry_hash() of parent and name
+ * @return The dentry, usable until the caller next sleeps, or NULL
+ */
+static struct dentry* dcache_find(const struct dentry* parent, const char* name, uint32_t length, uint32_t hash) {
+    for (struct dentry* dentry = *dcache_bucket(hash); dentry; dentry = dentry->hash_next) {
+        if (dentry->hash == hash && dentry->parent == parent && dentry->length == length &&
+            memcmp(dentry->name, name, length) == 0) {
+            return dentry;
+        }
+    }
+    return NULL;
+}
+
+// Publish a complete dentry at the head of its chain
+static void dcache_hash(struct dentry* dentry) {
+    struct dentry** bucket = dcache_bucket(dentry->hash);
+    
+    dentry->hash_next = *bucket;
+    dentry->flags |= DENTRY_HASHED;
+    __asm__ volatile("" ::: "memory");
+    *bucket = dentry;
+}
+
+// Unlink from its chain. hash_next stays valid so that a walker standing
+// on the entry can go on along the chain.
+static void dcache_unhash(struct dentry* dentry) {
+    if (!(dentry->flags & DENTRY_HASHED)) return;
+    
+    for (struct dentry** link = dcache_bucket(dentry->hash); *link; link = &(*link)->hash_next) {
+        if (*link == dentry) {
+            *link = dentry->hash_next;
+            break;
+        }
+    }
+    dentry->flags &= ~(uint32_t)DENTRY_HASHED;
+}
+
+static void dcache_unused_add(struct dentry* dentry) {
+    dentry->lru_previous = NULL;
+    dentry->lru_next = dcache_unused_head;
+    if (dcache_unused_head) dcache_unused_head->lru_previous = dentry;
+    else dcache_unused_tail = dentry;
+    dcache_unused_head = dentry;
+    dcache_statistics.unused++;
+}
+
+static void dcache_unused_remove(struct dentry* dentry) {
+    if (dentry->lru_previous) dentry->lru_previous->lru_next = dentry->lru_next;
+    else dcache_unused_head = dentry->lru_next;
+    if (dentry->lru_next) dentry->lru_next->lru_previous = dentry->lru_previous;
+    else dcache_unused_tail = dentry->lru_previous;
+    dcache_statistics.unused--;
+}
+
+// Bottom half: free dentries retired before the grace period
+static void dcache_free_retired(struct deferred_work* work) {
+    (void)work;
+    
+    while (dcache_retired) {
+        struct dentry* dentry = dcache_retired;
+        
+        dcache_retired = dentry->retired_next;
+        heap_free(dentry);
+    }
+}
+
+static struct dentry* dentry_get(struct dentry* dentry) {
+    if (dentry->references++ == 0) dcache_unused_remove(dentry);
+    return dentry;
+}
+
+/**
+ * @brief Free an unreferenced dentry and drop its hold on its parent
+ * 
+ * Parents left unreferenced go on the unused list, or are freed too when
+ * they are no longer hashed. Releasing the inodes may sleep.
+ */
+static void dentry_destroy(struct dentry* dentry) {
+    while (dentry) {
+        struct dentry* parent = dentry->parent;
+        
+        dcache_unhash(dentry);
+        if (!(dentry->flags & DENTRY_NEGATIVE)) dentry->mount->operations->release(dentry->inode);
+        dentry->retired_next = dcache_retired;
+        dcache_retired = dentry;
+        dcache_statistics.dentries--;
+        deferred_work_schedule(&dcache_free_work);
+        
+        if (!parent || --parent->references != 0) return;
+        if (parent->flags & DENTRY_HASHED) {
+            dcache_unused_add(parent);
+            return;
+        }
+        dentry = parent;
+    }
+}
+
+/**
+ * @brief Evict the oldest unused dentries
+ * 
+ * @param limit Unused dentries to keep
+ */
+static void dcache_shrink(uint32_t limit) {
+    while (dcache_statistics.unused > limit) {
+        struct dentry* dentry = dcache_unused_tail;
+        
+        dcache_unused_remove(dentry);
+        dcache_statistics.evictions++;
+        dentry_destroy(dentry);
+    }
+}
+
+/**
+ * @brief Drop a reference to a dentry
+ * 
+ * The last reference keeps a hashed dentry cached, evicting beyond
+ * DENTRY_CACHE, and frees an unhashed one. Either may sleep.
+ */
+void dentry_put(struct dentry* dentry) {
+    if (--dentry->references != 0) return;
+    
+    if (dentry->flags & DENTRY_HASHED) {
+        dcache_unused_add(dentry);
+        dcache_shrink(DENTRY_CACHE);
+    } else {
+        dentry_destroy(dentry);
+    }
+}
+
+// The directory ".." leads to, leaving filesystems at their mount points
+static struct dentry* dentry_parent(struct dentry* dentry) {
+    while (!dentry->parent && dentry->mount->mountpoint) {
+        dentry = dentry->mount->mountpoint;
+    }
+    return dentry->parent ? dentry->parent : dentry;
+}
+
+/**
+ * @brief Look a name up in the filesystem and cache the answer
+ * 
+ * @param parent Referenced directory
+ * @param name Name, not null-terminated
+ * @param length Length of the name
+ * @param hash dentry_hash() of parent and name
+ * @param result Receives the referenced dentry, negative if the name does
+ *        not exist
+ * @return 0 on success, otherwise a negative error
+ */
+static int32_t dcache_lookup_slow(struct dentry* parent, const char* name, uint32_t length, uint32_t hash,
+                                  struct dentry** result) {
+    const struct vfs_mount* mount = parent->mount;
+    void* inode = NULL;
+    
+    dcache_statistics.misses++;
+    int32_t status = mount->operations->lookup(mount->volume, parent->inode, name, length, &inode);
+    if (status == ERROR_BUSY || status == ERROR_NO_MEMORY) {
+        // The filesystem may be out of inodes that unused dentries pin
+        dcache_shrink(0);
+        status = mount->operations->lookup(mount->volume, parent->inode, name, length, &inode);
+    }
+    if (status != 0 && status != ERROR_NOT_FOUND) return status;
+    
+    // Another walker may have cached the name while the lookup slept
+    struct dentry* dentry = dcache_find(parent, name, length, hash);
+    if (dentry) {
+        *result = dentry_get(dentry);
+        if (status == 0) mount->operations->release(inode);
+        return 0;
+    }
+    
+    dentry = heap_allocate(sizeof(struct dentry) + length);
+    if (!dentry) {
+        if (status == 0) mount->operations->release(inode);
+        return ERROR_NO_MEMORY;
+    }
+    memset(dentry, 0, sizeof(*dentry));
+    dentry->parent = dentry_get(parent);
+    dentry->mount = parent->mount;
+    dentry->references = 1;
+    dentry->hash = hash;
+    dentry->length = length;
+    memcpy(dentry->name, name, length);
+    if (status == 0) {
+        dentry->inode = inode;
+        if (mount->operations->is_directory(inode)) dentry->flags |= DENTRY_DIRECTORY;
+    } else {
+        dentry->flags |= DENTRY_NEGATIVE;
+    }
+    dcache_statistics.dentries++;
+    dcache_hash(dentry);
+    *result = dentry;
+    return 0;
+}
+
+/**
+ * @brief Resolve a path
+ * 
+ * @param path '/'-separated names from the root; "." and ".." allowed
+ * @param negative Non-zero to accept a negative dentry for the last name
+ * @param result Receives the referenced dentry
+ * @return 0 on success, ERROR_NOT_FOUND, otherwise a negative error
+ */
+static int32_t vfs_walk(const char* path, int negative, struct dentry** result) {
+    struct dentry* dentry = vfs_root;
+    struct dentry* held = NULL;     // Pins the walk's position across sleeps
+    int32_t status = 0;
+    
+    if (!dentry) return ERROR_NOT_FOUND;
+    
+    for (;;) {
+        const char* name = path;
+        uint32_t length = 0;
+        
+        while (*name == '/') {
+            name++;
+        }
+        while (name[length] && name[length] != '/') {
+            length++;
+        }
+        if (length == 0) break;
+        
+        path = name + length;
+        if (length == 1 && name[0] == '.') continue;
+        if (length == 2 && name[0] == '.' && name[1] == '.') {
+            dentry = dentry_parent(dentry);
+            continue;
+        }
+        if (!(dentry->flags & DENTRY_DIRECTORY)) {
+            status = ERROR_NOT_FOUND;
+            break;
+        }
+        if (length > VFS_NAME_MAX) {
+            status = ERROR_INVALID_ARGUMENT;
+            break;
+        }
+        
+        uint32_t hash = dentry_hash(dentry, name, length);
+        struct dentry* child = dcache_find(dentry, name, length, hash);
+        if (child) {
+            dcache_statistics.hits++;
+            if (child->flags & DENTRY_NEGATIVE) dcache_statistics.negative_hits++;
+        } else {
+            // Leave the lockless walk: the filesystem may sleep
+            dentry_get(dentry);
+            status = dcache_lookup_slow(dentry, name, length, hash, &child);
+            dentry_put(dentry);
+            if (status != 0) break;
+            if (held) dentry_put(held);
+            held = child;
+        }
+        
+        if (child->flags & DENTRY_NEGATIVE) {
+            while (*path == '/') {
+                path++;
+            }
+            if (!negative || *path) status = ERROR_NOT_FOUND;
+            dentry = child;
+            break;
+        }
+        dentry = child;
+        while (dentry->mounted) {
+            dentry = dentry->mounted->root;
+        }
+    }
+    
+    if (status == 0) *result = dentry_get(dentry);
+    if (held) dentry_put(held);
+    return status;
+}
+
+/**
+ * @brief Look a path up
+ * 
+ * @param path '/'-separated names from the root
+ * @param result Receives the referenced dentry; drop it with dentry_put()
+ * @return 0 on success, ERROR_NOT_FOUND, otherwise a negative error
+ */
+int32_t vfs_lookup(const char* path, struct dentry** result) {
+    return vfs_walk(path, 0, result);
+}
+
+/**
+ * @brief Create a file or directory
+ * 
+ * @param path Path of the new entry
+ * @param is_directory Non-zero to create a directory
+ * @param result Receives the referenced dentry, or NULL if not wanted
+ * @return 0 on success, ERROR_BUSY if the name exists, otherwise a
+ *         negative error
+ */
+int32_t vfs_create(const char* path, int is_directory, struct dentry** result) {
+    struct dentry* dentry;
+    void* inode;
+    
+    int32_t status = vfs_walk(path, 1, &dentry);
+    if (status != 0) return status;
+    
+    const struct vfs_operations* operations = dentry->mount->operations;
+    if (!(dentry->flags & DENTRY_NEGATIVE)) {
+        status = ERROR_BUSY;
+    } else if (!operations->create) {
+        status = ERROR_INVALID_ARGUMENT;
+    } else {
+        status = operations->create(dentry->parent->inode, dentry->name, dentry->length, is_directory, &inode);
+    }
+    if (status == 0) {
+        // Make the entry positive in place, complete before it is visible
+        dentry->inode = inode;
+        if (is_directory) dentry->flags |= DENTRY_DIRECTORY;
+        __asm__ volatile("" ::: "memory");
+        dentry->flags &= ~(uint32_t)DENTRY_NEGATIVE;
+    }
+    if (status == 0 && result) {
+        *result = dentry;
+    } else {
+        dentry_put(dentry);
+    }
+    return status;
+}
+
+/**
+ * @brief Remove a file's name
+ * 
+ * @param path Path of the file
+ * @return 0 on success, ERROR_INVALID_ARGUMENT for a directory or a
+ *         read-only filesystem, otherwise a negative error
+ * 
+ * The name's dentry turns negative, unless the file is still open: then
+ * the dentry is unhashed and goes away, with the file, at the last close.
+ */
+int32_t vfs_unlink(const char* path) {
+    struct dentry* dentry;
+    
+    int32_t status = vfs_walk(path, 0, &dentry);
+    if (status != 0) return status;
+    
+    const struct vfs_operations* operations = dentry->mount->operations;
+    if ((dentry->flags & DENTRY_DIRECTORY) || !dentry->parent || !operations->unlink) {
+        status = ERROR_INVALID_ARGUMENT;
+    } else {
+        status = operations->unlink(dentry->parent->inode, dentry->name, dentry->length);
+    }
+    if (status == 0 && dentry->references == 1) {
+        void* inode = dentry->inode;
+        
+        dentry->flags |= DENTRY_NEGATIVE;
+        dentry->inode = NULL;
+        operations->release(inode);
+    } else if (status == 0) {
+        dcache_unhash(dentry);
+    }
+    dentry_put(dentry);
+    return status;
+}
+
+/**
+ * @brief Size of a file in bytes
+ */
+uint32_t vfs_size(const struct dentry* dentry) {
+    return dentry->mount->operations->size(dentry->inode);
+}
+
+/**
+ * @brief Read from a file without opening it
+ * 
+ * @param dentry File
+ * @param offset Byte offset
+ * @param buffer Kernel destination
+ * @param length Bytes wanted
+ * @return Bytes read, short at the end of the file, or a negative error
+ */
+int32_t vfs_read(const struct dentry* dentry, uint32_t offset, void* buffer, uint32_t length) {
+    if (dentry->flags & DENTRY_DIRECTORY) return ERROR_INVALID_ARGUMENT;
+    return dentry->mount->operations->read(dentry->inode, NULL, offset, buffer, length);
+}
+
+static int32_t vfs_file_read(struct file* file, uint8_t* buffer, uint32_t length, uint32_t flags) {
+    struct vfs_file* open = file->private_data;
+    struct dentry* dentry = open->dentry;
+    (void)flags;
+    
+    int32_t result = dentry->mount->operations->read(dentry->inode, &open->readahead, open->offset, buffer, length);
+    if (result > 0) open->offset += (uint32_t)result;
+    return result;
+}
+
+static int32_t vfs_file_write(struct file* file, const uint8_t* buffer, uint32_t length, uint32_t flags) {
+    struct vfs_file* open = file->private_data;
+    struct dentry* dentry = open->dentry;
+    (void)flags;
+    
+    int32_t result = dentry->mount->operations->write(dentry->inode, open->offset, buffer, length);
+    if (result > 0) open->offset += (uint32_t)result;
+    return result;
+}
+
+static int32_t vfs_file_sync(struct file* file) {
+    struct vfs_file* open = file->private_data;
+    struct dentry* dentry = open->dentry;
+    
+    return dentry->mount->operations->sync ? dentry->mount->operations->sync(dentry->inode) : 0;
+}
+
+// Mappings fault through the open file's readahead state
+static int32_t vfs_file_mmap(struct file* file, struct vm_area* area) {
+    struct vfs_file* open = file->private_data;
+    struct dentry* dentry = open->dentry;
+    const struct vfs_operations* operations = dentry->mount->operations;
+    
+    area->mapping = operations->mapping ? operations->mapping(dentry->inode) : NULL;
+    if (!area->mapping) return ERROR_INVALID_ARGUMENT;
+    area->readahead = &open->readahead;
+    return 0;
+}
+
+static void vfs_file_close(struct file* file) {
+    struct vfs_file* open = file->private_data;
+    
+    dentry_put(open->dentry);
+    heap_free(open);
+}
+
+static const struct file_operations vfs_file_operations = {
+    .read = vfs_file_read,
+    .write = vfs_file_write,
+    .sync = vfs_file_sync,
+    .mmap = vfs_file_mmap,
+    .close = vfs_file_close,
+};
+
+/**
+ * @brief Open a file by path
+ * 
+ * @param path '/'-separated names from the root
+ * @param flags FILE_READABLE and/or FILE_WRITABLE, and OPEN_CREATE
+ * @param result Receives the file, reading and writing from offset 0
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t vfs_open(const char* path, uint32_t flags, struct file** result) {
+    struct dentry* dentry;
+    
+    int32_t status = vfs_walk(path, 0, &dentry);
+    if (status == ERROR_NOT_FOUND && (flags & OPEN_CREATE)) {
+        status = vfs_create(path, 0, &dentry);
+        if (status == ERROR_BUSY) status = vfs_walk(path, 0, &dentry);
+    }
+    if (status != 0) return status;
+    
+    if ((flags & FILE_WRITABLE) && (!dentry->mount->operations->write || (dentry->flags & DENTRY_DIRECTORY))) {
+        dentry_put(dentry);
+        return ERROR_INVALID_ARGUMENT;
+    }
+    
+    struct vfs_file* open = heap_allocate(sizeof(struct vfs_file));
+    struct file* file = open ? file_create(&vfs_file_operations, flags & (FILE_READABLE | FILE_WRITABLE), open)
+                             : NULL;
+    if (!file) {
+        if (open) heap_free(open);
+        dentry_put(dentry);
+        return ERROR_NO_MEMORY;
+    }
+    memset(open, 0, sizeof(*open));
+    open->dentry = dentry;
+    *result = file;
+    return 0;
+}
+
+/**
+ * @brief Mount a filesystem
+ * 
+ * @param operations Filesystem operations
+ * @param volume Mounted volume passed to them
+ * @param path Directory to cover; ignored for the first mount, which
+ *        becomes the root
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t vfs_mount(const struct vfs_operations* operations, void* volume, const char* path) {
+    struct dentry* mountpoint = NULL;
+    void* inode;
+    
+    if (vfs_mount_count == MAX_VFS_MOUNTS) return ERROR_NO_MEMORY;
+    if (vfs_root) {
+        int32_t status = vfs_lookup(path, &mountpoint);
+        if (status != 0) return status;
+        if (!(mountpoint->flags & DENTRY_DIRECTORY) || mountpoint->mounted) {
+            dentry_put(mountpoint);
+            return ERROR_BUSY;
+        }
+    }
+    
+    struct dentry* root = heap_allocate(sizeof(struct dentry));
+    int32_t status = root ? operations->root(volume, &inode) : ERROR_NO_MEMORY;
+    if (status != 0) {
+        if (root) heap_free(root);
+        if (mountpoint) dentry_put(mountpoint);
+        return status;
+    }
+    
+    struct vfs_mount* mount = &vfs_mounts[vfs_mount_count++];
+    mount->operations = operations;
+    mount->volume = volume;
+    mount->root = root;
+    mount->mountpoint = mountpoint;     // Keeps its reference
+    memset(root, 0, sizeof(*root));
+    root->mount = mount;
+    root->inode = inode;
+    root->flags = DENTRY_DIRECTORY;
+    root->references = 1;               // Held by the mount
+    dcache_statistics.dentries++;
+    
+    __asm__ volatile("" ::: "memory");
+    if (mountpoint) mountpoint->mounted = mount;
+    else vfs_root = root;
+    return 0;
+}
+
+/**
+ * @brief Print dentry cache counters
+ */
+void dcache_statistics_print(void) {
+    uint32_t lookups = dcache_statistics.hits + dcache_statistics.misses;
+    
+    print_string("  dentry cache: ");
+    print_unsigned(dcache_statistics.dentries);
+    print_string(" dentries (");
+    print_unsigned(dcache_statistics.unused);
+    print_string(" unused), hit ratio ");
+    print_unsigned(lookups ? divide_u64((uint64_t)dcache_statistics.hits * 100, lookups) : 0);
+    print_string("%, ");
+    print_unsigned(dcache_statistics.negative_hits);
+    print_string(" negative hits, ");
+    print_unsigned(dcache_statistics.evictions);
+    print_string(" evictions\n");
+}
+
+static int32_t vfs_fat_root(void* volume, void** inode) {
+    (void)volume;
+    *inode = NULL;                      // The root directory has no node
+    return 0;
+}
+
+static int32_t vfs_fat_lookup(void* volume, void* directory, const char* name, uint32_t length, void** inode) {
+    struct fat_node* node;
+    
+    int32_t status = fat_lookup(volume, directory, name, length, &node);
+    if (status == 0) *inode = node;
+    return status;
+}
+
+static void vfs_fat_release(void* inode) {
+    fat_node_put(inode);
+}
+
+static int vfs_fat_is_directory(void* inode) {
+    return !inode || ((struct fat_node*)inode)->directory;
+}
+
+static uint32_t vfs_fat_size(void* inode) {
+    return inode ? ((struct fat_node*)inode)->size : 0;
+}
+
+static int32_t vfs_fat_read(void* inode, struct readahead_state* state, uint32_t offset, void* buffer,
+                            uint32_t length) {
+    return inode ? fat_node_read(inode, state, offset, buffer, length) : ERROR_INVALID_ARGUMENT;
+}
+
+static struct address_space* vfs_fat_mapping(void* inode) {
+    struct fat_node* node = inode;
+    
+    return node && !node->directory ? &node->mapping : NULL;
+}
+
+static const struct vfs_operations vfs_fat_operations = {
+    .root = vfs_fat_root,
+    .lookup = vfs_fat_lookup,
+    .release = vfs_fat_release,
+    .is_directory = vfs_fat_is_directory,
+    .size = vfs_fat_size,
+    .read = vfs_fat_read,
+    .mapping = vfs_fat_mapping,
+};
+
+static int32_t vfs_ext2_root(void* volume, void** inode) {
+    struct ext2_inode* root;
+    
+    int32_t status = ext2_inode_get(volume, EXT2_ROOT_INODE, &root);
+    if (status == 0) *inode = root;
+    return status;
+}
+
+static int32_t vfs_ext2_lookup(void* volume, void* directory, const char* name, uint32_t length, void** inode) {
+    struct ext2_inode* found;
+    (void)volume;
+    
+    int32_t status = ext2_lookup(directory, name, length, &found);
+    if (status == 0) *inode = found;
+    return status;
+}
+
+static void vfs_ext2_release(void* inode) {
+    ext2_inode_put(inode);
+}
+
+static int vfs_ext2_is_directory(void* inode) {
+    return (((struct ext2_inode*)inode)->disk.mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY;
+}
+
+static uint32_t vfs_ext2_size(void* inode) {
+    return ext2_size(inode);
+}
+
+static int32_t vfs_ext2_read(void* inode, struct readahead_state* state, uint32_t offset, void* buffer,
+                             uint32_t length) {
+    return ext2_read(inode, state, offset, buffer, length);
+}
+
+static int32_t vfs_ext2_write(void* inode, uint32_t offset, const void* buffer, uint32_t length) {
+    return ext2_write(inode, offset, buffer, length);
+}
+
+static int32_t vfs_ext2_create(void* directory, const char* name, uint32_t length, int is_directory, void** inode) {
+    struct ext2_inode* created;
+    
+    int32_t status = ext2_create(directory, name, length, is_directory, &created);
+    if (status == 0) *inode = created;
+    return status;
+}
+
+static int32_t vfs_ext2_unlink(void* directory, const char* name, uint32_t length) {
+    return ext2_unlink(directory, name, length);
+}
+
+static int32_t vfs_ext2_sync(void* inode) {
+    return ext2_sync(inode);
+}
+
+static struct address_space* vfs_ext2_mapping(void* inode) {
+    struct ext2_inode* node = inode;
+    
+    return (node->disk.mode & EXT2_MODE_TYPE) == EXT2_MODE_FILE ? &node->mapping : NULL;
+}
+
+static const struct vfs_operations vfs_ext2_operations = {
+    .root = vfs_ext2_root,
+    .lookup = vfs_ext2_lookup,
+    .release = vfs_ext2_release,
+    .is_directory = vfs_ext2_is_directory,
+    .size = vfs_ext2_size,
+    .read = vfs_ext2_read,
+    .write = vfs_ext2_write,
+    .create = vfs_ext2_create,
+    .unlink = vfs_ext2_unlink,
+    .sync = vfs_ext2_sync,
+    .mapping = vfs_ext2_mapping,
+};
+
+/**
+ * @brief Build the namespace from the volumes mounted at boot
+ * 
+ * With a boot archive, the tmpfs it is unpacked into is the root, with
+ * the first ext2 volume on /mnt and the boot floppy's FAT volume on
+ * /boot where the archive has those directories. Otherwise the first
+ * ext2 volume is the root, with the floppy on /boot if that directory
+ * exists, and without ext2 the floppy is the root.
+ */
+void vfs_initialize(void) {
+    dcache_free_work.function = dcache_free_retired;
+    
+    if (initramfs_unpack() == 0) {
+        if (ext2_volume_count) vfs_mount(&vfs_ext2_operations, &ext2_volumes[0], "/mnt");
+        if (fat_boot_volume) vfs_mount(&vfs_fat_operations, fat_boot_volume, "/boot");
+    } else if (ext2_volume_count && vfs_mount(&vfs_ext2_operations, &ext2_volumes[0], "/") == 0) {
+        if (fat_boot_volume) vfs_mount(&vfs_fat_operations, fat_boot_volume, "/boot");
+    } else if (fat_boot_volume) {
+        vfs_mount(&vfs_fat_operations, fat_boot_volume, "/");
+    }
+}
+
+// =============================================================================
+// Memory Filesystem
+// =============================================================================
+
+// tmpfs keeps files entirely in the page cache. A file's address space
+// is its only storage: every page written is pinned there, and a hole
+// reads as zeros. Directories are unsorted lists of names. An inode is
+// freed once it has neither names nor dentries referring to it.
+//
+// Data already in memory can become a file without a copy: whole pages
+// that are page-aligned are entered into the file's address space as
+// they are (see tmpfs_fill()).
+// Source: Linux mm/shmem.c; P. Snyder, "tmpfs: A Virtual Memory File
+//         System", EUUG Conference 1990
+
+struct tmpfs_inode;
+
+struct tmpfs_entry {
+    struct tmpfs_entry* next;
+    struct tmpfs_inode* inode;
+    uint32_t length;
+    char name[];                    // Not null-terminated
+};
+
+struct tmpfs_inode {
+    int directory;
+    uint32_t size;                  // Bytes, for files
+    uint32_t links;                 // Names referring to the inode
+    uint32_t references;            // Held through the VFS
+    struct tmpfs_entry* entries;    // Directory contents
+    struct address_space mapping;   // File contents, pinned
+};
+
+// Only asked for pages that were never written
+static int32_t tmpfs_read_page(struct address_space* mapping, uint32_t index, void* page) {
+    (void)mapping;
+    (void)index;
+    memset(page, 0, PAGE_SIZE);
+    return 0;
+}
+
+// Written through a shared mapping: the page now holds the only copy
+static int32_t tmpfs_page_mkwrite(struct address_space* mapping, struct cached_page* page) {
+    (void)mapping;
+    page->references++;
+    page_cache_pin(page);
+    return 0;
+}
+
+static const struct address_space_operations tmpfs_address_space_operations = {
+    .read_page = tmpfs_read_page,
+    .page_mkwrite = tmpfs_page_mkwrite,
+};
+
+static struct tmpfs_inode* tmpfs_inode_allocate(int directory) {
+    struct tmpfs_inode* inode = heap_allocate(sizeof(struct tmpfs_inode));
+    
+    if (!inode) return NULL;
+    memset(inode, 0, sizeof(*inode));
+    inode->directory = directory;
+    address_space_initialize(&inode->mapping, &tmpfs_address_space_operations, inode);
+    return inode;
+}
+
+// Unpin and drop a file's pages, then the inode
+static void tmpfs_inode_free(struct tmpfs_inode* inode) {
+    for (uint32_t index = 0; inode->mapping.page_count && index < PAGE_ALIGN_UP(inode->size) / PAGE_SIZE; ++index) {
+        struct cached_page* page = page_cache_find(&inode->mapping, index);
+        
+        if (!page) continue;
+        page_cache_put(page);
+        if (page->queue == PAGE_CACHE_UNEVICTABLE) page_cache_unpin(page);
+    }
+    page_cache_invalidate(&inode->mapping);
+    heap_free(inode);
+}
+
+static struct tmpfs_entry* tmpfs_find(const struct tmpfs_inode* directory, const char* name, uint32_t length) {
+    for (struct tmpfs_entry* entry = directory->entries; entry; entry = entry->next) {
+        if (entry->length == length && memcmp(entry->name, name, length) == 0) return entry;
+    }
+    return NULL;
+}
+
+// Grow a file to cover a range just written
+static void tmpfs_extend(struct tmpfs_inode* inode, uint32_t end) {
+    if (end > inode->size) {
+        inode->size = end;
+        inode->mapping.size = end;
+    }
+}
+
+/**
+ * @brief Create an empty tmpfs volume
+ * 
+ * @return Its root directory, the volume argument of tmpfs_operations,
+ *         or NULL if out of memory
+ */
+struct tmpfs_inode* tmpfs_create_volume(void) {
+    struct tmpfs_inode* root = tmpfs_inode_allocate(1);
+    
+    if (root) root->links = 1;          // Never freed
+    return root;
+}
+
+/**
+ * @brief Read from a file
+ * 
+ * @param inode File
+ * @param offset Byte offset
+ * @param buffer Kernel destination
+ * @param length Bytes wanted
+ * @return Bytes read, short at the end of the file, or a negative error
+ */
+int32_t tmpfs_read(struct tmpfs_inode* inode, uint32_t offset, void* buffer, uint32_t length) {
+    if (inode->directory) return ERROR_INVALID_ARGUMENT;
+    if (offset >= inode->size) return 0;
+    if (length > inode->size - offset) length = inode->size - offset;
+    if (length > 0x7FFFFFFF) length = 0x7FFFFFFF;
+    
+    // Pinned pages are always resident, so readahead has nothing to do
+    int32_t status = page_cache_read(&inode->mapping, NULL, offset, buffer, length);
+    return status != 0 ? status : (int32_t)length;
+}
+
+/**
+ * @brief Write to a file, extending it as needed
+ * 
+ * @param inode File
+ * @param offset Byte offset
+ * @param buffer Kernel source
+ * @param length Bytes to write
+ * @return Bytes written, short if memory ran out, or a negative error
+ */
+int32_t tmpfs_write(struct tmpfs_inode* inode, uint32_t offset, const void* buffer, uint32_t length) {
+    const uint8_t* source = (const uint8_t*)buffer;
+    uint32_t written = 0;
+    
+    if (inode->directory) return ERROR_INVALID_ARGUMENT;
+    if (length > 0x7FFFFFFF) length = 0x7FFFFFFF;
+    if (length > 0xFFFFFFFF - offset) return ERROR_INVALID_ARGUMENT;
+    
+    while (written < length) {
+        uint32_t position = offset + written;
+        uint32_t within = position & (PAGE_SIZE - 1);
+        uint32_t chunk = PAGE_SIZE - within < length - written ? PAGE_SIZE - within : length - written;
+        struct cached_page* page;
+        
+        int32_t status = page_cache_get(&inode->mapping, position / PAGE_SIZE, &page);
+        if (status != 0) return written ? (int32_t)written : status;
+        
+        memcpy(page->data + within, source + written, chunk);
+        page_cache_pin(page);
+        written += chunk;
+        tmpfs_extend(inode, position + chunk);
+    }
+    return (int32_t)written;
+}
+
+/**
+ * @brief Fill an empty file from memory, sharing whole pages
+ * 
+ * @param inode Empty file
+ * @param data Contents
+ * @param size Bytes
+ * @return 0 on success, otherwise a negative error
+ * 
+ * Each page-aligned, complete page of data is entered into the file as
+ * it is, with a new reference to its frame; the file then owns that
+ * memory and may write to it. Only a partial last page, or data that is
+ * not page-aligned, is copied.
+ */
+int32_t tmpfs_fill(struct tmpfs_inode* inode, const uint8_t* data, uint32_t size) {
+    uint32_t offset = 0;
+    
+    if (inode->directory || inode->size) return ERROR_INVALID_ARGUMENT;
+    
+    while (offset < size) {
+        uint32_t frame = (uint32_t)(data + offset);
+        
+        if (size - offset < PAGE_SIZE || (frame & (PAGE_SIZE - 1))) {
+            int32_t written = tmpfs_write(inode, offset, data + offset, size - offset);
+            if (written < 0) return written;
+            if ((uint32_t)written != size - offset) return ERROR_NO_MEMORY;
+            return 0;
+        }
+        
+        page_frame_reference(frame);
+        struct cached_page* page = page_cache_add_frame(&inode->mapping, offset / PAGE_SIZE, frame);
+        if (!page) {
+            page_frame_free(frame);
+            return ERROR_NO_MEMORY;
+        }
+        page_cache_pin(page);
+        offset += PAGE_SIZE;
+        tmpfs_extend(inode, offset);
+    }
+    return 0;
+}
+
+static int32_t vfs_tmpfs_root(void* volume, void** inode) {
+    struct tmpfs_inode* root = volume;
+    
+    root->references++;
+    *inode = root;
+    return 0;
+}
+
+static int32_t vfs_tmpfs_lookup(void* volume, void* directory, const char* name, uint32_t length, void** inode) {
+    struct tmpfs_entry* entry = tmpfs_find(directory, name, length);
+    (void)volume;
+    
+    if (!entry) return ERROR_NOT_FOUND;
+    entry->inode->references++;
+    *inode = entry->inode;
+    return 0;
+}
+
+static void vfs_tmpfs_release(void* inode) {
+    struct tmpfs_inode* node = inode;
+    
+    if (--node->references == 0 && node->links == 0) tmpfs_inode_free(node);
+}
+
+static int vfs_tmpfs_is_directory(void* inode) {
+    return ((struct tmpfs_inode*)inode)->directory;
+}
+
+static uint32_t vfs_tmpfs_size(void* inode) {
+    return ((struct tmpfs_inode*)inode)->size;
+}
+
+static int32_t vfs_tmpfs_read(void* inode, struct readahead_state* state, uint32_t offset, void* buffer,
+                              uint32_t length) {
+    (void)state;
+    return tmpfs_read(inode, offset, buffer, length);
+}
+
+static int32_t vfs_tmpfs_write(void* inode, uint32_t offset, const void* buffer, uint32_t length) {
+    return tmpfs_write(inode, offset, buffer, length);
+}
+
+static struct address_space* vfs_tmpfs_mapping(void* inode) {
+    struct tmpfs_inode* node = inode;
+    
+    return node->directory ? NULL : &node->mapping;
+}
+
+static int32_t vfs_tmpfs_create(void* directory, const char* name, uint32_t length, int is_directory,
+                                void** inode) {
+    struct tmpfs_inode* parent = directory;
+    
+    if (!parent->directory) return ERROR_INVALID_ARGUMENT;
+    if (tmpfs_find(parent, name, length)) return ERROR_BUSY;
+    
+    struct tmpfs_entry* entry = heap_allocate(sizeof(struct tmpfs_entry) + length);
+    struct tmpfs_inode* node = entry ? tmpfs_inode_allocate(is_directory) : NULL;
+    if (!node) {
+        if (entry) heap_free(entry);
+        return ERROR_NO_MEMORY;
+    }
+    node->links = 1;
+    node->references = 1;
+    entry->inode = node;
+    entry->length = length;
+    memcpy(entry->name, name, length);
+    entry->next = parent->entries;
+    parent->entries = entry;
+    *inode = node;
+    return 0;
+}
+
+static int32_t vfs_tmpfs_unlink(void* directory, const char* name, uint32_t length) {
+    struct tmpfs_inode* parent = directory;
+    
+    for (struct tmpfs_entry** link = &parent->entries; *link; link = &(*link)->next) {
+        struct tmpfs_entry* entry = *link;
+        
+        if (entry->length != length || memcmp(entry->name, name, length) != 0) continue;
+        if (entry->inode->directory) return ERROR_INVALID_ARGUMENT;
+        
+        *link = entry->next;
+        if (--entry->inode->links == 0 && entry->inode->references == 0) tmpfs_inode_free(entry->inode);
+        heap_free(entry);
+        return 0;
+    }
+    return ERROR_NOT_FOUND;
+}
+
+static const struct vfs_operations tmpfs_operations = {
+    .root = vfs_tmpfs_root,
+    .lookup = vfs_tmpfs_lookup,
+    .release = vfs_tmpfs_release,
+    .is_directory = vfs_tmpfs_is_directory,
+    .size = vfs_tmpfs_size,
+    .read = vfs_tmpfs_read,
+    .write = vfs_tmpfs_write,
+    .create = vfs_tmpfs_create,
+    .unlink = vfs_tmpfs_unlink,
+    .mapping = vfs_tmpfs_mapping,
+};
+
+// =============================================================================
+// Boot Archive
+// =============================================================================
+
+// The bootloader can load an archive from the floppy along with the
+// kernel (see mkinitramfs.sh). When it is there, a tmpfs becomes the root
+// and the archive is unpacked into it before any disk driver is needed,
+// so programs in /bin and configuration files are available at once.
+//
+// The archive is in the cpio "newc" format: a 110-byte header of ASCII
+// hex fields, the null-terminated name, then the data, each padded to a
+// multiple of 4 bytes. mkinitramfs.sh pads the names of larger files
+// further so that their data starts on a page boundary; tmpfs_fill() then
+// takes those pages over instead of copying them. Every archive frame is
+// released afterwards, which frees the ones no file kept.
+// Source: Linux Documentation/driver-api/early-userspace/buffer-format.rst
+//         and init/initramfs.c
+#define CPIO_HEADER_SIZE       110
+#define CPIO_MAGIC             "070701"
+#define CPIO_TRAILER           "TRAILER!!!"
+
+// Header fields, 8 hex digits each after the magic
+#define CPIO_FIELD_MODE        1
+#define CPIO_FIELD_FILE_SIZE   6
+#define CPIO_FIELD_NAME_SIZE   11
+
+// File types in the mode field
+#define CPIO_MODE_TYPE         0170000
+#define CPIO_MODE_DIRECTORY    0040000
+#define CPIO_MODE_FILE         0100000
+
+static uint32_t cpio_align(uint32_t offset) {
+    return (offset + 3) & ~3u;
+}
+
+/**
+ * @brief Parse a hex field of a cpio header
+ * 
+ * @return 0 on success, ERROR_INVALID_ARGUMENT for a malformed field
+ */
+static int32_t cpio_field(const uint8_t* header, uint32_t field, uint32_t* value) {
+    const uint8_t* digits = header + 6 + field * 8;
+    uint32_t result = 0;
+    
+    for (uint32_t i = 0; i < 8; ++i) {
+        uint8_t c = digits[i];
+        uint32_t digit;
+        
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else return ERROR_INVALID_ARGUMENT;
+        result = result << 4 | digit;
+    }
+    *value = result;
+    return 0;
+}
+
+/**
+ * @brief Create one archive entry under the root
+ * 
+ * @return 0 on success or for an entry that is skipped, otherwise a
+ *         negative error
+ */
+static int32_t initramfs_create(const char* name, uint32_t mode, const uint8_t* data, uint32_t size) {
+    char path[VFS_PATH_MAX];
+    struct dentry* dentry;
+    
+    while (name[0] == '.' && name[1] == '/') {
+        name += 2;
+    }
+    while (*name == '/') {
+        name++;
+    }
+    size_t length = string_length(name);
+    if (length == 0 || (length == 1 && name[0] == '.') || length + 2 > VFS_PATH_MAX) return 0;
+    
+    path[0] = '/';
+    memcpy(path + 1, name, length + 1);
+    
+    if ((mode & CPIO_MODE_TYPE) == CPIO_MODE_DIRECTORY) {
+        int32_t status = vfs_create(path, 1, NULL);
+        return status == ERROR_BUSY ? 0 : status;
+    }
+    if ((mode & CPIO_MODE_TYPE) != CPIO_MODE_FILE) return 0;     // Links and devices are not supported
+    
+    int32_t status = vfs_create(path, 0, &dentry);
+    if (status != 0) return status;
+    status = tmpfs_fill(dentry->inode, data, size);
+    dentry_put(dentry);
+    return status;
+}
+
+// Walk the archive's entries up to the trailer
+static int32_t initramfs_extract(const uint8_t* archive, uint32_t size) {
+    uint32_t offset = 0;
+    
+    while (offset < size && size - offset >= CPIO_HEADER_SIZE) {
+        const uint8_t* header = archive + offset;
+        const char* name = (const char*)header + CPIO_HEADER_SIZE;
+        uint32_t mode;
+        uint32_t file_size;
+        uint32_t name_size;
+        
+        if (memcmp(header, CPIO_MAGIC, 6) != 0 || cpio_field(header, CPIO_FIELD_MODE, &mode) != 0 ||
+            cpio_field(header, CPIO_FIELD_FILE_SIZE, &file_size) != 0 ||
+            cpio_field(header, CPIO_FIELD_NAME_SIZE, &name_size) != 0) {
+            return ERROR_INVALID_ARGUMENT;
+        }
+        if (name_size == 0 || name_size > size - offset - CPIO_HEADER_SIZE || name[name_size - 1] != '\0') {
+            return ERROR_INVALID_ARGUMENT;
+        }
+        uint32_t data = cpio_align(offset + CPIO_HEADER_SIZE + name_size);
+        if (data > size || file_size > size - data) return ERROR_INVALID_ARGUMENT;
+        if (memcmp(name, CPIO_TRAILER, sizeof(CPIO_TRAILER)) == 0) return 0;
+        
+        int32_t status = initramfs_create(name, mode, archive + data, file_size);
+        if (status == ERROR_NO_MEMORY) return status;
+        offset = cpio_align(data + file_size);
+    }
+    return ERROR_INVALID_ARGUMENT;
+}
+
+/**
+ * @brief Mount a tmpfs root and unpack the boot archive into it
+ * 
+ * @return 0 if the root was mounted, ERROR_NOT_FOUND without an archive,
+ *         otherwise a negative error
+ * 
+ * A damaged archive still leaves the entries before the damage in place.
+ * The archive's memory is released either way.
+ */
+int32_t initramfs_unpack(void) {
+    uint32_t address = boot_information.initramfs_address;
+    uint32_t size = boot_information.initramfs_size;
+    
+    if (size == 0) return ERROR_NOT_FOUND;
+    
+    struct tmpfs_inode* root = tmpfs_create_volume();
+    int32_t status = root ? vfs_mount(&tmpfs_operations, root, "/") : ERROR_NO_MEMORY;
+    if (status == 0) {
+        initramfs_extract((const uint8_t*)address, size);
+    } else if (root) {
+        heap_free(root);
+    }
+    
+    for (uint32_t frame = address; frame < address + size; frame += PAGE_SIZE) {
+        page_frame_free(frame);
+    }
+    boot_information.initramfs_size = 0;
+    return status;
+}
+
+// =============================================================================
+// Program Registry
+// =============================================================================
+
+// Executables that spawn and exec can start by name. Images live in kernel
+// memory for the lifetime of the system, since processes fault their pages
+// in from them on demand. A name that is not registered is looked for as
+// /bin/<name>, then in the boot floppy's root directory, and registered on
+// first use.
+#define MAX_PROGRAMS           16
+#define PROGRAM_NAME_MAX       32
+
+struct program_image {
+    char name[PROGRAM_NAME_MAX];
+    const uint8_t* image;
+    uint32_t size;
+};
+
+static struct program_image program_registry[MAX_PROGRAMS];
+
+/**
+ * @brief Make an executable image available to spawn and exec
+ * 
+ * @param name Program name (shorter than PROGRAM_NAME_MAX)
+ * @param image ELF32 image in kernel memory
+ * @param size Size of the image in bytes
+ * @return 0 on success, otherwise a negative error
+ */
+int32_t program_register(const char* name, const uint8_t* image, uint32_t size) {
+    size_t length = string_length(name);
+    
+    if (length == 0 || length >= PROGRAM_NAME_MAX) return ERROR_INVALID_ARGUMENT;
+    
+    for (uint32_t i = 0; i < MAX_PROGRAMS; ++i) {
+        if (!program_registry[i].image) {
+            memcpy(program_registry[i].name, name, length + 1);
+            program_registry[i].image = image;
+            program_registry[i].size = size;
+            return 0;
+        }
+    }
+    return ERROR_NO_MEMORY;
+}
+
+/**
+ * @brief Register a program from /bin or the boot floppy's root directory
+ * 
+ * @param name Program name, also its file name (8.3 on the floppy)
+ * @return 0 on success, otherwise a negative error
+ * 
+ * The whole file is read into kernel memory, which it keeps for good.
+ */
+static int32_t program_load(const char* name) {
+    char path[PROGRAM_NAME_MAX + 5];
+    size_t length = string_length(name);
+    struct dentry* dentry;
+    uint8_t* image;
+    uint32_t size;
+    int32_t result;
+    
+    memcpy(path, "/bin/", 5);
+    memcpy(path + 5, name, length + 1);
+    if (vfs_lookup(path, &dentry) == 0) {
+        size = (dentry->flags & DENTRY_DIRECTORY) ? 0 : vfs_size(dentry);
+        image = size ? heap_allocate(size) : NULL;
+        result = image ? vfs_read(dentry, 0, image, size) : 0;
+        dentry_put(dentry);
+    } else {
+        struct fat_file file;
+        
+        if (!fat_boot_volume) return ERROR_NOT_FOUND;
+        result = fat_open(fat_boot_volume, name, &file);
+        if (result != 0) return result;
+        
+        size = fat_size(&file);
+        image = size ? heap_allocate(size) : NULL;
+        result = image ? fat_read(&file, 0, image, size) : 0;
+        fat_close(&file);
+    }
+    if (!image) return size ? ERROR_NO_MEMORY : ERROR_BAD_EXECUTABLE;
+    
+    if (result == (int32_t)size) result = program_register(name, image, size);
+    if (result != 0) {
+        heap_free(image);
+        return result < 0 ? result : ERROR_IO;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find a registered program by a name held in user memory
+ * 
+ * @param name User address of the name (not null-terminated)
+ * @param length Length of the name
+ * @return The program, or NULL if the name is invalid or unknown
+ */
+static const struct program_image* program_lookup_user(uint32_t name, uint32_t length) {
+    char buffer[PROGRAM_NAME_MAX];
+    
+    if (length == 0 || length >= PROGRAM_NAME_MAX || !user_buffer_valid(name, length, 0)) {
+        return NULL;
+    }
+    memcpy(buffer, (const void*)name, length);
+    buffer[length] = '\0';
+    
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        for (uint32_t i = 0; i < MAX_PROGRAMS; ++i) {
+            if (program_registry[i].image && memcmp(program_registry[i].name, buffer, length + 1) == 0) {
+                return &program_registry[i];
+            }
+        }
+        if (attempt == 0 && program_load(buffer) != 0) break;
+    }
+    return NULL;
+}
+
+// =============================================================================
+// System Calls
+// =============================================================================
+
+// System call ABI: int 0x80 with the call number in EAX and up to five
+// arguments in EBX, ECX, EDX, ESI and EDI. The result is returned in EAX;
+// values from -4095 to -1 are ERROR_* codes, anything else (including user
+// addresses above 2GB) is a successful result.
+#define SYSCALL_EXIT           0
+#define SYSCALL_WRITE          1
+#define SYSCALL_YIELD          2
+#define SYSCALL_GETPID         3
+#define SYSCALL_FORK           4
+#define SYSCALL_VFORK          5
+#define SYSCALL_SPAWN          6
+#define SYSCALL_EXEC           7
+#define SYSCALL_WAIT           8
+#define SYSCALL_RING_CREATE    9
+#define SYSCALL_RING_MAP       10
+#define SYSCALL_RING_WAIT      11
+#define SYSCALL_RING_WAKE      12
+#define SYSCALL_PORT_CREATE    13
+#define SYSCALL_PORT_DESTROY   14
+#define SYSCALL_MESSAGE_SEND   15
+#define SYSCALL_MESSAGE_RECEIVE 16
+#define SYSCALL_READ           17
+#define SYSCALL_PIPE           18
+#define SYSCALL_CLOSE          19
+#define SYSCALL_SPLICE         20
+#define SYSCALL_TEE            21
+#define SYSCALL_CONSOLE_LOG    22
+#define SYSCALL_IO_RING_SETUP  23
+#define SYSCALL_IO_RING_ENTER  24
+#define SYSCALL_EVENT_CREATE   25
+#define SYSCALL_EVENT_CONTROL  26
+#define SYSCALL_EVENT_WAIT     27
+#define SYSCALL_FUTEX_WAIT     28
+#define SYSCALL_FUTEX_WAKE     29
+#define SYSCALL_FUTEX_REQUEUE  30
+#define SYSCALL_MULTI          31
+#define SYSCALL_PAGE_CACHE_STATS 32
+#define SYSCALL_OPEN           33
+#define SYSCALL_FSYNC          34
+#define SYSCALL_MMAP           35
+#define SYSCALL_MUNMAP         36
+#define SYSCALL_MSYNC          37
+#define SYSCALL_COUNT          38
+
+#define SYSCALL_WRITE_MAX      4096    // Longest write per call
+
+typedef int32_t (*syscall_handler_t)(uint32_t arg0, uint32_t arg1, uint32_t arg2,
+                                     uint32_t arg3, uint32_t arg4);
+
+static int32_t sys_exit(uint32_t code, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    process_exit((int32_t)code);
+    return 0;
+}
+
+static int32_t sys_write(uint32_t fd, uint32_t buffer, uint32_t length, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct file* file = file_descriptor_get(fd, FILE_WRITABLE);
+    if (!file || !file->operations->write) return ERROR_INVALID_ARGUMENT;
+    
+    if (length > SYSCALL_WRITE_MAX) length = SYSCALL_WRITE_MAX;
+    if (!user_buffer_valid(buffer, length, 0)) return ERROR_BAD_ADDRESS;
+    
+    return file->operations->write(file, (const uint8_t*)buffer, length, file->flags);
+}
+
+static int32_t sys_read(uint32_t fd, uint32_t buffer, uint32_t length, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct file* file = file_descriptor_get(fd, FILE_READABLE);
+    if (!file || !file->operations->read) return ERROR_INVALID_ARGUMENT;
+    if (!user_buffer_valid(buffer, length, 1)) return ERROR_BAD_ADDRESS;
+    
+    return file->operations->read(file, (uint8_t*)buffer, length, file->flags);
+}
+
+static int32_t sys_pipe(uint32_t fds_address, uint32_t flags, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    struct file* reader;
+    struct file* writer;
+    int32_t fds[2];
+    
+    if (!user_buffer_valid(fds_address, sizeof(fds), 1)) return ERROR_BAD_ADDRESS;
+    
+    int32_t result = pipe_create(&reader, &writer);
+    if (result != 0) return result;
+    
+    reader->flags |= flags & FILE_NONBLOCK;
+    writer->flags |= flags & FILE_NONBLOCK;
+    fds[0] = file_descriptor_install(current_process, reader);
+    fds[1] = fds[0] < 0 ? ERROR_BUSY : file_descriptor_install(current_process, writer);
+    if (fds[1] < 0) {
+        if (fds[0] >= 0) current_process->files[fds[0]] = NULL;
+        file_put(reader);
+        file_put(writer);
+        return ERROR_BUSY;
+    }
+    memcpy((void*)fds_address, fds, sizeof(fds));
+    return 0;
+}
+
+static int32_t sys_close(uint32_t fd, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct file* file = file_descriptor_get(fd, 0);
+    if (!file) return ERROR_INVALID_ARGUMENT;
+    
+    current_process->files[fd] = NULL;
+    file_put(file);
+    return 0;
+}
+
+static int32_t sys_splice(uint32_t fd_in, uint32_t fd_out, uint32_t length, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct file* input = file_descriptor_get(fd_in, FILE_READABLE);
+    struct file* output = file_descriptor_get(fd_out, FILE_WRITABLE);
+    if (!input || !output) return ERROR_INVALID_ARGUMENT;
+    
+    return file_splice(input, output, length, 0);
+}
+
+static int32_t sys_tee(uint32_t fd_in, uint32_t fd_out, uint32_t length, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct file* input = file_descriptor_get(fd_in, FILE_READABLE);
+    struct file* output = file_descriptor_get(fd_out, FILE_WRITABLE);
+    if (!input || !output) return ERROR_INVALID_ARGUMENT;
+    
+    return file_splice(input, output, length, 1);
+}
+
+static int32_t sys_console_log(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct file* file = console_log_open();
+    if (!file) return ERROR_NO_MEMORY;
+    
+    int32_t fd = file_descriptor_install(current_process, file);
+    if (fd < 0) file_put(file);
+    return fd;
+}
+
+static int32_t sys_yield(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    scheduler_yield();
+    return 0;
+}
+
+static int32_t sys_getpid(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    return (int32_t)current_process->pid;
+}
+
+static int32_t sys_fork(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct process* child = process_fork(current_process);
+    if (!child) return ERROR_NO_MEMORY;
+    
+    child->state = PROCESS_READY;
+    return (int32_t)child->pid;
+}
+
+static int32_t sys_vfork(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct process* parent = current_process;
+    struct process* child = process_vfork(parent);
+    if (!child) return ERROR_NO_MEMORY;
+    
+    uint32_t pid = child->pid;
+    child->state = PROCESS_READY;
+    
+    // The child runs on our address space until it calls exec or exit
+    while (child->vfork_parent == parent) {
+        wait_queue_sleep(&parent->child_wait);
+    }
+    return (int32_t)pid;
+}
+
+static int32_t sys_spawn(uint32_t name, uint32_t length, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    const struct program_image* program = program_lookup_user(name, length);
+    if (!program) return ERROR_NOT_FOUND;
+    
+    struct process* child = process_spawn(program->image, program->size, current_process);
+    if (!child) return ERROR_NO_MEMORY;
+    
+    child->state = PROCESS_READY;
+    return (int32_t)child->pid;
+}
+
+static int32_t sys_exec(uint32_t name, uint32_t length, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    const struct program_image* program = program_lookup_user(name, length);
+    if (!program) return ERROR_NOT_FOUND;
+    
+    return process_exec(program->image, program->size);
+}
+
+static int32_t sys_wait(uint32_t pid, uint32_t status, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    if (status && !user_buffer_valid(status, sizeof(int32_t), 1)) {
+        return ERROR_BAD_ADDRESS;
+    }
+    
+    while (1) {
+        int have_children = 0;
+        
+        for (uint32_t i = 1; i < MAX_PROCESSES; ++i) {
+            struct process* child = &process_table[i];
+            
+            if (child->state == PROCESS_UNUSED || child->parent != current_process) continue;
+            if (pid != 0 && child->pid != pid) continue;
+            
+            have_children = 1;
+            if (child->state == PROCESS_ZOMBIE) {
+                uint32_t child_pid = child->pid;
+                if (status) {
+                    *(int32_t*)status = child->exit_code;
+                }
+                process_reap(child);
+                return (int32_t)child_pid;
+            }
+        }
+        
+        if (!have_children) return ERROR_NO_CHILD;
+        wait_queue_sleep(&current_process->child_wait);
+    }
+}
+
+static int32_t sys_ring_create(uint32_t slot_count, uint32_t slot_size, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    struct shared_ring* ring = shared_ring_create(slot_count, slot_size);
+    if (!ring) return ERROR_INVALID_ARGUMENT;
+    
+    struct shared_memory* memory = ring->memory;
+    uint32_t address = shared_memory_map(current_process, memory, VM_READ | VM_WRITE);
+    shared_memory_put(memory);
+    return address ? (int32_t)address : ERROR_NO_MEMORY;
+}
+
+static int32_t sys_ring_map(uint32_t ring_id, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct shared_ring* ring = shared_ring_find(ring_id);
+    if (!ring) return ERROR_NOT_FOUND;
+    
+    uint32_t address = shared_memory_map(current_process, ring->memory, VM_READ | VM_WRITE);
+    return address ? (int32_t)address : ERROR_NO_MEMORY;
+}
+
+static int32_t sys_ring_wait(uint32_t ring_id, uint32_t side, uint32_t expected, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct shared_ring* ring = shared_ring_find(ring_id);
+    if (!ring) return ERROR_NOT_FOUND;
+    
+    shared_ring_wait(ring, side, expected);
+    return 0;
+}
+
+static int32_t sys_ring_wake(uint32_t ring_id, uint32_t side, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    struct shared_ring* ring = shared_ring_find(ring_id);
+    if (!ring) return ERROR_NOT_FOUND;
+    
+    shared_ring_wake(ring, side);
+    return 0;
+}
+
+static int32_t sys_port_create(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    return message_port_create();
+}
+
+static int32_t sys_port_destroy(uint32_t port_id, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct message_port* port = message_port_find(port_id);
+    if (!port) return ERROR_NOT_FOUND;
+    
+    message_port_destroy(port);
+    return 0;
+}
+
+static int32_t sys_message_send(uint32_t port_id, uint32_t address, uint32_t length, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct message_port* port = message_port_find(port_id);
+    if (!port) return ERROR_NOT_FOUND;
+    if (!user_buffer_valid(address, length, 0)) return ERROR_BAD_ADDRESS;
+    
+    // Below the measured threshold copying is cheaper than remapping
+    int remap = (address & (PAGE_SIZE - 1)) == 0 &&
+                PAGE_ALIGN_UP(length) / PAGE_SIZE >= ipc_remap_min_pages;
+    return message_send(current_process, port, address, length, remap);
+}
+
+static int32_t sys_message_receive(uint32_t port_id, uint32_t buffer, uint32_t capacity, uint32_t info_address, uint32_t arg4) {
+    (void)arg4;
+    
+    struct message_port* port = message_port_find(port_id);
+    struct message_info info;
+    
+    if (!port) return ERROR_NOT_FOUND;
+    if (!user_buffer_valid(buffer, capacity, 1) ||
+        !user_buffer_valid(info_address, sizeof(info), 1)) {
+        return ERROR_BAD_ADDRESS;
+    }
+    
+    int32_t result = message_receive(current_process, port, buffer, capacity, &info);
+    if (result >= 0) {
+        memcpy((void*)info_address, &info, sizeof(info));
+    }
+    return result;
+}
+
+static int32_t sys_io_ring_setup(uint32_t params_address, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct io_ring_params params;
+    
+    if (!user_buffer_valid(params_address, sizeof(params), 1)) return ERROR_BAD_ADDRESS;
+    memcpy(&params, (const void*)params_address, sizeof(params));
+    
+    struct io_ring* ring = io_ring_create(current_process, params.sq_entries, params.flags,
+                                          params.sq_thread_idle);
+    if (!ring) return ERROR_INVALID_ARGUMENT;
+    
+    struct file* file = file_create(&io_ring_operations, FILE_PRIVATE, ring);
+    if (!file) {
+        io_ring_destroy(ring);
+        return ERROR_NO_MEMORY;
+    }
+    
+    params.ring_address = shared_memory_map(current_process, ring->memory, VM_READ | VM_WRITE);
+    int32_t fd = params.ring_address ? file_descriptor_install(current_process, file) : ERROR_NO_MEMORY;
+    if (fd < 0) {
+        file_put(file);
+        return fd;
+    }
+    
+    params.sq_entries = ring->header->sq_entries;
+    params.ring_size = ring->memory->page_count * PAGE_SIZE;
+    memcpy((void*)params_address, &params, sizeof(params));
+    return fd;
+}
+
+static int32_t sys_io_ring_enter(uint32_t fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags, uint32_t arg4) {
+    (void)arg4;
+    
+    struct file* file = file_descriptor_get(fd, 0);
+    if (!file || file->operations != &io_ring_operations) return ERROR_INVALID_ARGUMENT;
+    
+    return io_ring_enter((struct io_ring*)file->private_data, to_submit, min_complete, flags);
+}
+
+static int32_t sys_event_create(uint32_t arg0, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg0; (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct event_poll* poll = event_poll_create();
+    if (!poll) return ERROR_NO_MEMORY;
+    
+    struct file* file = file_create(&event_poll_operations, FILE_READABLE, poll);
+    if (!file) {
+        event_poll_destroy(poll);
+        return ERROR_NO_MEMORY;
+    }
+    
+    int32_t fd = file_descriptor_install(current_process, file);
+    if (fd < 0) file_put(file);
+    return fd;
+}
+
+static int32_t sys_event_control(uint32_t poll_fd, uint32_t operation, uint32_t fd, uint32_t record_address, uint32_t arg4) {
+    (void)arg4;
+    
+    struct file* poll_file = file_descriptor_get(poll_fd, 0);
+    struct file* file = file_descriptor_get(fd, 0);
+    struct event_record record = {0, 0};
+    
+    if (!poll_file || poll_file->operations != &event_poll_operations || !file || file == poll_file) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    if (operation != EVENT_CONTROL_DELETE) {
+        if (!user_buffer_valid(record_address, sizeof(record), 0)) return ERROR_BAD_ADDRESS;
+        memcpy(&record, (const void*)record_address, sizeof(record));
+    }
+    return event_poll_control((struct event_poll*)poll_file->private_data, operation, fd, file, &record);
+}
+
+static int32_t sys_event_wait(uint32_t poll_fd, uint32_t records_address, uint32_t max, uint32_t timeout, uint32_t arg4) {
+    (void)arg4;
+    
+    struct file* poll_file = file_descriptor_get(poll_fd, 0);
+    if (!poll_file || poll_file->operations != &event_poll_operations) return ERROR_INVALID_ARGUMENT;
+    
+    if (max > EVENT_WAIT_MAX) max = EVENT_WAIT_MAX;
+    if (max == 0) return ERROR_INVALID_ARGUMENT;
+    if (!user_buffer_valid(records_address, max * sizeof(struct event_record), 1)) return ERROR_BAD_ADDRESS;
+    
+    return event_poll_wait((struct event_poll*)poll_file->private_data,
+                           (struct event_record*)records_address, max, timeout);
+}
+
+static int32_t sys_futex_wait(uint32_t address, uint32_t expected, uint32_t timeout, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    uint32_t key;
+    int32_t result = futex_key(address, &key);
+    if (result != 0) return result;
+    
+    return futex_wait_key(key, expected, timeout);
+}
+
+static int32_t sys_futex_wake(uint32_t address, uint32_t count, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    uint32_t key;
+    int32_t result = futex_key(address, &key);
+    if (result != 0) return result;
+    
+    return futex_wake_key(key, count);
+}
+
+static int32_t sys_futex_requeue(uint32_t address, uint32_t wake_count, uint32_t requeue_count, uint32_t target_address, uint32_t expected) {
+    uint32_t key, target;
+    int32_t result = futex_key(address, &key);
+    if (result == 0) result = futex_key(target_address, &target);
+    if (result != 0) return result;
+    
+    return futex_requeue_key(key, wake_count, requeue_count, target, expected);
+}
+
+static int32_t sys_page_cache_stats(uint32_t address, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct page_cache_statistics statistics;
+    
+    if (!user_buffer_valid(address, sizeof(statistics), 1)) return ERROR_BAD_ADDRESS;
+    page_cache_statistics_read(&statistics);
+    memcpy((void*)address, &statistics, sizeof(statistics));
+    return 0;
+}
+
+static int32_t sys_open(uint32_t path, uint32_t length, uint32_t flags, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    char buffer[VFS_PATH_MAX];
+    struct file* file;
+    
+    if (length == 0 || length >= VFS_PATH_MAX) return ERROR_INVALID_ARGUMENT;
+    if (!(flags & (FILE_READABLE | FILE_WRITABLE))) return ERROR_INVALID_ARGUMENT;
+    if (!user_buffer_valid(path, length, 0)) return ERROR_BAD_ADDRESS;
+    memcpy(buffer, (const void*)path, length);
+    buffer[length] = '\0';
+    
+    int32_t result = vfs_open(buffer, flags, &file);
+    if (result != 0) return result;
+    
+    int32_t fd = file_descriptor_install(current_process, file);
+    if (fd < 0) file_put(file);
+    return fd;
+}
+
+static int32_t sys_fsync(uint32_t fd, uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4;
+    
+    struct file* file = file_descriptor_get(fd, 0);
+    if (!file || !file->operations->sync) return ERROR_INVALID_ARGUMENT;
+    
+    return file->operations->sync(file);
+}
+
+static int32_t sys_mmap(uint32_t fd, uint32_t offset, uint32_t length, uint32_t protection, uint32_t flags) {
+    struct file* file = file_descriptor_get(fd, 0);
+    uint32_t address;
+    
+    if (!file || (protection & ~(uint32_t)(VM_READ | VM_WRITE | VM_EXEC))) return ERROR_INVALID_ARGUMENT;
+    if (flags != MAP_SHARED && flags != MAP_PRIVATE) return ERROR_INVALID_ARGUMENT;
+    
+    int32_t result = file_map_create(current_process, file, offset, length,
+                                     protection | (flags == MAP_SHARED ? VM_SHARED : 0), &address);
+    return result != 0 ? result : (int32_t)address;
+}
+
+// Only a whole file mapping can be unmapped
+static int32_t sys_munmap(uint32_t address, uint32_t length, uint32_t arg2, uint32_t arg3, uint32_t arg4) {
+    (void)arg2; (void)arg3; (void)arg4;
+    
+    struct vm_area* area = vm_area_find(current_process, address);
+    if (!area || !(area->flags & VM_FILE) || area->start != address || area->end - address != PAGE_ALIGN_UP(length)) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    vm_area_remove(current_process, area);
+    return 0;
+}
+
+static int32_t sys_msync(uint32_t address, uint32_t length, uint32_t flags, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    return file_map_sync(current_process, address, length, flags);
+}
+
+static int32_t sys_multi(uint32_t entries_address, uint32_t count, uint32_t flags, uint32_t arg3, uint32_t arg4);
+
+static const syscall_handler_t syscall_table[SYSCALL_COUNT] = {
+    [SYSCALL_EXIT]   = sys_exit,
+    [SYSCALL_WRITE]  = sys_write,
+    [SYSCALL_YIELD]  = sys_yield,
+    [SYSCALL_GETPID] = sys_getpid,
+    [SYSCALL_FORK]   = sys_fork,
+    [SYSCALL_VFORK]  = sys_vfork,
+    [SYSCALL_SPAWN]  = sys_spawn,
+    [SYSCALL_EXEC]   = sys_exec,
+    [SYSCALL_WAIT]   = sys_wait,
+    [SYSCALL_RING_CREATE] = sys_ring_create,
+    [SYSCALL_RING_MAP]    = sys_ring_map,
+    [SYSCALL_RING_WAIT]   = sys_ring_wait,
+    [SYSCALL_RING_WAKE]   = sys_ring_wake,
+    [SYSCALL_PORT_CREATE]     = sys_port_create,
+    [SYSCALL_PORT_DESTROY]    = sys_port_destroy,
+    [SYSCALL_MESSAGE_SEND]    = sys_message_send,
+    [SYSCALL_MESSAGE_RECEIVE] = sys_message_receive,
+    [SYSCALL_READ]        = sys_read,
+    [SYSCALL_PIPE]        = sys_pipe,
+    [SYSCALL_CLOSE]       = sys_close,
+    [SYSCALL_SPLICE]      = sys_splice,
+    [SYSCALL_TEE]         = sys_tee,
+    [SYSCALL_CONSOLE_LOG] = sys_console_log,
+    [SYSCALL_IO_RING_SETUP] = sys_io_ring_setup,
+    [SYSCALL_IO_RING_ENTER] = sys_io_ring_enter,
+    [SYSCALL_EVENT_CREATE]  = sys_event_create,
+    [SYSCALL_EVENT_CONTROL] = sys_event_control,
+    [SYSCALL_EVENT_WAIT]    = sys_event_wait,
+    [SYSCALL_FUTEX_WAIT]    = sys_futex_wait,
+    [SYSCALL_FUTEX_WAKE]    = sys_futex_wake,
+    [SYSCALL_FUTEX_REQUEUE] = sys_futex_requeue,
+    [SYSCALL_MULTI]         = sys_multi,
+    [SYSCALL_PAGE_CACHE_STATS] = sys_page_cache_stats,
+    [SYSCALL_OPEN]          = sys_open,
+    [SYSCALL_FSYNC]         = sys_fsync,
+    [SYSCALL_MMAP]          = sys_mmap,
+    [SYSCALL_MUNMAP]        = sys_munmap,
+    [SYSCALL_MSYNC]         = sys_msync,
+};
+
+// One call in a SYSCALL_MULTI batch. The kernel fills in result as each
+// call completes; entries after the last one run are left untouched.
+struct syscall_entry {
+    uint32_t number;
+    uint32_t arguments[5];
+    int32_t result;
+};
+
+#define SYSCALL_MULTI_MAX          256     // Longest batch per call
+#define SYSCALL_MULTI_STOP_ON_ERROR 0x1    // Stop after the first failing call
+
+/**
+ * @brief Check whether a system call result is an ERROR_* code
+ * 
+ * @param result Value a handler returned
+ * @return Non-zero for -4095..-1, zero for any successful result
+ */
+static inline int syscall_failed(int32_t result) {
+    return (uint32_t)result >= (uint32_t)-4095;
+}
+
+/**
+ * @brief Run a batch of system calls in a single kernel entry
+ * 
+ * @param entries_address User address of an array of struct syscall_entry
+ * @param count Number of entries
+ * @param flags SYSCALL_MULTI_STOP_ON_ERROR or 0
+ * @return Number of entries whose result was written back, or a negative
+ *         error code
+ * 
+ * Each entry is copied in and its result written back one at a time, so a
+ * call in the batch may unmap later entries; running into an unmapped
+ * entry ends the batch. Calls that take over the caller's trap frame
+ * (fork, vfork, exec) and nested batches are refused with
+ * ERROR_INVALID_ARGUMENT in their result slot.
+ */
+static int32_t sys_multi(uint32_t entries_address, uint32_t count, uint32_t flags, uint32_t arg3, uint32_t arg4) {
+    (void)arg3; (void)arg4;
+    
+    struct syscall_entry entry;
+    uint32_t done = 0;
+    
+    if (count == 0 || count > SYSCALL_MULTI_MAX || (flags & ~SYSCALL_MULTI_STOP_ON_ERROR)) {
+        return ERROR_INVALID_ARGUMENT;
+    }
+    if (!user_buffer_valid(entries_address, count * sizeof(entry), 1)) return ERROR_BAD_ADDRESS;
+    
+    for (; done < count; ++done) {
+        struct syscall_entry* user_entry = (struct syscall_entry*)entries_address + done;
+        
+        if (!user_buffer_valid((uint32_t)user_entry, sizeof(entry), 1)) break;
+        memcpy(&entry, user_entry, sizeof(entry));
+        
+        uint32_t number = entry.number;
+        if (number >= SYSCALL_COUNT || !syscall_table[number] || number == SYSCALL_MULTI ||
+            number == SYSCALL_FORK || number == SYSCALL_VFORK || number == SYSCALL_EXEC) {
+            entry.result = ERROR_INVALID_ARGUMENT;
+        } else {
+            entry.result = syscall_table[number](entry.arguments[0], entry.arguments[1], entry.arguments[2],
+                                                 entry.arguments[3], entry.arguments[4]);
+        }
+        
+        if (!user_buffer_valid((uint32_t)&user_entry->result, sizeof(entry.result), 1)) break;
+        user_entry->result = entry.result;
+        
+        if ((flags & SYSCALL_MULTI_STOP_ON_ERROR) && syscall_failed(entry.result)) {
+            ++done;
+            break;
+        }
+    }
+    return (int32_t)done;
+}
+
+/**
+ * @brief Decode and run a system call from the int 0x80 gate
+ * 
+ * @param frame Trap frame holding the caller's registers
+ */
+void syscall_dispatch(struct trap_frame* frame) {
+    current_process->trap_frame = frame;
+    
+    if (frame->eax >= SYSCALL_COUNT || !syscall_table[frame->eax]) {
+        frame->eax = (uint32_t)ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    
+    frame->eax = (uint32_t)syscall_table[frame->eax](frame->ebx, frame->ecx, frame->edx,
+                                                    frame->esi, frame->edi);
+}
+
+#ifdef KERNEL_BENCHMARKS
+
+// =============================================================================
+// Process Creation Benchmark
+// =============================================================================
+
+#define BENCHMARK_PROCESS_ITERATIONS  200
+#define BENCHMARK_RESIDENT_PAGES      256
+
+static uint8_t benchmark_program[PAGE_SIZE] __attribute__((aligned(4)));
+
+// Build a minimal ELF32 executable: one RWX segment whose first page holds
+// the headers and "mov eax, SYSCALL_EXIT; xor ebx, ebx; int 0x80", followed
+// by zero-filled data pages.
+static uint32_t benchmark_build_program(uint32_t data_pages) {
+    struct elf32_header* header = (struct elf32_header*)benchmark_program;
+    struct elf32_program_header* segment = (struct elf32_program_header*)(header + 1);
+    uint8_t* code = (uint8_t*)(segment + 1);
+    static const uint8_t exit_code[] = { 0xB8, SYSCALL_EXIT, 0, 0, 0, 0x31, 0xDB, 0xCD, 0x80 };
+    uint32_t code_offset = (uint32_t)(code - benchmark_program);
+    
+    memset(benchmark_program, 0, sizeof(benchmark_program));
+    header->magic = ELF_MAGIC;
+    header->file_class = ELF_CLASS_32;
+    header->data_encoding = ELF_DATA_LSB;
+    header->version_ident = 1;
+    header->type = ELF_TYPE_EXECUTABLE;
+    header->machine = ELF_MACHINE_386;
+    header->version = 1;
+    header->entry = USER_SPACE_START + code_offset;
+    header->program_header_offset = sizeof(*header);
+    header->header_size = sizeof(*header);
+    header->program_header_size = sizeof(*segment);
+    header->program_header_count = 1;
+    
+    segment->type = ELF_SEGMENT_LOAD;
+    segment->virtual_address = USER_SPACE_START;
+    segment->file_size = code_offset + sizeof(exit_code);
+    segment->memory_size = (1 + data_pages) * PAGE_SIZE;
+    segment->flags = ELF_FLAG_READ | ELF_FLAG_WRITE | ELF_FLAG_EXECUTE;
+    segment->alignment = PAGE_SIZE;
+    
+    memcpy(code, exit_code, sizeof(exit_code));
+    return segment->file_size;
+}
+
+/**
+ * @brief Measure process creation rates for fork, vfork and spawn
+ * 
+ * A parent with BENCHMARK_RESIDENT_PAGES populated pages is duplicated
+ * repeatedly; each child is torn down without running so only creation
+ * and teardown are timed. The last case spawns, runs and reaps a program
+ * that exits immediately, covering the whole lifecycle.
+ */
+void benchmark_process_creation(void) {
+    uint32_t size = benchmark_build_program(BENCHMARK_RESIDENT_PAGES);
+    struct process* parent = process_spawn(benchmark_program, size, NULL);
+    uint32_t created = 0;
+    uint64_t start;
+    
+    print_string(" Process creation (parent with 256 resident pages):\n");
+    if (!parent) return;
+    
+    for (uint32_t page = 0; page <= BENCHMARK_RESIDENT_PAGES; ++page) {
+        vm_area_fault(parent, USER_SPACE_START + page * PAGE_SIZE, PAGE_FAULT_WRITE);
+    }
+    
+    start = timestamp_read();
+    for (created = 0; created < BENCHMARK_PROCESS_ITERATIONS; ++created) {
+        struct process* child = process_fork(parent);
+        if (!child) break;
+        process_discard(child);
+    }
+    benchmark_report("fork (copy-on-write)", created, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (created = 0; created < BENCHMARK_PROCESS_ITERATIONS; ++created) {
+        struct process* child = process_vfork(parent);
+        if (!child) break;
+        process_discard(child);
+    }
+    benchmark_report("vfork (shared address space)", created, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (created = 0; created < BENCHMARK_PROCESS_ITERATIONS; ++created) {
+        struct process* child = process_spawn(benchmark_program, size, parent);
+        if (!child) break;
+        process_discard(child);
+    }
+    benchmark_report("spawn (fresh image)", created, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (created = 0; created < BENCHMARK_PROCESS_ITERATIONS; ++created) {
+        struct process* child = process_spawn(benchmark_program, size, NULL);
+        if (!child) break;
+        child->state = PROCESS_READY;
+        scheduler_yield();
+        process_reap_orphans();
+    }
+    benchmark_report("spawn + run + exit", created, timestamp_read() - start);
+    
+    process_discard(parent);
+}
+
+// =============================================================================
+// Shared Ring Benchmark
+// =============================================================================
+
+#define BENCHMARK_RING_MESSAGES     20000
+#define BENCHMARK_RING_SLOTS        256
+#define BENCHMARK_MESSAGE_SIZE      64
+
+// Baseline: a kernel pipe reached through the system call gate, copying
+// each message into the kernel on send and out again on receive.
+static struct file* benchmark_pipe_reader;
+static struct file* benchmark_pipe_writer;
+
+static inline void benchmark_syscall_gate(void) {
+    uint32_t result;
+    __asm__ volatile("int $0x80" : "=a"(result) : "a"(SYSCALL_GETPID) : "memory");
+    (void)result;
+}
+
+static void benchmark_pipe_send(const uint8_t* message) {
+    benchmark_syscall_gate();
+    pipe_write(benchmark_pipe_writer, message, BENCHMARK_MESSAGE_SIZE, 0);
+}
+
+static void benchmark_pipe_receive(uint8_t* message) {
+    benchmark_syscall_gate();
+    pipe_read(benchmark_pipe_reader, message, BENCHMARK_MESSAGE_SIZE, 0);
+}
+
+/**
+ * @brief Compare the shared-memory ring with a system-call-based pipe
+ * 
+ * Throughput fills the ring and drains it in batches; latency passes one
+ * message at a time (push immediately followed by pop). The pipe baseline
+ * takes one trip through the int 0x80 gate per send and per receive.
+ */
+void benchmark_shared_ring(void) {
+    struct shared_ring* ring = shared_ring_create(BENCHMARK_RING_SLOTS,
+                                                  BENCHMARK_MESSAGE_SIZE + RING_SLOT_HEADER_SIZE);
+    uint8_t message[BENCHMARK_MESSAGE_SIZE];
+    uint64_t start;
+    
+    print_string(" SPSC ring vs syscall pipe (64 byte messages):\n");
+    if (!ring) return;
+    if (pipe_create(&benchmark_pipe_reader, &benchmark_pipe_writer) != 0) {
+        shared_memory_put(ring->memory);
+        return;
+    }
+    
+    struct spsc_ring_header* header = (struct spsc_ring_header*)ring->memory->base;
+    memset(message, 0x5A, sizeof(message));
+    
+    start = timestamp_read();
+    for (uint32_t sent = 0; sent < BENCHMARK_RING_MESSAGES; sent += BENCHMARK_RING_SLOTS) {
+        for (uint32_t i = 0; i < BENCHMARK_RING_SLOTS; ++i) {
+            spsc_ring_push(header, message, sizeof(message));
+        }
+        for (uint32_t i = 0; i < BENCHMARK_RING_SLOTS; ++i) {
+            spsc_ring_pop(header, message, sizeof(message));
+        }
+    }
+    benchmark_report("ring throughput", BENCHMARK_RING_MESSAGES, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_RING_MESSAGES; ++i) {
+        spsc_ring_push(header, message, sizeof(message));
+        spsc_ring_pop(header, message, sizeof(message));
+    }
+    benchmark_report("ring latency (round trip)", BENCHMARK_RING_MESSAGES, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t sent = 0; sent < BENCHMARK_RING_MESSAGES; sent += BENCHMARK_RING_SLOTS) {
+        for (uint32_t i = 0; i < BENCHMARK_RING_SLOTS; ++i) {
+            benchmark_pipe_send(message);
+        }
+        for (uint32_t i = 0; i < BENCHMARK_RING_SLOTS; ++i) {
+            benchmark_pipe_receive(message);
+        }
+    }
+    benchmark_report("pipe throughput", BENCHMARK_RING_MESSAGES, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_RING_MESSAGES; ++i) {
+        benchmark_pipe_send(message);
+        benchmark_pipe_receive(message);
+    }
+    benchmark_report("pipe latency (round trip)", BENCHMARK_RING_MESSAGES, timestamp_read() - start);
+    
+    file_put(benchmark_pipe_reader);
+    file_put(benchmark_pipe_writer);
+    shared_memory_put(ring->memory);
+}
+
+// =============================================================================
+// Message Passing Benchmark
+// =============================================================================
+
+#define BENCHMARK_MESSAGE_ROUNDS    200
+#define BENCHMARK_MESSAGE_MAX_PAGES 64
+
+/**
+ * @brief Run benchmark code inside a process's address space
+ * 
+ * @param process Process to become, or NULL to return to the idle process
+ * 
+ * Lets kernel-side benchmarks use user addresses (and resolve their page
+ * faults) exactly as a system call made by that process would.
+ */
+void benchmark_enter_process(struct process* process) {
+    if (!process) process = &process_table[0];
+    
+    write_cr3((uint32_t)process->page_directory);
+    current_process = process;
+}
+
+/**
+ * @brief Compare copying and page remapping for messages of growing size
+ * 
+ * Each round sends a message to a port and receives it back in the same
+ * process. Remapped payloads are forwarded from wherever they arrived,
+ * the usual pattern for a pipeline stage.
+ */
+void benchmark_message_passing(void) {
+    uint32_t size = benchmark_build_program(2 * BENCHMARK_MESSAGE_MAX_PAGES);
+    struct process* process = process_spawn(benchmark_program, size, NULL);
+    struct message_info info;
+    int32_t port_id = message_port_create();
+    
+    print_string(" Message passing (zero-copy threshold ");
+    print_unsigned(ipc_remap_min_pages);
+    print_string(" pages):\n");
+    if (!process || port_id < 0) return;
+    
+    struct message_port* port = message_port_find((uint32_t)port_id);
+    uint32_t source = USER_SPACE_START + PAGE_SIZE;
+    uint32_t destination = source + BENCHMARK_MESSAGE_MAX_PAGES * PAGE_SIZE;
+    
+    benchmark_enter_process(process);
+    memset((void*)source, 0x3C, 2 * BENCHMARK_MESSAGE_MAX_PAGES * PAGE_SIZE);
+    
+    for (uint32_t pages = 1; pages <= BENCHMARK_MESSAGE_MAX_PAGES; pages *= 4) {
+        uint32_t length = pages * PAGE_SIZE;
+        uint64_t start = timestamp_read();
+        
+        for (uint32_t round = 0; round < BENCHMARK_MESSAGE_ROUNDS; ++round) {
+            message_send(process, port, source, length, 0);
+            message_receive(process, port, destination, length, &info);
+        }
+        uint64_t copy_cycles = timestamp_read() - start;
+        
+        uint32_t address = source;
+        start = timestamp_read();
+        for (uint32_t round = 0; round < BENCHMARK_MESSAGE_ROUNDS; ++round) {
+            message_send(process, port, address, length, 1);
+            message_receive(process, port, 0, 0, &info);
+            address = info.address;
+        }
+        uint64_t remap_cycles = timestamp_read() - start;
+        
+        print_string("  ");
+        print_unsigned(length / 1024);
+        print_string("KB copy: ");
+        print_unsigned(divide_u64(copy_cycles, BENCHMARK_MESSAGE_ROUNDS));
+        print_string(" cycles, remap: ");
+        print_unsigned(divide_u64(remap_cycles, BENCHMARK_MESSAGE_ROUNDS));
+        print_string(" cycles\n");
+    }
+    
+    benchmark_enter_process(NULL);
+    message_port_destroy(port);
+    process_discard(process);
+}
+
+// =============================================================================
+// Submission Ring Benchmark
+// =============================================================================
+
+#define BENCHMARK_IO_OPERATIONS     16384
+
+/**
+ * @brief Compare one system call per operation with batched ring entry
+ * 
+ * Every variant performs the same number of no-op operations. The ring
+ * variants queue a batch, cross the system call gate once and reap the
+ * whole batch of completions.
+ */
+void benchmark_io_ring(void) {
+    static const uint32_t batch_sizes[] = {1, 16, 256};
+    static const char* const labels[] = {"ring, batch of 1", "ring, batch of 16", "ring, batch of 256"};
+    struct io_ring* ring = io_ring_create(current_process, IO_RING_MAX_ENTRIES, 0, 0);
+    uint64_t start;
+    
+    print_string(" Submission ring vs per-operation system calls:\n");
+    if (!ring) return;
+    
+    struct io_ring_header* header = ring->header;
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_IO_OPERATIONS; ++i) {
+        benchmark_syscall_gate();
+    }
+    benchmark_report("syscall per operation", BENCHMARK_IO_OPERATIONS, timestamp_read() - start);
+    
+    for (uint32_t size = 0; size < sizeof(batch_sizes) / sizeof(batch_sizes[0]); ++size) {
+        uint32_t batch = batch_sizes[size];
+        
+        start = timestamp_read();
+        for (uint32_t done = 0; done < BENCHMARK_IO_OPERATIONS; done += batch) {
+            for (uint32_t i = 0; i < batch; ++i) {
+                struct io_submission* submission = &ring->sq[(header->sq_tail + i) & (header->sq_entries - 1)];
+                submission->opcode = IO_OP_NOP;
+                submission->user_data = done + i;
+            }
+            __atomic_store_n(&header->sq_tail, header->sq_tail + batch, __ATOMIC_RELEASE);
+            
+            benchmark_syscall_gate();
+            io_ring_enter(ring, batch, batch, IO_RING_ENTER_GETEVENTS);
+            __atomic_store_n(&header->cq_head, header->cq_tail, __ATOMIC_RELEASE);
+        }
+        benchmark_report(labels[size], BENCHMARK_IO_OPERATIONS, timestamp_read() - start);
+    }
+    
+    io_ring_destroy(ring);
+}
+
+// =============================================================================
+// Event Polling Benchmark
+// =============================================================================
+
+#define BENCHMARK_EVENT_MAX_PIPES   256
+#define BENCHMARK_EVENT_ROUNDS      1000
+
+/**
+ * @brief Show that event waits scale with ready files, not watched ones
+ * 
+ * Watches a growing number of pipes of which one is ready, and compares
+ * event_poll_wait() with polling every watched file in turn.
+ */
+void benchmark_event_poll(void) {
+    static struct file* readers[BENCHMARK_EVENT_MAX_PIPES];
+    static struct file* writers[BENCHMARK_EVENT_MAX_PIPES];
+    struct event_record records[4];
+    struct event_poll* poll = event_poll_create();
+    uint32_t created = 0;
+    uint8_t byte = 1;
+    
+    print_string(" Event poll vs scanning (one ready pipe):\n");
+    if (!poll) return;
+    
+    for (uint32_t watched = 4; watched <= BENCHMARK_EVENT_MAX_PIPES; watched *= 4) {
+        while (created < watched && pipe_create(&readers[created], &writers[created]) == 0) {
+            struct event_record record = {POLL_IN, created};
+            event_poll_control(poll, EVENT_CONTROL_ADD, created, readers[created], &record);
+            created++;
+        }
+        pipe_write(writers[created / 2], &byte, 1, 0);
+        
+        uint64_t start = timestamp_read();
+        for (uint32_t round = 0; round < BENCHMARK_EVENT_ROUNDS; ++round) {
+            event_poll_wait(poll, records, 4, 0);
+        }
+        uint64_t wait_cycles = timestamp_read() - start;
+        
+        uint32_t found = 0;
+        start = timestamp_read();
+        for (uint32_t round = 0; round < BENCHMARK_EVENT_ROUNDS; ++round) {
+            for (uint32_t i = 0; i < created; ++i) {
+                found += readers[i]->operations->poll(readers[i], NULL) & POLL_IN;
+            }
+        }
+        uint64_t scan_cycles = timestamp_read() - start;
+        (void)found;
+        
+        pipe_read(readers[created / 2], &byte, 1, 0);
+        
+        print_string("  ");
+        print_unsigned(created);
+        print_string(" watched - wait: ");
+        print_unsigned(divide_u64(wait_cycles, BENCHMARK_EVENT_ROUNDS));
+        print_string(" cycles, scan: ");
+        print_unsigned(divide_u64(scan_cycles, BENCHMARK_EVENT_ROUNDS));
+        print_string(" cycles\n");
+    }
+    
+    event_poll_destroy(poll);
+    for (uint32_t i = 0; i < created; ++i) {
+        file_put(readers[i]);
+        file_put(writers[i]);
+    }
+}
+
+// =============================================================================
+// Futex Benchmark
+// =============================================================================
+
+#define BENCHMARK_FUTEX_LOCKS       100000
+#define BENCHMARK_FUTEX_HANDOFFS    2000
+#define BENCHMARK_FUTEX_WAITERS     8
+
+static volatile uint32_t benchmark_futex_mutex;
+static volatile uint32_t benchmark_futex_condition;
+static volatile uint32_t benchmark_futex_finished;
+
+// Takes the mutex, then yields while holding it so the other thread finds
+// it contended
+static void benchmark_futex_contender(void* argument) {
+    (void)argument;
+    
+    for (uint32_t i = 0; i < BENCHMARK_FUTEX_HANDOFFS; ++i) {
+        futex_mutex_lock(&benchmark_futex_mutex);
+        scheduler_yield();
+        futex_mutex_unlock(&benchmark_futex_mutex);
+    }
+    benchmark_futex_finished++;
+}
+
+// Condition variable waiter: sleeps on the condition word, then takes the
+// mutex as if returning from a condition wait. Others may have been
+// requeued onto the mutex, so it is always taken in the contended state
+// to make sure unlock wakes the next one.
+static void benchmark_futex_condition_waiter(void* argument) {
+    (void)argument;
+    
+    futex_wait_key((uint32_t)&benchmark_futex_condition, 0, FUTEX_WAIT_FOREVER);
+    while (__atomic_exchange_n(&benchmark_futex_mutex, 2, __ATOMIC_ACQUIRE) != 0) {
+        futex_wait_key((uint32_t)&benchmark_futex_mutex, 2, FUTEX_WAIT_FOREVER);
+    }
+    futex_mutex_unlock(&benchmark_futex_mutex);
+    benchmark_futex_finished++;
+}
+
+/**
+ * @brief Broadcast to sleeping condition waiters and time until all of
+ *        them have held the mutex once
+ * 
+ * @param requeue Wake one waiter and requeue the rest onto the mutex
+ *                instead of waking them all
+ * @return Elapsed cycles, or 0 if the waiters could not be started
+ */
+static uint64_t benchmark_futex_broadcast(int requeue) {
+    benchmark_futex_condition = 0;
+    benchmark_futex_finished = 0;
+    
+    for (uint32_t i = 0; i < BENCHMARK_FUTEX_WAITERS; ++i) {
+        if (!kernel_thread_create(benchmark_futex_condition_waiter, NULL)) return 0;
+    }
+    scheduler_yield();                  // Let every waiter go to sleep
+    
+    uint64_t start = timestamp_read();
+    futex_mutex_lock(&benchmark_futex_mutex);
+    benchmark_futex_condition = 1;
+    if (requeue) {
+        // Requeued waiters will be woken by unlock, so mark the mutex contended
+        benchmark_futex_mutex = 2;
+        futex_requeue_key((uint32_t)&benchmark_futex_condition, 1, BENCHMARK_FUTEX_WAITERS,
+                          (uint32_t)&benchmark_futex_mutex, 1);
+    } else {
+        futex_wake_key((uint32_t)&benchmark_futex_condition, BENCHMARK_FUTEX_WAITERS);
+    }
+    futex_mutex_unlock(&benchmark_futex_mutex);
+    
+    while (benchmark_futex_finished < BENCHMARK_FUTEX_WAITERS) {
+        scheduler_yield();
+    }
+    return timestamp_read() - start;
+}
+
+/**
+ * @brief Measure uncontended and contended futex mutexes and broadcasts
+ * 
+ * Contention comes from kernel threads, which use the same code paths as
+ * system calls once the key is known.
+ */
+void benchmark_futex(void) {
+    uint64_t start;
+    
+    print_string(" Futex mutex:\n");
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_FUTEX_LOCKS; ++i) {
+        futex_mutex_lock(&benchmark_futex_mutex);
+        futex_mutex_unlock(&benchmark_futex_mutex);
+    }
+    benchmark_report("uncontended lock/unlock", BENCHMARK_FUTEX_LOCKS, timestamp_read() - start);
+    
+    benchmark_futex_finished = 0;
+    start = timestamp_read();
+    if (kernel_thread_create(benchmark_futex_contender, NULL) &&
+        kernel_thread_create(benchmark_futex_contender, NULL)) {
+        while (benchmark_futex_finished < 2) {
+            scheduler_yield();
+        }
+        benchmark_report("contended handoff", 2 * BENCHMARK_FUTEX_HANDOFFS, timestamp_read() - start);
+    }
+    
+    benchmark_report("broadcast, wake all", BENCHMARK_FUTEX_WAITERS, benchmark_futex_broadcast(0));
+    benchmark_report("broadcast, requeue", BENCHMARK_FUTEX_WAITERS, benchmark_futex_broadcast(1));
+}
+
+// =============================================================================
+// vDSO Benchmark
+// =============================================================================
+
+#define BENCHMARK_VDSO_CALLS        100000
+
+typedef uint64_t (*vdso_clock_function)(void);
+typedef uint32_t (*vdso_uptime_function)(void);
+
+/**
+ * @brief Compare vDSO time queries with a system call
+ * 
+ * The stubs are called at their user addresses from inside a process's
+ * address space, exactly as a program would call them.
+ */
+void benchmark_vdso(void) {
+    uint32_t size = benchmark_build_program(0);
+    struct process* process = process_spawn(benchmark_program, size, NULL);
+    volatile uint64_t sink = 0;
+    uint64_t start;
+    
+    print_string(" vDSO time queries:\n");
+    if (!process || !vdso_data) return;
+    
+    benchmark_enter_process(process);
+    vdso_clock_function clock = (vdso_clock_function)vdso_data->clock_entry;
+    vdso_uptime_function uptime = (vdso_uptime_function)vdso_data->uptime_entry;
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_VDSO_CALLS; ++i) {
+        sink += clock();
+    }
+    benchmark_report("vDSO clock (ns)", BENCHMARK_VDSO_CALLS, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_VDSO_CALLS; ++i) {
+        sink += uptime();
+    }
+    benchmark_report("vDSO uptime (ms)", BENCHMARK_VDSO_CALLS, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_VDSO_CALLS; ++i) {
+        benchmark_syscall_gate();
+    }
+    benchmark_report("system call", BENCHMARK_VDSO_CALLS, timestamp_read() - start);
+    
+    benchmark_enter_process(NULL);
+    process_discard(process);
+    (void)sink;
+}
+
+// =============================================================================
+// Batched System Call Benchmark
+// =============================================================================
+
+#define BENCHMARK_MULTI_CALLS       16384
+
+/**
+ * @brief Compare individual system calls with SYSCALL_MULTI batches
+ * 
+ * Every variant makes the same number of getpid calls through the int 0x80
+ * gate, from inside a process so the batch lives at a user address.
+ */
+void benchmark_multi_call(void) {
+    static const uint32_t batch_sizes[] = {1, 16, 256};
+    static const char* const labels[] = {"multi, batch of 1", "multi, batch of 16", "multi, batch of 256"};
+    uint32_t pages = (SYSCALL_MULTI_MAX * sizeof(struct syscall_entry) + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t size = benchmark_build_program(pages);
+    struct process* process = process_spawn(benchmark_program, size, NULL);
+    uint64_t start;
+    
+    print_string(" Batched system calls:\n");
+    if (!process) return;
+    
+    benchmark_enter_process(process);
+    struct syscall_entry* entries = (struct syscall_entry*)(USER_SPACE_START + PAGE_SIZE);
+    for (uint32_t i = 0; i < SYSCALL_MULTI_MAX; ++i) {
+        memset(&entries[i], 0, sizeof(entries[i]));
+        entries[i].number = SYSCALL_GETPID;
+    }
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_MULTI_CALLS; ++i) {
+        benchmark_syscall_gate();
+    }
+    benchmark_report("syscall per call", BENCHMARK_MULTI_CALLS, timestamp_read() - start);
+    
+    for (uint32_t index = 0; index < sizeof(batch_sizes) / sizeof(batch_sizes[0]); ++index) {
+        uint32_t batch = batch_sizes[index];
+        
+        start = timestamp_read();
+        for (uint32_t done = 0; done < BENCHMARK_MULTI_CALLS; done += batch) {
+            uint32_t result;
+            __asm__ volatile("int $0x80"
+                             : "=a"(result)
+                             : "a"(SYSCALL_MULTI), "b"(entries), "c"(batch), "d"(SYSCALL_MULTI_STOP_ON_ERROR)
+                             : "memory");
+            (void)result;
+        }
+        benchmark_report(labels[index], BENCHMARK_MULTI_CALLS, timestamp_read() - start);
+    }
+    
+    benchmark_enter_process(NULL);
+    process_discard(process);
+}
+
+// =============================================================================
+// ATA Transfer Benchmark
+// =============================================================================
+
+#define BENCHMARK_ATA_SEQUENTIAL_BYTES  (4 * 1024 * 1024)
+#define BENCHMARK_ATA_SEQUENTIAL_CHUNK  (64 * 1024)
+#define BENCHMARK_ATA_RANDOM_READS      256
+#define BENCHMARK_ATA_RANDOM_CHUNK      4096
+
+static void benchmark_ata_report(const char* label, uint32_t bytes, uint64_t cycles) {
+    uint32_t microseconds = timestamp_to_microseconds(cycles);
+    
+    if (microseconds == 0) microseconds = 1;
+    print_string("  ");
+    print_string(label);
+    print_string(": ");
+    print_unsigned(divide_u64((uint64_t)(bytes / 1024) * 1000000, microseconds));
+    print_string(" KB/s\n");
+}
+
+/**
+ * @brief Compare PIO and bus-master DMA reads on the first ATA drive
+ * 
+ * Sequential reads stream BENCHMARK_ATA_SEQUENTIAL_BYTES in 64KB requests;
+ * random reads fetch 4KB at pseudo-random sector offsets. Both modes read
+ * the same sectors in the same order.
+ */
+void benchmark_ata(void) {
+    static const char* const sequential_labels[] = {"sequential 64KB, PIO", "sequential 64KB, DMA"};
+    static const char* const random_labels[] = {"random 4KB, PIO", "random 4KB, DMA"};
+    uint32_t index = 0;
+    
+    print_string(" ATA reads, PIO vs bus-master DMA:\n");
+    while (index < ATA_DRIVES && !ata_drives[index].present) {
+        index++;
+    }
+    if (index == ATA_DRIVES || !ata_drives[index].dma) return;
+    
+    struct ata_drive* drive = &ata_drives[index];
+    uint32_t chunk_sectors = BENCHMARK_ATA_SEQUENTIAL_CHUNK / ATA_SECTOR_SIZE;
+    uint32_t sequential_sectors = BENCHMARK_ATA_SEQUENTIAL_BYTES / ATA_SECTOR_SIZE;
+    uint32_t span = drive->sector_count < sequential_sectors ? (uint32_t)drive->sector_count
+                                                              : sequential_sectors;
+    uint8_t* buffer = heap_allocate(BENCHMARK_ATA_SEQUENTIAL_CHUNK);
+    if (!buffer || span < chunk_sectors) return;
+    
+    for (uint32_t mode = 0; mode < 2; ++mode) {
+        uint32_t flags = mode == 0 ? ATA_TRANSFER_PIO : 0;
+        uint32_t bytes = 0;
+        uint64_t start = timestamp_read();
+        
+        for (uint32_t lba = 0; lba + chunk_sectors <= span; lba += chunk_sectors) {
+            if (ata_transfer(index, lba, chunk_sectors, buffer, flags) != 0) break;
+            bytes += BENCHMARK_ATA_SEQUENTIAL_CHUNK;
+        }
+        benchmark_ata_report(sequential_labels[mode], bytes, timestamp_read() - start);
+    }
+    
+    for (uint32_t mode = 0; mode < 2; ++mode) {
+        uint32_t flags = mode == 0 ? ATA_TRANSFER_PIO : 0;
+        uint32_t random_sectors = BENCHMARK_ATA_RANDOM_CHUNK / ATA_SECTOR_SIZE;
+        uint32_t seed = 12345;
+        uint32_t bytes = 0;
+        uint64_t start = timestamp_read();
+        
+        for (uint32_t i = 0; i < BENCHMARK_ATA_RANDOM_READS; ++i) {
+            seed = seed * 1103515245 + 12345;       // ANSI C rand() LCG
+            uint32_t lba = (seed >> 8) % (span - random_sectors + 1);
+            if (ata_transfer(index, lba, random_sectors, buffer, flags) != 0) break;
+            bytes += BENCHMARK_ATA_RANDOM_CHUNK;
+        }
+        benchmark_ata_report(random_labels[mode], bytes, timestamp_read() - start);
+    }
+    
+    heap_free(buffer);
+}
+
+// =============================================================================
+// AHCI Queue Depth Benchmark
+// =============================================================================
+
+#define BENCHMARK_AHCI_READS        2048
+#define BENCHMARK_AHCI_SPAN         (64 * 1024 * 1024 / ATA_SECTOR_SIZE)
+
+/**
+ * @brief Measure random 4KB read IOPS at increasing queue depths
+ * 
+ * Keeps `depth` requests in flight: each time the oldest completes, a new
+ * one is submitted in its place. Depth 1 is the synchronous baseline.
+ */
+void benchmark_ahci(void) {
+    static const uint32_t depths[] = {1, 8, 32};
+    static const char* const labels[] = {"4KB random reads, depth 1", "4KB random reads, depth 8",
+                                         "4KB random reads, depth 32"};
+    uint32_t sectors = BENCHMARK_ATA_RANDOM_CHUNK / ATA_SECTOR_SIZE;
+    uint32_t index = 0;
+    
+    print_string(" AHCI random reads by queue depth:\n");
+    while (index < AHCI_MAX_PORTS && !ahci_ports[index].present) {
+        index++;
+    }
+    if (index == AHCI_MAX_PORTS) return;
+    
+    struct ahci_port* port = &ahci_ports[index];
+    uint32_t span = port->sector_count < BENCHMARK_AHCI_SPAN ? (uint32_t)port->sector_count
+                                                              : BENCHMARK_AHCI_SPAN;
+    struct ahci_request* requests = heap_allocate(AHCI_MAX_SLOTS * sizeof(struct ahci_request));
+    uint8_t* buffers = heap_allocate(AHCI_MAX_SLOTS * BENCHMARK_ATA_RANDOM_CHUNK);
+    if (!requests || !buffers || span < sectors) return;
+    
+    print_string("  (NCQ ");
+    print_string(port->ncq ? "on" : "off");
+    print_string(")\n");
+    
+    for (uint32_t size = 0; size < sizeof(depths) / sizeof(depths[0]); ++size) {
+        uint32_t depth = depths[size];
+        uint32_t seed = 12345;
+        uint32_t completed = 0;
+        uint64_t start = timestamp_read();
+        
+        for (uint32_t i = 0; i < BENCHMARK_AHCI_READS + depth; ++i) {
+            struct ahci_request* request = &requests[i % depth];
+            
+            if (i >= depth && ahci_wait(request) == 0) completed++;
+            if (i >= BENCHMARK_AHCI_READS) continue;
+            
+            seed = seed * 1103515245 + 12345;
+            request->lba = (seed >> 8) % (span - sectors + 1);
+            request->count = sectors;
+            request->write = 0;
+            request->segment_count = 1;
+            request->segments[0].buffer = buffers + (i % depth) * BENCHMARK_ATA_RANDOM_CHUNK;
+            request->segments[0].length = BENCHMARK_ATA_RANDOM_CHUNK;
+            if (ahci_submit(index, request) != 0) {
+                request->done = 1;
+                request->result = ERROR_IO;
+            }
+        }
+        benchmark_report(labels[size], completed, timestamp_read() - start);
+    }
+    
+    heap_free(buffers);
+    heap_free(requests);
+}
+
+// =============================================================================
+// NVMe IOPS Benchmark
+// =============================================================================
+
+#define BENCHMARK_NVME_READS        4096
+#define BENCHMARK_NVME_SPAN         (64 * 1024 * 1024)     // Bytes
+
+/**
+ * @brief Measure random 4KB read IOPS, interrupt-driven vs polled
+ * 
+ * Same closed loop as benchmark_ahci(): `depth` requests stay in flight
+ * and each completion is replaced by a new random read. Polled requests
+ * go to the polled queue pair and spin on its CQ. Each CPU has its own
+ * queues, so runs with different BENCH_SMP counts show how much of the
+ * cost is per-queue rather than per-device.
+ */
+void benchmark_nvme(void) {
+    static const uint32_t depths[] = {1, 32};
+    static const char* const labels[] = {"4KB random reads, depth 1, interrupt",
+                                         "4KB random reads, depth 32, interrupt",
+                                         "4KB random reads, depth 1, polled",
+                                         "4KB random reads, depth 32, polled"};
+    struct nvme_controller* controller = &nvme_controllers[0];
+    
+    print_string(" NVMe random read IOPS:\n");
+    if (!controller->present) return;
+    
+    uint32_t blocks = BENCHMARK_ATA_RANDOM_CHUNK / controller->block_size;
+    uint64_t limit = BENCHMARK_NVME_SPAN / controller->block_size;
+    uint32_t span = (uint32_t)(controller->block_count < limit ? controller->block_count : limit);
+    struct nvme_request* requests = heap_allocate(NVME_QUEUE_COMMANDS * sizeof(struct nvme_request));
+    uint8_t* buffers = heap_allocate(NVME_QUEUE_COMMANDS * BENCHMARK_ATA_RANDOM_CHUNK);
+    if (!requests || !buffers || span < blocks) return;
+    
+    print_string("  (");
+    print_unsigned(controller->queue_count);
+    print_string(" interrupt and ");
+    print_unsigned(controller->polled_count);
+    print_string(" polled queue pairs)\n");
+    
+    for (uint32_t run = 0; run < 2 * sizeof(depths) / sizeof(depths[0]); ++run) {
+        uint32_t depth = depths[run % 2];
+        int polled = run >= 2;
+        uint32_t seed = 12345;
+        uint32_t completed = 0;
+        uint64_t start = timestamp_read();
+        
+        for (uint32_t i = 0; i < BENCHMARK_NVME_READS + depth; ++i) {
+            struct nvme_request* request = &requests[i % depth];
+            
+            if (i >= depth && nvme_wait(0, request) == 0) completed++;
+            if (i >= BENCHMARK_NVME_READS) continue;
+            
+            seed = seed * 1103515245 + 12345;
+            request->lba = (seed >> 8) % (span - blocks + 1);
+            request->count = blocks;
+            request->write = 0;
+            request->polled = polled;
+            request->buffer = buffers + (i % depth) * BENCHMARK_ATA_RANDOM_CHUNK;
+            if (nvme_submit(0, request) != 0) {
+                request->done = 1;
+                request->result = ERROR_IO;
+            }
+        }
+        benchmark_report(labels[run], completed, timestamp_read() - start);
+    }
+    
+    heap_free(buffers);
+    heap_free(requests);
+}
+
+// =============================================================================
+// Readahead Benchmark
+// =============================================================================
+
+#define BENCHMARK_READAHEAD_BYTES   (4 * 1024 * 1024)
+#define BENCHMARK_READAHEAD_CHUNK   4096
+
+/**
+ * @brief Read the start of a disk sequentially from a cold page cache,
+ *        with and without readahead
+ * 
+ * Uses the first of sda, vda, nvme0n1 and hda that exists, read 4KB at a
+ * time through the device's page cache like a file. The device's request
+ * statistics afterwards show how many commands each run took.
+ */
+void benchmark_readahead(void) {
+    static const char* const candidates[] = {"sda", "vda", "nvme0n1", "hda"};
+    static const char* const labels[] = {"sequential 4KB reads, no readahead", "sequential 4KB reads, readahead"};
+    struct block_device* device = NULL;
+    
+    print_string(" Cold sequential reads through the page cache:\n");
+    for (uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]) && !device; ++i) {
+        device = block_device_find(candidates[i]);
+    }
+    if (!device || device->cache.size < BENCHMARK_READAHEAD_BYTES) return;
+    
+    uint8_t* buffer = heap_allocate(BENCHMARK_READAHEAD_CHUNK);
+    if (!buffer) return;
+    
+    for (uint32_t run = 0; run < 2; ++run) {
+        struct readahead_state state;
+        uint32_t bytes = 0;
+        
+        memset(&state, 0, sizeof(state));
+        page_cache_invalidate(&device->cache);
+        uint32_t requests = device->statistics.reads;
+        uint64_t start = timestamp_read();
+        
+        for (uint32_t offset = 0; offset < BENCHMARK_READAHEAD_BYTES; offset += BENCHMARK_READAHEAD_CHUNK) {
+            if (page_cache_read(&device->cache, run ? &state : NULL, offset, buffer,
+                                BENCHMARK_READAHEAD_CHUNK) != 0) {
+                break;
+            }
+            bytes += BENCHMARK_READAHEAD_CHUNK;
+        }
+        benchmark_ata_report(labels[run], bytes, timestamp_read() - start);
+        print_string("    ");
+        print_unsigned(device->statistics.reads - requests);
+        print_string(" read commands on ");
+        print_string(device->name);
+        print_string("\n");
+    }
+    page_cache_statistics_print();
+    
+    heap_free(buffer);
+}
+
+// =============================================================================
+// Path Walk Benchmark
+// =============================================================================
+
+#define BENCHMARK_PATH_DEPTH        16      // Nested directories in the deep tree
+#define BENCHMARK_PATH_WIDTH        256     // Files in the wide directory
+#define BENCHMARK_PATH_LOOKUPS      4096
+#define BENCHMARK_PATH_COLD_WALKS   64
+#define BENCHMARK_PATH_MAX          128
+#define BENCHMARK_PATH_SEARCH       4       // Directories on the simulated $PATH
+
+/**
+ * @brief Append "/<prefix><number>" to a path
+ * 
+ * @return New length of the path
+ */
+static uint32_t benchmark_path_append(char* path, uint32_t length, char prefix, uint32_t number) {
+    char digits[10];
+    uint32_t count = 0;
+    
+    do {
+        digits[count++] = (char)('0' + number % 10);
+        number /= 10;
+    } while (number);
+    path[length++] = '/';
+    path[length++] = prefix;
+    while (count) {
+        path[length++] = digits[--count];
+    }
+    path[length] = '\0';
+    return length;
+}
+
+// Create an entry, unless an earlier run left it in place
+static int benchmark_path_create(const char* path, int is_directory) {
+    int32_t status = vfs_create(path, is_directory, NULL);
+    
+    return status == 0 || status == ERROR_BUSY;
+}
+
+/**
+ * @brief Resolve paths in a deep and a wide tree with cold and warm
+ *        dentry caches, and repeated misses as in a $PATH search
+ * 
+ * Needs a writable ext2 root (see BENCH_EXT2_DISK in the Makefile), on
+ * which it builds /bench/deep (BENCHMARK_PATH_DEPTH nested directories)
+ * and /bench/wide (BENCHMARK_PATH_WIDTH files). The same walks through
+ * ext2_open() show the cost of asking the filesystem for every component.
+ */
+void benchmark_path_walk(void) {
+    static const char* const search_path[BENCHMARK_PATH_SEARCH] = {"/bench/wide", "/bench/deep", "/bench", "/"};
+    char deep[BENCHMARK_PATH_MAX];
+    char path[BENCHMARK_PATH_MAX];
+    char misses[BENCHMARK_PATH_SEARCH][32];
+    struct dentry* dentry;
+    struct ext2_inode* inode;
+    uint64_t cycles = 0;
+    uint64_t start;
+    uint32_t length = 11;
+    
+    print_string(" Path lookups through the dentry cache:\n");
+    if (!vfs_root || vfs_root->mount->operations != &vfs_ext2_operations) return;
+    struct ext2_volume* volume = vfs_root->mount->volume;
+    if (volume->read_only) return;
+    
+    if (!benchmark_path_create("/bench", 1) || !benchmark_path_create("/bench/deep", 1) ||
+        !benchmark_path_create("/bench/wide", 1)) {
+        return;
+    }
+    memcpy(deep, "/bench/deep", length + 1);
+    for (uint32_t level = 0; level < BENCHMARK_PATH_DEPTH; ++level) {
+        length = benchmark_path_append(deep, length, 'd', level);
+        if (!benchmark_path_create(deep, 1)) return;
+    }
+    benchmark_path_append(deep, length, 'f', 0);
+    if (!benchmark_path_create(deep, 0)) return;
+    for (uint32_t i = 0; i < BENCHMARK_PATH_WIDTH; ++i) {
+        memcpy(path, "/bench/wide", 12);
+        benchmark_path_append(path, 11, 'f', i);
+        if (!benchmark_path_create(path, 0)) return;
+    }
+    for (uint32_t i = 0; i < BENCHMARK_PATH_SEARCH; ++i) {
+        length = (uint32_t)string_length(search_path[i]);
+        memcpy(misses[i], search_path[i], length);
+        memcpy(misses[i] + length, "/nosuchcommand", 15);
+    }
+    
+    // Deep tree: one component per level
+    for (uint32_t i = 0; i < BENCHMARK_PATH_COLD_WALKS; ++i) {
+        dcache_shrink(0);
+        start = timestamp_read();
+        if (vfs_lookup(deep, &dentry) == 0) dentry_put(dentry);
+        cycles += timestamp_read() - start;
+    }
+    benchmark_report("deep path, cold dentry cache", BENCHMARK_PATH_COLD_WALKS, cycles);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_PATH_LOOKUPS; ++i) {
+        if (vfs_lookup(deep, &dentry) == 0) dentry_put(dentry);
+    }
+    benchmark_report("deep path, warm dentry cache", BENCHMARK_PATH_LOOKUPS, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_PATH_LOOKUPS; ++i) {
+        if (ext2_open(volume, deep, &inode) == 0) ext2_inode_put(inode);
+    }
+    benchmark_report("deep path, ext2 lookups only", BENCHMARK_PATH_LOOKUPS, timestamp_read() - start);
+    
+    // Wide directory: one large directory to search
+    dcache_shrink(0);
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_PATH_WIDTH; ++i) {
+        memcpy(path, "/bench/wide", 12);
+        benchmark_path_append(path, 11, 'f', i);
+        if (vfs_lookup(path, &dentry) == 0) dentry_put(dentry);
+    }
+    benchmark_report("wide directory, cold dentry cache", BENCHMARK_PATH_WIDTH, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_PATH_LOOKUPS; ++i) {
+        memcpy(path, "/bench/wide", 12);
+        benchmark_path_append(path, 11, 'f', i % BENCHMARK_PATH_WIDTH);
+        if (vfs_lookup(path, &dentry) == 0) dentry_put(dentry);
+    }
+    benchmark_report("wide directory, warm dentry cache", BENCHMARK_PATH_LOOKUPS, timestamp_read() - start);
+    
+    // A command found in no directory on the search path
+    for (uint32_t i = 0; i < BENCHMARK_PATH_SEARCH; ++i) {
+        if (vfs_lookup(misses[i], &dentry) == 0) dentry_put(dentry);
+    }
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_PATH_LOOKUPS; ++i) {
+        if (vfs_lookup(misses[i % BENCHMARK_PATH_SEARCH], &dentry) == 0) dentry_put(dentry);
+    }
+    benchmark_report("$PATH misses, negative dentries", BENCHMARK_PATH_LOOKUPS, timestamp_read() - start);
+    
+    start = timestamp_read();
+    for (uint32_t i = 0; i < BENCHMARK_PATH_LOOKUPS; ++i) {
+        if (ext2_open(volume, misses[i % BENCHMARK_PATH_SEARCH], &inode) == 0) ext2_inode_put(inode);
+    }
+    benchmark_report("$PATH misses, ext2 lookups only", BENCHMARK_PATH_LOOKUPS, timestamp_read() - start);
+    dcache_statistics_print();
+}
+
+// =============================================================================
+// Journal Benchmark
+// =============================================================================
+
+#define BENCHMARK_JOURNAL_FILES     256     // Files each thread creates and deletes
+#define BENCHMARK_JOURNAL_THREADS   8
+#define BENCHMARK_JOURNAL_SIZE      512     // Bytes written to each file
+
+static struct ext2_inode* benchmark_journal_directory;
+static volatile uint32_t benchmark_journal_finished;
+
+// Create, write, close and delete small files under names of its own
+static void benchmark_journal_worker(void* argument) {
+    static const uint8_t data[BENCHMARK_JOURNAL_SIZE];
+    char name[16];
+    
+    for (uint32_t i = 0; i < BENCHMARK_JOURNAL_FILES; ++i) {
+        struct ext2_inode* inode;
+        uint32_t length = benchmark_path_append(name, 0, 'j', (uint32_t)argument * BENCHMARK_JOURNAL_FILES + i);
+        
+        if (ext2_create(benchmark_journal_directory, name + 1, length - 1, 0, &inode) != 0) break;
+        ext2_write(inode, 0, data, BENCHMARK_JOURNAL_SIZE);
+        ext2_inode_put(inode);
+        ext2_unlink(benchmark_journal_directory, name + 1, length - 1);
+    }
+    __atomic_fetch_add(&benchmark_journal_finished, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Create and delete small files on every writable ext2 volume,
+ *        from one thread and from several
+ * 
+ * The workers are kernel threads, and this thread only yields until they
+ * are done: a journal's commits and checkpoints can make an operation
+ * sleep, which the boot thread cannot. With several writers, operations
+ * that finish while a commit is being written share the next one, so an
+ * ext3 volume (see BENCH_EXT3_DISK in the Makefile) needs fewer commits
+ * than operations. A plain ext2 volume writes every change in place.
+ * FAT is read-only and not compared.
+ */
+void benchmark_journal(void) {
+    static const char* const labels[2][2] = {{"ext2, 1 thread", "ext2, 8 threads"},
+                                             {"ext3, 1 thread", "ext3, 8 threads"}};
+    
+    print_string(" Small file create/write/delete:\n");
+    for (uint32_t v = 0; v < ext2_volume_count; ++v) {
+        struct ext2_volume* volume = &ext2_volumes[v];
+        struct ext2_journal* journal = volume->journal;
+        
+        if (volume->read_only || ext2_inode_get(volume, EXT2_ROOT_INODE, &benchmark_journal_directory) != 0) {
+            continue;
+        }
+        for (uint32_t run = 0; run < 2; ++run) {
+            uint32_t threads = run ? BENCHMARK_JOURNAL_THREADS : 1;
+            uint32_t commits = journal ? journal->commits : 0;
+            uint32_t started = 0;
+            
+            benchmark_journal_finished = 0;
+            uint64_t start = timestamp_read();
+            while (started < threads && kernel_thread_create(benchmark_journal_worker, (void*)started)) {
+                started++;
+            }
+            while (benchmark_journal_finished < started) {
+                scheduler_yield();
+            }
+            benchmark_report(labels[journal != NULL][run], started * BENCHMARK_JOURNAL_FILES,
+                             timestamp_read() - start);
+            if (journal) {
+                print_string("    ");
+                print_unsigned(journal->commits - commits);
+                print_string(" commits, ");
+                print_unsigned(journal->checkpoints);
+                print_string(" checkpoints so far\n");
+            }
+        }
+        // Leave the volume idle for the boot thread
+        while (journal && journal->busy) {
+            scheduler_yield();
+        }
+        ext2_inode_put(benchmark_journal_directory);
+    }
+}
+
+// =============================================================================
+// Write-back Benchmark
+// =============================================================================
+
+#define BENCHMARK_WRITEBACK_BYTES   (4 * 1024 * 1024)
+#define BENCHMARK_WRITEBACK_SYNCED  (256 * 1024)    // Bytes written a chunk and a sync at a time
+#define BENCHMARK_WRITEBACK_CHUNK   4096
+
+/**
+ * @brief Write a file sequentially through the page cache, then again
+ *        with a sync after every write
+ * 
+ * Uses the first writable ext2 volume. The first run finishes at memory
+ * speed until the dirty threshold throttles it to the device's pace, and
+ * the sync that follows writes the rest in large sorted batches. The
+ * second run makes every 4KB write reach the disk before the next, which
+ * is what writing through the cache used to cost.
+ */
+void benchmark_writeback(void) {
+    static const char name[] = "writeback.bench";
+    struct ext2_volume* volume = NULL;
+    struct ext2_inode* directory;
+    struct ext2_inode* inode;
+    
+    print_string(" Sequential file writes:\n");
+    for (uint32_t v = 0; v < ext2_volume_count && !volume; ++v) {
+        if (!ext2_volumes[v].read_only) volume = &ext2_volumes[v];
+    }
+    if (!volume || ext2_inode_get(volume, EXT2_ROOT_INODE, &directory) != 0) return;
+    
+    uint8_t* buffer = heap_allocate(BENCHMARK_WRITEBACK_CHUNK);
+    if (buffer && ext2_create(directory, name, sizeof(name) - 1, 0, &inode) == 0) {
+        struct page_cache_statistics before, after;
+        uint32_t bytes = 0;
+        
+        memset(buffer, 0x5A, BENCHMARK_WRITEBACK_CHUNK);
+        page_cache_statistics_read(&before);
+        uint64_t start = timestamp_read();
+        while (bytes < BENCHMARK_WRITEBACK_BYTES &&
+               ext2_write(inode, bytes, buffer, BENCHMARK_WRITEBACK_CHUNK) == BENCHMARK_WRITEBACK_CHUNK) {
+            bytes += BENCHMARK_WRITEBACK_CHUNK;
+        }
+        uint64_t written = timestamp_read();
+        ext2_sync(inode);
+        uint64_t synced = timestamp_read();
+        page_cache_statistics_read(&after);
+        
+        benchmark_ata_report("4KB writes into the page cache", bytes, written - start);
+        benchmark_ata_report("4KB writes, then one sync", bytes, synced - start);
+        print_string("    ");
+        print_unsigned(after.written_pages - before.written_pages);
+        print_string(" pages written back, ");
+        print_unsigned(after.throttled - before.throttled);
+        print_string(" writes throttled\n");
+        
+        bytes = 0;
+        start = timestamp_read();
+        while (bytes < BENCHMARK_WRITEBACK_SYNCED &&
+               ext2_write(inode, bytes, buffer, BENCHMARK_WRITEBACK_CHUNK) == BENCHMARK_WRITEBACK_CHUNK &&
+               ext2_sync(inode) == 0) {
+            bytes += BENCHMARK_WRITEBACK_CHUNK;
+        }
+        benchmark_ata_report("4KB writes, each synced", bytes, timestamp_read() - start);
+        
+        ext2_inode_put(inode);
+        ext2_unlink(directory, name, sizeof(name) - 1);
+    }
+    heap_free(buffer);
+    ext2_inode_put(directory);
+}
+
+// =============================================================================
+// Memory-mapped File Benchmark
+// =============================================================================
+
+#define BENCHMARK_FILE_MAP_BYTES    (2 * 1024 * 1024)
+#define BENCHMARK_FILE_MAP_CHUNK    (64 * 1024)
+
+static uint32_t benchmark_sum(const uint32_t* words, uint32_t bytes) {
+    uint32_t sum = 0;
+    
+    for (uint32_t i = 0; i < bytes / sizeof(uint32_t); ++i) sum += words[i];
+    return sum;
+}
+
+/**
+ * @brief Sum a cached file read() a chunk at a time, then through a
+ *        private mapping
+ * 
+ * The file is written and synced first so every page is resident and
+ * clean: the mapped pass takes one fault per page and no I/O, and neither
+ * pass sleeps inside the borrowed address space. The difference is the
+ * copy into the buffer that the mapping avoids.
+ */
+void benchmark_file_map(void) {
+    static const char path[] = "/mmap.bench";
+    uint32_t size = benchmark_build_program(0);
+    struct process* process = process_spawn(benchmark_program, size, NULL);
+    uint8_t* buffer = heap_allocate(BENCHMARK_FILE_MAP_CHUNK);
+    volatile uint32_t sink = 0;
+    struct file* file = NULL;
+    uint32_t bytes = 0;
+    uint32_t address;
+    
+    print_string(" Cached file reads:\n");
+    if (process && buffer && vfs_open(path, FILE_READABLE | FILE_WRITABLE | OPEN_CREATE, &file) == 0) {
+        memset(buffer, 0xA5, BENCHMARK_FILE_MAP_CHUNK);
+        while (bytes < BENCHMARK_FILE_MAP_BYTES &&
+               file->operations->write(file, buffer, BENCHMARK_FILE_MAP_CHUNK, 0) == BENCHMARK_FILE_MAP_CHUNK) {
+            bytes += BENCHMARK_FILE_MAP_CHUNK;
+        }
+        struct dentry* dentry = ((struct vfs_file*)file->private_data)->dentry;
+        
+        if (bytes == BENCHMARK_FILE_MAP_BYTES && file->operations->sync(file) == 0) {
+            benchmark_enter_process(process);
+            
+            uint64_t start = timestamp_read();
+            for (uint32_t offset = 0; offset < bytes; offset += BENCHMARK_FILE_MAP_CHUNK) {
+                if (vfs_read(dentry, offset, buffer, BENCHMARK_FILE_MAP_CHUNK) != BENCHMARK_FILE_MAP_CHUNK) break;
+                sink += benchmark_sum((const uint32_t*)buffer, BENCHMARK_FILE_MAP_CHUNK);
+            }
+            benchmark_ata_report("64KB reads, then a sum", bytes, timestamp_read() - start);
+            
+            if (file_map_create(process, file, 0, bytes, VM_READ, &address) == 0) {
+                start = timestamp_read();
+                sink += benchmark_sum((const uint32_t*)address, bytes);
+                benchmark_ata_report("private mapping, summed in place", bytes, timestamp_read() - start);
+                vm_area_remove(process, vm_area_find(process, address));
+            }
+            benchmark_enter_process(NULL);
+        }
+        file_put(file);
+        vfs_unlink(path);
+    }
+    if (buffer) heap_free(buffer);
+    if (process) process_discard(process);
+    (void)sink;
+}
+
+#endif // KERNEL_BENCHMARKS
@@ -0,0 +1,62 @@
+#!/bin/sh
+# --------------------------------------------------
+# File: mkinitramfs.sh
+# Description: Packs a directory into the boot archive (cpio "newc") that
+#              the kernel unpacks into its tmpfs root at boot
+# Usage: sh mkinitramfs.sh <output> <directory>
+# --------------------------------------------------
+set -e
+export LC_ALL=C
+
+if [ $# -ne 2 ] || [ ! -d "$2" ]; then
+    echo "usage: $0 <output> <directory>" >&2
+    exit 1
+fi
+
+# Absolute output path, since entries are listed from inside the directory
+: > "$1"
+output=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+inode=0
+
+# Write N zero bytes
+zeros() {
+    if [ "$1" -gt 0 ]; then
+        dd if=/dev/zero bs=1 count="$1" 2>/dev/null >> "$output"
+    fi
+}
+
+# Append one entry: name mode size [file]
+# The header and name, and the data, are each padded to 4 bytes. The name
+# of a file of a page or more is padded with extra NULs so that its data
+# starts on a page boundary: the archive is loaded page-aligned, and the
+# kernel then shares those pages with tmpfs instead of copying them.
+entry() {
+    offset=$(( $(wc -c < "$output") ))
+    namesize=$(( ${#1} + 1 ))
+    if [ "$3" -ge 4096 ]; then
+        namesize=$(( (offset + 110 + namesize + 4095) / 4096 * 4096 - offset - 110 ))
+    fi
+    inode=$(( inode + 1 ))
+
+    printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+        "$inode" "$2" 0 0 1 0 "$3" 0 0 0 0 "$namesize" 0 >> "$output"
+    printf '%s' "$1" >> "$output"
+    zeros $(( namesize - ${#1} + (4 - (110 + namesize) % 4) % 4 ))
+    if [ -n "$4" ]; then
+        cat "$4" >> "$output"
+        zeros $(( (4 - $3 % 4) % 4 ))
+    fi
+}
+
+# Modes in decimal: directory 040755, file 0100644 or executable 0100755
+(cd "$2" && find . ! -name . | sort) | while IFS= read -r path; do
+    name=${path#./}
+    if [ -d "$2/$path" ]; then
+        entry "$name" 16877 0
+    elif [ -f "$2/$path" ]; then
+        mode=33188
+        if [ -x "$2/$path" ]; then mode=33261; fi
+        entry "$name" "$mode" $(( $(wc -c < "$2/$path") )) "$2/$path"
+    fi
+done
+entry "TRAILER!!!" 0 0